@@ -1,6 +1,5 @@
 #!/usr/bin/env ruby
 require 'libssh'
-require 'socket'
 GC.stress = true
 
 ssh_host = 'rossmann'
@@ -21,42 +20,7 @@ if session.userauth_publickey_auto != LibSSH::AUTH_SUCCESS
   raise 'authorization failed'
 end
 
-mutex = Mutex.new
-cv = ConditionVariable.new
-server_thread = Thread.start do
-  bufsiz = 16384
-  TCPServer.open(local_port) do |server|
-    mutex.synchronize { cv.signal }
-    socket = server.accept
-    channel = LibSSH::Channel.new(session)
-    channel.open_forward(remote_host, remote_port) do
-      reader = Thread.start do
-        begin
-          loop do
-            channel.write(socket.readpartial(bufsiz))
-          end
-        rescue EOFError # rubocop:disable Lint/HandleExceptions
-        end
-        channel.send_eof
-      end
-
-      writer = Thread.start do
-        loop do
-          size = channel.poll
-          if size.nil?
-            break
-          end
-          data = channel.read(size)
-          socket.write(data)
-        end
-      end
-
-      reader.join
-      writer.join
-    end
-  end
+session.forward_local('127.0.0.1', local_port, remote_host, remote_port) do |forward|
+  system('psql', '-h', 'localhost', '-p', local_port.to_s, '-U', 'postgres', '-d', 'postgres', '-c', 'SELECT NOW()')
+  puts "sent=#{forward.bytes_sent}, received=#{forward.bytes_received}"
 end
-
-mutex.synchronize { cv.wait(mutex) }
-system('psql', '-h', 'localhost', '-p', local_port.to_s, '-U', 'postgres', '-d', 'postgres', '-c', 'SELECT NOW()')
-server_thread.join
@@ -23,9 +23,6 @@ end
 scp = LibSSH::Scp.new(session, :write, target_dir)
 scp.init do
   path = Pathname.new(__dir__).parent.join('README.md')
-  scp.push_file(path.basename.to_s, path.size, path.stat.mode & 0xfff)
-  path.read do |buf|
-    scp.write(buf)
-  end
+  scp.upload_file(path.to_s, path.basename.to_s)
   puts "Uploaded #{path} to #{host}:#{File.join(target_dir, path.basename)}"
 end
@@ -0,0 +1,29 @@
+#!/usr/bin/env ruby
+require 'libssh'
+
+host = 'barkhorn'
+remote_path = '/var/log/syslog'
+local_path = 'syslog'
+
+session = LibSSH::Session.new
+# session.log_verbosity = :debug
+session.host = host
+session.parse_config
+session.add_identity('%d/id_ed25519')
+
+session.connect
+if session.server_known != LibSSH::SERVER_KNOWN_OK
+  raise
+end
+if session.userauth_publickey_auto != LibSSH::AUTH_SUCCESS
+  raise 'authorization failed'
+end
+
+session.sftp do |sftp|
+  attrs = sftp.stat(remote_path)
+  puts "size=#{attrs.size}, mode=#{attrs.permissions.to_s(8)}, mtime=#{attrs.mtime}"
+  started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  bytes, sha256 = sftp.download(remote_path, local_path, requests: 64, digest: :sha256)
+  elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - started
+  puts "Downloaded #{bytes} bytes in #{elapsed.round(3)}s, sha256=#{sha256}"
+end
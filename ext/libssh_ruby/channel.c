@@ -1,5 +1,13 @@
 #include "libssh_ruby.h"
+#include <errno.h>
+#include <poll.h>
 #include <ruby/thread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef HAVE_SSH_ADD_CHANNEL_CALLBACKS
+#include <libssh/callbacks.h>
+#include <pthread.h>
+#endif
 
 #define RAISE_IF_ERROR(rc) \
   if ((rc) == SSH_ERROR)   \
@@ -7,18 +15,44 @@
 
 VALUE rb_cLibSSHChannel;
 
-static ID id_stderr, id_timeout;
+static ID id_stderr, id_timeout, id_deadline, id_binary, id_max_output,
+    id_limit, id_call, id_digest;
+
+#ifdef HAVE_SSH_ADD_CHANNEL_CALLBACKS
+/* Events received by the callbacks are kept here until
+ * Session#process_events dispatches them to the blocks. */
+struct ChannelCallbacksStruct {
+  struct ssh_channel_callbacks_struct callbacks;
+  pthread_mutex_t lock;
+  int *pending;
+  /* Sequence of struct data_record and its data */
+  char *buf;
+  size_t len, capa;
+  /* Offset of the last record, or SIZE_MAX */
+  size_t last;
+  int eof, closed, exit_status_set, exit_status;
+  /* Whether on_data gets ASCII-8BIT Strings */
+  int binary;
+  VALUE on_data, on_eof, on_exit_status, on_close;
+};
+typedef struct ChannelCallbacksStruct ChannelCallbacks;
+
+struct data_record {
+  int is_stderr;
+  uint32_t len;
+};
+
+static void channel_callbacks_free(ChannelCallbacks *cbs) {
+  pthread_mutex_destroy(&cbs->lock);
+  free(cbs->buf);
+  ruby_xfree(cbs);
+}
+#endif
 
 static void channel_mark(void *);
 static void channel_free(void *);
 static size_t channel_memsize(const void *);
 
-struct ChannelHolderStruct {
-  ssh_channel channel;
-  VALUE session;
-};
-typedef struct ChannelHolderStruct ChannelHolder;
-
 static const rb_data_type_t channel_type = {
     "ssh_channel",
     {channel_mark, channel_free, channel_memsize, {NULL, NULL}},
@@ -31,6 +65,8 @@ static VALUE channel_alloc(VALUE klass) {
   ChannelHolder *holder = ALLOC(ChannelHolder);
   holder->channel = NULL;
   holder->session = Qundef;
+  holder->window = 0;
+  holder->callbacks = NULL;
   return TypedData_Wrap_Struct(klass, &channel_type, holder);
 }
 
@@ -39,6 +75,14 @@ static void channel_mark(void *arg) {
   if (holder->channel != NULL) {
     rb_gc_mark(holder->session);
   }
+#ifdef HAVE_SSH_ADD_CHANNEL_CALLBACKS
+  if (holder->callbacks != NULL) {
+    rb_gc_mark(holder->callbacks->on_data);
+    rb_gc_mark(holder->callbacks->on_eof);
+    rb_gc_mark(holder->callbacks->on_exit_status);
+    rb_gc_mark(holder->callbacks->on_close);
+  }
+#endif
 }
 
 static void channel_free(void *arg) {
@@ -49,6 +93,15 @@ static void channel_free(void *arg) {
     /* ssh_channel_free(holder->channel); */
     holder->channel = NULL;
   }
+#ifdef HAVE_SSH_ADD_CHANNEL_CALLBACKS
+  /* A channel with callbacks is referenced by its session until the callbacks
+   * are removed, so the session is unreachable and no more callbacks are
+   * called here. */
+  if (holder->callbacks != NULL) {
+    channel_callbacks_free(holder->callbacks);
+    holder->callbacks = NULL;
+  }
+#endif
 
   ruby_xfree(holder);
 }
@@ -57,6 +110,12 @@ static size_t channel_memsize(RB_UNUSED_VAR(const void *arg)) {
   return sizeof(ChannelHolder);
 }
 
+ChannelHolder *libssh_ruby_channel_holder(VALUE channel) {
+  ChannelHolder *holder;
+  TypedData_Get_Struct(channel, ChannelHolder, &channel_type, holder);
+  return holder;
+}
+
 /* @overload initialize(session)
  *  Initialize a channel from the session.
  *  @param [Session] session
@@ -71,6 +130,7 @@ static VALUE m_initialize(VALUE self, VALUE session) {
   session_holder = libssh_ruby_session_holder(session);
   holder->channel = ssh_channel_new(session_holder->session);
   holder->session = session;
+  holder->window = session_holder->channel_window;
 
   return self;
 }
@@ -87,61 +147,181 @@ static void *nogvl_close(void *ptr) {
 }
 
 /*
- * @overload close
+ * @overload close(deadline: nil)
  *  Close a channel.
+ *  @param [Numeric, Time, nil] deadline Raise {TimeoutError} unless the
+ *    close is sent by then. A Numeric is seconds from now.
  *  @return [nil]
+ *  @raise [TimeoutError]
  *  @see http://api.libssh.org/stable/group__libssh__channel.html
  *    ssh_channel_close
  */
-static VALUE m_close(VALUE self) {
+static VALUE m_close(int argc, VALUE *argv, VALUE self) {
   ChannelHolder *holder;
   struct nogvl_channel_args args;
+  VALUE opts;
+  struct timespec ts;
+  const struct timespec *deadline;
 
   TypedData_Get_Struct(self, ChannelHolder, &channel_type, holder);
+  rb_scan_args(argc, argv, "0:", &opts);
+  deadline = libssh_ruby_deadline_option(opts, &ts);
   args.channel = holder->channel;
-  rb_thread_call_without_gvl(nogvl_close, &args, RUBY_UBF_IO, NULL);
+  libssh_ruby_session_call(holder->session, nogvl_close, &args, &args.rc,
+                           SSH_AGAIN, -1, deadline);
   RAISE_IF_ERROR(args.rc);
 
   return Qnil;
 }
 
+/* Close the channel after the block of #open_session and #open_forward. */
+static VALUE close_after_block(VALUE self) {
+  return m_close(0, NULL, self);
+}
+
+struct nogvl_grow_window_args {
+  ssh_channel channel;
+  uint32_t window;
+  int rc;
+};
+
+static void *nogvl_grow_window(void *ptr) {
+  struct nogvl_grow_window_args *args = ptr;
+  void *buf;
+
+  /* libssh has no API to set the window, but a read of +count+ bytes grows
+   * the local window to +count+ before waiting. It is done only right after
+   * the channel is opened, when no request has been sent, so nothing is
+   * consumed. Leave the window to libssh if any data is buffered anyway. */
+  if (ssh_channel_poll(args->channel, 0) != 0 ||
+      ssh_channel_poll(args->channel, 1) != 0) {
+    args->rc = SSH_OK;
+    return NULL;
+  }
+  /* The destination is only mapped, so no page is touched unless the server
+   * sends data without a request. */
+  buf = mmap(NULL, args->window, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED) {
+    args->rc = SSH_OK;
+    return NULL;
+  }
+  /* With timeout 0 it returns immediately. */
+  args->rc = ssh_channel_read_timeout(args->channel, buf, args->window, 1, 0);
+  if (args->rc == SSH_AGAIN) {
+    args->rc = SSH_OK;
+  }
+  munmap(buf, args->window);
+  return NULL;
+}
+
+/* Announce holder->window bytes of the local window to the remote party.
+ * Call it once when the channel gets open. Later reads keep the window with
+ * channel_read. */
+static void grow_window(ChannelHolder *holder) {
+  struct nogvl_grow_window_args args;
+
+  args.channel = holder->channel;
+  args.window = holder->window;
+  libssh_ruby_session_call(holder->session, nogvl_grow_window, &args, &args.rc,
+                           SSH_AGAIN, -1, NULL);
+  RAISE_IF_ERROR(args.rc);
+}
+
 static void *nogvl_open_session(void *ptr) {
   struct nogvl_channel_args *args = ptr;
   args->rc = ssh_channel_open_session(args->channel);
   return NULL;
 }
 
-/* FIXME: When Channel#open_session is called before authorization,
- * #open_session will block infinitely and unable to stop it by C-c. */
 /*
- * @overload open_session
+ * @overload open_session(deadline: nil)
  *  Open a session channel, and close it after the block.
+ *  @param [Numeric, Time, nil] deadline Raise {TimeoutError} unless the
+ *    channel is opened by then. A Numeric is seconds from now.
  *  @yieldparam [Channel] channel self
  *  @return [Object] Return value of the block
+ *  @raise [TimeoutError]
  *  @see http://api.libssh.org/stable/group__libssh__channel.html
  *    ssh_channel_open_session
  */
-static VALUE m_open_session(VALUE self) {
+static VALUE m_open_session(int argc, VALUE *argv, VALUE self) {
   ChannelHolder *holder;
   struct nogvl_channel_args args;
+  VALUE opts;
+  struct timespec ts;
+  const struct timespec *deadline;
+  int was_open;
 
   TypedData_Get_Struct(self, ChannelHolder, &channel_type, holder);
+  rb_scan_args(argc, argv, "0:", &opts);
+  deadline = libssh_ruby_deadline_option(opts, &ts);
   /* When ssh_channel_open_session is called before ssh_connect, libssh would
    * crash :-< */
   if (!ssh_is_connected(ssh_channel_get_session(holder->channel))) {
     rb_raise(rb_eArgError, "Session isn't connected");
   }
+  /* #open_session_nonblocking may have opened it already. */
+  was_open = ssh_channel_is_open(holder->channel);
   args.channel = holder->channel;
-  rb_thread_call_without_gvl(nogvl_open_session, &args, RUBY_UBF_IO, NULL);
+  libssh_ruby_session_call(holder->session, nogvl_open_session, &args, &args.rc,
+                           SSH_AGAIN, -1, deadline);
   RAISE_IF_ERROR(args.rc);
+  if (holder->window > 0 && !was_open) {
+    grow_window(holder);
+  }
 
   if (rb_block_given_p()) {
-    return rb_ensure(rb_yield, Qnil, m_close, self);
+    return rb_ensure(rb_yield, Qnil, close_after_block, self);
   } else {
     return Qnil;
   }
 }
 
+static void try_open_session(ChannelHolder *holder,
+                             struct nogvl_channel_args *args) {
+  SessionHolder *session = libssh_ruby_session_holder(holder->session);
+
+  libssh_ruby_session_nonblocking_begin(session);
+  args->rc = ssh_channel_open_session(args->channel);
+  libssh_ruby_session_nonblocking_end(session);
+}
+
+/*
+ * @overload open_session_nonblocking
+ *  Send a request to open a session channel without waiting for the reply.
+ *  The reply is handled while the session is used for other channels. Call
+ *  this method again or {#open_session} to complete the opening.
+ *  @return [Boolean] +true+ if the channel is open, +false+ if the reply
+ *    hasn't arrived yet.
+ *  @since 0.5.0
+ *  @see http://api.libssh.org/stable/group__libssh__channel.html
+ *    ssh_channel_open_session
+ */
+static VALUE m_open_session_nonblocking(VALUE self) {
+  ChannelHolder *holder;
+  struct nogvl_channel_args args;
+
+  TypedData_Get_Struct(self, ChannelHolder, &channel_type, holder);
+  if (!ssh_is_connected(ssh_channel_get_session(holder->channel))) {
+    rb_raise(rb_eArgError, "Session isn't connected");
+  }
+  if (ssh_channel_is_open(holder->channel)) {
+    return Qtrue;
+  }
+  args.channel = holder->channel;
+  /* It never waits, so the GVL is kept. */
+  try_open_session(holder, &args);
+  if (args.rc == SSH_AGAIN) {
+    return Qfalse;
+  }
+  RAISE_IF_ERROR(args.rc);
+  if (holder->window > 0) {
+    grow_window(holder);
+  }
+  return Qtrue;
+}
+
 struct nogvl_open_forward_args {
   ssh_channel channel;
   const char *remote_host;
@@ -156,32 +336,42 @@ static void *nogvl_open_forward(void *ptr) {
   return NULL;
 }
 
-/* FIXME: When Channel#open_forward is called before authorization,
- * #open_session will block infinitely and unable to stop it by C-c. */
 /*
- * @overload open_forward(remote_host, remote_port)
+ * @overload open_forward(remote_host, remote_port, deadline: nil)
  *  Open a TCP/IP forwarding channel.
  *  @param [String] remote_host The remote host to connected.
  *  @param [Fixnum] remote_port The remote port.
+ *  @param [Numeric, Time, nil] deadline Raise {TimeoutError} unless the
+ *    channel is opened by then. A Numeric is seconds from now.
  *  @return [nil]
+ *  @raise [TimeoutError]
  *  @since 0.4.0
  *  @see http://api.libssh.org/stable/group__libssh__channel.html
  *    ssh_channel_open_forward
  */
-static VALUE m_open_forward(VALUE self, VALUE remote_host, VALUE remote_port) {
+static VALUE m_open_forward(int argc, VALUE *argv, VALUE self) {
   ChannelHolder *holder;
   struct nogvl_open_forward_args args;
+  VALUE remote_host, remote_port, opts;
+  struct timespec ts;
+  const struct timespec *deadline;
 
   TypedData_Get_Struct(self, ChannelHolder, &channel_type, holder);
+  rb_scan_args(argc, argv, "20:", &remote_host, &remote_port, &opts);
+  deadline = libssh_ruby_deadline_option(opts, &ts);
   args.remote_host = StringValueCStr(remote_host);
   Check_Type(remote_port, T_FIXNUM);
   args.remote_port = FIX2INT(remote_port);
   args.channel = holder->channel;
-  rb_thread_call_without_gvl(nogvl_open_forward, &args, RUBY_UBF_IO, NULL);
+  libssh_ruby_session_call(holder->session, nogvl_open_forward, &args, &args.rc,
+                           SSH_AGAIN, -1, deadline);
   RAISE_IF_ERROR(args.rc);
+  if (holder->window > 0) {
+    grow_window(holder);
+  }
 
   if (rb_block_given_p()) {
-    return rb_ensure(rb_yield, Qnil, m_close, self);
+    return rb_ensure(rb_yield, Qnil, close_after_block, self);
   } else {
     return Qnil;
   }
@@ -201,21 +391,32 @@ static void *nogvl_request_exec(void *ptr) {
 }
 
 /*
- * @overload request_exec(cmd)
+ * @overload request_exec(cmd, deadline: nil)
  *  Run a shell command without an interactive shell.
  *  @param [String] cmd The command to execute
+ *  @param [Numeric, Time, nil] deadline Raise {TimeoutError} unless the
+ *    request is done by then. A Numeric is seconds from now.
  *  @return [nil]
+ *  @raise [TimeoutError]
  *  @see http://api.libssh.org/stable/group__libssh__channel.html
  *    ssh_channel_request_exec
  */
-static VALUE m_request_exec(VALUE self, VALUE cmd) {
+static VALUE m_request_exec(int argc, VALUE *argv, VALUE self) {
   ChannelHolder *holder;
   struct nogvl_request_exec_args args;
+  VALUE cmd, opts;
+  struct timespec ts;
+  const struct timespec *deadline;
 
   TypedData_Get_Struct(self, ChannelHolder, &channel_type, holder);
+  rb_scan_args(argc, argv, "10:", &cmd, &opts);
+  deadline = libssh_ruby_deadline_option(opts, &ts);
   args.channel = holder->channel;
+  cmd = rb_str_new_frozen(StringValue(cmd));
   args.cmd = StringValueCStr(cmd);
-  rb_thread_call_without_gvl(nogvl_request_exec, &args, RUBY_UBF_IO, NULL);
+  libssh_ruby_session_call(holder->session, nogvl_request_exec, &args, &args.rc,
+                           SSH_AGAIN, -1, deadline);
+  RB_GC_GUARD(cmd);
   RAISE_IF_ERROR(args.rc);
   return Qnil;
 }
@@ -239,7 +440,8 @@ static VALUE m_request_pty(VALUE self) {
 
   TypedData_Get_Struct(self, ChannelHolder, &channel_type, holder);
   args.channel = holder->channel;
-  rb_thread_call_without_gvl(nogvl_request_pty, &args, RUBY_UBF_IO, NULL);
+  libssh_ruby_session_call(holder->session, nogvl_request_pty, &args, &args.rc,
+                           SSH_AGAIN, -1, NULL);
   RAISE_IF_ERROR(args.rc);
   return Qnil;
 }
@@ -249,60 +451,155 @@ struct nogvl_read_args {
   char *buf;
   uint32_t count;
   int is_stderr;
+  /* Whether to keep the window of ChannelHolder.window */
+  int keep_window;
   int timeout;
+  struct timespec deadline_ts;
+  const struct timespec *deadline;
   int rc;
 };
 
+/*
+ * Read up to +count+ bytes without waiting. Return SSH_EOF at EOF and 0 if
+ * no data is available. With +keep_window+, the read goes through
+ * ssh_channel_read_timeout, which grows the local window to +count+ when
+ * less is left, as libssh has no API to set the window.
+ */
+static int channel_read(ssh_channel channel, char *buf, uint32_t count,
+                        int is_stderr, int keep_window) {
+  if (keep_window) {
+    int n = ssh_channel_read_timeout(channel, buf, count, is_stderr, 0);
+
+    /* 0 is either no data or EOF. */
+    if (n != 0) {
+      return n;
+    }
+  }
+  return ssh_channel_read_nonblocking(channel, buf, count, is_stderr);
+}
+
+/* Called by libssh_ruby_session_call, so the session is nonblocking. */
 static void *nogvl_read(void *ptr) {
   struct nogvl_read_args *args = ptr;
-  args->rc = ssh_channel_read_timeout(args->channel, args->buf, args->count,
-                                      args->is_stderr, args->timeout);
+
+  args->rc = channel_read(args->channel, args->buf, args->count,
+                          args->is_stderr, args->keep_window);
+  if (args->rc == SSH_EOF) {
+    args->rc = 0;
+  } else if (args->rc == 0) {
+    args->rc = SSH_AGAIN;
+  }
   return NULL;
 }
 
+static void get_read_kwargs(VALUE opts, struct nogvl_read_args *args,
+                            int *binary) {
+  const ID table[] = {id_stderr, id_timeout, id_deadline, id_binary};
+  VALUE kwvals[sizeof(table) / sizeof(*table)];
+
+  rb_get_kwargs(opts, table, 0, binary == NULL ? 3 : 4, kwvals);
+  if (kwvals[0] == Qundef) {
+    args->is_stderr = 0;
+  } else {
+    args->is_stderr = RTEST(kwvals[0]) ? 1 : 0;
+  }
+  if (kwvals[1] == Qundef) {
+    args->timeout = -1;
+  } else {
+    Check_Type(kwvals[1], T_FIXNUM);
+    args->timeout = FIX2INT(kwvals[1]);
+  }
+  if (libssh_ruby_get_deadline(kwvals[2], &args->deadline_ts)) {
+    args->deadline = &args->deadline_ts;
+  } else {
+    args->deadline = NULL;
+  }
+  if (binary != NULL) {
+    *binary = kwvals[3] != Qundef && RTEST(kwvals[3]);
+  }
+}
+
 /*
- * @overload read(count, stderr: false, timeout: -1)
+ * @overload read(count, stderr: false, timeout: -1, deadline: nil, binary: false)
  *  Read data from a channel.
  *  @param [Fixnum] count The count of bytes to be read.
  *  @param [Boolean] stderr Read from the stderr flow or not.
  *  @param [Fixnum] timeout A timeout in seconds. +-1+ means infinite timeout.
+ *  @param [Numeric, Time, nil] deadline Raise {TimeoutError} if no data
+ *    arrives by then. A Numeric is seconds from now.
+ *  @param [Boolean] binary Return an ASCII-8BIT String instead of UTF-8.
  *  @return [String] Data read from the channel.
+ *  @raise [TimeoutError]
  *  @see http://api.libssh.org/stable/group__libssh__channel.html
  *    ssh_channel_read_timeout
  */
 static VALUE m_read(int argc, VALUE *argv, VALUE self) {
   ChannelHolder *holder;
   VALUE count, opts;
-  const ID table[] = {id_stderr, id_timeout};
-  VALUE kwvals[sizeof(table) / sizeof(*table)];
   struct nogvl_read_args args;
+  int binary;
   VALUE ret;
 
   TypedData_Get_Struct(self, ChannelHolder, &channel_type, holder);
   rb_scan_args(argc, argv, "10:", &count, &opts);
   Check_Type(count, T_FIXNUM);
-  rb_get_kwargs(opts, table, 0, 2, kwvals);
-  if (kwvals[0] == Qundef) {
-    args.is_stderr = 0;
-  } else {
-    args.is_stderr = RTEST(kwvals[0]) ? 1 : 0;
-  }
-  if (kwvals[1] == Qundef) {
-    args.timeout = -1;
-  } else {
-    Check_Type(kwvals[1], T_FIXNUM);
-    args.timeout = FIX2INT(kwvals[1]);
-  }
+  get_read_kwargs(opts, &args, &binary);
   args.channel = holder->channel;
   args.count = FIX2UINT(count);
-  args.buf = ALLOC_N(char, args.count);
-  rb_thread_call_without_gvl(nogvl_read, &args, RUBY_UBF_IO, NULL);
+  args.keep_window = holder->window > 0;
+  if (binary) {
+    ret = rb_str_new(NULL, args.count);
+  } else {
+    ret = rb_utf8_str_new(NULL, args.count);
+  }
+  args.buf = RSTRING_PTR(ret);
+  libssh_ruby_session_call(holder->session, nogvl_read, &args, &args.rc,
+                           SSH_AGAIN, args.timeout, args.deadline);
+  RAISE_IF_ERROR(args.rc);
 
-  ret = rb_utf8_str_new(args.buf, args.rc);
-  ruby_xfree(args.buf);
+  rb_str_resize(ret, args.rc < 0 ? 0 : args.rc);
   return ret;
 }
 
+/*
+ * @overload read_into(buffer, maxlen, stderr: false, timeout: -1, deadline: nil)
+ *  Read data from a channel into the given buffer. The buffer is resized to
+ *  the bytes read and its encoding is set to ASCII-8BIT. Its capacity is
+ *  kept, so the same buffer can be reused without allocation.
+ *  @param [String] buffer The buffer to be filled.
+ *  @param [Fixnum] maxlen The maximum count of bytes to be read.
+ *  @param [Boolean] stderr Read from the stderr flow or not.
+ *  @param [Fixnum] timeout A timeout in seconds. +-1+ means infinite timeout.
+ *  @param [Numeric, Time, nil] deadline Raise {TimeoutError} if no data
+ *    arrives by then. A Numeric is seconds from now.
+ *  @return [Fixnum] The number of bytes read.
+ *  @raise [TimeoutError]
+ *  @since 0.5.0
+ *  @see http://api.libssh.org/stable/group__libssh__channel.html
+ *    ssh_channel_read_timeout
+ */
+static VALUE m_read_into(int argc, VALUE *argv, VALUE self) {
+  ChannelHolder *holder;
+  VALUE buffer, maxlen, opts;
+  struct nogvl_read_args args;
+
+  TypedData_Get_Struct(self, ChannelHolder, &channel_type, holder);
+  rb_scan_args(argc, argv, "20:", &buffer, &maxlen, &opts);
+  Check_Type(maxlen, T_FIXNUM);
+  get_read_kwargs(opts, &args, NULL);
+  args.channel = holder->channel;
+  args.count = FIX2UINT(maxlen);
+  args.keep_window = holder->window > 0;
+  args.buf = libssh_ruby_buffer_prepare(buffer, args.count);
+  libssh_ruby_buffer_session_call(buffer, holder->session, nogvl_read, &args,
+                                  &args.rc, SSH_AGAIN, args.timeout,
+                                  args.deadline);
+  libssh_ruby_buffer_finish(buffer, args.rc);
+  RAISE_IF_ERROR(args.rc);
+
+  return INT2FIX(args.rc < 0 ? 0 : args.rc);
+}
+
 struct nogvl_read_nonblocking_args {
   ssh_channel channel;
   char *buf;
@@ -319,10 +616,12 @@ static void *nogvl_read_nonblocking(void *ptr) {
 }
 
 /*
- * @overload read_nonblocking(count, is_stderr = false)
+ * @overload read_nonblocking(count, is_stderr = false, stderr: false, binary: false)
  *  Do a nonblocking read on the channel.
  *  @param [Fixnum] count The count of bytes to be read.
  *  @param [Boolean] is_stderr Read from the stderr flow or not.
+ *  @param [Boolean] stderr Same as +is_stderr+.
+ *  @param [Boolean] binary Return an ASCII-8BIT String instead of UTF-8.
  *  @return [String, nil] Data read from the channel. +nil+ on EOF.
  *  @since 0.3.0
  *  @see http://api.libssh.org/stable/group__libssh__channel.html
@@ -330,30 +629,94 @@ static void *nogvl_read_nonblocking(void *ptr) {
  */
 static VALUE m_read_nonblocking(int argc, VALUE *argv, VALUE self) {
   ChannelHolder *holder;
-  VALUE count, is_stderr;
+  VALUE count, is_stderr, opts;
+  const ID table[] = {id_stderr, id_binary};
+  VALUE kwvals[sizeof(table) / sizeof(*table)];
   struct nogvl_read_nonblocking_args args;
   VALUE ret;
 
   TypedData_Get_Struct(self, ChannelHolder, &channel_type, holder);
   args.channel = holder->channel;
-  rb_scan_args(argc, argv, "11", &count, &is_stderr);
+  rb_scan_args(argc, argv, "11:", &count, &is_stderr, &opts);
   Check_Type(count, T_FIXNUM);
+  rb_get_kwargs(opts, table, 0, 2, kwvals);
   args.count = FIX2UINT(count);
-  if (is_stderr == Qundef) {
+  if (kwvals[0] != Qundef) {
+    args.is_stderr = RTEST(kwvals[0]) ? 1 : 0;
+  } else if (is_stderr == Qundef) {
     args.is_stderr = 0;
   } else {
     args.is_stderr = RTEST(is_stderr) ? 1 : 0;
   }
-  args.buf = ALLOC_N(char, args.count);
-  rb_thread_call_without_gvl(nogvl_read_nonblocking, &args, RUBY_UBF_IO, NULL);
+  if (kwvals[1] != Qundef && RTEST(kwvals[1])) {
+    ret = rb_str_new(NULL, args.count);
+  } else {
+    ret = rb_utf8_str_new(NULL, args.count);
+  }
+  args.buf = RSTRING_PTR(ret);
+  /* It never returns SSH_AGAIN, so it is called only once. */
+  libssh_ruby_session_call(holder->session, nogvl_read_nonblocking, &args,
+                           &args.rc, SSH_AGAIN, -1, NULL);
+  RAISE_IF_ERROR(args.rc);
 
   if (args.rc == SSH_EOF) {
-    ret = Qnil;
+    return Qnil;
   } else {
-    ret = rb_utf8_str_new(args.buf, args.rc);
+    rb_str_resize(ret, args.rc);
+    return ret;
   }
-  ruby_xfree(args.buf);
-  return ret;
+}
+
+/*
+ * @overload window_size=(size)
+ *  Set the local window of the channel for high throughput. It must be set
+ *  before {#open_session} or {#open_forward}, which announce the window at
+ *  once. {#copy_to} and {#exec_capture} read this many bytes at a time so
+ *  that libssh keeps the window this large. {#read} and {#read_into} keep it
+ *  only when +count+ is at least this large, and smaller reads let libssh
+ *  refill the window by its default size. Links with a large
+ *  bandwidth-delay product need a window larger than the libssh default.
+ *  @param [Integer, nil] size The window size in bytes. +nil+ means the
+ *    libssh default.
+ *  @return [Integer, nil]
+ *  @since 0.5.0
+ *  @see Session#channel_window_size=
+ */
+static VALUE m_set_window_size(VALUE self, VALUE size) {
+  ChannelHolder *holder;
+
+  TypedData_Get_Struct(self, ChannelHolder, &channel_type, holder);
+  holder->window = NIL_P(size) ? 0 : NUM2UINT(size);
+  return size;
+}
+
+/*
+ * @overload window_size
+ *  Get the local window size set by {#window_size=}.
+ *  @return [Integer, nil] +nil+ if the libssh default is used.
+ *  @since 0.5.0
+ */
+static VALUE m_window_size(VALUE self) {
+  ChannelHolder *holder;
+
+  TypedData_Get_Struct(self, ChannelHolder, &channel_type, holder);
+  return holder->window == 0 ? Qnil : UINT2NUM(holder->window);
+}
+
+/*
+ * @overload remote_window
+ *  Get the current window of the remote party, i.e. the bytes which can be
+ *  written without waiting for a window adjust.
+ *  @return [Integer]
+ *  @since 0.5.0
+ *  @see http://api.libssh.org/stable/group__libssh__channel.html
+ *    ssh_channel_window_size
+ */
+static VALUE m_remote_window(VALUE self) {
+  ChannelHolder *holder;
+
+  TypedData_Get_Struct(self, ChannelHolder, &channel_type, holder);
+  return UINT2NUM(ssh_channel_window_size(holder->channel));
 }
 
 /*
@@ -409,32 +772,41 @@ struct nogvl_poll_args {
 
 static void *nogvl_poll(void *ptr) {
   struct nogvl_poll_args *args = ptr;
-  args->rc =
-      ssh_channel_poll_timeout(args->channel, args->timeout, args->is_stderr);
+
+  args->rc = ssh_channel_poll(args->channel, args->is_stderr);
+  if (args->rc == 0) {
+    args->rc = SSH_AGAIN;
+  }
   return NULL;
 }
 
 /*
- * @overload poll(stderr: false, timeout: -1)
+ * @overload poll(stderr: false, timeout: -1, deadline: nil)
  *  Poll a channel for data to read.
  *  @param [Boolean] stderr A boolean to select the stderr stream.
  *  @param [Fixnum] timeout A timeout in milliseconds. A negative value means an
  *    infinite timeout.
- *  @return [Fixnum, nil] The number of bytes available for reading. +nil+ if
- *    timed out.
+ *  @param [Numeric, Time, nil] deadline Raise {TimeoutError} if no data
+ *    arrives by then. A Numeric is seconds from now.
+ *  @return [Fixnum, nil] The number of bytes available for reading. +nil+ on
+ *    EOF.
+ *  @raise [TimeoutError]
  *  @see http://api.libssh.org/stable/group__libssh__channel.html
  *    ssh_channel_poll_timeout
  */
 static VALUE m_poll(int argc, VALUE *argv, VALUE self) {
   ChannelHolder *holder;
   VALUE opts;
-  const ID table[] = {id_stderr, id_timeout};
+  const ID table[] = {id_stderr, id_timeout, id_deadline};
   VALUE kwvals[sizeof(table) / sizeof(*table)];
   struct nogvl_poll_args args;
+  struct timespec ts;
+  const struct timespec *deadline;
 
   TypedData_Get_Struct(self, ChannelHolder, &channel_type, holder);
   rb_scan_args(argc, argv, "00:", &opts);
-  rb_get_kwargs(opts, table, 0, 2, kwvals);
+  rb_get_kwargs(opts, table, 0, 3, kwvals);
+  deadline = libssh_ruby_get_deadline(kwvals[2], &ts) ? &ts : NULL;
   if (kwvals[0] == Qundef) {
     args.is_stderr = 0;
   } else {
@@ -448,11 +820,14 @@ static VALUE m_poll(int argc, VALUE *argv, VALUE self) {
   }
 
   args.channel = holder->channel;
-  rb_thread_call_without_gvl(nogvl_poll, &args, RUBY_UBF_IO, NULL);
+  libssh_ruby_session_call(holder->session, nogvl_poll, &args, &args.rc,
+                           SSH_AGAIN, args.timeout, deadline);
   RAISE_IF_ERROR(args.rc);
 
   if (args.rc == SSH_EOF) {
     return Qnil;
+  } else if (args.rc == SSH_AGAIN) {
+    return INT2FIX(0);
   } else {
     return INT2FIX(args.rc);
   }
@@ -460,27 +835,40 @@ static VALUE m_poll(int argc, VALUE *argv, VALUE self) {
 
 static void *nogvl_get_exit_status(void *ptr) {
   struct nogvl_channel_args *args = ptr;
+  ssh_session session = ssh_channel_get_session(args->channel);
+
   args->rc = ssh_channel_get_exit_status(args->channel);
+  if (args->rc == -1 && !ssh_is_blocking(session) &&
+      !ssh_channel_is_closed(args->channel) && ssh_is_connected(session)) {
+    args->rc = SSH_AGAIN;
+  }
   return NULL;
 }
 
-/* FIXME: When Channel#get_exit_status is called before #request_exec,
- * #get_exit_status will block infinitely and unable to stop it by C-c. */
 /*
- * @overload get_exit_status
+ * @overload get_exit_status(deadline: nil)
  *  Get the exit status of the channel.
+ *  @param [Numeric, Time, nil] deadline Raise {TimeoutError} unless the
+ *    status is received by then. A Numeric is seconds from now.
  *  @return [Fixnum, nil] The exit status. +nil+ if no exit status has been
  *    returned.
+ *  @raise [TimeoutError]
  *  @see http://api.libssh.org/stable/group__libssh__channel.html
  *    ssh_channel_get_exit_status
  */
-static VALUE m_get_exit_status(VALUE self) {
+static VALUE m_get_exit_status(int argc, VALUE *argv, VALUE self) {
   ChannelHolder *holder;
   struct nogvl_channel_args args;
+  VALUE opts;
+  struct timespec ts;
+  const struct timespec *deadline;
 
   TypedData_Get_Struct(self, ChannelHolder, &channel_type, holder);
+  rb_scan_args(argc, argv, "0:", &opts);
+  deadline = libssh_ruby_deadline_option(opts, &ts);
   args.channel = holder->channel;
-  rb_thread_call_without_gvl(nogvl_get_exit_status, &args, RUBY_UBF_IO, NULL);
+  libssh_ruby_session_call(holder->session, nogvl_get_exit_status, &args,
+                           &args.rc, SSH_AGAIN, -1, deadline);
   if (args.rc == -1) {
     return Qnil;
   } else {
@@ -488,16 +876,187 @@ static VALUE m_get_exit_status(VALUE self) {
   }
 }
 
+struct nogvl_exec_capture_args {
+  ChannelHolder *holder;
+  const char *cmd;
+  size_t max_output;
+  const struct timespec *deadline;
+  /* As large as the window to keep, see channel_read */
+  char *chunk;
+  uint32_t chunk_size;
+  struct capture_buffer out[2];
+  /* 0: requesting exec, 1: reading, 2: getting the exit status */
+  int stage;
+  int eof[2];
+  int exit_status;
+  /* Set when the output cannot be allocated */
+  int nomem;
+  int rc;
+};
+
+/* Run by libssh_ruby_session_call, so return SSH_AGAIN to wait for the
+ * session and resume from the current stage. */
+static void *nogvl_exec_capture(void *ptr) {
+  struct nogvl_exec_capture_args *args = ptr;
+  ssh_channel channel = args->holder->channel;
+  int is_stderr;
+
+  if (args->stage == 0) {
+    args->rc = ssh_channel_request_exec(channel, args->cmd);
+    if (args->rc != SSH_OK) {
+      return NULL;
+    }
+    args->stage = 1;
+  }
+
+  while (args->stage == 1) {
+    int progress = 0;
+
+    for (is_stderr = 0; is_stderr < 2; is_stderr++) {
+      int rc;
+
+      if (args->eof[is_stderr]) {
+        continue;
+      }
+      rc = channel_read(channel, args->chunk, args->chunk_size, is_stderr,
+                        args->holder->window > 0);
+      if (rc == SSH_ERROR) {
+        args->rc = SSH_ERROR;
+        return NULL;
+      } else if (rc == SSH_EOF) {
+        args->eof[is_stderr] = 1;
+      } else if (rc > 0) {
+        if (libssh_ruby_capture_append(&args->out[is_stderr], args->chunk, rc,
+                                       args->max_output) != 0) {
+          /* Not a libssh error, so stop with SSH_OK and raise later. */
+          args->nomem = 1;
+          args->rc = SSH_OK;
+          return NULL;
+        }
+        progress = 1;
+      }
+    }
+    if (args->eof[0] && args->eof[1]) {
+      args->stage = 2;
+    } else if (!progress) {
+      args->rc = SSH_AGAIN;
+      return NULL;
+    }
+  }
+
+  args->exit_status = ssh_channel_get_exit_status(channel);
+  if (args->exit_status == -1 && !ssh_channel_is_closed(channel) &&
+      ssh_is_connected(ssh_channel_get_session(channel))) {
+    args->rc = SSH_AGAIN;
+  } else {
+    args->rc = SSH_OK;
+  }
+  return NULL;
+}
+
+static VALUE exec_capture_body(VALUE ptr) {
+  struct nogvl_exec_capture_args *args = (void *)ptr;
+  ChannelHolder *holder = args->holder;
+  VALUE ret;
+
+  args->chunk = malloc(args->chunk_size);
+  if (args->chunk == NULL) {
+    rb_memerror();
+  }
+  libssh_ruby_session_call(holder->session, nogvl_exec_capture, args,
+                           &args->rc, SSH_AGAIN, -1, args->deadline);
+  if (args->nomem) {
+    rb_memerror();
+  }
+  RAISE_IF_ERROR(args->rc);
+
+  ret = rb_ary_new_capa(3);
+  rb_ary_push(ret, rb_utf8_str_new(args->out[0].ptr, args->out[0].len));
+  rb_ary_push(ret, rb_utf8_str_new(args->out[1].ptr, args->out[1].len));
+  rb_ary_push(ret,
+              args->exit_status == -1 ? Qnil : INT2FIX(args->exit_status));
+  return ret;
+}
+
+static VALUE exec_capture_ensure(VALUE ptr) {
+  struct nogvl_exec_capture_args *args = (void *)ptr;
+
+  free(args->chunk);
+  free(args->out[0].ptr);
+  free(args->out[1].ptr);
+  return Qnil;
+}
+
+/*
+ * @overload exec_capture(cmd, max_output: nil, deadline: nil)
+ *  Run a shell command and collect its stdout, stderr and exit status. The
+ *  whole conversation is done without GVL.
+ *  @param [String] cmd The command to execute
+ *  @param [Integer, nil] max_output The maximum bytes kept for each of stdout
+ *    and stderr. The rest is read and discarded. +nil+ means unlimited.
+ *  @param [Numeric, Time, nil] deadline Raise {TimeoutError} unless the
+ *    command exits by then. A Numeric is seconds from now.
+ *  @return [Array] +[stdout, stderr, exit_status]+. +exit_status+ is +nil+ if
+ *    no exit status has been returned.
+ *  @raise [TimeoutError]
+ *  @since 0.5.0
+ *  @see http://api.libssh.org/stable/group__libssh__channel.html
+ *    ssh_channel_request_exec
+ */
+static VALUE m_exec_capture(int argc, VALUE *argv, VALUE self) {
+  ChannelHolder *holder;
+  VALUE cmd, opts, ret;
+  const ID table[] = {id_max_output, id_deadline};
+  VALUE kwvals[sizeof(table) / sizeof(*table)];
+  struct nogvl_exec_capture_args args;
+  struct timespec ts;
+
+  TypedData_Get_Struct(self, ChannelHolder, &channel_type, holder);
+  rb_scan_args(argc, argv, "10:", &cmd, &opts);
+  rb_get_kwargs(opts, table, 0, 2, kwvals);
+  if (kwvals[0] == Qundef || NIL_P(kwvals[0])) {
+    args.max_output = SIZE_MAX;
+  } else {
+    args.max_output = NUM2SIZET(kwvals[0]);
+  }
+  args.deadline = libssh_ruby_get_deadline(kwvals[1], &ts) ? &ts : NULL;
+  args.holder = holder;
+  cmd = rb_str_new_frozen(StringValue(cmd));
+  args.cmd = StringValueCStr(cmd);
+  args.chunk = NULL;
+  args.chunk_size = holder->window > 16384 ? holder->window : 16384;
+  memset(args.out, 0, sizeof(args.out));
+  args.stage = 0;
+  args.eof[0] = args.eof[1] = 0;
+  args.nomem = 0;
+  args.exit_status = -1;
+  ret = rb_ensure(exec_capture_body, (VALUE)&args, exec_capture_ensure,
+                  (VALUE)&args);
+  RB_GC_GUARD(cmd);
+  return ret;
+}
+
 struct nogvl_write_args {
   ssh_channel channel;
-  const void *data;
+  const char *data;
   uint32_t len;
+  uint32_t written;
   int rc;
 };
 
+/* A nonblocking session may write partially, so this can be called again
+ * until the rest is written. */
 static void *nogvl_write(void *ptr) {
   struct nogvl_write_args *args = ptr;
-  args->rc = ssh_channel_write(args->channel, args->data, args->len);
+  int rc = ssh_channel_write(args->channel, args->data + args->written,
+                             args->len - args->written);
+
+  if (rc == SSH_ERROR) {
+    args->rc = SSH_ERROR;
+    return NULL;
+  }
+  args->written += rc;
+  args->rc = args->written < args->len ? SSH_AGAIN : (int)args->written;
   return NULL;
 }
 
@@ -516,13 +1075,439 @@ static VALUE m_write(VALUE self, VALUE data) {
   Check_Type(data, T_STRING);
   TypedData_Get_Struct(self, ChannelHolder, &channel_type, holder);
   args.channel = holder->channel;
+  data = rb_str_new_frozen(data);
   args.data = RSTRING_PTR(data);
   args.len = RSTRING_LEN(data);
-  rb_thread_call_without_gvl(nogvl_write, &args, RUBY_UBF_IO, NULL);
+  args.written = 0;
+  libssh_ruby_session_call(holder->session, nogvl_write, &args, &args.rc,
+                           SSH_AGAIN, -1, NULL);
+  RB_GC_GUARD(data);
   RAISE_IF_ERROR(args.rc);
   return INT2FIX(args.rc);
 }
 
+struct write_iov {
+  const char *ptr;
+  size_t len;
+};
+
+struct nogvl_writev_args {
+  ssh_channel channel;
+  const struct write_iov *iov;
+  long iovcnt;
+  /* The next record to write or to stage */
+  long next;
+  /* Small records waiting to be written */
+  char *stage;
+  size_t staged;
+  /* The unwritten part of the staged records or of a large record */
+  const char *ptr;
+  size_t left;
+  size_t total;
+  int rc;
+};
+
+#define WRITEV_COALESCE_SIZE 32768
+
+/* A nonblocking session may write partially, so this keeps the progress and
+ * can be called again until everything is written. */
+static void *nogvl_writev(void *ptr) {
+  struct nogvl_writev_args *args = ptr;
+
+  for (;;) {
+    const struct write_iov *iov;
+
+    if (args->left > 0) {
+      uint32_t n = args->left > UINT32_MAX ? UINT32_MAX : (uint32_t)args->left;
+      int rc = ssh_channel_write(args->channel, args->ptr, n);
+
+      if (rc == SSH_ERROR) {
+        args->rc = SSH_ERROR;
+        return NULL;
+      }
+      args->ptr += rc;
+      args->left -= rc;
+      args->total += rc;
+      if ((uint32_t)rc < n) {
+        args->rc = SSH_AGAIN;
+        return NULL;
+      }
+      continue;
+    }
+    if (args->next == args->iovcnt) {
+      if (args->staged == 0) {
+        args->rc = SSH_OK;
+        return NULL;
+      }
+      args->ptr = args->stage;
+      args->left = args->staged;
+      args->staged = 0;
+      continue;
+    }
+    iov = &args->iov[args->next];
+    if (iov->len < WRITEV_COALESCE_SIZE) {
+      /* Small records are packed into one SSH packet. */
+      if (args->staged + iov->len > WRITEV_COALESCE_SIZE) {
+        args->ptr = args->stage;
+        args->left = args->staged;
+        args->staged = 0;
+        continue;
+      }
+      memcpy(args->stage + args->staged, iov->ptr, iov->len);
+      args->staged += iov->len;
+    } else {
+      if (args->staged > 0) {
+        args->ptr = args->stage;
+        args->left = args->staged;
+        args->staged = 0;
+        continue;
+      }
+      args->ptr = iov->ptr;
+      args->left = iov->len;
+    }
+    args->next++;
+  }
+}
+
+static VALUE writev_strings(VALUE self, VALUE strings, VALUE opts) {
+  ChannelHolder *holder;
+  struct nogvl_writev_args args;
+  struct write_iov *iov;
+  VALUE pinned, iov_tmp, stage_tmp;
+  struct timespec ts;
+  const struct timespec *deadline;
+  long i, len;
+
+  TypedData_Get_Struct(self, ChannelHolder, &channel_type, holder);
+  deadline = libssh_ruby_deadline_option(opts, &ts);
+  len = RARRAY_LEN(strings);
+  /* Frozen copies share the buffers with the originals and keep the data
+   * unchanged while GVL is released. */
+  pinned = rb_ary_new_capa(len);
+  for (i = 0; i < len; i++) {
+    VALUE str = RARRAY_AREF(strings, i);
+    Check_Type(str, T_STRING);
+    rb_ary_push(pinned, rb_str_new_frozen(str));
+  }
+  iov = ALLOCV_N(struct write_iov, iov_tmp, len);
+  for (i = 0; i < len; i++) {
+    VALUE str = RARRAY_AREF(pinned, i);
+    iov[i].ptr = RSTRING_PTR(str);
+    iov[i].len = RSTRING_LEN(str);
+  }
+  args.channel = holder->channel;
+  args.iov = iov;
+  args.iovcnt = len;
+  args.next = 0;
+  args.stage = ALLOCV_N(char, stage_tmp, WRITEV_COALESCE_SIZE);
+  args.staged = 0;
+  args.ptr = NULL;
+  args.left = 0;
+  args.total = 0;
+  libssh_ruby_session_call(holder->session, nogvl_writev, &args, &args.rc,
+                           SSH_AGAIN, -1, deadline);
+  ALLOCV_END(iov_tmp);
+  ALLOCV_END(stage_tmp);
+  RB_GC_GUARD(pinned);
+  RAISE_IF_ERROR(args.rc);
+  return SIZET2NUM(args.total);
+}
+
+/*
+ * @overload writev(strings, deadline: nil)
+ *  Write all of the given strings on the channel without acquiring GVL until
+ *  everything is sent. Small strings are coalesced into larger packets.
+ *  @param [Array<String>] strings Data to write.
+ *  @param [Numeric, Time, nil] deadline Raise {TimeoutError} unless
+ *    everything is written by then. A Numeric is seconds from now.
+ *  @return [Integer] The total number of bytes written.
+ *  @raise [TimeoutError]
+ *  @since 0.5.0
+ *  @see http://api.libssh.org/stable/group__libssh__channel.html
+ *    ssh_channel_write
+ */
+static VALUE m_writev(int argc, VALUE *argv, VALUE self) {
+  VALUE strings, opts;
+
+  rb_scan_args(argc, argv, "10:", &strings, &opts);
+  Check_Type(strings, T_ARRAY);
+  return writev_strings(self, strings, opts);
+}
+
+/*
+ * @overload write_all(data, deadline: nil)
+ *  Write the whole data on the channel without acquiring GVL until it is
+ *  fully sent.
+ *  @param [String] data Data to write.
+ *  @param [Numeric, Time, nil] deadline Raise {TimeoutError} unless the data
+ *    is written by then. A Numeric is seconds from now.
+ *  @return [Integer] The number of bytes written.
+ *  @raise [TimeoutError]
+ *  @since 0.5.0
+ *  @see http://api.libssh.org/stable/group__libssh__channel.html
+ *    ssh_channel_write
+ */
+static VALUE m_write_all(int argc, VALUE *argv, VALUE self) {
+  VALUE data, opts;
+
+  rb_scan_args(argc, argv, "10:", &data, &opts);
+  Check_Type(data, T_STRING);
+  return writev_strings(self, rb_ary_new_from_args(1, data), opts);
+}
+
+#define COPY_BUFSIZ 65536
+
+struct nogvl_copy_args {
+  ssh_channel channel;
+  int fd;
+  int is_stderr;
+  char *buf;
+  uint32_t bufsiz;
+  /* The part of +buf+ not written yet */
+  uint32_t off, len;
+  uint64_t limit;
+  uint64_t total;
+  DigestState digest;
+  int err;
+  int rc;
+};
+
+/* Wait for the local descriptor, or fail with EINTR when the call is
+ * interrupted through the wakeup pipe of libssh_ruby_session_call. */
+static int wait_fd(struct nogvl_copy_args *args, short events) {
+  Wakeup *wakeup = libssh_ruby_wakeup_current();
+  struct pollfd pfds[2];
+
+  pfds[0].fd = args->fd;
+  pfds[0].events = events;
+  pfds[1].fd = wakeup != NULL ? wakeup->fd[0] : -1;
+  pfds[1].events = POLLIN;
+  for (;;) {
+    if (wakeup != NULL && libssh_ruby_wakeup_interrupted(wakeup)) {
+      errno = EINTR;
+      return -1;
+    }
+    pfds[0].revents = pfds[1].revents = 0;
+    if (poll(pfds, 2, -1) < 0) {
+      return -1;
+    }
+    if (pfds[0].revents != 0) {
+      return 0;
+    }
+    /* Bytes left by an earlier call are ignored. */
+    libssh_ruby_wakeup_drain(wakeup);
+  }
+}
+
+/* Both copies are called again while +rc+ is SSH_AGAIN, so the data read
+ * but not written yet is kept in +buf+ between the calls. */
+static void *nogvl_copy_to(void *ptr) {
+  struct nogvl_copy_args *args = ptr;
+
+  for (;;) {
+    uint64_t rest;
+    uint32_t count;
+    int n;
+
+    while (args->off < args->len) {
+      ssize_t w = write(args->fd, args->buf + args->off,
+                        args->len - args->off);
+      if (w < 0) {
+        if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+            wait_fd(args, POLLOUT) == 0) {
+          continue;
+        }
+        args->err = errno;
+        args->rc = SSH_OK;
+        return NULL;
+      }
+      args->off += w;
+    }
+    if (args->total >= args->limit) {
+      args->rc = SSH_OK;
+      return NULL;
+    }
+    rest = args->limit - args->total;
+    count = rest < args->bufsiz ? (uint32_t)rest : args->bufsiz;
+    n = ssh_channel_read_timeout(args->channel, args->buf, count,
+                                 args->is_stderr, 0);
+    if (n == SSH_ERROR) {
+      args->rc = SSH_ERROR;
+      return NULL;
+    } else if (n <= 0) {
+      /* Unlike ssh_channel_is_eof, this ignores data left in the other
+       * stream. */
+      n = ssh_channel_poll(args->channel, args->is_stderr);
+      if (n == SSH_ERROR) {
+        args->rc = SSH_ERROR;
+        return NULL;
+      } else if (n == SSH_EOF || ssh_channel_is_closed(args->channel)) {
+        args->rc = SSH_OK;
+        return NULL;
+      } else if (n == 0) {
+        args->rc = SSH_AGAIN;
+        return NULL;
+      }
+      continue;
+    }
+    libssh_ruby_digest_update(&args->digest, args->buf, n);
+    args->total += n;
+    args->off = 0;
+    args->len = n;
+  }
+}
+
+static void *nogvl_copy_from(void *ptr) {
+  struct nogvl_copy_args *args = ptr;
+
+  for (;;) {
+    uint64_t rest;
+    size_t count;
+    ssize_t n;
+
+    if (args->off < args->len) {
+      int rc = ssh_channel_write(args->channel, args->buf + args->off,
+                                 args->len - args->off);
+
+      if (rc == SSH_ERROR) {
+        args->rc = SSH_ERROR;
+        return NULL;
+      }
+      args->off += rc;
+      if (args->off < args->len) {
+        args->rc = SSH_AGAIN;
+        return NULL;
+      }
+    }
+    if (args->total >= args->limit) {
+      args->rc = SSH_OK;
+      return NULL;
+    }
+    rest = args->limit - args->total;
+    count = rest < args->bufsiz ? (size_t)rest : args->bufsiz;
+    n = read(args->fd, args->buf, count);
+    if (n < 0) {
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+          wait_fd(args, POLLIN) == 0) {
+        continue;
+      }
+      args->err = errno;
+      args->rc = SSH_OK;
+      return NULL;
+    } else if (n == 0) {
+      args->rc = SSH_OK;
+      return NULL;
+    }
+    libssh_ruby_digest_update(&args->digest, args->buf, n);
+    args->total += n;
+    args->off = 0;
+    args->len = (uint32_t)n;
+  }
+}
+
+static VALUE copy_fd(VALUE self, int argc, VALUE *argv,
+                     void *(*func)(void *), int allow_stderr) {
+  ChannelHolder *holder;
+  VALUE io, opts;
+  /* stderr: comes last so that copy_from can leave it out */
+  const ID table[] = {id_limit, id_digest, id_deadline, id_stderr};
+  VALUE kwvals[sizeof(table) / sizeof(*table)];
+  struct nogvl_copy_args args;
+  VALUE buf_tmp;
+  struct timespec ts;
+  const struct timespec *deadline;
+
+  TypedData_Get_Struct(self, ChannelHolder, &channel_type, holder);
+  rb_scan_args(argc, argv, "10:", &io, &opts);
+  rb_get_kwargs(opts, table, 0, allow_stderr ? 4 : 3, kwvals);
+  deadline = libssh_ruby_get_deadline(kwvals[2], &ts) ? &ts : NULL;
+  if (kwvals[0] == Qundef || NIL_P(kwvals[0])) {
+    args.limit = UINT64_MAX;
+  } else {
+    args.limit = NUM2ULL(kwvals[0]);
+  }
+  if (allow_stderr && kwvals[3] != Qundef) {
+    args.is_stderr = RTEST(kwvals[3]) ? 1 : 0;
+  } else {
+    args.is_stderr = 0;
+  }
+  args.channel = holder->channel;
+  args.fd = libssh_ruby_fd(io);
+  args.off = args.len = 0;
+  args.total = 0;
+  args.rc = SSH_OK;
+  libssh_ruby_digest_init(&args.digest, kwvals[1]);
+  /* Reading as much as the window lets libssh grow the window at once. */
+  args.bufsiz = holder->window > COPY_BUFSIZ ? holder->window : COPY_BUFSIZ;
+  args.buf = ALLOCV_N(char, buf_tmp, args.bufsiz);
+  do {
+    args.err = 0;
+    libssh_ruby_session_call(holder->session, func, &args, &args.rc,
+                             SSH_AGAIN, -1, deadline);
+    if (args.err == EINTR) {
+      rb_thread_check_ints();
+    }
+  } while (args.err == EINTR);
+  ALLOCV_END(buf_tmp);
+  RB_GC_GUARD(io);
+  RAISE_IF_ERROR(args.rc);
+  if (args.err != 0) {
+    rb_syserr_fail(args.err, "copy");
+  }
+  if (args.digest.meta != NULL) {
+    return rb_assoc_new(ULL2NUM(args.total),
+                        libssh_ruby_digest_finish(&args.digest));
+  }
+  return ULL2NUM(args.total);
+}
+
+/*
+ * @overload copy_to(io, limit: nil, stderr: false, digest: nil, deadline: nil)
+ *  Copy data read from the channel to a local file descriptor until EOF or
+ *  +limit+ bytes, without acquiring GVL during the transfer. A write to a
+ *  blocking descriptor isn't interrupted, so pass a nonblocking one such as
+ *  an IO opened by Ruby.
+ *  @param [IO, Fixnum] io The destination IO or file descriptor.
+ *  @param [Integer, nil] limit The maximum bytes to copy.
+ *  @param [Boolean] stderr Read from the stderr flow or not.
+ *  @param [Symbol, String, Class, nil] digest Hash the copied data with this
+ *    algorithm of the digest library, such as +:sha256+.
+ *  @param [Numeric, Time, nil] deadline Raise {TimeoutError} unless the copy
+ *    is done by then. A Numeric is seconds from now.
+ *  @return [Integer, Array] The number of bytes copied, or the number and
+ *    the hex digest when +digest+ is given.
+ *  @raise [TimeoutError]
+ *  @since 0.5.0
+ *  @see http://api.libssh.org/stable/group__libssh__channel.html
+ *    ssh_channel_read
+ */
+static VALUE m_copy_to(int argc, VALUE *argv, VALUE self) {
+  return copy_fd(self, argc, argv, nogvl_copy_to, 1);
+}
+
+/*
+ * @overload copy_from(io, limit: nil, digest: nil, deadline: nil)
+ *  Copy data read from a local file descriptor to the channel until EOF or
+ *  +limit+ bytes, without acquiring GVL during the transfer. A read from a
+ *  blocking descriptor isn't interrupted, so pass a nonblocking one such as
+ *  an IO opened by Ruby.
+ *  @param [IO, Fixnum] io The source IO or file descriptor.
+ *  @param [Integer, nil] limit The maximum bytes to copy.
+ *  @param [Symbol, String, Class, nil] digest Hash the copied data with this
+ *    algorithm of the digest library, such as +:sha256+.
+ *  @param [Numeric, Time, nil] deadline Raise {TimeoutError} unless the copy
+ *    is done by then. A Numeric is seconds from now.
+ *  @return [Integer, Array] The number of bytes copied, or the number and
+ *    the hex digest when +digest+ is given.
+ *  @raise [TimeoutError]
+ *  @since 0.5.0
+ *  @see http://api.libssh.org/stable/group__libssh__channel.html
+ *    ssh_channel_write
+ */
+static VALUE m_copy_from(int argc, VALUE *argv, VALUE self) {
+  return copy_fd(self, argc, argv, nogvl_copy_from, 0);
+}
+
 static void *nogvl_send_eof(void *ptr) {
   struct nogvl_channel_args *args = ptr;
   args->rc = ssh_channel_send_eof(args->channel);
@@ -530,19 +1515,28 @@ static void *nogvl_send_eof(void *ptr) {
 }
 
 /*
- * @overload send_eof
+ * @overload send_eof(deadline: nil)
  *  Send EOF on the channel.
+ *  @param [Numeric, Time, nil] deadline Raise {TimeoutError} unless EOF is
+ *    sent by then. A Numeric is seconds from now.
  *  @return [nil]
+ *  @raise [TimeoutError]
  *  @see http://api.libssh.org/stable/group__libssh__channel.html
  *    ssh_channel_send_eof
  */
-static VALUE m_send_eof(VALUE self) {
+static VALUE m_send_eof(int argc, VALUE *argv, VALUE self) {
   ChannelHolder *holder;
   struct nogvl_channel_args args;
+  VALUE opts;
+  struct timespec ts;
+  const struct timespec *deadline;
 
   TypedData_Get_Struct(self, ChannelHolder, &channel_type, holder);
+  rb_scan_args(argc, argv, "0:", &opts);
+  deadline = libssh_ruby_deadline_option(opts, &ts);
   args.channel = holder->channel;
-  rb_thread_call_without_gvl(nogvl_send_eof, &args, RUBY_UBF_IO, NULL);
+  libssh_ruby_session_call(holder->session, nogvl_send_eof, &args, &args.rc,
+                           SSH_AGAIN, -1, deadline);
   RAISE_IF_ERROR(args.rc);
   return Qnil;
 }
@@ -584,11 +1578,13 @@ static void set_select_channels(ssh_channel **c_channels, VALUE rb_channels) {
 
 /*
  * @overload select(read_channels, write_channels, except_channels, timeout)
- *  Act like the standard select(2) on channels.
+ *  Act like the standard select(2) on channels. It can't be interrupted
+ *  before +timeout+ passes and takes no +deadline:+. Use {Selector} to wait
+ *  interruptibly.
  *  @param [Array<Channel>] read_channels
  *  @param [Array<Channel>] write_channels
  *  @param [Array<Channel>] except_channels
- *  @param [Fixnum, nil] timeout timeout in seconds.
+ *  @param [Numeric, nil] timeout timeout in seconds.
  *  @return [nil]
  *  @see http://api.libssh.org/stable/group__libssh__channel.html
  *    ssh_channel_select
@@ -602,21 +1598,345 @@ static VALUE s_select(RB_UNUSED_VAR(VALUE self), VALUE read_channels,
   if (NIL_P(timeout)) {
     args.timeout = NULL;
   } else {
-    Check_Type(timeout, T_FIXNUM);
-    tv.tv_sec = FIX2INT(timeout);
-    tv.tv_usec = 0;
+    double sec = NUM2DBL(timeout);
+    tv.tv_sec = (time_t)sec;
+    tv.tv_usec = (suseconds_t)((sec - tv.tv_sec) * 1e6);
     args.timeout = &tv;
   }
   set_select_channels(&args.read_channels, read_channels);
   set_select_channels(&args.write_channels, write_channels);
   set_select_channels(&args.except_channels, except_channels);
-  rb_thread_call_without_gvl(nogvl_select, &args, RUBY_UBF_IO, NULL);
+  libssh_ruby_nogvl(nogvl_select, &args);
   ruby_xfree(args.read_channels);
   ruby_xfree(args.write_channels);
   ruby_xfree(args.except_channels);
   return Qnil;
 }
 
+#ifdef HAVE_SSH_ADD_CHANNEL_CALLBACKS
+static void callbacks_notify(ChannelCallbacks *cbs) {
+  __atomic_add_fetch(cbs->pending, 1, __ATOMIC_RELEASE);
+}
+
+/* Append data to the buffer. The lock must be held. */
+static int callbacks_append(ChannelCallbacks *cbs, const char *data,
+                            uint32_t len, int is_stderr) {
+  struct data_record rec;
+  int coalesce = 0;
+  size_t need;
+
+  if (cbs->last != SIZE_MAX) {
+    memcpy(&rec, cbs->buf + cbs->last, sizeof(rec));
+    coalesce = rec.is_stderr == is_stderr && rec.len <= UINT32_MAX - len;
+  }
+  need = len + (coalesce ? 0 : sizeof(rec));
+  if (cbs->len + need > cbs->capa) {
+    size_t capa = cbs->capa == 0 ? 4096 : cbs->capa * 2;
+    char *buf;
+
+    while (capa < cbs->len + need) {
+      capa *= 2;
+    }
+    buf = realloc(cbs->buf, capa);
+    if (buf == NULL) {
+      return 0;
+    }
+    cbs->buf = buf;
+    cbs->capa = capa;
+  }
+  if (!coalesce) {
+    rec.is_stderr = is_stderr;
+    rec.len = 0;
+    cbs->last = cbs->len;
+    cbs->len += sizeof(rec);
+  }
+  memcpy(cbs->buf + cbs->len, data, len);
+  cbs->len += len;
+  rec.len += len;
+  memcpy(cbs->buf + cbs->last, &rec, sizeof(rec));
+  return 1;
+}
+
+static int callbacks_data(RB_UNUSED_VAR(ssh_session session),
+                          RB_UNUSED_VAR(ssh_channel channel), void *data,
+                          uint32_t len, int is_stderr, void *userdata) {
+  ChannelCallbacks *cbs = userdata;
+  int ok;
+
+  pthread_mutex_lock(&cbs->lock);
+  ok = callbacks_append(cbs, data, len, is_stderr);
+  pthread_mutex_unlock(&cbs->lock);
+  if (!ok) {
+    /* Leave it in the channel and try again on the next packet. */
+    return 0;
+  }
+  callbacks_notify(cbs);
+  return len;
+}
+
+static void callbacks_eof(RB_UNUSED_VAR(ssh_session session),
+                          RB_UNUSED_VAR(ssh_channel channel), void *userdata) {
+  ChannelCallbacks *cbs = userdata;
+
+  pthread_mutex_lock(&cbs->lock);
+  cbs->eof = 1;
+  pthread_mutex_unlock(&cbs->lock);
+  callbacks_notify(cbs);
+}
+
+static void callbacks_close(RB_UNUSED_VAR(ssh_session session),
+                            RB_UNUSED_VAR(ssh_channel channel),
+                            void *userdata) {
+  ChannelCallbacks *cbs = userdata;
+
+  pthread_mutex_lock(&cbs->lock);
+  cbs->closed = 1;
+  pthread_mutex_unlock(&cbs->lock);
+  callbacks_notify(cbs);
+}
+
+static void callbacks_exit_status(RB_UNUSED_VAR(ssh_session session),
+                                  RB_UNUSED_VAR(ssh_channel channel),
+                                  int exit_status, void *userdata) {
+  ChannelCallbacks *cbs = userdata;
+
+  pthread_mutex_lock(&cbs->lock);
+  cbs->exit_status_set = 1;
+  cbs->exit_status = exit_status;
+  pthread_mutex_unlock(&cbs->lock);
+  callbacks_notify(cbs);
+}
+
+static ChannelCallbacks *channel_callbacks(VALUE self, ChannelHolder *holder) {
+  ChannelCallbacks *cbs;
+
+  if (holder->callbacks != NULL) {
+    return holder->callbacks;
+  }
+  cbs = ALLOC(ChannelCallbacks);
+  memset(cbs, 0, sizeof(*cbs));
+  pthread_mutex_init(&cbs->lock, NULL);
+  cbs->pending = &libssh_ruby_session_holder(holder->session)->pending;
+  cbs->last = SIZE_MAX;
+  cbs->on_data = cbs->on_eof = cbs->on_exit_status = cbs->on_close = Qnil;
+  cbs->callbacks.userdata = cbs;
+  cbs->callbacks.channel_eof_function = callbacks_eof;
+  cbs->callbacks.channel_close_function = callbacks_close;
+  cbs->callbacks.channel_exit_status_function = callbacks_exit_status;
+  ssh_callbacks_init(&cbs->callbacks);
+  if (ssh_add_channel_callbacks(holder->channel, &cbs->callbacks) != SSH_OK) {
+    channel_callbacks_free(cbs);
+    libssh_ruby_raise(ssh_channel_get_session(holder->channel));
+  }
+  holder->callbacks = cbs;
+  libssh_ruby_session_add_channel(holder->session, self);
+  return cbs;
+}
+
+/* Move data which arrived before Channel#on_data to the callback buffer. */
+static void callbacks_take_buffered(ChannelHolder *holder,
+                                    ChannelCallbacks *cbs) {
+  char buf[4096];
+  int is_stderr, n, taken = 0;
+
+  for (is_stderr = 0; is_stderr <= 1; is_stderr++) {
+    while ((n = ssh_channel_read_nonblocking(holder->channel, buf, sizeof(buf),
+                                             is_stderr)) > 0) {
+      pthread_mutex_lock(&cbs->lock);
+      callbacks_append(cbs, buf, n, is_stderr);
+      pthread_mutex_unlock(&cbs->lock);
+      taken = 1;
+    }
+  }
+  if (taken) {
+    callbacks_notify(cbs);
+  }
+}
+
+/*
+ * @overload on_data(binary: false)
+ *  Receive data of the channel with the block instead of {#read}. Data is
+ *  buffered in native memory when it arrives, and given to the block by
+ *  {Session#process_events}.
+ *  @param [Boolean] binary Give ASCII-8BIT Strings instead of UTF-8. Data is
+ *    given as it arrives, so a UTF-8 String may end in the middle of a
+ *    character.
+ *  @yieldparam [String] data Data received.
+ *  @yieldparam [Boolean] stderr Whether it is from the stderr flow.
+ *  @return [Channel] self
+ *  @since 0.5.0
+ *  @see http://api.libssh.org/stable/group__libssh__callbacks.html
+ *    ssh_channel_callbacks_struct
+ */
+static VALUE m_on_data(int argc, VALUE *argv, VALUE self) {
+  ChannelHolder *holder;
+  ChannelCallbacks *cbs;
+  const ID table[] = {id_binary};
+  VALUE opts, binary;
+
+  rb_scan_args(argc, argv, "0:", &opts);
+  rb_get_kwargs(opts, table, 0, 1, &binary);
+  rb_need_block();
+  TypedData_Get_Struct(self, ChannelHolder, &channel_type, holder);
+  cbs = channel_callbacks(self, holder);
+  cbs->binary = binary != Qundef && RTEST(binary);
+  RB_OBJ_WRITE(self, &cbs->on_data, rb_block_proc());
+  if (cbs->callbacks.channel_data_function == NULL) {
+    callbacks_take_buffered(holder, cbs);
+    cbs->callbacks.channel_data_function = callbacks_data;
+  }
+  return self;
+}
+
+/*
+ * @overload on_eof
+ *  Call the block from {Session#process_events} when the remote party sends
+ *  EOF.
+ *  @return [Channel] self
+ *  @since 0.5.0
+ *  @see http://api.libssh.org/stable/group__libssh__callbacks.html
+ *    ssh_channel_callbacks_struct
+ */
+static VALUE m_on_eof(VALUE self) {
+  ChannelHolder *holder;
+
+  rb_need_block();
+  TypedData_Get_Struct(self, ChannelHolder, &channel_type, holder);
+  RB_OBJ_WRITE(self, &channel_callbacks(self, holder)->on_eof,
+               rb_block_proc());
+  return self;
+}
+
+/*
+ * @overload on_exit_status
+ *  Call the block from {Session#process_events} when the exit status
+ *  arrives.
+ *  @yieldparam [Fixnum] status The exit status.
+ *  @return [Channel] self
+ *  @since 0.5.0
+ *  @see http://api.libssh.org/stable/group__libssh__callbacks.html
+ *    ssh_channel_callbacks_struct
+ */
+static VALUE m_on_exit_status(VALUE self) {
+  ChannelHolder *holder;
+
+  rb_need_block();
+  TypedData_Get_Struct(self, ChannelHolder, &channel_type, holder);
+  RB_OBJ_WRITE(self, &channel_callbacks(self, holder)->on_exit_status,
+               rb_block_proc());
+  return self;
+}
+
+/*
+ * @overload on_close
+ *  Call the block from {Session#process_events} when the remote party closes
+ *  the channel. No more callbacks are called after this.
+ *  @return [Channel] self
+ *  @since 0.5.0
+ *  @see http://api.libssh.org/stable/group__libssh__callbacks.html
+ *    ssh_channel_callbacks_struct
+ */
+static VALUE m_on_close(VALUE self) {
+  ChannelHolder *holder;
+
+  rb_need_block();
+  TypedData_Get_Struct(self, ChannelHolder, &channel_type, holder);
+  RB_OBJ_WRITE(self, &channel_callbacks(self, holder)->on_close,
+               rb_block_proc());
+  return self;
+}
+
+struct dispatch_args {
+  ChannelCallbacks *cbs;
+  char *buf;
+  size_t len;
+  int eof, closed, exit_status_set, exit_status;
+  int count;
+};
+
+static VALUE dispatch_body(VALUE ptr) {
+  struct dispatch_args *args = (struct dispatch_args *)ptr;
+  ChannelCallbacks *cbs = args->cbs;
+  size_t off = 0;
+
+  while (off < args->len) {
+    struct data_record rec;
+
+    memcpy(&rec, args->buf + off, sizeof(rec));
+    off += sizeof(rec);
+    if (!NIL_P(cbs->on_data)) {
+      const char *data = args->buf + off;
+
+      rb_funcall(cbs->on_data, id_call, 2,
+                 cbs->binary ? rb_str_new(data, rec.len)
+                             : rb_utf8_str_new(data, rec.len),
+                 rec.is_stderr ? Qtrue : Qfalse);
+      args->count++;
+    }
+    off += rec.len;
+  }
+  if (args->eof && !NIL_P(cbs->on_eof)) {
+    rb_funcall(cbs->on_eof, id_call, 0);
+    args->count++;
+  }
+  if (args->exit_status_set && !NIL_P(cbs->on_exit_status)) {
+    rb_funcall(cbs->on_exit_status, id_call, 1, INT2FIX(args->exit_status));
+    args->count++;
+  }
+  if (args->closed && !NIL_P(cbs->on_close)) {
+    rb_funcall(cbs->on_close, id_call, 0);
+    args->count++;
+  }
+  return Qnil;
+}
+
+static VALUE dispatch_ensure(VALUE ptr) {
+  struct dispatch_args *args = (struct dispatch_args *)ptr;
+  free(args->buf);
+  return Qnil;
+}
+
+/*
+ * Call the blocks for events received by the callbacks of +channel+, and
+ * return the number of the blocks called. +*finished+ is set when the channel
+ * is closed and no more events will come.
+ */
+int libssh_ruby_channel_dispatch(VALUE channel, int *finished) {
+  ChannelHolder *holder;
+  ChannelCallbacks *cbs;
+  struct dispatch_args args;
+
+  TypedData_Get_Struct(channel, ChannelHolder, &channel_type, holder);
+  cbs = holder->callbacks;
+  *finished = 0;
+  if (cbs == NULL) {
+    *finished = 1;
+    return 0;
+  }
+  pthread_mutex_lock(&cbs->lock);
+  args.cbs = cbs;
+  args.buf = cbs->buf;
+  args.len = cbs->len;
+  args.eof = cbs->eof;
+  args.closed = cbs->closed;
+  args.exit_status_set = cbs->exit_status_set;
+  args.exit_status = cbs->exit_status;
+  cbs->buf = NULL;
+  cbs->len = cbs->capa = 0;
+  cbs->last = SIZE_MAX;
+  cbs->eof = cbs->closed = cbs->exit_status_set = 0;
+  pthread_mutex_unlock(&cbs->lock);
+  args.count = 0;
+
+  if (args.closed) {
+    ssh_remove_channel_callbacks(holder->channel, &cbs->callbacks);
+    *finished = 1;
+  }
+  rb_ensure(dispatch_body, (VALUE)&args, dispatch_ensure, (VALUE)&args);
+  return args.count;
+}
+#endif
+
 /*
  * Document-class: LibSSH::Channel
  * Wrapper for ssh_channel struct in libssh.
@@ -632,30 +1952,65 @@ void Init_libssh_channel(void) {
   rb_define_method(rb_cLibSSHChannel, "initialize",
                    RUBY_METHOD_FUNC(m_initialize), 1);
   rb_define_method(rb_cLibSSHChannel, "open_session",
-                   RUBY_METHOD_FUNC(m_open_session), 0);
+                   RUBY_METHOD_FUNC(m_open_session), -1);
+  rb_define_method(rb_cLibSSHChannel, "open_session_nonblocking",
+                   RUBY_METHOD_FUNC(m_open_session_nonblocking), 0);
   rb_define_method(rb_cLibSSHChannel, "open_forward",
-                   RUBY_METHOD_FUNC(m_open_forward), 2);
-  rb_define_method(rb_cLibSSHChannel, "close", RUBY_METHOD_FUNC(m_close), 0);
+                   RUBY_METHOD_FUNC(m_open_forward), -1);
+  rb_define_method(rb_cLibSSHChannel, "close", RUBY_METHOD_FUNC(m_close), -1);
   rb_define_method(rb_cLibSSHChannel, "request_exec",
-                   RUBY_METHOD_FUNC(m_request_exec), 1);
+                   RUBY_METHOD_FUNC(m_request_exec), -1);
+  rb_define_method(rb_cLibSSHChannel, "exec_capture",
+                   RUBY_METHOD_FUNC(m_exec_capture), -1);
   rb_define_method(rb_cLibSSHChannel, "request_pty",
                    RUBY_METHOD_FUNC(m_request_pty), 0);
   rb_define_method(rb_cLibSSHChannel, "read", RUBY_METHOD_FUNC(m_read), -1);
+  rb_define_method(rb_cLibSSHChannel, "read_into",
+                   RUBY_METHOD_FUNC(m_read_into), -1);
   rb_define_method(rb_cLibSSHChannel, "read_nonblocking",
                    RUBY_METHOD_FUNC(m_read_nonblocking), -1);
   rb_define_method(rb_cLibSSHChannel, "poll", RUBY_METHOD_FUNC(m_poll), -1);
+  rb_define_method(rb_cLibSSHChannel, "window_size=",
+                   RUBY_METHOD_FUNC(m_set_window_size), 1);
+  rb_define_method(rb_cLibSSHChannel, "window_size",
+                   RUBY_METHOD_FUNC(m_window_size), 0);
+  rb_define_method(rb_cLibSSHChannel, "remote_window",
+                   RUBY_METHOD_FUNC(m_remote_window), 0);
   rb_define_method(rb_cLibSSHChannel, "eof?", RUBY_METHOD_FUNC(m_eof_p), 0);
   rb_define_method(rb_cLibSSHChannel, "closed?", RUBY_METHOD_FUNC(m_closed_p), 0);
   rb_define_method(rb_cLibSSHChannel, "open?", RUBY_METHOD_FUNC(m_open_p), 0);
   rb_define_method(rb_cLibSSHChannel, "get_exit_status",
-                   RUBY_METHOD_FUNC(m_get_exit_status), 0);
+                   RUBY_METHOD_FUNC(m_get_exit_status), -1);
   rb_define_method(rb_cLibSSHChannel, "write", RUBY_METHOD_FUNC(m_write), 1);
+  rb_define_method(rb_cLibSSHChannel, "write_all",
+                   RUBY_METHOD_FUNC(m_write_all), -1);
+  rb_define_method(rb_cLibSSHChannel, "writev", RUBY_METHOD_FUNC(m_writev), -1);
+  rb_define_method(rb_cLibSSHChannel, "copy_to", RUBY_METHOD_FUNC(m_copy_to),
+                   -1);
+  rb_define_method(rb_cLibSSHChannel, "copy_from",
+                   RUBY_METHOD_FUNC(m_copy_from), -1);
   rb_define_method(rb_cLibSSHChannel, "send_eof", RUBY_METHOD_FUNC(m_send_eof),
-                   0);
+                   -1);
+
+#ifdef HAVE_SSH_ADD_CHANNEL_CALLBACKS
+  rb_define_method(rb_cLibSSHChannel, "on_data", RUBY_METHOD_FUNC(m_on_data),
+                   -1);
+  rb_define_method(rb_cLibSSHChannel, "on_eof", RUBY_METHOD_FUNC(m_on_eof), 0);
+  rb_define_method(rb_cLibSSHChannel, "on_exit_status",
+                   RUBY_METHOD_FUNC(m_on_exit_status), 0);
+  rb_define_method(rb_cLibSSHChannel, "on_close",
+                   RUBY_METHOD_FUNC(m_on_close), 0);
+#endif
 
   rb_define_singleton_method(rb_cLibSSHChannel, "select",
                              RUBY_METHOD_FUNC(s_select), 4);
 
   id_stderr = rb_intern("stderr");
   id_timeout = rb_intern("timeout");
+  id_deadline = rb_intern("deadline");
+  id_binary = rb_intern("binary");
+  id_max_output = rb_intern("max_output");
+  id_limit = rb_intern("limit");
+  id_digest = rb_intern("digest");
+  id_call = rb_intern("call");
 }
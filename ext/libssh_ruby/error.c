@@ -1,6 +1,7 @@
 #include "libssh_ruby.h"
 
 VALUE rb_eLibSSHError;
+VALUE rb_eLibSSHTimeoutError;
 ID id_code;
 
 /*
@@ -21,17 +22,32 @@ void Init_libssh_error(void) {
   id_code = rb_intern("@code");
 
   rb_define_attr(rb_eLibSSHError, "code", 1, 0);
+
+  /*
+   * Document-class: LibSSH::TimeoutError
+   * Raised when a call doesn't finish by its +deadline:+.
+   *
+   * @since 0.5.0
+   */
+  rb_eLibSSHTimeoutError =
+      rb_define_class_under(rb_mLibSSH, "TimeoutError", rb_eLibSSHError);
 }
 
-void libssh_ruby_raise(ssh_session session) {
-  VALUE exc, code, message;
+VALUE libssh_ruby_error_new(int code, const char *message) {
+  VALUE exc;
   VALUE argv[1];
 
-  code = INT2FIX(ssh_get_error_code(session));
-  message = rb_str_new_cstr(ssh_get_error(session));
-  argv[0] = message;
+  argv[0] = rb_str_new_cstr(message);
   exc = rb_class_new_instance(1, argv, rb_eLibSSHError);
-  rb_ivar_set(exc, id_code, code);
+  rb_ivar_set(exc, id_code, INT2FIX(code));
+  return exc;
+}
 
-  rb_exc_raise(exc);
+void libssh_ruby_raise_timeout(void) {
+  rb_raise(rb_eLibSSHTimeoutError, "Deadline exceeded");
+}
+
+void libssh_ruby_raise(ssh_session session) {
+  rb_exc_raise(libssh_ruby_error_new(ssh_get_error_code(session),
+                                     ssh_get_error(session)));
 }
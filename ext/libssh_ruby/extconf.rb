@@ -17,5 +17,16 @@ unless have_library('ssh_threads')
 end
 
 have_const('SSH_KEYTYPE_ED25519', 'libssh/libssh.h')
+have_func('rb_io_descriptor', 'ruby/io.h')
+have_func('rb_fiber_scheduler_current', 'ruby/fiber/scheduler.h')
+have_const('RB_NOGVL_OFFLOAD_SAFE', 'ruby/thread.h')
+have_func('ssh_channel_listen_forward', 'libssh/libssh.h')
+have_func('ssh_add_channel_callbacks', 'libssh/callbacks.h')
+have_struct_member('struct ssh_channel_callbacks_struct', 'channel_write_wontblock_function', 'libssh/callbacks.h')
+have_func('posix_fallocate', 'fcntl.h')
+have_func('sftp_aio_begin_write', 'libssh/sftp.h')
+have_library('z', 'deflate', 'zlib.h')
+have_library('zstd', 'ZSTD_compressStream', 'zstd.h')
+have_func('ZSTD_minCLevel', 'zstd.h')
 
 create_makefile('libssh/libssh_ruby')
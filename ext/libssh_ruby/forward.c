@@ -0,0 +1,913 @@
+#include "libssh_ruby.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <ruby/thread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifndef HAVE_SSH_CHANNEL_LISTEN_FORWARD
+/* libssh < 0.7.0 */
+#define ssh_channel_listen_forward ssh_forward_listen
+#define ssh_channel_cancel_forward ssh_forward_cancel
+#define ssh_channel_accept_forward(session, timeout_ms, port) \
+  ssh_forward_accept((session), (timeout_ms))
+#endif
+
+VALUE rb_cLibSSHForward;
+
+static VALUE running_forwards = Qnil;
+
+static void forward_mark(void *);
+static void forward_free(void *);
+static size_t forward_memsize(const void *);
+
+#define FORWARD_BUFSIZ 16384
+
+enum conn_state {
+  /* Waiting for the reply to the channel open request. */
+  CONN_OPENING,
+  /* Waiting for the local socket to connect. */
+  CONN_CONNECTING,
+  CONN_OPEN,
+};
+
+struct ForwardConnStruct {
+  ssh_channel channel;
+  int sock;
+  enum conn_state state;
+  /* The originator of the channel, sent with the open request. */
+  char origin_host[NI_MAXHOST];
+  int origin_port;
+  int sock_eof, channel_eof;
+  char out[FORWARD_BUFSIZ];
+  size_t out_off, out_len;
+  struct ForwardConnStruct *next;
+};
+typedef struct ForwardConnStruct ForwardConn;
+
+struct ForwardHolderStruct {
+  VALUE session;
+  ssh_session ssh;
+  pthread_t thread;
+  int running;
+  volatile int stop;
+  int wakeup[2];
+  int listen_fd;
+  int local_port;
+  char *remote_host;
+  int remote_port;
+  int is_remote;
+  struct sockaddr_storage connect_addr;
+  socklen_t connect_addrlen;
+  ForwardConn *conns;
+  uint64_t bytes_sent, bytes_received, connections, active_connections;
+  char *error;
+};
+typedef struct ForwardHolderStruct ForwardHolder;
+
+static const rb_data_type_t forward_type = {
+    "libssh_forward",
+    {forward_mark, forward_free, forward_memsize, {NULL, NULL}},
+    NULL,
+    NULL,
+    RUBY_TYPED_WB_PROTECTED,
+};
+
+#define STAT_ADD(var, n) __atomic_add_fetch(&(var), (n), __ATOMIC_RELAXED)
+#define STAT_SUB(var, n) __atomic_sub_fetch(&(var), (n), __ATOMIC_RELAXED)
+#define STAT_GET(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+
+static VALUE forward_alloc(VALUE klass) {
+  ForwardHolder *holder = ALLOC(ForwardHolder);
+  holder->session = Qundef;
+  holder->ssh = NULL;
+  holder->running = 0;
+  holder->stop = 0;
+  holder->wakeup[0] = holder->wakeup[1] = -1;
+  holder->listen_fd = -1;
+  holder->local_port = 0;
+  holder->remote_host = NULL;
+  holder->remote_port = 0;
+  holder->is_remote = 0;
+  holder->connect_addrlen = 0;
+  holder->conns = NULL;
+  holder->bytes_sent = holder->bytes_received = 0;
+  holder->connections = holder->active_connections = 0;
+  holder->error = NULL;
+  return TypedData_Wrap_Struct(klass, &forward_type, holder);
+}
+
+static void forward_mark(void *arg) {
+  ForwardHolder *holder = arg;
+  if (holder->ssh != NULL) {
+    rb_gc_mark(holder->session);
+  }
+}
+
+static void forward_release(ForwardHolder *holder) {
+  if (holder->listen_fd != -1) {
+    close(holder->listen_fd);
+    holder->listen_fd = -1;
+  }
+  if (holder->wakeup[0] != -1) {
+    close(holder->wakeup[0]);
+    close(holder->wakeup[1]);
+    holder->wakeup[0] = holder->wakeup[1] = -1;
+  }
+  free(holder->remote_host);
+  holder->remote_host = NULL;
+}
+
+static void forward_free(void *arg) {
+  ForwardHolder *holder = arg;
+
+  /* A running forward is kept in running_forwards, so it isn't free'ed
+   * until it is closed. */
+  forward_release(holder);
+  free(holder->error);
+  ruby_xfree(holder);
+}
+
+static size_t forward_memsize(RB_UNUSED_VAR(const void *arg)) {
+  return sizeof(ForwardHolder);
+}
+
+static void set_nonblock(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags != -1) {
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  }
+}
+
+static void forward_set_error(ForwardHolder *holder, const char *message) {
+  if (holder->error == NULL) {
+    __atomic_store_n(&holder->error, strdup(message), __ATOMIC_RELEASE);
+  }
+}
+
+static ForwardConn *conn_add(ForwardHolder *holder, ssh_channel channel,
+                             int sock, enum conn_state state) {
+  ForwardConn *conn = malloc(sizeof(ForwardConn));
+
+  if (conn == NULL) {
+    if (state != CONN_OPENING) {
+      ssh_channel_close(channel);
+    }
+    ssh_channel_free(channel);
+    close(sock);
+    return NULL;
+  }
+  set_nonblock(sock);
+  conn->channel = channel;
+  conn->sock = sock;
+  conn->state = state;
+  conn->sock_eof = conn->channel_eof = 0;
+  conn->out_off = conn->out_len = 0;
+  conn->next = holder->conns;
+  holder->conns = conn;
+  STAT_ADD(holder->connections, 1);
+  STAT_ADD(holder->active_connections, 1);
+  return conn;
+}
+
+static void conn_close(ForwardHolder *holder, ForwardConn *conn) {
+  /* A channel still opening has nothing to close on the remote side. */
+  if (conn->state != CONN_OPENING && !ssh_channel_is_closed(conn->channel)) {
+    ssh_channel_close(conn->channel);
+  }
+  ssh_channel_free(conn->channel);
+  close(conn->sock);
+  STAT_SUB(holder->active_connections, 1);
+  free(conn);
+}
+
+/* Move bytes of a connection in both directions as far as possible without
+ * blocking. Return -1 when the connection should be closed. */
+static int conn_pump(ForwardHolder *holder, ForwardConn *conn,
+                     short revents) {
+  char in[FORWARD_BUFSIZ];
+
+  if (conn->state == CONN_OPENING) {
+    /* The session is nonblocking, so this only checks the reply after the
+     * first call sends the request. */
+    int rc = ssh_channel_open_forward(conn->channel, holder->remote_host,
+                                      holder->remote_port, conn->origin_host,
+                                      conn->origin_port);
+    if (rc == SSH_AGAIN) {
+      return 0;
+    } else if (rc != SSH_OK) {
+      return -1;
+    }
+    conn->state = CONN_OPEN;
+  } else if (conn->state == CONN_CONNECTING) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (!(revents & (POLLOUT | POLLERR | POLLHUP))) {
+      return 0;
+    }
+    if (getsockopt(conn->sock, SOL_SOCKET, SO_ERROR, &err, &len) != 0 ||
+        err != 0) {
+      return -1;
+    }
+    conn->state = CONN_OPEN;
+  }
+
+  for (;;) {
+    if (conn->out_len == 0 && !conn->channel_eof) {
+      int n = ssh_channel_read_nonblocking(conn->channel, conn->out,
+                                           sizeof(conn->out), 0);
+      if (n == SSH_ERROR) {
+        return -1;
+      } else if (n == SSH_EOF) {
+        conn->channel_eof = 1;
+        shutdown(conn->sock, SHUT_WR);
+      } else if (n > 0) {
+        conn->out_off = 0;
+        conn->out_len = n;
+        STAT_ADD(holder->bytes_received, n);
+      }
+    }
+    if (conn->out_len == 0) {
+      break;
+    } else {
+      ssize_t w = write(conn->sock, conn->out + conn->out_off,
+                        conn->out_len - conn->out_off);
+      if (w < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+          break;
+        }
+        return -1;
+      }
+      conn->out_off += w;
+      if (conn->out_off == conn->out_len) {
+        conn->out_off = conn->out_len = 0;
+      }
+    }
+  }
+
+  if (!conn->sock_eof && (revents & (POLLIN | POLLHUP))) {
+    uint32_t window = ssh_channel_window_size(conn->channel);
+
+    /* Never write more than the remote window so that ssh_channel_write
+     * doesn't block the whole loop. */
+    while (window > 0) {
+      size_t count = window < sizeof(in) ? window : sizeof(in);
+      ssize_t n = read(conn->sock, in, count);
+
+      if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+          break;
+        }
+        return -1;
+      } else if (n == 0) {
+        conn->sock_eof = 1;
+        if (ssh_channel_send_eof(conn->channel) == SSH_ERROR) {
+          return -1;
+        }
+        break;
+      }
+      if (ssh_channel_write(conn->channel, in, n) == SSH_ERROR) {
+        return -1;
+      }
+      STAT_ADD(holder->bytes_sent, n);
+      window -= n;
+    }
+  }
+
+  if (conn->channel_eof && conn->out_len == 0 &&
+      (conn->sock_eof || ssh_channel_is_closed(conn->channel))) {
+    return -1;
+  }
+  return 0;
+}
+
+static void accept_local(ForwardHolder *holder) {
+  for (;;) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    char serv[NI_MAXSERV];
+    ssh_channel channel;
+    ForwardConn *conn;
+    int sock;
+
+    sock = accept(holder->listen_fd, (struct sockaddr *)&addr, &addrlen);
+    if (sock < 0) {
+      return;
+    }
+    channel = ssh_channel_new(holder->ssh);
+    if (channel == NULL) {
+      close(sock);
+      continue;
+    }
+    /* The channel is opened by conn_pump without waiting for the reply. */
+    conn = conn_add(holder, channel, sock, CONN_OPENING);
+    if (conn == NULL) {
+      continue;
+    }
+    if (getnameinfo((struct sockaddr *)&addr, addrlen, conn->origin_host,
+                    sizeof(conn->origin_host), serv, sizeof(serv),
+                    NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+      strcpy(conn->origin_host, "127.0.0.1");
+      strcpy(serv, "0");
+    }
+    conn->origin_port = atoi(serv);
+  }
+}
+
+/* Accept a forwarded channel if any. Return 1 if a channel is accepted. */
+static int accept_remote(ForwardHolder *holder) {
+  ssh_channel channel;
+  int port = holder->remote_port;
+  int sock;
+  enum conn_state state = CONN_OPEN;
+
+  channel = ssh_channel_accept_forward(holder->ssh, 0, &port);
+  if (channel == NULL) {
+    return 0;
+  }
+  if (port != holder->remote_port) {
+    /* Only one remote forward per session is supported. */
+    ssh_channel_close(channel);
+    ssh_channel_free(channel);
+    return 1;
+  }
+  sock = socket(holder->connect_addr.ss_family, SOCK_STREAM, 0);
+  if (sock == -1) {
+    ssh_channel_close(channel);
+    ssh_channel_free(channel);
+    return 1;
+  }
+  /* The connection is completed by conn_pump when the socket gets
+   * writable. */
+  set_nonblock(sock);
+  if (connect(sock, (struct sockaddr *)&holder->connect_addr,
+              holder->connect_addrlen) != 0) {
+    if (errno != EINPROGRESS) {
+      close(sock);
+      ssh_channel_close(channel);
+      ssh_channel_free(channel);
+      return 1;
+    }
+    state = CONN_CONNECTING;
+  }
+  conn_add(holder, channel, sock, state);
+  return 1;
+}
+
+static void *forward_thread(void *ptr) {
+  ForwardHolder *holder = ptr;
+  struct pollfd *fds = NULL;
+  size_t fds_capa = 0;
+  ssh_event event;
+  int accept_pending = 0;
+
+  /* The event is used to process incoming packets, including window
+   * adjustments for channels which have already got EOF. */
+  event = ssh_event_new();
+  if (event == NULL || ssh_event_add_session(event, holder->ssh) != SSH_OK) {
+    forward_set_error(holder, "Cannot create ssh_event");
+    if (event != NULL) {
+      ssh_event_free(event);
+    }
+    return NULL;
+  }
+  /* The session is nonblocking while the thread runs, so nothing waits for
+   * the server in this loop. Channel opens are completed by later
+   * iterations. */
+  while (!holder->stop) {
+    ForwardConn *conn, **link;
+    size_t nfds = 0, i;
+
+    for (conn = holder->conns; conn != NULL; conn = conn->next) {
+      nfds++;
+    }
+    nfds += 3;
+    if (nfds > fds_capa) {
+      struct pollfd *p = realloc(fds, nfds * sizeof(*fds));
+      if (p == NULL) {
+        forward_set_error(holder, "Cannot allocate memory");
+        break;
+      }
+      fds = p;
+      fds_capa = nfds;
+    }
+    fds[0].fd = holder->wakeup[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = ssh_get_fd(holder->ssh);
+    fds[1].events = POLLIN;
+    if (ssh_get_poll_flags(holder->ssh) & SSH_WRITE_PENDING) {
+      fds[1].events |= POLLOUT;
+    }
+    fds[2].fd = holder->listen_fd;
+    fds[2].events = POLLIN;
+    for (i = 3, conn = holder->conns; conn != NULL; conn = conn->next, i++) {
+      fds[i].fd = conn->sock;
+      fds[i].events = 0;
+      if (conn->state == CONN_CONNECTING) {
+        fds[i].events |= POLLOUT;
+      } else if (conn->state == CONN_OPEN && !conn->sock_eof &&
+                 ssh_channel_window_size(conn->channel) > 0) {
+        fds[i].events |= POLLIN;
+      }
+      if (conn->out_len > 0) {
+        fds[i].events |= POLLOUT;
+      }
+    }
+    for (i = 0; i < nfds; i++) {
+      fds[i].revents = 0;
+    }
+
+    if (poll(fds, nfds, accept_pending ? 0 : 100) < 0 && errno != EINTR) {
+      forward_set_error(holder, strerror(errno));
+      break;
+    }
+    if (fds[0].revents & POLLIN) {
+      char c;
+      while (read(holder->wakeup[0], &c, 1) > 0) {
+      }
+    }
+    if (holder->stop) {
+      break;
+    }
+    if (holder->is_remote) {
+      /* ssh_channel_accept_forward processes incoming packets too. It may
+       * wait up to 50ms when nothing arrives, so it is called again only
+       * while channels keep being accepted. */
+      if ((fds[1].revents & (POLLIN | POLLOUT)) || accept_pending) {
+        accept_pending = accept_remote(holder);
+      }
+    } else if (fds[1].revents & (POLLIN | POLLOUT)) {
+      if (ssh_event_dopoll(event, 0) == SSH_ERROR) {
+        forward_set_error(holder, ssh_get_error(holder->ssh));
+        break;
+      }
+    }
+    if (fds[1].revents & (POLLERR | POLLHUP | POLLNVAL) ||
+        !ssh_is_connected(holder->ssh)) {
+      forward_set_error(holder, ssh_get_error(holder->ssh));
+      break;
+    }
+    if (holder->listen_fd != -1 && (fds[2].revents & POLLIN)) {
+      accept_local(holder);
+    }
+
+    link = &holder->conns;
+    i = 3;
+    while (*link != NULL) {
+      short revents = 0;
+
+      conn = *link;
+      /* Connections accepted in this iteration aren't in fds yet. */
+      if (i < nfds && fds[i].fd == conn->sock) {
+        revents = fds[i].revents;
+        i++;
+      }
+      if (conn_pump(holder, conn, revents) == -1) {
+        *link = conn->next;
+        conn_close(holder, conn);
+      } else {
+        link = &conn->next;
+      }
+    }
+  }
+
+  while (holder->conns != NULL) {
+    ForwardConn *conn = holder->conns;
+    holder->conns = conn->next;
+    conn_close(holder, conn);
+  }
+  free(fds);
+  ssh_event_remove_session(event, holder->ssh);
+  ssh_event_free(event);
+  return NULL;
+}
+
+static int listen_local(const char *bind_addr, int port, int *bound_port) {
+  struct addrinfo hints, *res, *ai;
+  char serv[16];
+  int fd = -1, err;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  snprintf(serv, sizeof(serv), "%d", port);
+  err = getaddrinfo(bind_addr, serv, &hints, &res);
+  if (err != 0) {
+    rb_raise(rb_eArgError, "%s: %s", bind_addr, gai_strerror(err));
+  }
+  for (ai = res; ai != NULL; ai = ai->ai_next) {
+    int one = 1;
+
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd == -1) {
+      continue;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 128) == 0) {
+      break;
+    }
+    err = errno;
+    close(fd);
+    fd = -1;
+    errno = err;
+  }
+  freeaddrinfo(res);
+  if (fd == -1) {
+    rb_sys_fail(bind_addr);
+  }
+  set_nonblock(fd);
+
+  {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    char host[NI_MAXHOST];
+
+    *bound_port = port;
+    if (getsockname(fd, (struct sockaddr *)&addr, &addrlen) == 0 &&
+        getnameinfo((struct sockaddr *)&addr, addrlen, host, sizeof(host),
+                    serv, sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV) ==
+            0) {
+      *bound_port = atoi(serv);
+    }
+  }
+  return fd;
+}
+
+static void forward_start(VALUE self, ForwardHolder *holder) {
+  int err;
+
+  if (pipe(holder->wakeup) != 0) {
+    holder->wakeup[0] = holder->wakeup[1] = -1;
+    forward_release(holder);
+    rb_sys_fail("pipe");
+  }
+  set_nonblock(holder->wakeup[0]);
+  set_nonblock(holder->wakeup[1]);
+  libssh_ruby_session_nonblocking_begin(
+      libssh_ruby_session_holder(holder->session));
+  err = pthread_create(&holder->thread, NULL, forward_thread, holder);
+  if (err != 0) {
+    libssh_ruby_session_nonblocking_end(
+        libssh_ruby_session_holder(holder->session));
+    forward_release(holder);
+    rb_syserr_fail(err, "pthread_create");
+  }
+  holder->running = 1;
+  rb_ary_push(running_forwards, self);
+}
+
+/*
+ * @overload local(session, bind_addr, local_port, remote_host, remote_port)
+ *  Start forwarding connections to +bind_addr:local_port+ to
+ *  +remote_host:remote_port+ via the session. Connections are accepted and
+ *  pumped by a native thread in the background until {#close} is called.
+ *  The session must not be used by other threads while forwarding.
+ *  @param [Session] session A connected and authenticated session.
+ *  @param [String] bind_addr The local address to listen on.
+ *  @param [Fixnum] local_port The local port to listen on. +0+ picks a free
+ *    port.
+ *  @param [String] remote_host The remote host to connect to.
+ *  @param [Fixnum] remote_port The remote port to connect to.
+ *  @return [Forward]
+ *  @since 0.5.0
+ *  @see http://api.libssh.org/stable/group__libssh__channel.html
+ *    ssh_channel_open_forward
+ */
+static VALUE s_local(RB_UNUSED_VAR(VALUE klass), VALUE session,
+                     VALUE bind_addr, VALUE local_port, VALUE remote_host,
+                     VALUE remote_port) {
+  VALUE self;
+  ForwardHolder *holder;
+  SessionHolder *session_holder;
+
+  Check_Type(local_port, T_FIXNUM);
+  Check_Type(remote_port, T_FIXNUM);
+  session_holder = libssh_ruby_session_holder(session);
+  if (!ssh_is_connected(session_holder->session)) {
+    rb_raise(rb_eArgError, "Session isn't connected");
+  }
+  self = forward_alloc(rb_cLibSSHForward);
+  TypedData_Get_Struct(self, ForwardHolder, &forward_type, holder);
+  holder->remote_host = strdup(StringValueCStr(remote_host));
+  holder->remote_port = FIX2INT(remote_port);
+  holder->listen_fd = listen_local(StringValueCStr(bind_addr),
+                                   FIX2INT(local_port), &holder->local_port);
+  RB_OBJ_WRITE(self, &holder->session, session);
+  holder->ssh = session_holder->session;
+  forward_start(self, holder);
+  return self;
+}
+
+struct nogvl_listen_forward_args {
+  ssh_session session;
+  int port;
+  int bound_port;
+  int rc;
+};
+
+static void *nogvl_listen_forward(void *ptr) {
+  struct nogvl_listen_forward_args *args = ptr;
+  args->bound_port = args->port;
+  args->rc = ssh_channel_listen_forward(args->session, NULL, args->port,
+                                        &args->bound_port);
+  return NULL;
+}
+
+static void resolve_local(ForwardHolder *holder, const char *host, int port) {
+  struct addrinfo hints, *res;
+  char serv[16];
+  int err;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(serv, sizeof(serv), "%d", port);
+  err = getaddrinfo(host, serv, &hints, &res);
+  if (err != 0) {
+    rb_raise(rb_eArgError, "%s: %s", host, gai_strerror(err));
+  }
+  memcpy(&holder->connect_addr, res->ai_addr, res->ai_addrlen);
+  holder->connect_addrlen = res->ai_addrlen;
+  freeaddrinfo(res);
+}
+
+/*
+ * @overload remote(session, remote_port, local_host, local_port, deadline: nil)
+ *  Request the server to listen on +remote_port+ and forward the connections
+ *  to +local_host:local_port+. Forwarded channels are accepted and pumped by
+ *  a native thread in the background until {#close} is called. The session
+ *  must not be used by other threads while forwarding, and only one remote
+ *  forward can run on a session.
+ *  @param [Session] session A connected and authenticated session.
+ *  @param [Fixnum] remote_port The remote port to listen on. +0+ lets the
+ *    server pick a port.
+ *  @param [String] local_host The local host to connect to.
+ *  @param [Fixnum] local_port The local port to connect to.
+ *  @param [Numeric, Time, nil] deadline Raise {TimeoutError} unless the
+ *    server accepts the request by then. A Numeric is seconds from now.
+ *  @return [Forward]
+ *  @raise [TimeoutError]
+ *  @since 0.5.0
+ *  @see http://api.libssh.org/stable/group__libssh__channel.html
+ *    ssh_channel_listen_forward
+ */
+static VALUE s_remote(int argc, VALUE *argv, RB_UNUSED_VAR(VALUE klass)) {
+  VALUE self, session, remote_port, local_host, local_port, opts;
+  ForwardHolder *holder;
+  SessionHolder *session_holder;
+  struct nogvl_listen_forward_args args;
+  struct timespec ts;
+  const struct timespec *deadline;
+
+  rb_scan_args(argc, argv, "40:", &session, &remote_port, &local_host,
+               &local_port, &opts);
+  deadline = libssh_ruby_deadline_option(opts, &ts);
+  Check_Type(remote_port, T_FIXNUM);
+  Check_Type(local_port, T_FIXNUM);
+  session_holder = libssh_ruby_session_holder(session);
+  if (!ssh_is_connected(session_holder->session)) {
+    rb_raise(rb_eArgError, "Session isn't connected");
+  }
+  self = forward_alloc(rb_cLibSSHForward);
+  TypedData_Get_Struct(self, ForwardHolder, &forward_type, holder);
+  holder->is_remote = 1;
+  holder->local_port = FIX2INT(local_port);
+  resolve_local(holder, StringValueCStr(local_host), holder->local_port);
+
+  args.session = session_holder->session;
+  args.port = FIX2INT(remote_port);
+  libssh_ruby_session_call(session, nogvl_listen_forward, &args, &args.rc,
+                           SSH_AGAIN, -1, deadline);
+  if (args.rc != SSH_OK) {
+    libssh_ruby_raise(session_holder->session);
+  }
+  holder->remote_port = args.bound_port == 0 ? args.port : args.bound_port;
+  RB_OBJ_WRITE(self, &holder->session, session);
+  holder->ssh = session_holder->session;
+  forward_start(self, holder);
+  return self;
+}
+
+struct nogvl_cancel_forward_args {
+  ssh_session session;
+  int port;
+  int rc;
+};
+
+static void *nogvl_cancel_forward(void *ptr) {
+  struct nogvl_cancel_forward_args *args = ptr;
+  args->rc = ssh_channel_cancel_forward(args->session, NULL, args->port);
+  return NULL;
+}
+
+static void *nogvl_join(void *ptr) {
+  ForwardHolder *holder = ptr;
+  pthread_join(holder->thread, NULL);
+  return NULL;
+}
+
+/*
+ * @overload close(deadline: nil)
+ *  Stop forwarding and close all the forwarded connections. A remote
+ *  forward is cancelled on the server as well.
+ *  @param [Numeric, Time, nil] deadline Raise {TimeoutError} unless the
+ *    server replies to the cancel by then. A Numeric is seconds from now.
+ *    The forward is closed locally anyway.
+ *  @return [nil]
+ *  @raise [TimeoutError]
+ *  @since 0.5.0
+ *  @see http://api.libssh.org/stable/group__libssh__channel.html
+ *    ssh_channel_cancel_forward
+ */
+static VALUE m_close(int argc, VALUE *argv, VALUE self) {
+  ForwardHolder *holder;
+  VALUE opts;
+  struct timespec ts;
+  const struct timespec *deadline;
+
+  TypedData_Get_Struct(self, ForwardHolder, &forward_type, holder);
+  rb_scan_args(argc, argv, "0:", &opts);
+  deadline = libssh_ruby_deadline_option(opts, &ts);
+  if (holder->running) {
+    struct nogvl_cancel_forward_args args;
+
+    holder->stop = 1;
+    if (write(holder->wakeup[1], "", 1) < 0) {
+      /* The thread wakes up by the poll timeout anyway. */
+    }
+    rb_thread_call_without_gvl(nogvl_join, holder, RUBY_UBF_IO, NULL);
+    libssh_ruby_session_nonblocking_end(
+        libssh_ruby_session_holder(holder->session));
+    holder->running = 0;
+    forward_release(holder);
+    rb_ary_delete(running_forwards, self);
+    if (holder->is_remote && ssh_is_connected(holder->ssh)) {
+      /* A failure is ignored as the server closes the port with the
+       * session anyway. */
+      args.session = holder->ssh;
+      args.port = holder->remote_port;
+      libssh_ruby_session_call(holder->session, nogvl_cancel_forward, &args,
+                               &args.rc, SSH_AGAIN, -1, deadline);
+    }
+  }
+  return Qnil;
+}
+
+/*
+ * @overload running?
+ *  Check if the forwarding thread is still running.
+ *  @return [Boolean]
+ *  @since 0.5.0
+ */
+static VALUE m_running_p(VALUE self) {
+  ForwardHolder *holder;
+
+  TypedData_Get_Struct(self, ForwardHolder, &forward_type, holder);
+  if (holder->running &&
+      __atomic_load_n(&holder->error, __ATOMIC_ACQUIRE) == NULL) {
+    return Qtrue;
+  } else {
+    return Qfalse;
+  }
+}
+
+/*
+ * @overload local_port
+ *  The local port listened on by a local forward, or connected to by a
+ *  remote forward.
+ *  @return [Fixnum]
+ *  @since 0.5.0
+ */
+static VALUE m_local_port(VALUE self) {
+  ForwardHolder *holder;
+
+  TypedData_Get_Struct(self, ForwardHolder, &forward_type, holder);
+  return INT2FIX(holder->local_port);
+}
+
+/*
+ * @overload remote_port
+ *  The remote port connected to by a local forward, or listened on by a
+ *  remote forward.
+ *  @return [Fixnum]
+ *  @since 0.5.0
+ */
+static VALUE m_remote_port(VALUE self) {
+  ForwardHolder *holder;
+
+  TypedData_Get_Struct(self, ForwardHolder, &forward_type, holder);
+  return INT2FIX(holder->remote_port);
+}
+
+/*
+ * @overload bytes_sent
+ *  Total bytes sent from local sockets to the remote side.
+ *  @return [Integer]
+ *  @since 0.5.0
+ */
+static VALUE m_bytes_sent(VALUE self) {
+  ForwardHolder *holder;
+
+  TypedData_Get_Struct(self, ForwardHolder, &forward_type, holder);
+  return ULL2NUM(STAT_GET(holder->bytes_sent));
+}
+
+/*
+ * @overload bytes_received
+ *  Total bytes received from the remote side to local sockets.
+ *  @return [Integer]
+ *  @since 0.5.0
+ */
+static VALUE m_bytes_received(VALUE self) {
+  ForwardHolder *holder;
+
+  TypedData_Get_Struct(self, ForwardHolder, &forward_type, holder);
+  return ULL2NUM(STAT_GET(holder->bytes_received));
+}
+
+/*
+ * @overload connections
+ *  Total number of forwarded connections.
+ *  @return [Integer]
+ *  @since 0.5.0
+ */
+static VALUE m_connections(VALUE self) {
+  ForwardHolder *holder;
+
+  TypedData_Get_Struct(self, ForwardHolder, &forward_type, holder);
+  return ULL2NUM(STAT_GET(holder->connections));
+}
+
+/*
+ * @overload active_connections
+ *  Number of forwarded connections currently open.
+ *  @return [Integer]
+ *  @since 0.5.0
+ */
+static VALUE m_active_connections(VALUE self) {
+  ForwardHolder *holder;
+
+  TypedData_Get_Struct(self, ForwardHolder, &forward_type, holder);
+  return ULL2NUM(STAT_GET(holder->active_connections));
+}
+
+/*
+ * @overload error
+ *  The error which stopped the forwarding thread.
+ *  @return [String, nil]
+ *  @since 0.5.0
+ */
+static VALUE m_error(VALUE self) {
+  ForwardHolder *holder;
+  const char *error;
+
+  TypedData_Get_Struct(self, ForwardHolder, &forward_type, holder);
+  error = __atomic_load_n(&holder->error, __ATOMIC_ACQUIRE);
+  if (error == NULL) {
+    return Qnil;
+  } else {
+    return rb_str_new_cstr(error);
+  }
+}
+
+/*
+ * Document-class: LibSSH::Forward
+ * Port forwarding running on a native thread.
+ *
+ * @since 0.5.0
+ */
+
+void Init_libssh_forward(void) {
+  rb_cLibSSHForward = rb_define_class_under(rb_mLibSSH, "Forward", rb_cObject);
+  rb_undef_alloc_func(rb_cLibSSHForward);
+
+  running_forwards = rb_ary_new();
+  rb_gc_register_address(&running_forwards);
+
+  rb_define_singleton_method(rb_cLibSSHForward, "local",
+                             RUBY_METHOD_FUNC(s_local), 5);
+  rb_define_singleton_method(rb_cLibSSHForward, "remote",
+                             RUBY_METHOD_FUNC(s_remote), -1);
+
+  rb_define_method(rb_cLibSSHForward, "close", RUBY_METHOD_FUNC(m_close), -1);
+  rb_define_method(rb_cLibSSHForward, "running?",
+                   RUBY_METHOD_FUNC(m_running_p), 0);
+  rb_define_method(rb_cLibSSHForward, "local_port",
+                   RUBY_METHOD_FUNC(m_local_port), 0);
+  rb_define_method(rb_cLibSSHForward, "remote_port",
+                   RUBY_METHOD_FUNC(m_remote_port), 0);
+  rb_define_method(rb_cLibSSHForward, "bytes_sent",
+                   RUBY_METHOD_FUNC(m_bytes_sent), 0);
+  rb_define_method(rb_cLibSSHForward, "bytes_received",
+                   RUBY_METHOD_FUNC(m_bytes_received), 0);
+  rb_define_method(rb_cLibSSHForward, "connections",
+                   RUBY_METHOD_FUNC(m_connections), 0);
+  rb_define_method(rb_cLibSSHForward, "active_connections",
+                   RUBY_METHOD_FUNC(m_active_connections), 0);
+  rb_define_method(rb_cLibSSHForward, "error", RUBY_METHOD_FUNC(m_error), 0);
+}
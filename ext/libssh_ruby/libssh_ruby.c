@@ -1,8 +1,18 @@
 #include "libssh_ruby.h"
 #include <libssh/callbacks.h>
+#include <ruby/digest.h>
+#include <ruby/encoding.h>
+#include <ruby/io.h>
+#include <ruby/thread.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
 
 VALUE rb_mLibSSH;
 
+/* Wakeup of the current native thread */
+static pthread_key_t wakeup_key;
+
 /*
  * @overload version(req_version = 0)
  *  When +req_version+ is given, check if libssh is the required version.
@@ -26,9 +36,421 @@ static VALUE m_version(int argc, VALUE *argv, RB_UNUSED_VAR(VALUE self)) {
   return rb_str_new_cstr(ssh_version(c_req_version));
 }
 
+/*
+ * Make +buffer+ a binary String which can hold +maxlen+ bytes without
+ * reallocation, and return the pointer to be filled.
+ */
+char *libssh_ruby_buffer_prepare(VALUE buffer, long maxlen) {
+  StringValue(buffer);
+  if (maxlen > RSTRING_LEN(buffer)) {
+    rb_str_modify_expand(buffer, maxlen - RSTRING_LEN(buffer));
+  } else {
+    rb_str_modify(buffer);
+  }
+  rb_enc_associate(buffer, rb_ascii8bit_encoding());
+  return RSTRING_PTR(buffer);
+}
+
+struct buffer_nogvl_args {
+  void *(*func)(void *);
+  void *data;
+};
+
+static VALUE buffer_nogvl_body(VALUE ptr) {
+  struct buffer_nogvl_args *args = (struct buffer_nogvl_args *)ptr;
+  libssh_ruby_nogvl(args->func, args->data);
+  return Qnil;
+}
+
+/*
+ * Call +func+ without GVL while +buffer+ is locked, so that other threads
+ * cannot modify or reallocate it during the call.
+ */
+void libssh_ruby_buffer_nogvl(VALUE buffer, void *(*func)(void *),
+                              void *data) {
+  struct buffer_nogvl_args args;
+
+  args.func = func;
+  args.data = data;
+  rb_str_locktmp(buffer);
+  rb_ensure(buffer_nogvl_body, (VALUE)&args, rb_str_unlocktmp, buffer);
+}
+
+struct buffer_session_call_args {
+  VALUE session;
+  void *(*func)(void *);
+  void *data;
+  const int *rc;
+  int again;
+  int timeout;
+  const struct timespec *deadline;
+};
+
+static VALUE buffer_session_call_body(VALUE ptr) {
+  struct buffer_session_call_args *args =
+      (struct buffer_session_call_args *)ptr;
+  libssh_ruby_session_call(args->session, args->func, args->data, args->rc,
+                           args->again, args->timeout, args->deadline);
+  return Qnil;
+}
+
+/*
+ * Same as libssh_ruby_buffer_nogvl, but call +func+ with
+ * libssh_ruby_session_call.
+ */
+void libssh_ruby_buffer_session_call(VALUE buffer, VALUE session,
+                                     void *(*func)(void *), void *data,
+                                     const int *rc, int again, int timeout,
+                                     const struct timespec *deadline) {
+  struct buffer_session_call_args args;
+
+  args.session = session;
+  args.func = func;
+  args.data = data;
+  args.rc = rc;
+  args.again = again;
+  args.timeout = timeout;
+  args.deadline = deadline;
+  rb_str_locktmp(buffer);
+  rb_ensure(buffer_session_call_body, (VALUE)&args, rb_str_unlocktmp, buffer);
+}
+
+/* Set the length of +buffer+ filled by a read. */
+void libssh_ruby_buffer_finish(VALUE buffer, long len) {
+  rb_str_set_len(buffer, len < 0 ? 0 : len);
+}
+
+/*
+ * Append +len+ bytes of +data+ to +buf+, keeping at most +max_output+ bytes.
+ * Return -1 if memory cannot be allocated. Safe to call without GVL.
+ */
+int libssh_ruby_capture_append(struct capture_buffer *buf, const char *data,
+                               size_t len, size_t max_output) {
+  if (len > max_output - buf->len) {
+    /* Data beyond max_output is still read to keep the window open, but
+     * dropped here. */
+    len = max_output - buf->len;
+  }
+  if (buf->len + len > buf->capa) {
+    size_t capa = buf->capa == 0 ? 4096 : buf->capa;
+    char *ptr;
+
+    while (capa < buf->len + len) {
+      capa *= 2;
+    }
+    ptr = realloc(buf->ptr, capa);
+    if (ptr == NULL) {
+      return -1;
+    }
+    buf->ptr = ptr;
+    buf->capa = capa;
+  }
+  memcpy(buf->ptr + buf->len, data, len);
+  buf->len += len;
+  return 0;
+}
+
+static VALUE digest_class(VALUE name) {
+  return rb_const_get(rb_digest_namespace(), rb_intern_str(name));
+}
+
+static VALUE digest_class_missing(VALUE name, RB_UNUSED_VAR(VALUE exc)) {
+  rb_raise(rb_eArgError, "Unsupported digest: %" PRIsVALUE, name);
+}
+
+/*
+ * Return the rb_digest_metadata_t of +algo+, an algorithm name such as
+ * +:sha256+ or +:md5+, or a Digest::Base subclass. The hash functions of
+ * Ruby's digest library are used, and they are safe to call without GVL.
+ */
+const void *libssh_ruby_digest_metadata(VALUE algo) {
+  const rb_digest_metadata_t *meta;
+  VALUE klass, obj = Qnil;
+  ID id_metadata = rb_id_metadata();
+
+  if (SYMBOL_P(algo) || RB_TYPE_P(algo, T_STRING)) {
+    VALUE name = rb_funcall(rb_String(algo), rb_intern("upcase"), 0);
+
+    klass = rb_rescue2(digest_class, name, digest_class_missing, name,
+                       rb_eNameError, (VALUE)0);
+  } else {
+    klass = algo;
+  }
+  for (; RB_TYPE_P(klass, T_CLASS); klass = rb_class_superclass(klass)) {
+    if (rb_ivar_defined(klass, id_metadata)) {
+      obj = rb_ivar_get(klass, id_metadata);
+      break;
+    }
+  }
+  if (!RB_TYPE_P(obj, T_DATA)) {
+    rb_raise(rb_eArgError, "Unsupported digest: %" PRIsVALUE, algo);
+  }
+  meta = DATA_PTR(obj);
+  if (meta->api_version != RUBY_DIGEST_API_VERSION) {
+    rb_raise(rb_eArgError, "Unsupported digest: %" PRIsVALUE, algo);
+  }
+  return meta;
+}
+
+/*
+ * Prepare +digest+ for the +digest:+ option. Return 0 if +algo+ is nil or
+ * undef.
+ */
+int libssh_ruby_digest_init(DigestState *digest, VALUE algo) {
+  const rb_digest_metadata_t *meta;
+
+  digest->meta = NULL;
+  digest->ctx = NULL;
+  digest->tmp = 0;
+  if (algo == Qundef || NIL_P(algo)) {
+    return 0;
+  }
+  meta = libssh_ruby_digest_metadata(algo);
+  /* Not ALLOCV, which may use alloca in this frame. */
+  digest->ctx = rb_alloc_tmp_buffer(&digest->tmp, (long)meta->ctx_size);
+  if (!meta->init_func(digest->ctx)) {
+    rb_raise(rb_eRuntimeError, "Digest initialization failed");
+  }
+  digest->meta = meta;
+  return 1;
+}
+
+/*
+ * Prepare +digest+ to update a Digest::Base instance in place, for the
+ * +digest:+ option of streaming calls. Return 0 if +obj+ is nil or undef.
+ * The state isn't finished, as +obj+ keeps hashing across calls.
+ */
+int libssh_ruby_digest_attach(DigestState *digest, VALUE obj) {
+  const rb_digest_metadata_t *meta;
+
+  digest->meta = NULL;
+  digest->ctx = NULL;
+  digest->tmp = 0;
+  if (obj == Qundef || NIL_P(obj)) {
+    return 0;
+  }
+  meta = libssh_ruby_digest_metadata(rb_obj_class(obj));
+  if (!RB_TYPE_P(obj, T_DATA)) {
+    rb_raise(rb_eArgError, "Unsupported digest: %" PRIsVALUE, obj);
+  }
+  if (RTYPEDDATA_P(obj)) {
+    digest->ctx = rb_check_typeddata(obj, RTYPEDDATA_TYPE(obj));
+  } else {
+    digest->ctx = DATA_PTR(obj);
+  }
+  digest->meta = meta;
+  return 1;
+}
+
+/* Hash +len+ bytes of +data+ unless +digest+ is unused. */
+void libssh_ruby_digest_update(DigestState *digest, const void *data,
+                               size_t len) {
+  const rb_digest_metadata_t *meta = digest->meta;
+
+  if (meta != NULL) {
+    meta->update_func(digest->ctx, (unsigned char *)data, len);
+  }
+}
+
+/* Return a lowercase hex String of +len+ bytes of +buf+. */
+VALUE libssh_ruby_hex_new(const unsigned char *buf, size_t len) {
+  static const char hex[] = "0123456789abcdef";
+  VALUE ret = rb_usascii_str_new(NULL, (long)len * 2);
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    RSTRING_PTR(ret)[i * 2] = hex[buf[i] >> 4];
+    RSTRING_PTR(ret)[i * 2 + 1] = hex[buf[i] & 0xf];
+  }
+  return ret;
+}
+
+/* Return the hex digest, or nil if +digest+ is unused. */
+VALUE libssh_ruby_digest_finish(DigestState *digest) {
+  const rb_digest_metadata_t *meta = digest->meta;
+  unsigned char *buf;
+
+  if (meta == NULL) {
+    return Qnil;
+  }
+  buf = ALLOCA_N(unsigned char, meta->digest_len);
+  if (!meta->finish_func(digest->ctx, buf)) {
+    rb_raise(rb_eRuntimeError, "Digest finalization failed");
+  }
+  rb_free_tmp_buffer(&digest->tmp);
+  digest->meta = NULL;
+  digest->ctx = NULL;
+  return libssh_ruby_hex_new(buf, meta->digest_len);
+}
+
+/*
+ * Call +func+ without GVL. When the current fiber has a scheduler, the call
+ * may be offloaded to another thread so that other fibers keep running.
+ * Used for operations which libssh cannot do in nonblocking mode.
+ */
+void *libssh_ruby_nogvl(void *(*func)(void *), void *data) {
+#ifdef HAVE_CONST_RB_NOGVL_OFFLOAD_SAFE
+  return rb_nogvl(func, data, RUBY_UBF_IO, NULL, RB_NOGVL_OFFLOAD_SAFE);
+#else
+  return rb_thread_call_without_gvl(func, data, RUBY_UBF_IO, NULL);
+#endif
+}
+
+static void wakeup_free(void *ptr) {
+  Wakeup *wakeup = ptr;
+
+  close(wakeup->fd[0]);
+  close(wakeup->fd[1]);
+  free(wakeup);
+}
+
+/*
+ * Get the wakeup of the current thread with its flag cleared. Call it with
+ * GVL right before a blocking region whose unblocking function is
+ * libssh_ruby_wakeup. The pipe is created once for each native thread, so
+ * no other thread reads from it.
+ */
+Wakeup *libssh_ruby_wakeup_prepare(void) {
+  Wakeup *wakeup = pthread_getspecific(wakeup_key);
+
+  if (wakeup == NULL) {
+    int i;
+
+    /* Freed by the thread-specific data destructor, so not by xmalloc. */
+    wakeup = malloc(sizeof(Wakeup));
+    if (wakeup == NULL) {
+      rb_memerror();
+    }
+    if (pipe(wakeup->fd) != 0) {
+      free(wakeup);
+      rb_sys_fail("pipe");
+    }
+    for (i = 0; i < 2; i++) {
+      fcntl(wakeup->fd[i], F_SETFL, fcntl(wakeup->fd[i], F_GETFL) | O_NONBLOCK);
+      fcntl(wakeup->fd[i], F_SETFD, FD_CLOEXEC);
+    }
+    pthread_setspecific(wakeup_key, wakeup);
+  }
+  __atomic_store_n(&wakeup->interrupted, 0, __ATOMIC_RELAXED);
+  return wakeup;
+}
+
+/* The wakeup prepared by the current thread, for use without GVL. */
+Wakeup *libssh_ruby_wakeup_current(void) {
+  return pthread_getspecific(wakeup_key);
+}
+
+/* Whether the unblocking function has been called. Check it before each
+ * wait, as the pipe may have been read by an earlier check. */
+int libssh_ruby_wakeup_interrupted(Wakeup *wakeup) {
+  return __atomic_load_n(&wakeup->interrupted, __ATOMIC_ACQUIRE);
+}
+
+/* Read the pipe after it gets readable. Bytes left by an earlier region
+ * are discarded. Return whether the unblocking function has been called. */
+int libssh_ruby_wakeup_drain(Wakeup *wakeup) {
+  char buf[64];
+
+  while (read(wakeup->fd[0], buf, sizeof(buf)) > 0) {
+  }
+  return libssh_ruby_wakeup_interrupted(wakeup);
+}
+
+/* Unblocking function to wake up the thread waiting on +ptr+. */
+void libssh_ruby_wakeup(void *ptr) {
+  Wakeup *wakeup = ptr;
+
+  /* The flag is set first so that the waiting thread never misses it. */
+  __atomic_store_n(&wakeup->interrupted, 1, __ATOMIC_RELEASE);
+  if (write(wakeup->fd[1], "", 1) < 0) {
+    /* The pipe is full, so the waiting thread will wake up anyway. */
+  }
+}
+
+/* Set +deadline+ to +ms+ milliseconds after now on the monotonic clock. */
+void libssh_ruby_deadline_after(struct timespec *deadline, long ms) {
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  deadline->tv_sec += ms / 1000;
+  deadline->tv_nsec += (ms % 1000) * 1000000L;
+  if (deadline->tv_nsec >= 1000000000L) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000L;
+  }
+}
+
+/*
+ * Convert the +deadline:+ option, which is either seconds from now or a
+ * Time, to the monotonic clock. Return 0 if +deadline+ is nil or undef.
+ */
+int libssh_ruby_get_deadline(VALUE deadline, struct timespec *ts) {
+  double sec;
+
+  if (deadline == Qundef || NIL_P(deadline)) {
+    return 0;
+  }
+  if (rb_obj_is_kind_of(deadline, rb_cTime)) {
+    struct timespec at = rb_time_timespec(deadline), now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    sec = (at.tv_sec - now.tv_sec) + (at.tv_nsec - now.tv_nsec) / 1e9;
+  } else {
+    sec = NUM2DBL(deadline);
+  }
+  libssh_ruby_deadline_after(ts, sec <= 0 ? 0 : (long)(sec * 1000));
+  return 1;
+}
+
+/*
+ * Get the +deadline:+ keyword argument from +opts+. Return +ts+, or NULL if
+ * it isn't given.
+ */
+const struct timespec *libssh_ruby_deadline_option(VALUE opts,
+                                                   struct timespec *ts) {
+  ID table[1];
+  VALUE deadline;
+
+  table[0] = rb_intern("deadline");
+  rb_get_kwargs(opts, table, 0, 1, &deadline);
+  return libssh_ruby_get_deadline(deadline, ts) ? ts : NULL;
+}
+
+/* Milliseconds until +deadline+, or 0 if it has passed. */
+long libssh_ruby_remaining_ms(const struct timespec *deadline) {
+  struct timespec now;
+  long ms;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+       (deadline->tv_nsec - now.tv_nsec) / 1000000;
+  return ms < 0 ? 0 : ms;
+}
+
+/*
+ * Get the file descriptor from +io+, which is either an IO-like object or an
+ * Integer file descriptor. Data buffered in the IO is flushed beforehand.
+ */
+int libssh_ruby_fd(VALUE io) {
+  if (FIXNUM_P(io)) {
+    return FIX2INT(io);
+  }
+  io = rb_io_get_io(io);
+  rb_io_flush(io);
+#ifdef HAVE_RB_IO_DESCRIPTOR
+  return rb_io_descriptor(io);
+#else
+  {
+    rb_io_t *fptr;
+    GetOpenFile(io, fptr);
+    rb_io_check_closed(fptr);
+    return fptr->fd;
+  }
+#endif
+}
+
 void Init_libssh_ruby(void) {
   ssh_threads_set_callbacks(ssh_threads_get_pthread());
   ssh_init();
+  pthread_key_create(&wakeup_key, wakeup_free);
 
   rb_mLibSSH = rb_define_module("LibSSH");
 
@@ -80,4 +502,10 @@ void Init_libssh_ruby(void) {
   Init_libssh_error();
   Init_libssh_key();
   Init_libssh_scp();
+  Init_libssh_forward();
+  Init_libssh_selector();
+  Init_libssh_sftp();
+  Init_libssh_remote_file();
+  Init_libssh_sync();
+  Init_libssh_tar();
 }
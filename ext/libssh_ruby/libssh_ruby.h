@@ -6,9 +6,12 @@
 
 #include <ruby/ruby.h>
 #include <libssh/libssh.h>
+#include <libssh/sftp.h>
+#include <time.h>
 
 extern VALUE rb_mLibSSH;
 extern VALUE rb_cLibSSHKey;
+extern VALUE rb_cLibSSHSFTP;
 
 void Init_libssh_ruby(void);
 void Init_libssh_session(void);
@@ -16,20 +19,132 @@ void Init_libssh_channel(void);
 void Init_libssh_error(void);
 void Init_libssh_key(void);
 void Init_libssh_scp(void);
+void Init_libssh_forward(void);
+void Init_libssh_selector(void);
+void Init_libssh_sftp(void);
+void Init_libssh_remote_file(void);
+void Init_libssh_sync(void);
+void Init_libssh_tar(void);
 
+VALUE libssh_ruby_error_new(int code, const char *message);
 void libssh_ruby_raise(ssh_session session);
+void libssh_ruby_raise_timeout(void);
 
 struct SessionHolderStruct {
   ssh_session session;
+  /* IO for the session socket to wait on with a fiber scheduler. */
+  VALUE io;
+  /* Channels with callbacks, dispatched by Session#process_events. */
+  VALUE channels;
+  /* Selectors with callbacks on the channels, kept alive with the session */
+  VALUE selectors;
+  /* Incremented by channel callbacks when they have something to dispatch. */
+  int pending;
+  /* Default ChannelHolder.window */
+  uint32_t channel_window;
+  /* Calls which need nonblocking mode, and the mode to restore after them.
+   * Both are changed only with GVL. */
+  int nonblocking_calls;
+  int saved_blocking;
+  /* Values of Session#timeout= and #timeout_usec= */
+  long timeout, timeout_usec;
 };
 typedef struct SessionHolderStruct SessionHolder;
 
+struct ChannelCallbacksStruct;
+
+struct ChannelHolderStruct {
+  ssh_channel channel;
+  VALUE session;
+  /* Local window to keep for high throughput. 0 means the libssh default. */
+  uint32_t window;
+  struct ChannelCallbacksStruct *callbacks;
+};
+typedef struct ChannelHolderStruct ChannelHolder;
+
 struct KeyHolderStruct {
   ssh_key key;
 };
 typedef struct KeyHolderStruct KeyHolder;
 
+struct SFTPHolderStruct {
+  sftp_session sftp;
+  VALUE session;
+};
+typedef struct SFTPHolderStruct SFTPHolder;
+
 SessionHolder *libssh_ruby_session_holder(VALUE session);
+ChannelHolder *libssh_ruby_channel_holder(VALUE channel);
 KeyHolder *libssh_ruby_key_holder(VALUE key);
+SFTPHolder *libssh_ruby_sftp_holder(VALUE sftp);
+
+char *libssh_ruby_buffer_prepare(VALUE buffer, long maxlen);
+void libssh_ruby_buffer_nogvl(VALUE buffer, void *(*func)(void *), void *data);
+void libssh_ruby_buffer_session_call(VALUE buffer, VALUE session,
+                                     void *(*func)(void *), void *data,
+                                     const int *rc, int again, int timeout,
+                                     const struct timespec *deadline);
+void libssh_ruby_buffer_finish(VALUE buffer, long len);
+
+/* Output collected without GVL. +ptr+ is allocated by malloc. */
+struct capture_buffer {
+  char *ptr;
+  size_t len, capa;
+};
+int libssh_ruby_capture_append(struct capture_buffer *buf, const char *data,
+                               size_t len, size_t max_output);
+
+/* State of the +digest:+ option */
+struct DigestStateStruct {
+  /* const rb_digest_metadata_t *, or NULL without the option */
+  const void *meta;
+  void *ctx;
+  /* Owner of +ctx+, freed by GC when an exception is raised */
+  volatile VALUE tmp;
+};
+typedef struct DigestStateStruct DigestState;
+
+const void *libssh_ruby_digest_metadata(VALUE algo);
+int libssh_ruby_digest_init(DigestState *digest, VALUE algo);
+int libssh_ruby_digest_attach(DigestState *digest, VALUE obj);
+void libssh_ruby_digest_update(DigestState *digest, const void *data,
+                               size_t len);
+VALUE libssh_ruby_digest_finish(DigestState *digest);
+VALUE libssh_ruby_hex_new(const unsigned char *buf, size_t len);
+
+void *libssh_ruby_nogvl(void *(*func)(void *), void *data);
+void libssh_ruby_session_add_channel(VALUE session, VALUE channel);
+void libssh_ruby_session_nonblocking_begin(SessionHolder *holder);
+void libssh_ruby_session_nonblocking_end(SessionHolder *holder);
+void libssh_ruby_session_add_selector(VALUE session, VALUE selector);
+void libssh_ruby_session_remove_selector(VALUE session, VALUE selector);
+int libssh_ruby_channel_dispatch(VALUE channel, int *finished);
+
+/* Pipe of a native thread to wake it up from a wait without GVL */
+struct WakeupStruct {
+  int fd[2];
+  /* Set by the unblocking function before it writes to the pipe */
+  int interrupted;
+};
+typedef struct WakeupStruct Wakeup;
+
+Wakeup *libssh_ruby_wakeup_prepare(void);
+Wakeup *libssh_ruby_wakeup_current(void);
+int libssh_ruby_wakeup_interrupted(Wakeup *wakeup);
+int libssh_ruby_wakeup_drain(Wakeup *wakeup);
+void libssh_ruby_wakeup(void *wakeup);
+
+int libssh_ruby_nonblocking_p(void);
+void libssh_ruby_session_call(VALUE session, void *(*func)(void *), void *data,
+                              const int *rc, int again, int timeout,
+                              const struct timespec *deadline);
+
+void libssh_ruby_deadline_after(struct timespec *deadline, long ms);
+int libssh_ruby_get_deadline(VALUE deadline, struct timespec *ts);
+const struct timespec *libssh_ruby_deadline_option(VALUE opts,
+                                                   struct timespec *ts);
+long libssh_ruby_remaining_ms(const struct timespec *deadline);
+
+int libssh_ruby_fd(VALUE io);
 
 #endif /* LIBSSH_RUBY_H */
@@ -0,0 +1,774 @@
+#include "libssh_ruby.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <ruby/io.h>
+
+VALUE rb_cLibSSHRemoteFile;
+
+static ID id_block_size, id_cache_blocks, id_readahead, id_init, id_close;
+static ID id_hits, id_misses, id_requests;
+
+#define DEFAULT_BLOCK_SIZE 65536
+#define DEFAULT_CACHE_BLOCKS 64
+#define DEFAULT_READAHEAD 8
+/* Index of an empty cache block, and the size of a file of unknown size */
+#define NO_BLOCK UINT64_MAX
+
+struct cache_block {
+  uint64_t index;
+  /* Valid bytes. Less than the block size only at EOF. */
+  uint32_t len;
+  /* Tick of the last use, for LRU eviction */
+  uint64_t used;
+  char *data;
+};
+
+struct block_fetch {
+  struct cache_block *block;
+  uint64_t index;
+  uint32_t len;
+  uint32_t received;
+  int id;
+};
+
+struct RemoteFileHolderStruct {
+  sftp_file file;
+  VALUE sftp;
+  /* Close +sftp+ with the file. Set when opened with a Session. */
+  int owns_sftp;
+  /* Set while the cache is filled without GVL */
+  int busy;
+  uint64_t size;
+  uint64_t pos;
+  uint32_t block_size;
+  int nblocks;
+  int readahead;
+  struct cache_block *blocks;
+  struct block_fetch *fetches;
+  char *data;
+  uint64_t tick;
+  /* The last block read, to detect sequential reads */
+  uint64_t last_block;
+  uint64_t hits, misses, requests;
+};
+typedef struct RemoteFileHolderStruct RemoteFileHolder;
+
+static void remote_file_mark(void *);
+static void remote_file_free(void *);
+static size_t remote_file_memsize(const void *);
+
+static const rb_data_type_t remote_file_type = {
+    "remote_file",
+    {remote_file_mark, remote_file_free, remote_file_memsize, {NULL, NULL}},
+    NULL,
+    NULL,
+    RUBY_TYPED_WB_PROTECTED | RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE remote_file_alloc(VALUE klass) {
+  RemoteFileHolder *holder = ALLOC(RemoteFileHolder);
+  holder->file = NULL;
+  holder->sftp = Qundef;
+  holder->owns_sftp = 0;
+  holder->busy = 0;
+  holder->nblocks = 0;
+  holder->block_size = 0;
+  holder->blocks = NULL;
+  holder->fetches = NULL;
+  holder->data = NULL;
+  return TypedData_Wrap_Struct(klass, &remote_file_type, holder);
+}
+
+static void remote_file_mark(void *arg) {
+  RemoteFileHolder *holder = arg;
+  if (holder->file != NULL) {
+    rb_gc_mark(holder->sftp);
+  }
+}
+
+static void free_cache(RemoteFileHolder *holder) {
+  ruby_xfree(holder->blocks);
+  holder->blocks = NULL;
+  ruby_xfree(holder->fetches);
+  holder->fetches = NULL;
+  ruby_xfree(holder->data);
+  holder->data = NULL;
+  holder->nblocks = 0;
+}
+
+static void remote_file_free(void *arg) {
+  RemoteFileHolder *holder = arg;
+  /* An unclosed file is leaked as SFTP::File does. */
+  free_cache(holder);
+  ruby_xfree(holder);
+}
+
+static size_t remote_file_memsize(const void *arg) {
+  const RemoteFileHolder *holder = arg;
+  return sizeof(*holder) +
+         holder->nblocks * (sizeof(struct cache_block) +
+                            sizeof(struct block_fetch) + holder->block_size);
+}
+
+static RemoteFileHolder *get_holder(VALUE self) {
+  RemoteFileHolder *holder;
+
+  TypedData_Get_Struct(self, RemoteFileHolder, &remote_file_type, holder);
+  if (holder->file == NULL) {
+    rb_raise(rb_eIOError, "closed remote file");
+  }
+  return holder;
+}
+
+struct nogvl_open_args {
+  sftp_session sftp;
+  const char *path;
+  sftp_file file;
+  uint64_t size;
+};
+
+static void *nogvl_open(void *ptr) {
+  struct nogvl_open_args *args = ptr;
+  sftp_attributes attrs;
+
+  args->file = sftp_open(args->sftp, args->path, O_RDONLY, 0);
+  if (args->file == NULL) {
+    return NULL;
+  }
+  attrs = sftp_fstat(args->file);
+  if (attrs != NULL) {
+    if (attrs->flags & SSH_FILEXFER_ATTR_SIZE) {
+      args->size = attrs->size;
+    }
+    sftp_attributes_free(attrs);
+  }
+  return NULL;
+}
+
+static long positive_option(VALUE value, long default_value, const char *name) {
+  long n;
+
+  if (value == Qundef || NIL_P(value)) {
+    return default_value;
+  }
+  n = NUM2LONG(value);
+  if (n <= 0 || n > INT32_MAX) {
+    rb_raise(rb_eArgError, "%s must be positive", name);
+  }
+  return n;
+}
+
+/* @overload initialize(sftp, path, block_size: 65536, cache_blocks: 64, readahead: 8)
+ *  Open a remote file to read.
+ *  @param [SFTP, Session] sftp An initialized SFTP, or a Session to start
+ *    an SFTP which is closed with the file.
+ *  @param [String] path The remote file.
+ *  @param [Integer] block_size The size of the blocks read and cached.
+ *  @param [Integer] cache_blocks The number of the cached blocks.
+ *  @param [Integer] readahead The number of the blocks read ahead with a
+ *    cache miss during sequential reads. 0 disables read-ahead.
+ *  @return [RemoteFile]
+ *  @see http://api.libssh.org/stable/group__libssh__sftp.html sftp_open
+ */
+static VALUE m_initialize(int argc, VALUE *argv, VALUE self) {
+  RemoteFileHolder *holder;
+  SFTPHolder *sftp_holder;
+  VALUE sftp, path, opts;
+  const ID table[] = {id_block_size, id_cache_blocks, id_readahead};
+  VALUE kwvals[sizeof(table) / sizeof(*table)];
+  struct nogvl_open_args args;
+  long block_size, nblocks, readahead = DEFAULT_READAHEAD;
+  int i;
+
+  TypedData_Get_Struct(self, RemoteFileHolder, &remote_file_type, holder);
+  rb_scan_args(argc, argv, "20:", &sftp, &path, &opts);
+  rb_get_kwargs(opts, table, 0, 3, kwvals);
+  block_size =
+      positive_option(kwvals[0], DEFAULT_BLOCK_SIZE, "block_size");
+  nblocks = positive_option(kwvals[1], DEFAULT_CACHE_BLOCKS, "cache_blocks");
+  if (kwvals[2] != Qundef && !NIL_P(kwvals[2])) {
+    readahead = NUM2INT(kwvals[2]);
+    if (readahead < 0) {
+      rb_raise(rb_eArgError, "readahead must not be negative");
+    }
+  }
+  path = rb_str_new_frozen(path);
+
+  if (!rb_obj_is_kind_of(sftp, rb_cLibSSHSFTP)) {
+    sftp = rb_class_new_instance(1, &sftp, rb_cLibSSHSFTP);
+    rb_funcall(sftp, id_init, 0);
+    holder->owns_sftp = 1;
+  }
+  sftp_holder = libssh_ruby_sftp_holder(sftp);
+  args.sftp = sftp_holder->sftp;
+  args.path = StringValueCStr(path);
+  args.size = NO_BLOCK;
+  libssh_ruby_nogvl(nogvl_open, &args);
+  RB_GC_GUARD(path);
+  if (args.file == NULL) {
+    ssh_session session =
+        libssh_ruby_session_holder(sftp_holder->session)->session;
+    VALUE exc =
+        libssh_ruby_error_new(ssh_get_error_code(session), ssh_get_error(session));
+
+    if (holder->owns_sftp) {
+      rb_funcall(sftp, id_close, 0);
+    }
+    rb_exc_raise(exc);
+  }
+
+  holder->file = args.file;
+  RB_OBJ_WRITE(self, &holder->sftp, sftp);
+  holder->size = args.size;
+  holder->pos = 0;
+  holder->block_size = block_size;
+  holder->nblocks = nblocks;
+  holder->readahead = readahead;
+  holder->blocks = ALLOC_N(struct cache_block, nblocks);
+  holder->fetches = ALLOC_N(struct block_fetch, nblocks);
+  holder->data = ALLOC_N(char, (size_t)nblocks * block_size);
+  for (i = 0; i < nblocks; i++) {
+    holder->blocks[i].index = NO_BLOCK;
+    holder->blocks[i].len = 0;
+    holder->blocks[i].used = 0;
+    holder->blocks[i].data = holder->data + (size_t)i * block_size;
+  }
+  holder->tick = 0;
+  holder->last_block = NO_BLOCK;
+  holder->hits = 0;
+  holder->misses = 0;
+  holder->requests = 0;
+
+  return self;
+}
+
+static struct cache_block *find_block(RemoteFileHolder *holder,
+                                      uint64_t index) {
+  int i;
+
+  for (i = 0; i < holder->nblocks; i++) {
+    if (holder->blocks[i].index == index) {
+      return &holder->blocks[i];
+    }
+  }
+  return NULL;
+}
+
+/* Take the least recently used block not used since +tick+. */
+static struct cache_block *evict_block(RemoteFileHolder *holder,
+                                       uint64_t tick) {
+  struct cache_block *victim = NULL;
+  int i;
+
+  for (i = 0; i < holder->nblocks; i++) {
+    struct cache_block *block = &holder->blocks[i];
+    if (block->used < tick && (victim == NULL || block->used < victim->used)) {
+      victim = block;
+    }
+  }
+  return victim;
+}
+
+struct nogvl_fetch_args {
+  sftp_file file;
+  struct block_fetch *fetches;
+  int n;
+  uint32_t block_size;
+  int rc;
+};
+
+/*
+ * Receive the reply of the read in flight for +f+. The offset is set first
+ * because sftp_async_read returns 0 without taking the reply off the queue
+ * once it has seen EOF.
+ */
+static int fetch_reply(sftp_file file, struct block_fetch *f,
+                       uint32_t block_size) {
+  sftp_seek64(file, f->index * block_size + f->received);
+  return sftp_async_read(file, f->block->data + f->received,
+                         f->len - f->received, f->id);
+}
+
+/* Receive and drop the replies of the reads in flight for fetches +from+ to
+ * +to+ - 1, so that they don't stay queued in the sftp session. */
+static void drain_fetches(struct nogvl_fetch_args *args, int from, int to) {
+  int i;
+
+  for (i = from; i < to; i++) {
+    fetch_reply(args->file, &args->fetches[i], args->block_size);
+  }
+}
+
+/* Send all of the reads first, so that the blocks cost one round trip. */
+static void *nogvl_fetch(void *ptr) {
+  struct nogvl_fetch_args *args = ptr;
+  int i;
+
+  for (i = 0; i < args->n; i++) {
+    struct block_fetch *f = &args->fetches[i];
+
+    sftp_seek64(args->file, f->index * args->block_size);
+    f->id = sftp_async_read_begin(args->file, f->len);
+    f->received = 0;
+    if (f->id < 0) {
+      args->rc = SSH_ERROR;
+      drain_fetches(args, 0, i);
+      return NULL;
+    }
+  }
+  for (i = 0; i < args->n; i++) {
+    struct block_fetch *f = &args->fetches[i];
+
+    while (f->received < f->len) {
+      int n = fetch_reply(args->file, f, args->block_size);
+      if (n == SSH_ERROR) {
+        args->rc = SSH_ERROR;
+        drain_fetches(args, i + 1, args->n);
+        return NULL;
+      } else if (n == 0) {
+        break;
+      }
+      f->received += n;
+      if (f->received < f->len) {
+        /* Request the rest of a short read. */
+        sftp_seek64(args->file,
+                    f->index * args->block_size + f->received);
+        f->id = sftp_async_read_begin(args->file, f->len - f->received);
+        if (f->id < 0) {
+          args->rc = SSH_ERROR;
+          drain_fetches(args, i + 1, args->n);
+          return NULL;
+        }
+      }
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Make the blocks from +first+ to +last+ cached. The missing blocks and the
+ * blocks read ahead are read with one round trip.
+ */
+static void fetch_blocks(RemoteFileHolder *holder, uint64_t first,
+                         uint64_t last) {
+  uint64_t tick = ++holder->tick, index;
+  struct nogvl_fetch_args args;
+  int cached = 0, i;
+
+  args.n = 0;
+  for (index = first; index <= last; index++) {
+    struct cache_block *block = find_block(holder, index);
+
+    if (block != NULL) {
+      block->used = tick;
+      holder->hits++;
+      cached++;
+    } else {
+      holder->fetches[args.n++].index = index;
+      holder->misses++;
+    }
+  }
+  if (args.n > 0 && holder->last_block != NO_BLOCK &&
+      (first == holder->last_block || first == holder->last_block + 1)) {
+    int ahead = 0;
+
+    for (index = last + 1; ahead < holder->readahead &&
+                           args.n < holder->nblocks - cached &&
+                           index * holder->block_size < holder->size;
+         index++, ahead++) {
+      if (find_block(holder, index) == NULL) {
+        holder->fetches[args.n++].index = index;
+      }
+    }
+  }
+  holder->last_block = last;
+  if (args.n == 0) {
+    return;
+  }
+
+  for (i = 0; i < args.n; i++) {
+    struct block_fetch *f = &holder->fetches[i];
+    uint64_t offset = f->index * holder->block_size;
+
+    f->block = evict_block(holder, tick);
+    f->block->index = NO_BLOCK;
+    f->block->used = tick;
+    f->len = holder->block_size;
+    if (holder->size != NO_BLOCK && holder->size - offset < f->len) {
+      f->len = holder->size - offset;
+    }
+  }
+  args.file = holder->file;
+  args.fetches = holder->fetches;
+  args.block_size = holder->block_size;
+  args.rc = SSH_OK;
+  libssh_ruby_nogvl(nogvl_fetch, &args);
+  holder->requests += args.n;
+
+  for (i = 0; i < args.n; i++) {
+    struct block_fetch *f = &holder->fetches[i];
+
+    if (args.rc == SSH_OK) {
+      f->block->index = f->index;
+      f->block->len = f->received;
+    } else {
+      f->block->used = 0;
+    }
+  }
+  if (args.rc == SSH_ERROR) {
+    SFTPHolder *sftp_holder = libssh_ruby_sftp_holder(holder->sftp);
+    libssh_ruby_raise(
+        libssh_ruby_session_holder(sftp_holder->session)->session);
+  }
+}
+
+struct pread_args {
+  RemoteFileHolder *holder;
+  uint64_t offset;
+  uint64_t len;
+  VALUE buf;
+};
+
+static VALUE pread_body(VALUE ptr) {
+  struct pread_args *args = (struct pread_args *)ptr;
+  RemoteFileHolder *holder = args->holder;
+  uint64_t pos = args->offset, end = args->offset + args->len;
+  uint64_t bs = holder->block_size;
+
+  while (pos < end) {
+    uint64_t first = pos / bs, last = (end - 1) / bs, index;
+
+    if (last - first >= (uint64_t)holder->nblocks) {
+      last = first + holder->nblocks - 1;
+    }
+    fetch_blocks(holder, first, last);
+    for (index = first; index <= last && pos < end; index++) {
+      struct cache_block *block = find_block(holder, index);
+      uint64_t off = pos - index * bs, n;
+
+      if (block == NULL || block->len <= off) {
+        return Qnil;
+      }
+      n = block->len - off;
+      if (n > end - pos) {
+        n = end - pos;
+      }
+      rb_str_cat(args->buf, block->data + off, n);
+      pos += n;
+      if (block->len < bs) {
+        return Qnil;
+      }
+    }
+  }
+  return Qnil;
+}
+
+static VALUE pread_ensure(VALUE ptr) {
+  struct pread_args *args = (struct pread_args *)ptr;
+  args->holder->busy = 0;
+  return Qnil;
+}
+
+/* @overload pread(length, offset)
+ *  Read +length+ bytes at +offset+ without moving the position. Cached
+ *  blocks are served without a request, and the missing blocks are read
+ *  with one round trip.
+ *  @param [Integer] length The maximum count of bytes to be read.
+ *  @param [Integer] offset The offset to read at.
+ *  @return [String] An ASCII-8BIT String, shorter than +length+ at EOF.
+ *  @raise [EOFError] When +offset+ is at or beyond EOF.
+ *  @see http://api.libssh.org/stable/group__libssh__sftp.html
+ *    sftp_async_read
+ */
+static VALUE m_pread(VALUE self, VALUE length, VALUE offset) {
+  RemoteFileHolder *holder = get_holder(self);
+  struct pread_args args;
+  LONG_LONG off = NUM2LL(offset);
+  long len = NUM2LONG(length);
+
+  if (len < 0) {
+    rb_raise(rb_eArgError, "negative string size (or size too big)");
+  } else if (off < 0) {
+    rb_syserr_fail(EINVAL, "pread");
+  } else if (holder->busy) {
+    rb_raise(rb_eIOError, "remote file is being read by another thread");
+  }
+  args.holder = holder;
+  args.offset = off;
+  args.len = len;
+  if (holder->size != NO_BLOCK) {
+    if (args.offset >= holder->size) {
+      args.len = 0;
+    } else if (holder->size - args.offset < args.len) {
+      args.len = holder->size - args.offset;
+    }
+  }
+  args.buf = rb_str_buf_new(args.len);
+  if (args.len > 0) {
+    holder->busy = 1;
+    rb_ensure(pread_body, (VALUE)&args, pread_ensure, (VALUE)&args);
+  }
+  if (len > 0 && RSTRING_LEN(args.buf) == 0) {
+    rb_eof_error();
+  }
+  return args.buf;
+}
+
+struct pread_line_args {
+  RemoteFileHolder *holder;
+  uint64_t offset;
+  const char *sep;
+  long seplen;
+  VALUE buf;
+};
+
+/* Find +sep+ in +data+. Return the offset, or -1 if not found. */
+static long find_sep(const char *data, long len, const char *sep,
+                     long seplen) {
+  const char *p = data, *end = data + len;
+
+  while (end - p >= seplen) {
+    p = memchr(p, sep[0], end - p - seplen + 1);
+    if (p == NULL) {
+      return -1;
+    } else if (memcmp(p, sep, seplen) == 0) {
+      return p - data;
+    }
+    p++;
+  }
+  return -1;
+}
+
+/* Return how many bytes of +data+ complete +sep+ which the line ends with
+ * the beginning of, or 0. */
+static long complete_sep(VALUE line, const char *data, long len,
+                         const char *sep, long seplen) {
+  long k, linelen = RSTRING_LEN(line);
+
+  for (k = seplen - 1; k > 0; k--) {
+    if (k <= linelen && seplen - k <= len &&
+        memcmp(RSTRING_PTR(line) + linelen - k, sep, k) == 0 &&
+        memcmp(data, sep + k, seplen - k) == 0) {
+      return seplen - k;
+    }
+  }
+  return 0;
+}
+
+static VALUE pread_line_body(VALUE ptr) {
+  struct pread_line_args *args = (struct pread_line_args *)ptr;
+  RemoteFileHolder *holder = args->holder;
+  uint64_t pos = args->offset, bs = holder->block_size;
+
+  while (holder->size == NO_BLOCK || pos < holder->size) {
+    uint64_t index = pos / bs, off = pos - index * bs;
+    struct cache_block *block;
+    long len, i;
+
+    fetch_blocks(holder, index, index);
+    block = find_block(holder, index);
+    if (block == NULL || block->len <= off) {
+      break;
+    }
+    len = block->len - off;
+    /* Only the line is copied out of the block. */
+    i = complete_sep(args->buf, block->data + off, len, args->sep,
+                     args->seplen);
+    if (i == 0) {
+      i = find_sep(block->data + off, len, args->sep, args->seplen);
+      if (i >= 0) {
+        i += args->seplen;
+      }
+    }
+    if (i > 0) {
+      rb_str_cat(args->buf, block->data + off, i);
+      break;
+    }
+    rb_str_cat(args->buf, block->data + off, len);
+    pos += len;
+    if (block->len < bs) {
+      break;
+    }
+  }
+  return Qnil;
+}
+
+static VALUE pread_line_ensure(VALUE ptr) {
+  struct pread_line_args *args = (struct pread_line_args *)ptr;
+  args->holder->busy = 0;
+  return Qnil;
+}
+
+/* @overload pread_line(sep, offset)
+ *  Read a line ending with +sep+ at +offset+ without moving the position.
+ *  The separator is searched in the cached blocks, so only the line is
+ *  copied.
+ *  @param [String] sep The line separator. Must not be empty.
+ *  @param [Integer] offset The offset to read at.
+ *  @return [String] An ASCII-8BIT String, which doesn't end with +sep+ at
+ *    EOF, and is empty at or beyond EOF.
+ *  @since 0.5.0
+ */
+static VALUE m_pread_line(VALUE self, VALUE sep, VALUE offset) {
+  RemoteFileHolder *holder = get_holder(self);
+  struct pread_line_args args;
+  LONG_LONG off = NUM2LL(offset);
+
+  StringValue(sep);
+  if (RSTRING_LEN(sep) == 0) {
+    rb_raise(rb_eArgError, "empty separator");
+  } else if (off < 0) {
+    rb_syserr_fail(EINVAL, "pread_line");
+  } else if (holder->busy) {
+    rb_raise(rb_eIOError, "remote file is being read by another thread");
+  }
+  sep = rb_str_new_frozen(sep);
+  args.holder = holder;
+  args.offset = off;
+  args.sep = RSTRING_PTR(sep);
+  args.seplen = RSTRING_LEN(sep);
+  args.buf = rb_str_buf_new(0);
+  holder->busy = 1;
+  rb_ensure(pread_line_body, (VALUE)&args, pread_line_ensure, (VALUE)&args);
+  RB_GC_GUARD(sep);
+  return args.buf;
+}
+
+/* @overload size
+ *  @return [Integer, nil] The size of the file when opened, or nil if the
+ *    server doesn't tell it.
+ */
+static VALUE m_size(VALUE self) {
+  RemoteFileHolder *holder = get_holder(self);
+  return holder->size == NO_BLOCK ? Qnil : ULL2NUM(holder->size);
+}
+
+/* @overload pos
+ *  @return [Integer] The current position.
+ */
+static VALUE m_pos(VALUE self) {
+  return ULL2NUM(get_holder(self)->pos);
+}
+
+/* @overload pos=(pos)
+ *  Set the current position.
+ *  @param [Integer] pos The new position.
+ *  @return [Integer]
+ */
+static VALUE m_set_pos(VALUE self, VALUE pos) {
+  RemoteFileHolder *holder = get_holder(self);
+  LONG_LONG n = NUM2LL(pos);
+
+  if (n < 0) {
+    rb_syserr_fail(EINVAL, "pos");
+  }
+  holder->pos = n;
+  return pos;
+}
+
+/* @overload block_size
+ *  @return [Integer] The size of the cached blocks.
+ */
+static VALUE m_block_size(VALUE self) {
+  return UINT2NUM(get_holder(self)->block_size);
+}
+
+/* @overload stats
+ *  Get the statistics of the block cache.
+ *  @return [Hash{Symbol => Integer}] +:hits+ and +:misses+ count the
+ *    blocks read, and +:requests+ counts the blocks requested including
+ *    read-ahead.
+ */
+static VALUE m_stats(VALUE self) {
+  RemoteFileHolder *holder = get_holder(self);
+  VALUE ret = rb_hash_new();
+
+  rb_hash_aset(ret, ID2SYM(id_hits), ULL2NUM(holder->hits));
+  rb_hash_aset(ret, ID2SYM(id_misses), ULL2NUM(holder->misses));
+  rb_hash_aset(ret, ID2SYM(id_requests), ULL2NUM(holder->requests));
+  return ret;
+}
+
+static void *nogvl_close(void *ptr) {
+  sftp_close(ptr);
+  return NULL;
+}
+
+/* @overload close
+ *  Close the remote file, and the SFTP started for it.
+ *  @return [nil]
+ *  @see http://api.libssh.org/stable/group__libssh__sftp.html sftp_close
+ */
+static VALUE m_close(VALUE self) {
+  RemoteFileHolder *holder;
+  sftp_file file;
+
+  TypedData_Get_Struct(self, RemoteFileHolder, &remote_file_type, holder);
+  if (holder->file == NULL) {
+    return Qnil;
+  } else if (holder->busy) {
+    rb_raise(rb_eIOError, "remote file is being read by another thread");
+  }
+  file = holder->file;
+  holder->file = NULL;
+  free_cache(holder);
+  libssh_ruby_nogvl(nogvl_close, file);
+  if (holder->owns_sftp) {
+    rb_funcall(holder->sftp, id_close, 0);
+  }
+  return Qnil;
+}
+
+/* @overload closed?
+ *  Check if the remote file is closed or not.
+ *  @return [Boolean]
+ */
+static VALUE m_closed_p(VALUE self) {
+  RemoteFileHolder *holder;
+
+  TypedData_Get_Struct(self, RemoteFileHolder, &remote_file_type, holder);
+  return holder->file == NULL ? Qtrue : Qfalse;
+}
+
+/*
+ * Document-class: LibSSH::RemoteFile
+ * A remote file read over SFTP as an IO-like object. Blocks of the file are
+ * kept in a native LRU cache, and sequential reads make the following
+ * blocks read ahead.
+ *
+ * @since 0.5.0
+ */
+
+void Init_libssh_remote_file(void) {
+  rb_cLibSSHRemoteFile =
+      rb_define_class_under(rb_mLibSSH, "RemoteFile", rb_cObject);
+  rb_define_alloc_func(rb_cLibSSHRemoteFile, remote_file_alloc);
+
+  rb_define_method(rb_cLibSSHRemoteFile, "initialize",
+                   RUBY_METHOD_FUNC(m_initialize), -1);
+  rb_define_method(rb_cLibSSHRemoteFile, "pread", RUBY_METHOD_FUNC(m_pread),
+                   2);
+  rb_define_method(rb_cLibSSHRemoteFile, "pread_line",
+                   RUBY_METHOD_FUNC(m_pread_line), 2);
+  rb_define_method(rb_cLibSSHRemoteFile, "size", RUBY_METHOD_FUNC(m_size), 0);
+  rb_define_method(rb_cLibSSHRemoteFile, "pos", RUBY_METHOD_FUNC(m_pos), 0);
+  rb_define_method(rb_cLibSSHRemoteFile, "pos=", RUBY_METHOD_FUNC(m_set_pos),
+                   1);
+  rb_define_method(rb_cLibSSHRemoteFile, "block_size",
+                   RUBY_METHOD_FUNC(m_block_size), 0);
+  rb_define_method(rb_cLibSSHRemoteFile, "stats", RUBY_METHOD_FUNC(m_stats),
+                   0);
+  rb_define_method(rb_cLibSSHRemoteFile, "close", RUBY_METHOD_FUNC(m_close),
+                   0);
+  rb_define_method(rb_cLibSSHRemoteFile, "closed?",
+                   RUBY_METHOD_FUNC(m_closed_p), 0);
+
+  id_block_size = rb_intern("block_size");
+  id_cache_blocks = rb_intern("cache_blocks");
+  id_readahead = rb_intern("readahead");
+  id_init = rb_intern("init");
+  id_close = rb_intern("close");
+  id_hits = rb_intern("hits");
+  id_misses = rb_intern("misses");
+  id_requests = rb_intern("requests");
+}
@@ -1,5 +1,15 @@
 #include "libssh_ruby.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <ruby/thread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define RAISE_IF_ERROR(rc) \
   if ((rc) == SSH_ERROR)   \
@@ -7,7 +17,9 @@
 
 VALUE rb_cLibSSHScp;
 
-static ID id_read, id_write;
+static ID id_read, id_write, id_binary, id_mode, id_chunk, id_to_path;
+static ID id_recursive, id_basename, id_name, id_path, id_data;
+static ID id_concurrency, id_dirname, id_digest;
 
 static void scp_mark(void *);
 static void scp_free(void *);
@@ -52,21 +64,28 @@ static size_t scp_memsize(RB_UNUSED_VAR(const void *arg)) {
   return sizeof(ScpHolder);
 }
 
-/* @overload initialize(session, mode, path)
+/* @overload initialize(session, mode, path, recursive: false)
  *  Create a new scp session.
  *  @param [Session] session The SSH session to use.
  *  @param [Symbol] mode +:read+ or +:write+.
  *  @param [String] path The directory in which write or read will be done.
+ *  @param [Boolean] recursive Transfer directories. Required by
+ *    {#push_directory}, {#upload_tree} and {#download_tree}. Since 0.5.0.
  *  @return [Scp]
  *  @see http://api.libssh.org/stable/group__libssh__scp.html ssh_scp_new
  */
-static VALUE m_initialize(VALUE self, VALUE session, VALUE mode, VALUE path) {
+static VALUE m_initialize(int argc, VALUE *argv, VALUE self) {
   ScpHolder *holder;
   SessionHolder *session_holder;
+  VALUE session, mode, path, opts;
+  const ID table[] = {id_recursive};
+  VALUE kwvals[sizeof(table) / sizeof(*table)];
   char *c_path;
   ID id_mode;
   int c_mode;
 
+  rb_scan_args(argc, argv, "30:", &session, &mode, &path, &opts);
+  rb_get_kwargs(opts, table, 0, 1, kwvals);
   Check_Type(mode, T_SYMBOL);
   id_mode = SYM2ID(mode);
   if (id_mode == id_read) {
@@ -76,6 +95,9 @@ static VALUE m_initialize(VALUE self, VALUE session, VALUE mode, VALUE path) {
   } else {
     rb_raise(rb_eArgError, "Invalid mode value: %" PRIsVALUE, mode);
   }
+  if (kwvals[0] != Qundef && RTEST(kwvals[0])) {
+    c_mode |= SSH_SCP_RECURSIVE;
+  }
   c_path = StringValueCStr(path);
   TypedData_Get_Struct(self, ScpHolder, &scp_type, holder);
   session_holder = libssh_ruby_session_holder(session);
@@ -107,7 +129,7 @@ static VALUE m_close(VALUE self) {
 
   TypedData_Get_Struct(self, ScpHolder, &scp_type, holder);
   args.scp = holder->scp;
-  rb_thread_call_without_gvl(nogvl_close, &args, RUBY_UBF_IO, NULL);
+  libssh_ruby_nogvl(nogvl_close, &args);
   RAISE_IF_ERROR(args.rc);
 
   return Qnil;
@@ -131,7 +153,7 @@ static VALUE m_init(VALUE self) {
 
   TypedData_Get_Struct(self, ScpHolder, &scp_type, holder);
   args.scp = holder->scp;
-  rb_thread_call_without_gvl(nogvl_init, &args, RUBY_UBF_IO, NULL);
+  libssh_ruby_nogvl(nogvl_init, &args);
   RAISE_IF_ERROR(args.rc);
 
   return rb_ensure(rb_yield, Qnil, m_close, self);
@@ -170,7 +192,69 @@ static VALUE m_push_file(VALUE self, VALUE filename, VALUE size, VALUE mode) {
   args.filename = StringValueCStr(filename);
   args.size = NUM2ULONG(size);
   args.mode = FIX2INT(mode);
-  rb_thread_call_without_gvl(nogvl_push_file, &args, RUBY_UBF_IO, NULL);
+  libssh_ruby_nogvl(nogvl_push_file, &args);
+  RAISE_IF_ERROR(args.rc);
+  return Qnil;
+}
+
+struct nogvl_push_directory_args {
+  ssh_scp scp;
+  const char *dirname;
+  int mode;
+  int rc;
+};
+
+static void *nogvl_push_directory(void *ptr) {
+  struct nogvl_push_directory_args *args = ptr;
+  args->rc = ssh_scp_push_directory(args->scp, args->dirname, args->mode);
+  return NULL;
+}
+
+/* @overload push_directory(dirname, mode)
+ *  Create a directory in a scp in sink mode, and enter it. The scp must be
+ *  created with +recursive: true+.
+ *  @param [String] dirname The name of the directory being created.
+ *  @param [Fixnum] mode The UNIX permissions for the new directory.
+ *  @return [nil]
+ *  @since 0.5.0
+ *  @see http://api.libssh.org/stable/group__libssh__scp.html
+ *    ssh_scp_push_directory
+ */
+static VALUE m_push_directory(VALUE self, VALUE dirname, VALUE mode) {
+  ScpHolder *holder;
+  struct nogvl_push_directory_args args;
+
+  TypedData_Get_Struct(self, ScpHolder, &scp_type, holder);
+  args.scp = holder->scp;
+  dirname = rb_str_new_frozen(dirname);
+  args.dirname = StringValueCStr(dirname);
+  args.mode = NUM2INT(mode);
+  libssh_ruby_nogvl(nogvl_push_directory, &args);
+  RB_GC_GUARD(dirname);
+  RAISE_IF_ERROR(args.rc);
+  return Qnil;
+}
+
+static void *nogvl_leave_directory(void *ptr) {
+  struct nogvl_scp_args *args = ptr;
+  args->rc = ssh_scp_leave_directory(args->scp);
+  return NULL;
+}
+
+/* @overload leave_directory
+ *  Leave the directory entered by {#push_directory}.
+ *  @return [nil]
+ *  @since 0.5.0
+ *  @see http://api.libssh.org/stable/group__libssh__scp.html
+ *    ssh_scp_leave_directory
+ */
+static VALUE m_leave_directory(VALUE self) {
+  ScpHolder *holder;
+  struct nogvl_scp_args args;
+
+  TypedData_Get_Struct(self, ScpHolder, &scp_type, holder);
+  args.scp = holder->scp;
+  libssh_ruby_nogvl(nogvl_leave_directory, &args);
   RAISE_IF_ERROR(args.rc);
   return Qnil;
 }
@@ -188,26 +272,627 @@ static void *nogvl_write(void *ptr) {
   return NULL;
 }
 
-/* @overload write(data)
+/* Prepare the +digest:+ option of a streaming call. */
+static void attach_digest(DigestState *digest, VALUE opts) {
+  const ID table[] = {id_digest};
+  VALUE obj;
+
+  rb_get_kwargs(opts, table, 0, 1, &obj);
+  libssh_ruby_digest_attach(digest, obj);
+}
+
+/* @overload write(data, digest: nil)
  *  Write into a remote scp file.
  *  @param [String] data The data to write.
+ *  @param [Digest::Base, nil] digest Updated with +data+, to hash a file
+ *    written in pieces. Since 0.5.0.
  *  @return [nil]
  *  @see http://api.libssh.org/stable/group__libssh__scp.html ssh_scp_write
  */
-static VALUE m_write(VALUE self, VALUE data) {
+static VALUE m_write(int argc, VALUE *argv, VALUE self) {
   ScpHolder *holder;
   struct nogvl_write_args args;
+  VALUE data, opts;
+  DigestState digest;
 
   TypedData_Get_Struct(self, ScpHolder, &scp_type, holder);
+  rb_scan_args(argc, argv, "10:", &data, &opts);
   Check_Type(data, T_STRING);
+  attach_digest(&digest, opts);
   args.scp = holder->scp;
   args.buffer = RSTRING_PTR(data);
   args.len = RSTRING_LEN(data);
-  rb_thread_call_without_gvl(nogvl_write, &args, RUBY_UBF_IO, NULL);
+  libssh_ruby_nogvl(nogvl_write, &args);
   RAISE_IF_ERROR(args.rc);
+  /* Only the data written is hashed. */
+  libssh_ruby_digest_update(&digest, RSTRING_PTR(data), RSTRING_LEN(data));
+  RB_GC_GUARD(data);
   return Qnil;
 }
 
+#define DEFAULT_CHUNK_SIZE (1024 * 1024)
+
+/* State of file transfers done without GVL. */
+struct scp_transfer {
+  ssh_scp scp;
+  char *buf;
+  size_t chunk;
+  /* Files and bytes transferred */
+  unsigned long files;
+  uint64_t bytes;
+  /* errno of a local file operation, or -1 if a file is truncated */
+  int err;
+  /* The local path of +err+ */
+  char path[PATH_MAX];
+  DigestState digest;
+  volatile int interrupted;
+  int rc;
+};
+
+static void transfer_init(struct scp_transfer *t, ScpHolder *holder,
+                          VALUE chunk) {
+  t->scp = holder->scp;
+  t->buf = NULL;
+  if (chunk == Qundef || NIL_P(chunk)) {
+    t->chunk = DEFAULT_CHUNK_SIZE;
+  } else {
+    t->chunk = NUM2SIZET(chunk);
+    if (t->chunk == 0) {
+      rb_raise(rb_eArgError, "chunk must be positive");
+    }
+  }
+  t->files = 0;
+  t->bytes = 0;
+  t->err = 0;
+  t->path[0] = '\0';
+  libssh_ruby_digest_init(&t->digest, Qnil);
+  t->interrupted = 0;
+  t->rc = SSH_OK;
+}
+
+static void transfer_fail(struct scp_transfer *t, int err, const char *path) {
+  t->err = err;
+  snprintf(t->path, sizeof(t->path), "%s", path);
+}
+
+/* Send +size+ bytes of +fd+ after ssh_scp_push_file64. */
+static int transfer_send(struct scp_transfer *t, int fd, uint64_t size,
+                         const char *path) {
+  uint64_t sent = 0;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  while (sent < size) {
+    size_t len = t->chunk;
+    ssize_t n;
+
+    if (t->interrupted) {
+      return -1;
+    }
+    if (len > size - sent) {
+      len = size - sent;
+    }
+    n = pread(fd, t->buf, len, (off_t)sent);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      transfer_fail(t, n < 0 ? errno : -1, path);
+      return -1;
+    }
+    libssh_ruby_digest_update(&t->digest, t->buf, n);
+    t->rc = ssh_scp_write(t->scp, t->buf, n);
+    if (t->rc != SSH_OK) {
+      return -1;
+    }
+    sent += n;
+    t->bytes += n;
+  }
+  t->files++;
+  return 0;
+}
+
+/* Receive +size+ bytes into +fd+ after ssh_scp_accept_request. */
+static int transfer_receive(struct scp_transfer *t, int fd, uint64_t size,
+                            const char *path) {
+  uint64_t received = 0;
+
+  while (received < size) {
+    size_t len = t->chunk, off = 0;
+    int n;
+
+    if (t->interrupted) {
+      return -1;
+    }
+    if (len > size - received) {
+      len = size - received;
+    }
+    n = ssh_scp_read(t->scp, t->buf, len);
+    if (n == SSH_ERROR) {
+      t->rc = SSH_ERROR;
+      return -1;
+    }
+    libssh_ruby_digest_update(&t->digest, t->buf, n);
+    while (off < (size_t)n) {
+      ssize_t w = write(fd, t->buf + off, n - off);
+
+      if (w < 0 && errno == EINTR) {
+        continue;
+      } else if (w < 0) {
+        transfer_fail(t, errno, path);
+        return -1;
+      }
+      off += w;
+    }
+    received += n;
+    t->bytes += n;
+  }
+  t->files++;
+  return 0;
+}
+
+static void preallocate(int fd, uint64_t size) {
+#ifdef HAVE_POSIX_FALLOCATE
+  if (size > 0) {
+    /* Only a hint. Filesystems without the support just fail. */
+    posix_fallocate(fd, 0, (off_t)size);
+  }
+#endif
+}
+
+static void transfer_ubf(void *ptr) {
+  struct scp_transfer *t = ptr;
+  t->interrupted = 1;
+}
+
+struct transfer_call_args {
+  struct scp_transfer *t;
+  void *(*func)(void *);
+  void *data;
+  /* Closed after the call unless -1 */
+  int fd;
+};
+
+static VALUE transfer_call_body(VALUE ptr) {
+  struct transfer_call_args *args = (struct transfer_call_args *)ptr;
+
+  args->t->buf = ALLOC_N(char, args->t->chunk);
+  rb_thread_call_without_gvl(args->func, args->data, transfer_ubf, args->t);
+  return Qnil;
+}
+
+static VALUE transfer_call_ensure(VALUE ptr) {
+  struct transfer_call_args *args = (struct transfer_call_args *)ptr;
+
+  ruby_xfree(args->t->buf);
+  args->t->buf = NULL;
+  if (args->fd != -1) {
+    close(args->fd);
+  }
+  return Qnil;
+}
+
+/*
+ * Call +func+ with +data+ without GVL, which can be interrupted through
+ * +t+, and raise if the transfer has failed.
+ */
+static void transfer_call(ScpHolder *holder, struct scp_transfer *t,
+                          void *(*func)(void *), void *data, int fd) {
+  struct transfer_call_args args;
+
+  args.t = t;
+  args.func = func;
+  args.data = data;
+  args.fd = fd;
+  rb_ensure(transfer_call_body, (VALUE)&args, transfer_call_ensure,
+            (VALUE)&args);
+
+  if (t->err > 0) {
+    rb_syserr_fail(t->err, t->path);
+  } else if (t->err < 0) {
+    rb_raise(rb_eIOError, "%s was truncated during the transfer", t->path);
+  }
+  RAISE_IF_ERROR(t->rc);
+  rb_thread_check_ints();
+}
+
+struct nogvl_upload_file_args {
+  struct scp_transfer *t;
+  int fd;
+  const char *path;
+  const char *filename;
+  uint64_t size;
+  int mode;
+};
+
+static void *nogvl_upload_file(void *ptr) {
+  struct nogvl_upload_file_args *args = ptr;
+  struct scp_transfer *t = args->t;
+
+  t->rc = ssh_scp_push_file64(t->scp, args->filename, args->size, args->mode);
+  if (t->rc == SSH_OK) {
+    transfer_send(t, args->fd, args->size, args->path);
+  }
+  return NULL;
+}
+
+/* @overload upload_file(local_path, remote_name, mode: nil, chunk: nil, digest: nil)
+ *  Send a local file to a scp in sink mode. The file is read with pread(2)
+ *  and written without GVL, so no Ruby String is allocated for the data.
+ *  @param [String] local_path The path of the local file.
+ *  @param [String] remote_name The name of the file being sent.
+ *  @param [Fixnum, nil] mode The UNIX permissions for the new file. The
+ *    permissions of the local file are used by default.
+ *  @param [Integer, nil] chunk The size of the buffer to read the file.
+ *    +nil+ means 1 MiB.
+ *  @param [Symbol, Class, nil] digest An algorithm such as +:sha256+ or
+ *    +:md5+, or a Digest::Base subclass, to hash the data sent.
+ *  @return [Integer, Array] The number of bytes sent, or
+ *    +[bytes, hexdigest]+ with +digest+.
+ *  @since 0.5.0
+ *  @see http://api.libssh.org/stable/group__libssh__scp.html
+ *    ssh_scp_push_file64
+ */
+static VALUE m_upload_file(int argc, VALUE *argv, VALUE self) {
+  ScpHolder *holder;
+  VALUE local_path, remote_name, opts;
+  const ID table[] = {id_mode, id_chunk, id_digest};
+  VALUE kwvals[sizeof(table) / sizeof(*table)];
+  struct scp_transfer t;
+  struct nogvl_upload_file_args args;
+  struct stat st;
+
+  TypedData_Get_Struct(self, ScpHolder, &scp_type, holder);
+  rb_scan_args(argc, argv, "20:", &local_path, &remote_name, &opts);
+  rb_get_kwargs(opts, table, 0, 3, kwvals);
+  FilePathValue(local_path);
+  remote_name = rb_str_new_frozen(remote_name);
+  transfer_init(&t, holder, kwvals[1]);
+  libssh_ruby_digest_init(&t.digest, kwvals[2]);
+  args.t = &t;
+  args.path = StringValueCStr(local_path);
+  args.filename = StringValueCStr(remote_name);
+  /* Convert it before the open, which would leak the fd if this raised. */
+  args.mode =
+      kwvals[0] == Qundef || NIL_P(kwvals[0]) ? -1 : NUM2INT(kwvals[0]);
+
+  args.fd = rb_cloexec_open(args.path, O_RDONLY, 0);
+  if (args.fd < 0) {
+    rb_sys_fail_str(local_path);
+  }
+  if (fstat(args.fd, &st) != 0) {
+    int err = errno;
+    close(args.fd);
+    rb_syserr_fail_str(err, local_path);
+  }
+  args.size = st.st_size;
+  if (args.mode == -1) {
+    args.mode = st.st_mode & 07777;
+  }
+  if (t.chunk > args.size && args.size > 0) {
+    t.chunk = args.size;
+  }
+  transfer_call(holder, &t, nogvl_upload_file, &args, args.fd);
+  RB_GC_GUARD(local_path);
+  RB_GC_GUARD(remote_name);
+  if (t.digest.meta != NULL) {
+    return rb_assoc_new(ULL2NUM(t.bytes), libssh_ruby_digest_finish(&t.digest));
+  }
+  return ULL2NUM(t.bytes);
+}
+
+struct upload_entry {
+  const char *name;
+  /* Either +path+ or +data+ is used. */
+  const char *path;
+  const char *data;
+  size_t len;
+  /* -1 means the permissions of +path+ */
+  int mode;
+};
+
+struct nogvl_upload_batch_args {
+  struct scp_transfer *t;
+  struct upload_entry *entries;
+  long nentries;
+};
+
+static int upload_entry_data(struct scp_transfer *t,
+                             const struct upload_entry *entry) {
+  size_t sent = 0;
+
+  t->rc = ssh_scp_push_file64(t->scp, entry->name, entry->len, entry->mode);
+  if (t->rc != SSH_OK) {
+    return -1;
+  }
+  while (sent < entry->len) {
+    size_t len = entry->len - sent;
+
+    if (t->interrupted) {
+      return -1;
+    }
+    if (len > t->chunk) {
+      len = t->chunk;
+    }
+    t->rc = ssh_scp_write(t->scp, entry->data + sent, len);
+    if (t->rc != SSH_OK) {
+      return -1;
+    }
+    sent += len;
+    t->bytes += len;
+  }
+  t->files++;
+  return 0;
+}
+
+static int upload_entry_path(struct scp_transfer *t,
+                             const struct upload_entry *entry) {
+  struct stat st;
+  int fd, rc = -1;
+
+  fd = open(entry->path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    transfer_fail(t, errno, entry->path);
+    return -1;
+  }
+  if (fstat(fd, &st) != 0) {
+    transfer_fail(t, errno, entry->path);
+  } else {
+    t->rc = ssh_scp_push_file64(t->scp, entry->name, st.st_size,
+                                entry->mode == -1 ? (int)(st.st_mode & 07777)
+                                                  : entry->mode);
+    if (t->rc == SSH_OK) {
+      rc = transfer_send(t, fd, st.st_size, entry->path);
+    }
+  }
+  close(fd);
+  return rc;
+}
+
+static void *nogvl_upload_batch(void *ptr) {
+  struct nogvl_upload_batch_args *args = ptr;
+  long i;
+
+  for (i = 0; i < args->nentries && !args->t->interrupted; i++) {
+    const struct upload_entry *entry = &args->entries[i];
+    int rc;
+
+    if (entry->path != NULL) {
+      rc = upload_entry_path(args->t, entry);
+    } else {
+      rc = upload_entry_data(args->t, entry);
+    }
+    if (rc != 0) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+/* @overload upload_batch(entries, chunk: nil)
+ *  Send many files to a scp in sink mode in one call without GVL.
+ *  @param [Array<Hash>] entries The files to send. Each Hash has +:name+,
+ *    the name of the file being sent, and either +:path+, the path of a
+ *    local file, or +:data+, a String of the contents. +:mode+ is the UNIX
+ *    permissions, which defaults to the permissions of +:path+ or +0644+.
+ *  @param [Integer, nil] chunk The size of the buffer to read files.
+ *    +nil+ means 1 MiB.
+ *  @return [Array] +[files, bytes]+. The number of the files and bytes sent.
+ *  @since 0.5.0
+ *  @see http://api.libssh.org/stable/group__libssh__scp.html
+ *    ssh_scp_push_file64
+ */
+static VALUE m_upload_batch(int argc, VALUE *argv, VALUE self) {
+  ScpHolder *holder;
+  VALUE entries, opts, keep, tmp, ret;
+  const ID table[] = {id_chunk};
+  VALUE kwvals[sizeof(table) / sizeof(*table)];
+  struct scp_transfer t;
+  struct nogvl_upload_batch_args args;
+  long i;
+
+  TypedData_Get_Struct(self, ScpHolder, &scp_type, holder);
+  rb_scan_args(argc, argv, "10:", &entries, &opts);
+  rb_get_kwargs(opts, table, 0, 1, kwvals);
+  Check_Type(entries, T_ARRAY);
+  transfer_init(&t, holder, kwvals[0]);
+
+  /* Keep the strings alive and unchanged during the call. */
+  keep = rb_ary_new_capa(RARRAY_LEN(entries) * 2);
+  args.t = &t;
+  args.nentries = RARRAY_LEN(entries);
+  /* Freed by GC if an entry is invalid */
+  args.entries = ALLOCV_N(struct upload_entry, tmp, args.nentries);
+  MEMZERO(args.entries, struct upload_entry, args.nentries);
+  for (i = 0; i < args.nentries; i++) {
+    struct upload_entry *entry = &args.entries[i];
+    VALUE hash = rb_check_hash_type(RARRAY_AREF(entries, i));
+    VALUE name, path, data, mode;
+
+    if (NIL_P(hash)) {
+      rb_raise(rb_eTypeError, "entry must be a Hash");
+    }
+    name = rb_hash_aref(hash, ID2SYM(id_name));
+    path = rb_hash_aref(hash, ID2SYM(id_path));
+    data = rb_hash_aref(hash, ID2SYM(id_data));
+    mode = rb_hash_aref(hash, ID2SYM(id_mode));
+    if (NIL_P(name) || NIL_P(path) == NIL_P(data)) {
+      rb_raise(rb_eArgError, "entry needs :name and either :path or :data");
+    }
+    name = rb_str_new_frozen(StringValue(name));
+    rb_ary_push(keep, name);
+    entry->name = StringValueCStr(name);
+    if (NIL_P(path)) {
+      data = rb_str_new_frozen(StringValue(data));
+      rb_ary_push(keep, data);
+      entry->data = RSTRING_PTR(data);
+      entry->len = RSTRING_LEN(data);
+      entry->mode = NIL_P(mode) ? 0644 : NUM2INT(mode);
+    } else {
+      FilePathValue(path);
+      path = rb_str_new_frozen(path);
+      rb_ary_push(keep, path);
+      entry->path = StringValueCStr(path);
+      entry->mode = NIL_P(mode) ? -1 : NUM2INT(mode);
+    }
+  }
+  transfer_call(holder, &t, nogvl_upload_batch, &args, -1);
+  ALLOCV_END(tmp);
+  RB_GC_GUARD(keep);
+
+  ret = rb_ary_new_capa(2);
+  rb_ary_push(ret, ULONG2NUM(t.files));
+  rb_ary_push(ret, ULL2NUM(t.bytes));
+  return ret;
+}
+
+struct nogvl_tree_args {
+  struct scp_transfer *t;
+  /* The current local path */
+  char path[PATH_MAX];
+  const char *name;
+  int mode;
+};
+
+static int upload_tree_file(struct scp_transfer *t, const char *path,
+                            const char *name) {
+  struct stat st;
+  int fd, rc = -1;
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    transfer_fail(t, errno, path);
+    return -1;
+  }
+  if (fstat(fd, &st) != 0) {
+    transfer_fail(t, errno, path);
+  } else {
+    t->rc = ssh_scp_push_file64(t->scp, name, st.st_size, st.st_mode & 07777);
+    if (t->rc == SSH_OK) {
+      rc = transfer_send(t, fd, st.st_size, path);
+    }
+  }
+  close(fd);
+  return rc;
+}
+
+/* Send the directory at +path+, whose length is +len+, as +name+. */
+static int upload_tree_dir(struct scp_transfer *t, char *path, size_t len,
+                           const char *name, int mode) {
+  DIR *dir;
+  struct dirent *ent;
+  int rc = 0;
+
+  dir = opendir(path);
+  if (dir == NULL) {
+    transfer_fail(t, errno, path);
+    return -1;
+  }
+  t->rc = ssh_scp_push_directory(t->scp, name, mode);
+  if (t->rc != SSH_OK) {
+    closedir(dir);
+    return -1;
+  }
+  while (rc == 0 && (ent = readdir(dir)) != NULL) {
+    size_t nlen = strlen(ent->d_name);
+    struct stat st;
+
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+      continue;
+    }
+    if (t->interrupted) {
+      rc = -1;
+      break;
+    }
+    if (len + 1 + nlen >= PATH_MAX) {
+      transfer_fail(t, ENAMETOOLONG, path);
+      rc = -1;
+      break;
+    }
+    path[len] = '/';
+    memcpy(path + len + 1, ent->d_name, nlen + 1);
+    /* Symbolic links are followed like scp -r. */
+    if (stat(path, &st) != 0) {
+      transfer_fail(t, errno, path);
+      rc = -1;
+    } else if (S_ISDIR(st.st_mode)) {
+      rc = upload_tree_dir(t, path, len + 1 + nlen, ent->d_name,
+                           st.st_mode & 07777);
+    } else if (S_ISREG(st.st_mode)) {
+      rc = upload_tree_file(t, path, ent->d_name);
+    }
+    path[len] = '\0';
+  }
+  closedir(dir);
+  if (rc == 0) {
+    t->rc = ssh_scp_leave_directory(t->scp);
+    if (t->rc != SSH_OK) {
+      rc = -1;
+    }
+  }
+  return rc;
+}
+
+static void *nogvl_upload_tree(void *ptr) {
+  struct nogvl_tree_args *args = ptr;
+
+  upload_tree_dir(args->t, args->path, strlen(args->path), args->name,
+                  args->mode);
+  return NULL;
+}
+
+/* @overload upload_tree(local_dir, remote_name = File.basename(local_dir), chunk: nil)
+ *  Send a local directory with all of its contents in one scp stream
+ *  without GVL. Only regular files and directories are sent, and symbolic
+ *  links are followed. The scp must be created with +recursive: true+.
+ *  @param [String] local_dir The path of the local directory.
+ *  @param [String] remote_name The name of the directory being sent.
+ *  @param [Integer, nil] chunk The size of the buffer to read files.
+ *    +nil+ means 1 MiB.
+ *  @return [Array] +[files, bytes]+. The number of the files and bytes sent.
+ *  @since 0.5.0
+ *  @see http://api.libssh.org/stable/group__libssh__scp.html
+ *    ssh_scp_push_directory
+ */
+static VALUE m_upload_tree(int argc, VALUE *argv, VALUE self) {
+  ScpHolder *holder;
+  VALUE local_dir, remote_name, opts, ret;
+  const ID table[] = {id_chunk};
+  VALUE kwvals[sizeof(table) / sizeof(*table)];
+  struct scp_transfer t;
+  struct nogvl_tree_args args;
+  struct stat st;
+
+  TypedData_Get_Struct(self, ScpHolder, &scp_type, holder);
+  rb_scan_args(argc, argv, "11:", &local_dir, &remote_name, &opts);
+  rb_get_kwargs(opts, table, 0, 1, kwvals);
+  FilePathValue(local_dir);
+  if (NIL_P(remote_name)) {
+    remote_name = rb_funcall(rb_cFile, id_basename, 1, local_dir);
+  }
+  remote_name = rb_str_new_frozen(remote_name);
+  transfer_init(&t, holder, kwvals[0]);
+  args.t = &t;
+  args.name = StringValueCStr(remote_name);
+  if ((size_t)RSTRING_LEN(local_dir) >= sizeof(args.path)) {
+    rb_syserr_fail_str(ENAMETOOLONG, local_dir);
+  }
+  strcpy(args.path, StringValueCStr(local_dir));
+  if (stat(args.path, &st) != 0) {
+    rb_sys_fail_str(local_dir);
+  } else if (!S_ISDIR(st.st_mode)) {
+    rb_syserr_fail_str(ENOTDIR, local_dir);
+  }
+  args.mode = st.st_mode & 07777;
+  transfer_call(holder, &t, nogvl_upload_tree, &args, -1);
+  RB_GC_GUARD(remote_name);
+
+  ret = rb_ary_new_capa(2);
+  rb_ary_push(ret, ULONG2NUM(t.files));
+  rb_ary_push(ret, ULL2NUM(t.bytes));
+  return ret;
+}
+
 static void *nogvl_pull_request(void *ptr) {
   struct nogvl_scp_args *args = ptr;
   args->rc = ssh_scp_pull_request(args->scp);
@@ -231,7 +916,7 @@ static VALUE m_pull_request(VALUE self) {
 
   TypedData_Get_Struct(self, ScpHolder, &scp_type, holder);
   args.scp = holder->scp;
-  rb_thread_call_without_gvl(nogvl_pull_request, &args, RUBY_UBF_IO, NULL);
+  libssh_ruby_nogvl(nogvl_pull_request, &args);
   RAISE_IF_ERROR(args.rc);
   return INT2FIX(args.rc);
 }
@@ -306,7 +991,7 @@ static VALUE m_accept_request(VALUE self) {
 
   TypedData_Get_Struct(self, ScpHolder, &scp_type, holder);
   args.scp = holder->scp;
-  rb_thread_call_without_gvl(nogvl_accept_request, &args, RUBY_UBF_IO, NULL);
+  libssh_ruby_nogvl(nogvl_accept_request, &args);
   RAISE_IF_ERROR(args.rc);
   return Qnil;
 }
@@ -337,7 +1022,7 @@ static VALUE m_deny_request(VALUE self, VALUE reason) {
   TypedData_Get_Struct(self, ScpHolder, &scp_type, holder);
   args.scp = holder->scp;
   args.reason = StringValueCStr(reason);
-  rb_thread_call_without_gvl(nogvl_deny_request, &args, RUBY_UBF_IO, NULL);
+  libssh_ruby_nogvl(nogvl_deny_request, &args);
   RAISE_IF_ERROR(args.rc);
   return Qnil;
 }
@@ -355,31 +1040,733 @@ static void *nogvl_read(void *ptr) {
   return NULL;
 }
 
-/* @overload read(size)
+/* @overload read(size, binary: false, digest: nil)
  *  Read from a remote scp file.
  *  @param [Fixnum] The size of the buffer.
+ *  @param [Boolean] binary Return an ASCII-8BIT String instead of UTF-8.
+ *  @param [Digest::Base, nil] digest Updated with the data read, to hash a
+ *    file read in pieces. Since 0.5.0.
  *  @return [String]
  *  @see http://api.libssh.org/stable/group__libssh__scp.html ssh_scp_read
  */
-static VALUE m_read(VALUE self, VALUE size) {
+static VALUE m_read(int argc, VALUE *argv, VALUE self) {
   ScpHolder *holder;
+  VALUE size, opts;
+  const ID table[] = {id_binary, id_digest};
+  VALUE kwvals[sizeof(table) / sizeof(*table)];
   struct nogvl_read_args args;
+  DigestState digest;
+  VALUE ret;
 
   TypedData_Get_Struct(self, ScpHolder, &scp_type, holder);
+  rb_scan_args(argc, argv, "10:", &size, &opts);
   Check_Type(size, T_FIXNUM);
+  rb_get_kwargs(opts, table, 0, 2, kwvals);
+  libssh_ruby_digest_attach(&digest, kwvals[1]);
   args.scp = holder->scp;
   args.size = FIX2INT(size);
-  args.buffer = ALLOC_N(char, args.size);
-  rb_thread_call_without_gvl(nogvl_read, &args, RUBY_UBF_IO, NULL);
-  if (args.rc == SSH_ERROR) {
-    ruby_xfree(args.buffer);
-    RAISE_IF_ERROR(args.rc);
-    return Qnil; /* unreachable */
+  if (kwvals[0] != Qundef && RTEST(kwvals[0])) {
+    ret = rb_str_new(NULL, args.size);
   } else {
-    VALUE ret = rb_utf8_str_new(args.buffer, args.rc);
-    ruby_xfree(args.buffer);
-    return ret;
+    ret = rb_utf8_str_new(NULL, args.size);
   }
+  args.buffer = RSTRING_PTR(ret);
+  libssh_ruby_nogvl(nogvl_read, &args);
+  RAISE_IF_ERROR(args.rc);
+
+  rb_str_resize(ret, args.rc);
+  libssh_ruby_digest_update(&digest, RSTRING_PTR(ret), RSTRING_LEN(ret));
+  return ret;
+}
+
+/* @overload read_into(buffer, maxlen, digest: nil)
+ *  Read from a remote scp file into the given buffer. The buffer is resized
+ *  to the bytes read and its encoding is set to ASCII-8BIT. Its capacity is
+ *  kept, so the same buffer can be reused without allocation.
+ *  @param [String] buffer The buffer to be filled.
+ *  @param [Fixnum] maxlen The maximum count of bytes to be read.
+ *  @param [Digest::Base, nil] digest Updated with the data read.
+ *  @return [Fixnum] The number of bytes read.
+ *  @since 0.5.0
+ *  @see http://api.libssh.org/stable/group__libssh__scp.html ssh_scp_read
+ */
+static VALUE m_read_into(int argc, VALUE *argv, VALUE self) {
+  ScpHolder *holder;
+  struct nogvl_read_args args;
+  VALUE buffer, maxlen, opts;
+  DigestState digest;
+
+  TypedData_Get_Struct(self, ScpHolder, &scp_type, holder);
+  rb_scan_args(argc, argv, "20:", &buffer, &maxlen, &opts);
+  Check_Type(maxlen, T_FIXNUM);
+  attach_digest(&digest, opts);
+  args.scp = holder->scp;
+  args.size = FIX2INT(maxlen);
+  args.buffer = libssh_ruby_buffer_prepare(buffer, args.size);
+  libssh_ruby_buffer_nogvl(buffer, nogvl_read, &args);
+  libssh_ruby_buffer_finish(buffer, args.rc);
+  RAISE_IF_ERROR(args.rc);
+  libssh_ruby_digest_update(&digest, RSTRING_PTR(buffer), args.rc);
+
+  return INT2FIX(args.rc);
+}
+
+struct nogvl_download_file_args {
+  struct scp_transfer *t;
+  int fd;
+  int preallocate;
+  const char *path;
+  uint64_t size;
+};
+
+static void *nogvl_download_file(void *ptr) {
+  struct nogvl_download_file_args *args = ptr;
+  struct scp_transfer *t = args->t;
+
+  t->rc = ssh_scp_accept_request(t->scp);
+  if (t->rc != SSH_OK) {
+    return NULL;
+  }
+  if (args->preallocate) {
+    preallocate(args->fd, args->size);
+  }
+  transfer_receive(t, args->fd, args->size, args->path);
+  return NULL;
+}
+
+/* @overload download_file(local, mode: nil, chunk: nil, digest: nil)
+ *  Accept the pending NEWFILE request and write the file to +local+. The
+ *  file is received into one reusable buffer without GVL, so the memory
+ *  use doesn't depend on the file size.
+ *  @param [String, IO, Integer] local The path of the local file, or an IO
+ *    or a file descriptor to write into. A path is created or truncated,
+ *    and its space is preallocated.
+ *  @param [Fixnum, nil] mode The UNIX permissions for a new file. The
+ *    permissions sent by the remote party are used by default.
+ *  @param [Integer, nil] chunk The size of the buffer. +nil+ means 1 MiB.
+ *  @param [Symbol, Class, nil] digest An algorithm such as +:sha256+ or
+ *    +:md5+, or a Digest::Base subclass, to hash the data received.
+ *  @return [Array] +[size, elapsed]+. The number of bytes received and the
+ *    elapsed time in seconds. The hex digest is appended with +digest+.
+ *  @since 0.5.0
+ *  @see #pull_request
+ *  @see http://api.libssh.org/stable/group__libssh__scp.html ssh_scp_read
+ */
+static VALUE m_download_file(int argc, VALUE *argv, VALUE self) {
+  ScpHolder *holder;
+  VALUE local, opts, ret;
+  const ID table[] = {id_mode, id_chunk, id_digest};
+  VALUE kwvals[sizeof(table) / sizeof(*table)];
+  struct scp_transfer t;
+  struct nogvl_download_file_args args;
+  struct timespec started, finished;
+  int close_fd;
+
+  TypedData_Get_Struct(self, ScpHolder, &scp_type, holder);
+  rb_scan_args(argc, argv, "10:", &local, &opts);
+  rb_get_kwargs(opts, table, 0, 3, kwvals);
+  transfer_init(&t, holder, kwvals[1]);
+  libssh_ruby_digest_init(&t.digest, kwvals[2]);
+  args.t = &t;
+  args.size = ssh_scp_request_get_size64(holder->scp);
+  if (t.chunk > args.size && args.size > 0) {
+    t.chunk = args.size;
+  }
+
+  if (RB_TYPE_P(local, T_STRING) || rb_respond_to(local, id_to_path)) {
+    int mode;
+
+    if (kwvals[0] == Qundef || NIL_P(kwvals[0])) {
+      mode = ssh_scp_request_get_permissions(holder->scp);
+      RAISE_IF_ERROR(mode);
+    } else {
+      mode = NUM2INT(kwvals[0]);
+    }
+    FilePathValue(local);
+    args.path = StringValueCStr(local);
+    args.fd = rb_cloexec_open(args.path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if (args.fd < 0) {
+      struct nogvl_deny_request_args deny_args;
+      const int err = errno;
+
+      /* Deny the request so that the remote party doesn't wait for it. */
+      deny_args.scp = holder->scp;
+      deny_args.reason = strerror(err);
+      libssh_ruby_nogvl(nogvl_deny_request, &deny_args);
+      rb_syserr_fail_str(err, local);
+    }
+    close_fd = 1;
+    args.preallocate = 1;
+  } else {
+    args.path = "write";
+    args.fd = libssh_ruby_fd(local);
+    close_fd = 0;
+    args.preallocate = 0;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  transfer_call(holder, &t, nogvl_download_file, &args,
+                close_fd ? args.fd : -1);
+  clock_gettime(CLOCK_MONOTONIC, &finished);
+  RB_GC_GUARD(local);
+
+  ret = rb_ary_new_capa(3);
+  rb_ary_push(ret, ULL2NUM(t.bytes));
+  rb_ary_push(ret, rb_float_new((finished.tv_sec - started.tv_sec) +
+                                (finished.tv_nsec - started.tv_nsec) / 1e9));
+  if (t.digest.meta != NULL) {
+    rb_ary_push(ret, libssh_ruby_digest_finish(&t.digest));
+  }
+  return ret;
+}
+
+/* Whether +name+ sent by the remote party is safe to create locally. */
+static int valid_name(const char *name) {
+  return name != NULL && name[0] != '\0' && strchr(name, '/') == NULL &&
+         strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+static void *nogvl_download_tree(void *ptr) {
+  struct nogvl_tree_args *args = ptr;
+  struct scp_transfer *t = args->t;
+  char *path = args->path;
+  size_t len = strlen(path);
+  int depth = 0;
+
+  while (!t->interrupted) {
+    int request = ssh_scp_pull_request(t->scp), mode, fd, rc;
+    const char *name;
+    size_t nlen;
+
+    switch (request) {
+      case SSH_SCP_REQUEST_NEWDIR:
+      case SSH_SCP_REQUEST_NEWFILE:
+        name = ssh_scp_request_get_filename(t->scp);
+        mode = ssh_scp_request_get_permissions(t->scp) & 07777;
+        if (!valid_name(name)) {
+          ssh_scp_deny_request(t->scp, "Invalid name");
+          transfer_fail(t, EINVAL, name == NULL ? "" : name);
+          return NULL;
+        }
+        nlen = strlen(name);
+        if (len + 1 + nlen >= sizeof(args->path)) {
+          ssh_scp_deny_request(t->scp, "Name too long");
+          transfer_fail(t, ENAMETOOLONG, path);
+          return NULL;
+        }
+        path[len] = '/';
+        memcpy(path + len + 1, name, nlen + 1);
+        if (request == SSH_SCP_REQUEST_NEWDIR) {
+          /* The owner must be able to write the contents. */
+          if (mkdir(path, mode | S_IRWXU) != 0 && errno != EEXIST) {
+            int err = errno;
+
+            ssh_scp_deny_request(t->scp, strerror(err));
+            transfer_fail(t, err, path);
+            return NULL;
+          }
+          t->rc = ssh_scp_accept_request(t->scp);
+          if (t->rc != SSH_OK) {
+            return NULL;
+          }
+          len += 1 + nlen;
+          depth++;
+          break;
+        }
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+        if (fd < 0) {
+          int err = errno;
+
+          ssh_scp_deny_request(t->scp, strerror(err));
+          transfer_fail(t, err, path);
+          return NULL;
+        }
+        t->rc = ssh_scp_accept_request(t->scp);
+        if (t->rc != SSH_OK) {
+          close(fd);
+          return NULL;
+        }
+        preallocate(fd, ssh_scp_request_get_size64(t->scp));
+        rc = transfer_receive(t, fd, ssh_scp_request_get_size64(t->scp),
+                              path);
+        close(fd);
+        if (rc != 0) {
+          return NULL;
+        }
+        path[len] = '\0';
+        break;
+      case SSH_SCP_REQUEST_ENDDIR:
+        if (depth > 0) {
+          len = strrchr(path, '/') - path;
+          path[len] = '\0';
+          depth--;
+        }
+        break;
+      case SSH_SCP_REQUEST_WARNING:
+        break;
+      case SSH_SCP_REQUEST_EOF:
+        return NULL;
+      default:
+        t->rc = SSH_ERROR;
+        return NULL;
+    }
+  }
+  return NULL;
+}
+
+/* @overload download_tree(local_dir, chunk: nil)
+ *  Receive all of the files and directories sent by the remote party into
+ *  +local_dir+ in one scp stream without GVL. The scp must be created with
+ *  +recursive: true+.
+ *  @param [String] local_dir The local directory to write into. It's
+ *    created unless it exists.
+ *  @param [Integer, nil] chunk The size of the buffer. +nil+ means 1 MiB.
+ *  @return [Array] +[files, bytes]+. The number of the files and bytes
+ *    received.
+ *  @since 0.5.0
+ *  @see http://api.libssh.org/stable/group__libssh__scp.html
+ *    ssh_scp_pull_request
+ */
+static VALUE m_download_tree(int argc, VALUE *argv, VALUE self) {
+  ScpHolder *holder;
+  VALUE local_dir, opts, ret;
+  const ID table[] = {id_chunk};
+  VALUE kwvals[sizeof(table) / sizeof(*table)];
+  struct scp_transfer t;
+  struct nogvl_tree_args args;
+
+  TypedData_Get_Struct(self, ScpHolder, &scp_type, holder);
+  rb_scan_args(argc, argv, "10:", &local_dir, &opts);
+  rb_get_kwargs(opts, table, 0, 1, kwvals);
+  FilePathValue(local_dir);
+  transfer_init(&t, holder, kwvals[0]);
+  args.t = &t;
+  if ((size_t)RSTRING_LEN(local_dir) >= sizeof(args.path)) {
+    rb_syserr_fail_str(ENAMETOOLONG, local_dir);
+  }
+  strcpy(args.path, StringValueCStr(local_dir));
+  if (mkdir(args.path, 0777) != 0 && errno != EEXIST) {
+    rb_sys_fail_str(local_dir);
+  }
+  transfer_call(holder, &t, nogvl_download_tree, &args, -1);
+
+  ret = rb_ary_new_capa(2);
+  rb_ary_push(ret, ULONG2NUM(t.files));
+  rb_ary_push(ret, ULL2NUM(t.bytes));
+  return ret;
+}
+
+#define BROADCAST_CHUNK_SIZE (256 * 1024)
+/* How long an interrupted broadcast waits for the current chunks */
+#define BROADCAST_ABORT_WAIT_MS 1000
+
+struct broadcast_job {
+  ssh_session session;
+  /* Set by the worker while sending, under the lock */
+  int running;
+  /* Bytes sent, updated atomically by the worker */
+  uint64_t sent;
+  uint64_t reported;
+  int code;
+  /* NULL on success */
+  char *message;
+};
+
+struct broadcast_args {
+  struct broadcast_job *jobs;
+  long njobs;
+  long next;
+  int concurrency;
+  const char *dir;
+  const char *name;
+  int fd;
+  uint64_t size;
+  int mode;
+  pthread_t *threads;
+  int nthreads;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  long finished;
+  int exited;
+  /* Set by the unblocking function to return to Ruby */
+  int wakeup;
+  /* Set to stop the workers */
+  volatile int interrupted;
+};
+
+static void broadcast_job_fail(struct broadcast_job *job, int code,
+                               const char *message) {
+  job->code = code;
+  job->message = strdup(message);
+}
+
+static void broadcast_job_run(struct broadcast_args *args,
+                              struct broadcast_job *job, char *buf) {
+  ssh_scp scp;
+  uint64_t sent = 0;
+
+  scp = ssh_scp_new(job->session, SSH_SCP_WRITE, args->dir);
+  if (scp == NULL) {
+    broadcast_job_fail(job, ssh_get_error_code(job->session),
+                       ssh_get_error(job->session));
+    return;
+  }
+  if (ssh_scp_init(scp) != SSH_OK ||
+      ssh_scp_push_file64(scp, args->name, args->size, args->mode) !=
+          SSH_OK) {
+    goto error;
+  }
+  while (sent < args->size) {
+    size_t len = BROADCAST_CHUNK_SIZE;
+    ssize_t n;
+
+    if (args->interrupted) {
+      broadcast_job_fail(job, SSH_FATAL, "Interrupted");
+      goto done;
+    }
+    if (len > args->size - sent) {
+      len = args->size - sent;
+    }
+    /* Each worker reads with its own buffer. Unlike a mapping, a file
+     * truncated meanwhile fails only the transfer. */
+    n = pread(args->fd, buf, len, (off_t)sent);
+    if (n <= 0) {
+      broadcast_job_fail(job, SSH_FATAL,
+                         n == 0 ? "File truncated" : strerror(errno));
+      goto done;
+    }
+    len = n;
+    if (ssh_scp_write(scp, buf, len) != SSH_OK) {
+      goto error;
+    }
+    sent += len;
+    __atomic_store_n(&job->sent, sent, __ATOMIC_RELAXED);
+  }
+  if (ssh_scp_close(scp) != SSH_OK) {
+    goto error;
+  }
+  goto done;
+
+error:
+  broadcast_job_fail(job, ssh_get_error_code(job->session),
+                     ssh_get_error(job->session));
+done:
+  ssh_scp_free(scp);
+}
+
+static void *broadcast_worker(void *ptr) {
+  struct broadcast_args *args = ptr;
+  char *buf = malloc(BROADCAST_CHUNK_SIZE);
+
+  for (;;) {
+    long i = __atomic_fetch_add(&args->next, 1, __ATOMIC_RELAXED);
+    struct broadcast_job *job;
+
+    if (i >= args->njobs) {
+      break;
+    }
+    job = &args->jobs[i];
+    pthread_mutex_lock(&args->lock);
+    job->running = !args->interrupted;
+    pthread_mutex_unlock(&args->lock);
+    if (!job->running) {
+      broadcast_job_fail(job, SSH_FATAL, "Interrupted");
+    } else if (buf == NULL) {
+      broadcast_job_fail(job, SSH_FATAL, "Cannot allocate memory");
+    } else {
+      broadcast_job_run(args, job, buf);
+    }
+    pthread_mutex_lock(&args->lock);
+    job->running = 0;
+    args->finished++;
+    pthread_cond_broadcast(&args->cond);
+    pthread_mutex_unlock(&args->lock);
+  }
+  free(buf);
+  pthread_mutex_lock(&args->lock);
+  args->exited++;
+  pthread_cond_broadcast(&args->cond);
+  pthread_mutex_unlock(&args->lock);
+  return NULL;
+}
+
+/* Wait until all of the jobs finish, or for a while to report progress. */
+static void *nogvl_broadcast_wait(void *ptr) {
+  struct broadcast_args *args = ptr;
+  struct timespec deadline;
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += 200 * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  pthread_mutex_lock(&args->lock);
+  while (args->finished < args->njobs && !args->wakeup) {
+    if (pthread_cond_timedwait(&args->cond, &args->lock, &deadline) != 0) {
+      break;
+    }
+  }
+  args->wakeup = 0;
+  pthread_mutex_unlock(&args->lock);
+  return NULL;
+}
+
+static void broadcast_ubf(void *ptr) {
+  struct broadcast_args *args = ptr;
+
+  pthread_mutex_lock(&args->lock);
+  args->wakeup = 1;
+  pthread_cond_signal(&args->cond);
+  pthread_mutex_unlock(&args->lock);
+}
+
+static void broadcast_report(struct broadcast_args *args) {
+  long i;
+
+  if (!rb_block_given_p()) {
+    return;
+  }
+  for (i = 0; i < args->njobs; i++) {
+    struct broadcast_job *job = &args->jobs[i];
+    uint64_t sent = __atomic_load_n(&job->sent, __ATOMIC_RELAXED);
+
+    if (sent != job->reported) {
+      job->reported = sent;
+      rb_yield_values(2, LONG2NUM(i), ULL2NUM(sent));
+    }
+  }
+}
+
+static VALUE broadcast_body(VALUE ptr) {
+  struct broadcast_args *args = (struct broadcast_args *)ptr;
+  long finished, i;
+  VALUE ret;
+
+  do {
+    rb_thread_call_without_gvl(nogvl_broadcast_wait, args, broadcast_ubf,
+                               args);
+    pthread_mutex_lock(&args->lock);
+    finished = args->finished;
+    pthread_mutex_unlock(&args->lock);
+    broadcast_report(args);
+    rb_thread_check_ints();
+  } while (finished < args->njobs);
+
+  ret = rb_ary_new_capa(args->njobs);
+  for (i = 0; i < args->njobs; i++) {
+    struct broadcast_job *job = &args->jobs[i];
+
+    if (job->message != NULL) {
+      rb_ary_push(ret, libssh_ruby_error_new(job->code, job->message));
+    } else {
+      rb_ary_push(ret, Qnil);
+    }
+  }
+  return ret;
+}
+
+/* Wait until all of the workers exit, BROADCAST_ABORT_WAIT_MS passes, or
+ * the unblocking function is called. */
+static void *nogvl_broadcast_wait_exit(void *ptr) {
+  struct broadcast_args *args = ptr;
+  struct timespec deadline;
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += BROADCAST_ABORT_WAIT_MS / 1000;
+  deadline.tv_nsec += (BROADCAST_ABORT_WAIT_MS % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  pthread_mutex_lock(&args->lock);
+  while (args->exited < args->nthreads && !args->wakeup) {
+    if (pthread_cond_timedwait(&args->cond, &args->lock, &deadline) != 0) {
+      break;
+    }
+  }
+  args->wakeup = 0;
+  pthread_mutex_unlock(&args->lock);
+  return NULL;
+}
+
+static VALUE broadcast_ensure(VALUE ptr) {
+  struct broadcast_args *args = (struct broadcast_args *)ptr;
+  long i;
+  int exited;
+
+  /* Workers stop after the current chunk when an exception is raised. A
+   * chunk may take long on a stuck host, so the transfers still in progress
+   * after a short wait, or a second interrupt, are aborted by shutting down
+   * the sockets of their sessions. An interrupt isn't raised here, so
+   * rb_thread_call_without_gvl2 is used. */
+  pthread_mutex_lock(&args->lock);
+  args->interrupted = 1;
+  pthread_mutex_unlock(&args->lock);
+  rb_thread_call_without_gvl2(nogvl_broadcast_wait_exit, args, broadcast_ubf,
+                              args);
+  pthread_mutex_lock(&args->lock);
+  exited = args->exited;
+  if (exited < args->nthreads) {
+    for (i = 0; i < args->njobs; i++) {
+      if (args->jobs[i].running) {
+        shutdown(ssh_get_fd(args->jobs[i].session), SHUT_RDWR);
+      }
+    }
+  }
+  pthread_mutex_unlock(&args->lock);
+  /* The workers return right away now, so they are joined with GVL. */
+  for (i = 0; i < args->nthreads; i++) {
+    pthread_join(args->threads[i], NULL);
+  }
+
+  for (i = 0; i < args->njobs; i++) {
+    free(args->jobs[i].message);
+  }
+  ruby_xfree(args->threads);
+  pthread_mutex_destroy(&args->lock);
+  pthread_cond_destroy(&args->cond);
+  close(args->fd);
+  return Qnil;
+}
+
+static int compare_sessions(const void *a, const void *b) {
+  uintptr_t x = (uintptr_t) * (const ssh_session *)a;
+  uintptr_t y = (uintptr_t) * (const ssh_session *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Raise ArgumentError if a session appears twice, as its workers would
+ * use it concurrently. */
+static void check_unique_sessions(const struct broadcast_args *args) {
+  ssh_session *sorted;
+  VALUE sorted_v;
+  long i;
+
+  if (args->njobs < 2) {
+    return;
+  }
+  sorted = ALLOCV_N(ssh_session, sorted_v, args->njobs);
+  for (i = 0; i < args->njobs; i++) {
+    sorted[i] = args->jobs[i].session;
+  }
+  qsort(sorted, args->njobs, sizeof(*sorted), compare_sessions);
+  for (i = 1; i < args->njobs; i++) {
+    if (sorted[i] == sorted[i - 1]) {
+      rb_raise(rb_eArgError, "sessions must be unique");
+    }
+  }
+  ALLOCV_END(sorted_v);
+}
+
+/* @overload broadcast(sessions, local_path, remote_path, concurrency: 16, mode: nil)
+ *  Send one local file to many hosts concurrently. The file is opened once
+ *  and sent by a pool of native threads, each of which serves one session at
+ *  a time, so a slow host doesn't stall the others. If interrupted, the
+ *  sessions still sending a chunk a second later are disconnected.
+ *  @param [Array<Session>] sessions Connected and authenticated sessions.
+ *    Each session can appear only once.
+ *  @param [String] local_path The path of the local file. If it is
+ *    truncated during the transfer, the remaining sends fail.
+ *  @param [String] remote_path The path of the remote file.
+ *  @param [Integer] concurrency The number of the threads.
+ *  @param [Fixnum, nil] mode The UNIX permissions for the new file. The
+ *    permissions of the local file are used by default.
+ *  @yieldparam [Integer] index The index of the session which has made
+ *    progress.
+ *  @yieldparam [Integer] sent The number of bytes sent to the session.
+ *  @return [Array<LibSSH::Error, nil>] The error of each session. +nil+
+ *    means the file has been sent.
+ *  @since 0.5.0
+ *  @see Session.connect_all
+ */
+static VALUE s_broadcast(int argc, VALUE *argv, RB_UNUSED_VAR(VALUE klass)) {
+  VALUE sessions, local_path, remote_path, opts, dir, name, ret, jobs_v;
+  const ID table[] = {id_concurrency, id_mode};
+  VALUE kwvals[sizeof(table) / sizeof(*table)];
+  struct broadcast_args args;
+  struct stat st;
+  long i;
+
+  rb_scan_args(argc, argv, "30:", &sessions, &local_path, &remote_path, &opts);
+  rb_get_kwargs(opts, table, 0, 2, kwvals);
+  Check_Type(sessions, T_ARRAY);
+  sessions = rb_ary_dup(sessions);
+  FilePathValue(local_path);
+  StringValue(remote_path);
+  dir = rb_str_new_frozen(rb_funcall(rb_cFile, id_dirname, 1, remote_path));
+  name = rb_str_new_frozen(rb_funcall(rb_cFile, id_basename, 1, remote_path));
+  args.dir = StringValueCStr(dir);
+  args.name = StringValueCStr(name);
+  args.concurrency =
+      kwvals[0] == Qundef || NIL_P(kwvals[0]) ? 16 : NUM2INT(kwvals[0]);
+  if (args.concurrency < 1) {
+    rb_raise(rb_eArgError, "concurrency must be positive");
+  }
+
+  args.njobs = RARRAY_LEN(sessions);
+  args.jobs = ALLOCV_N(struct broadcast_job, jobs_v, args.njobs);
+  memset(args.jobs, 0, args.njobs * sizeof(*args.jobs));
+  for (i = 0; i < args.njobs; i++) {
+    args.jobs[i].session =
+        libssh_ruby_session_holder(RARRAY_AREF(sessions, i))->session;
+  }
+  check_unique_sessions(&args);
+  /* Convert it before the open, which would leak the fd if this raised. */
+  args.mode =
+      kwvals[1] == Qundef || NIL_P(kwvals[1]) ? -1 : NUM2INT(kwvals[1]);
+
+  args.fd = rb_cloexec_open(StringValueCStr(local_path), O_RDONLY, 0);
+  if (args.fd < 0) {
+    rb_sys_fail_str(local_path);
+  }
+  if (fstat(args.fd, &st) != 0) {
+    int err = errno;
+    close(args.fd);
+    rb_syserr_fail_str(err, local_path);
+  }
+  args.size = st.st_size;
+  if (args.mode == -1) {
+    args.mode = st.st_mode & 07777;
+  }
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(args.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  if (args.concurrency > args.njobs) {
+    args.concurrency = args.njobs == 0 ? 1 : (int)args.njobs;
+  }
+  args.next = 0;
+  args.finished = 0;
+  args.exited = 0;
+  args.wakeup = 0;
+  args.interrupted = 0;
+  pthread_mutex_init(&args.lock, NULL);
+  pthread_cond_init(&args.cond, NULL);
+  args.threads = ALLOC_N(pthread_t, args.concurrency);
+  for (args.nthreads = 0; args.nthreads < args.concurrency; args.nthreads++) {
+    if (pthread_create(&args.threads[args.nthreads], NULL, broadcast_worker,
+                       &args) != 0) {
+      break;
+    }
+  }
+  if (args.nthreads == 0) {
+    /* No worker, so fail every job. */
+    args.next = args.njobs;
+    args.finished = args.njobs;
+    for (i = 0; i < args.njobs; i++) {
+      broadcast_job_fail(&args.jobs[i], SSH_FATAL, "Cannot create a thread");
+    }
+  }
+
+  ret = rb_ensure(broadcast_body, (VALUE)&args, broadcast_ensure,
+                  (VALUE)&args);
+  ALLOCV_END(jobs_v);
+  RB_GC_GUARD(sessions);
+  RB_GC_GUARD(dir);
+  RB_GC_GUARD(name);
+  return ret;
 }
 
 /* @overload request_warning
@@ -404,6 +1791,11 @@ static VALUE m_request_warning(VALUE self) {
 /* Document-class: LibSSH::Scp
  * Wrapper for ssh_scp struct in libssh.
  *
+ * The scp functions of libssh work only in blocking mode, so unlike
+ * {Channel}, Scp methods take no +deadline:+ and a remote party which stops
+ * responding blocks them. The bulk transfers such as {#upload_file} check
+ * for interrupts between the packets. Use {Session#timeout=} to bound them.
+ *
  * @since 0.2.0
  * @see http://api.libssh.org/stable/group__libssh__scp.html
  */
@@ -411,6 +1803,8 @@ static VALUE m_request_warning(VALUE self) {
 void Init_libssh_scp(void) {
   rb_cLibSSHScp = rb_define_class_under(rb_mLibSSH, "Scp", rb_cObject);
   rb_define_alloc_func(rb_cLibSSHScp, scp_alloc);
+  rb_define_singleton_method(rb_cLibSSHScp, "broadcast",
+                             RUBY_METHOD_FUNC(s_broadcast), -1);
 
   /* @see #pull_request */
   rb_define_const(rb_cLibSSHScp, "REQUEST_NEWFILE",
@@ -428,12 +1822,22 @@ void Init_libssh_scp(void) {
   rb_define_const(rb_cLibSSHScp, "REQUEST_EOF", INT2FIX(SSH_SCP_REQUEST_EOF));
 
   rb_define_method(rb_cLibSSHScp, "initialize", RUBY_METHOD_FUNC(m_initialize),
-                   3);
+                   -1);
   rb_define_method(rb_cLibSSHScp, "init", RUBY_METHOD_FUNC(m_init), 0);
   rb_define_method(rb_cLibSSHScp, "close", RUBY_METHOD_FUNC(m_close), 0);
   rb_define_method(rb_cLibSSHScp, "push_file", RUBY_METHOD_FUNC(m_push_file),
                    3);
-  rb_define_method(rb_cLibSSHScp, "write", RUBY_METHOD_FUNC(m_write), 1);
+  rb_define_method(rb_cLibSSHScp, "write", RUBY_METHOD_FUNC(m_write), -1);
+  rb_define_method(rb_cLibSSHScp, "upload_file",
+                   RUBY_METHOD_FUNC(m_upload_file), -1);
+  rb_define_method(rb_cLibSSHScp, "upload_batch",
+                   RUBY_METHOD_FUNC(m_upload_batch), -1);
+  rb_define_method(rb_cLibSSHScp, "push_directory",
+                   RUBY_METHOD_FUNC(m_push_directory), 2);
+  rb_define_method(rb_cLibSSHScp, "leave_directory",
+                   RUBY_METHOD_FUNC(m_leave_directory), 0);
+  rb_define_method(rb_cLibSSHScp, "upload_tree",
+                   RUBY_METHOD_FUNC(m_upload_tree), -1);
 
   rb_define_method(rb_cLibSSHScp, "pull_request",
                    RUBY_METHOD_FUNC(m_pull_request), 0);
@@ -447,10 +1851,28 @@ void Init_libssh_scp(void) {
                    RUBY_METHOD_FUNC(m_accept_request), 0);
   rb_define_method(rb_cLibSSHScp, "deny_request",
                    RUBY_METHOD_FUNC(m_deny_request), 1);
-  rb_define_method(rb_cLibSSHScp, "read", RUBY_METHOD_FUNC(m_read), 1);
+  rb_define_method(rb_cLibSSHScp, "read", RUBY_METHOD_FUNC(m_read), -1);
+  rb_define_method(rb_cLibSSHScp, "read_into", RUBY_METHOD_FUNC(m_read_into),
+                   -1);
+  rb_define_method(rb_cLibSSHScp, "download_file",
+                   RUBY_METHOD_FUNC(m_download_file), -1);
+  rb_define_method(rb_cLibSSHScp, "download_tree",
+                   RUBY_METHOD_FUNC(m_download_tree), -1);
   rb_define_method(rb_cLibSSHScp, "request_warning",
                    RUBY_METHOD_FUNC(m_request_warning), 0);
 
   id_read = rb_intern("read");
   id_write = rb_intern("write");
+  id_binary = rb_intern("binary");
+  id_mode = rb_intern("mode");
+  id_chunk = rb_intern("chunk");
+  id_to_path = rb_intern("to_path");
+  id_recursive = rb_intern("recursive");
+  id_basename = rb_intern("basename");
+  id_name = rb_intern("name");
+  id_path = rb_intern("path");
+  id_data = rb_intern("data");
+  id_concurrency = rb_intern("concurrency");
+  id_dirname = rb_intern("dirname");
+  id_digest = rb_intern("digest");
 }
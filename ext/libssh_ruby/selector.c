@@ -0,0 +1,665 @@
+#include "libssh_ruby.h"
+#include <libssh/callbacks.h>
+#include <poll.h>
+#include <pthread.h>
+#include <ruby/thread.h>
+#include <time.h>
+
+#ifdef HAVE_SSH_ADD_CHANNEL_CALLBACKS
+
+#define EVENT_READ 1
+#define EVENT_STDERR 2
+#define EVENT_WRITE 4
+#define EVENT_CLOSED 8
+
+VALUE rb_cLibSSHSelector;
+
+static ID id_read, id_stderr, id_write, id_closed;
+
+static void selector_mark(void *);
+static void selector_free(void *);
+static size_t selector_memsize(const void *);
+
+struct SelectorHolderStruct;
+
+struct SelectorEntryStruct {
+  VALUE channel;
+  ssh_channel c_channel;
+  int interests;
+  int queued;
+  unsigned long checked;
+  struct SelectorHolderStruct *selector;
+  struct ssh_channel_callbacks_struct callbacks;
+};
+typedef struct SelectorEntryStruct SelectorEntry;
+
+struct SelectorHolderStruct {
+  SelectorEntry **entries;
+  long len, capa;
+  /* Entries which may be ready. Callbacks push entries here, so that select
+   * doesn't have to check all the registered channels. Callbacks run on
+   * any thread processing packets of the session, so +queue+, +queue_len+
+   * and SelectorEntry.queued are protected by +lock+. */
+  SelectorEntry **queue;
+  long queue_len;
+  pthread_mutex_t lock;
+  long write_interests;
+  /* Sessions of the registered channels. Each of them keeps the selector
+   * alive while it has entries, see libssh_ruby_session_add_selector. */
+  ssh_session *sessions;
+  VALUE *session_objs;
+  long *session_refs;
+  long nsessions, sessions_capa;
+  ssh_event event;
+  unsigned long generation;
+};
+typedef struct SelectorHolderStruct SelectorHolder;
+
+static const rb_data_type_t selector_type = {
+    "libssh_selector",
+    {selector_mark, selector_free, selector_memsize, {NULL, NULL}},
+    NULL,
+    NULL,
+    RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE selector_alloc(VALUE klass) {
+  SelectorHolder *holder = ALLOC(SelectorHolder);
+  holder->entries = NULL;
+  holder->len = holder->capa = 0;
+  holder->queue = NULL;
+  holder->queue_len = 0;
+  pthread_mutex_init(&holder->lock, NULL);
+  holder->write_interests = 0;
+  holder->sessions = NULL;
+  holder->session_objs = NULL;
+  holder->session_refs = NULL;
+  holder->nsessions = holder->sessions_capa = 0;
+  holder->event = NULL;
+  holder->generation = 0;
+  return TypedData_Wrap_Struct(klass, &selector_type, holder);
+}
+
+static void selector_mark(void *arg) {
+  SelectorHolder *holder = arg;
+  long i;
+
+  for (i = 0; i < holder->len; i++) {
+    rb_gc_mark(holder->entries[i]->channel);
+  }
+  for (i = 0; i < holder->nsessions; i++) {
+    rb_gc_mark(holder->session_objs[i]);
+  }
+}
+
+static void selector_free(void *arg) {
+  SelectorHolder *holder = arg;
+  long i;
+
+  /* The sessions keep the selector alive while it has entries, so any
+   * remaining entry belongs to a session free'ed in this GC, which never
+   * calls the callbacks again. */
+  for (i = 0; i < holder->len; i++) {
+    ruby_xfree(holder->entries[i]);
+  }
+  if (holder->event != NULL) {
+    ssh_event_free(holder->event);
+  }
+  ruby_xfree(holder->entries);
+  ruby_xfree(holder->queue);
+  ruby_xfree(holder->sessions);
+  ruby_xfree(holder->session_objs);
+  ruby_xfree(holder->session_refs);
+  pthread_mutex_destroy(&holder->lock);
+  ruby_xfree(holder);
+}
+
+static size_t selector_memsize(const void *arg) {
+  const SelectorHolder *holder = arg;
+  return sizeof(SelectorHolder) +
+         holder->capa * (2 * sizeof(SelectorEntry *) + sizeof(SelectorEntry));
+}
+
+static void entry_enqueue(SelectorEntry *entry) {
+  SelectorHolder *holder = entry->selector;
+
+  pthread_mutex_lock(&holder->lock);
+  if (!entry->queued) {
+    entry->queued = 1;
+    holder->queue[holder->queue_len++] = entry;
+  }
+  pthread_mutex_unlock(&holder->lock);
+}
+
+static int entry_data_callback(RB_UNUSED_VAR(ssh_session session),
+                               RB_UNUSED_VAR(ssh_channel channel),
+                               RB_UNUSED_VAR(void *data),
+                               RB_UNUSED_VAR(uint32_t len),
+                               RB_UNUSED_VAR(int is_stderr), void *userdata) {
+  entry_enqueue(userdata);
+  /* Leave the data in the channel buffer for Channel#read. */
+  return 0;
+}
+
+static void entry_state_callback(RB_UNUSED_VAR(ssh_session session),
+                                 RB_UNUSED_VAR(ssh_channel channel),
+                                 void *userdata) {
+  entry_enqueue(userdata);
+}
+
+#ifdef HAVE_STRUCT_SSH_CHANNEL_CALLBACKS_STRUCT_CHANNEL_WRITE_WONTBLOCK_FUNCTION
+static int entry_write_callback(RB_UNUSED_VAR(ssh_session session),
+                                RB_UNUSED_VAR(ssh_channel channel),
+                                RB_UNUSED_VAR(uint32_t bytes), void *userdata) {
+  entry_enqueue(userdata);
+  return 0;
+}
+#endif
+
+static SelectorEntry *find_entry(SelectorHolder *holder, VALUE channel,
+                                 long *index) {
+  long i;
+
+  for (i = 0; i < holder->len; i++) {
+    if (holder->entries[i]->channel == channel) {
+      if (index != NULL) {
+        *index = i;
+      }
+      return holder->entries[i];
+    }
+  }
+  return NULL;
+}
+
+static void add_session(SelectorHolder *holder, VALUE self,
+                        VALUE session_obj) {
+  ssh_session session = libssh_ruby_session_holder(session_obj)->session;
+  long i;
+
+  for (i = 0; i < holder->nsessions; i++) {
+    if (holder->sessions[i] == session) {
+      holder->session_refs[i]++;
+      return;
+    }
+  }
+  if (holder->nsessions == holder->sessions_capa) {
+    holder->sessions_capa =
+        holder->sessions_capa == 0 ? 4 : holder->sessions_capa * 2;
+    REALLOC_N(holder->sessions, ssh_session, holder->sessions_capa);
+    REALLOC_N(holder->session_objs, VALUE, holder->sessions_capa);
+    REALLOC_N(holder->session_refs, long, holder->sessions_capa);
+  }
+  libssh_ruby_session_add_selector(session_obj, self);
+  holder->sessions[holder->nsessions] = session;
+  holder->session_objs[holder->nsessions] = session_obj;
+  holder->session_refs[holder->nsessions] = 1;
+  holder->nsessions++;
+}
+
+static void remove_session(SelectorHolder *holder, VALUE self,
+                           ssh_session session) {
+  long i;
+
+  for (i = 0; i < holder->nsessions; i++) {
+    if (holder->sessions[i] == session) {
+      if (--holder->session_refs[i] == 0) {
+        libssh_ruby_session_remove_selector(holder->session_objs[i], self);
+        holder->nsessions--;
+        holder->sessions[i] = holder->sessions[holder->nsessions];
+        holder->session_objs[i] = holder->session_objs[holder->nsessions];
+        holder->session_refs[i] = holder->session_refs[holder->nsessions];
+      }
+      return;
+    }
+  }
+}
+
+static int parse_interests(int argc, VALUE *argv) {
+  int i, interests = 0;
+
+  if (argc == 0) {
+    return EVENT_READ;
+  }
+  for (i = 0; i < argc; i++) {
+    ID id;
+
+    Check_Type(argv[i], T_SYMBOL);
+    id = SYM2ID(argv[i]);
+    if (id == id_read) {
+      interests |= EVENT_READ;
+    } else if (id == id_stderr) {
+      interests |= EVENT_STDERR;
+    } else if (id == id_write) {
+      interests |= EVENT_WRITE;
+    } else if (id == id_closed) {
+      interests |= EVENT_CLOSED;
+    } else {
+      rb_raise(rb_eArgError, "Invalid interest: %" PRIsVALUE, argv[i]);
+    }
+  }
+  return interests;
+}
+
+static VALUE events_to_ary(int events) {
+  VALUE ary = rb_ary_new();
+
+  if (events & EVENT_READ) {
+    rb_ary_push(ary, ID2SYM(id_read));
+  }
+  if (events & EVENT_STDERR) {
+    rb_ary_push(ary, ID2SYM(id_stderr));
+  }
+  if (events & EVENT_WRITE) {
+    rb_ary_push(ary, ID2SYM(id_write));
+  }
+  if (events & EVENT_CLOSED) {
+    rb_ary_push(ary, ID2SYM(id_closed));
+  }
+  return ary;
+}
+
+/*
+ * @overload initialize
+ *  Create an empty selector.
+ *  @return [Selector]
+ */
+static VALUE m_initialize(VALUE self) {
+  SelectorHolder *holder;
+
+  TypedData_Get_Struct(self, SelectorHolder, &selector_type, holder);
+  holder->event = ssh_event_new();
+  if (holder->event == NULL) {
+    rb_raise(rb_eNoMemError, "Cannot create ssh_event");
+  }
+  return self;
+}
+
+/*
+ * @overload register(channel, *interests)
+ *  Watch a channel. Registering an already registered channel replaces its
+ *  interests.
+ *  @param [Channel] channel The channel to watch.
+ *  @param [Array<Symbol>] interests Any of +:read+, +:stderr+, +:write+ and
+ *    +:closed+. Defaults to +:read+.
+ *  @return [Selector] self
+ */
+static VALUE m_register(int argc, VALUE *argv, VALUE self) {
+  SelectorHolder *holder;
+  ChannelHolder *channel_holder;
+  SelectorEntry *entry;
+  VALUE channel;
+  int interests;
+
+  TypedData_Get_Struct(self, SelectorHolder, &selector_type, holder);
+  rb_check_arity(argc, 1, UNLIMITED_ARGUMENTS);
+  channel = argv[0];
+  channel_holder = libssh_ruby_channel_holder(channel);
+  interests = parse_interests(argc - 1, argv + 1);
+
+  entry = find_entry(holder, channel, NULL);
+  if (entry != NULL) {
+    if (entry->interests & EVENT_WRITE) {
+      holder->write_interests--;
+    }
+  } else {
+    if (holder->len == holder->capa) {
+      long capa = holder->capa == 0 ? 16 : holder->capa * 2;
+      SelectorEntry **queue;
+
+      REALLOC_N(holder->entries, SelectorEntry *, capa);
+      queue = ALLOC_N(SelectorEntry *, capa);
+      /* Callbacks may be pushing to the queue on another thread. */
+      pthread_mutex_lock(&holder->lock);
+      MEMCPY(queue, holder->queue, SelectorEntry *, holder->queue_len);
+      ruby_xfree(holder->queue);
+      holder->queue = queue;
+      holder->capa = capa;
+      pthread_mutex_unlock(&holder->lock);
+    }
+    entry = ALLOC(SelectorEntry);
+    entry->channel = channel;
+    entry->c_channel = channel_holder->channel;
+    entry->queued = 0;
+    entry->checked = 0;
+    entry->selector = holder;
+    memset(&entry->callbacks, 0, sizeof(entry->callbacks));
+    entry->callbacks.userdata = entry;
+    entry->callbacks.channel_data_function = entry_data_callback;
+    entry->callbacks.channel_eof_function = entry_state_callback;
+    entry->callbacks.channel_close_function = entry_state_callback;
+#ifdef HAVE_STRUCT_SSH_CHANNEL_CALLBACKS_STRUCT_CHANNEL_WRITE_WONTBLOCK_FUNCTION
+    entry->callbacks.channel_write_wontblock_function = entry_write_callback;
+#endif
+    ssh_callbacks_init(&entry->callbacks);
+    if (ssh_add_channel_callbacks(entry->c_channel, &entry->callbacks) !=
+        SSH_OK) {
+      ruby_xfree(entry);
+      libssh_ruby_raise(ssh_channel_get_session(channel_holder->channel));
+    }
+    holder->entries[holder->len++] = entry;
+    add_session(holder, self, channel_holder->session);
+  }
+  entry->interests = interests;
+  if (interests & EVENT_WRITE) {
+    holder->write_interests++;
+  }
+  /* Data may be buffered already. */
+  entry_enqueue(entry);
+  return self;
+}
+
+static void entry_remove(SelectorHolder *holder, VALUE self, long index) {
+  SelectorEntry *entry = holder->entries[index];
+  long i;
+
+  ssh_remove_channel_callbacks(entry->c_channel, &entry->callbacks);
+  pthread_mutex_lock(&holder->lock);
+  if (entry->queued) {
+    for (i = 0; i < holder->queue_len; i++) {
+      if (holder->queue[i] == entry) {
+        holder->queue[i] = holder->queue[--holder->queue_len];
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&holder->lock);
+  if (entry->interests & EVENT_WRITE) {
+    holder->write_interests--;
+  }
+  remove_session(holder, self, ssh_channel_get_session(entry->c_channel));
+  holder->entries[index] = holder->entries[--holder->len];
+  ruby_xfree(entry);
+}
+
+/*
+ * @overload deregister(channel)
+ *  Stop watching a channel.
+ *  @param [Channel] channel
+ *  @return [Selector] self
+ */
+static VALUE m_deregister(VALUE self, VALUE channel) {
+  SelectorHolder *holder;
+  long index;
+
+  TypedData_Get_Struct(self, SelectorHolder, &selector_type, holder);
+  if (find_entry(holder, channel, &index) != NULL) {
+    entry_remove(holder, self, index);
+  }
+  return self;
+}
+
+/*
+ * @overload close
+ *  Deregister all the channels.
+ *  @return [nil]
+ */
+static VALUE m_close(VALUE self) {
+  SelectorHolder *holder;
+
+  TypedData_Get_Struct(self, SelectorHolder, &selector_type, holder);
+  while (holder->len > 0) {
+    entry_remove(holder, self, holder->len - 1);
+  }
+  return Qnil;
+}
+
+/*
+ * @overload size
+ *  The number of registered channels.
+ *  @return [Fixnum]
+ */
+static VALUE m_size(VALUE self) {
+  SelectorHolder *holder;
+
+  TypedData_Get_Struct(self, SelectorHolder, &selector_type, holder);
+  return LONG2NUM(holder->len);
+}
+
+struct nogvl_selector_select_args {
+  SelectorHolder *holder;
+  /* Interrupts the wait of select */
+  Wakeup *wakeup;
+  struct timespec deadline;
+  int infinite;
+  SelectorEntry **ready;
+  int *events;
+  long nready;
+  ssh_session error_session;
+};
+
+static int entry_events(SelectorEntry *entry) {
+  ssh_channel channel = entry->c_channel;
+  int events = 0, closed, rc;
+
+  closed = ssh_channel_is_closed(channel);
+  if (entry->interests & EVENT_READ) {
+    /* EOF is readable as read(2) returns 0. */
+    rc = closed ? SSH_EOF : ssh_channel_poll(channel, 0);
+    if (rc > 0 || rc == SSH_EOF) {
+      events |= EVENT_READ;
+    }
+  }
+  if (entry->interests & EVENT_STDERR) {
+    rc = closed ? SSH_EOF : ssh_channel_poll(channel, 1);
+    if (rc > 0) {
+      events |= EVENT_STDERR;
+    }
+  }
+  if (entry->interests & EVENT_WRITE) {
+    if (!closed && ssh_channel_window_size(channel) > 0) {
+      events |= EVENT_WRITE;
+    }
+  }
+  if (entry->interests & EVENT_CLOSED) {
+    if (closed || ssh_channel_is_eof(channel)) {
+      events |= EVENT_CLOSED;
+    }
+  }
+  return events;
+}
+
+static void collect_ready(struct nogvl_selector_select_args *args) {
+  SelectorHolder *holder = args->holder;
+  long i, keep = 0;
+
+  holder->generation++;
+  args->nready = 0;
+  /* Checking a queued entry may process packets and queue other entries,
+   * so the lock isn't held while checking, and queue_len is read every
+   * time. Entries are only appended meanwhile, after +i+. */
+  for (i = 0;; i++) {
+    SelectorEntry *entry;
+    int events;
+
+    pthread_mutex_lock(&holder->lock);
+    if (i >= holder->queue_len) {
+      holder->queue_len = keep;
+      pthread_mutex_unlock(&holder->lock);
+      break;
+    }
+    entry = holder->queue[i];
+    pthread_mutex_unlock(&holder->lock);
+
+    events = entry_events(entry);
+    entry->checked = holder->generation;
+    pthread_mutex_lock(&holder->lock);
+    if (events != 0) {
+      /* Keep it queued while it is ready, like level-triggered poll(2). */
+      args->ready[args->nready] = entry;
+      args->events[args->nready] = events;
+      args->nready++;
+      holder->queue[keep++] = entry;
+    } else {
+      entry->queued = 0;
+    }
+    pthread_mutex_unlock(&holder->lock);
+  }
+
+#ifndef HAVE_STRUCT_SSH_CHANNEL_CALLBACKS_STRUCT_CHANNEL_WRITE_WONTBLOCK_FUNCTION
+  /* Without the callback, a window adjust doesn't queue the entry. */
+  if (holder->write_interests > 0) {
+    for (i = 0; i < holder->len; i++) {
+      SelectorEntry *entry = holder->entries[i];
+
+      if ((entry->interests & EVENT_WRITE) &&
+          entry->checked != holder->generation) {
+        if (!ssh_channel_is_closed(entry->c_channel) &&
+            ssh_channel_window_size(entry->c_channel) > 0) {
+          args->ready[args->nready] = entry;
+          args->events[args->nready] = EVENT_WRITE;
+          args->nready++;
+        }
+      }
+    }
+  }
+#endif
+}
+
+static int wakeup_callback(RB_UNUSED_VAR(socket_t fd),
+                           RB_UNUSED_VAR(int revents), void *userdata) {
+  /* Bytes left by an earlier call are ignored. */
+  libssh_ruby_wakeup_drain(userdata);
+  return 0;
+}
+
+static void *nogvl_selector_select(void *ptr) {
+  struct nogvl_selector_select_args *args = ptr;
+  SelectorHolder *holder = args->holder;
+  long i;
+
+  /* Sessions are in the event only during select, so that the event never
+   * refers to a free'ed session. */
+  for (i = 0; i < holder->nsessions; i++) {
+    ssh_event_add_session(holder->event, holder->sessions[i]);
+  }
+  ssh_event_add_fd(holder->event, args->wakeup->fd[0], POLLIN,
+                   wakeup_callback, args->wakeup);
+  for (;;) {
+    int timeout;
+
+    collect_ready(args);
+    if (args->nready > 0 || libssh_ruby_wakeup_interrupted(args->wakeup)) {
+      break;
+    }
+    timeout =
+        args->infinite ? -1 : (int)libssh_ruby_remaining_ms(&args->deadline);
+    if (timeout == 0) {
+      break;
+    }
+    if (ssh_event_dopoll(holder->event, timeout) == SSH_ERROR) {
+      for (i = 0; i < holder->nsessions; i++) {
+        if (!ssh_is_connected(holder->sessions[i]) ||
+            ssh_get_error_code(holder->sessions[i]) != 0) {
+          args->error_session = holder->sessions[i];
+          break;
+        }
+      }
+      if (args->error_session == NULL) {
+        args->error_session = holder->sessions[0];
+      }
+      break;
+    }
+  }
+  ssh_event_remove_fd(holder->event, args->wakeup->fd[0]);
+  for (i = 0; i < holder->nsessions; i++) {
+    ssh_event_remove_session(holder->event, holder->sessions[i]);
+  }
+  return NULL;
+}
+
+/*
+ * @overload select(timeout = nil)
+ *  Wait until any of the registered channels gets ready.
+ *  @param [Numeric, nil] timeout Timeout in seconds. Fractions are honored in
+ *    milliseconds. +nil+ means infinite timeout.
+ *  @return [Hash{Channel => Array<Symbol>}] Ready channels and their events.
+ *    Empty if timed out.
+ */
+static VALUE m_select(int argc, VALUE *argv, VALUE self) {
+  SelectorHolder *holder;
+  VALUE timeout, ret;
+  struct nogvl_selector_select_args args;
+  long i;
+
+  TypedData_Get_Struct(self, SelectorHolder, &selector_type, holder);
+  rb_scan_args(argc, argv, "01", &timeout);
+  args.holder = holder;
+  args.infinite = NIL_P(timeout);
+  if (!args.infinite) {
+    libssh_ruby_deadline_after(&args.deadline,
+                               (long)(NUM2DBL(timeout) * 1000));
+  }
+  args.nready = 0;
+  args.error_session = NULL;
+  if (holder->len == 0) {
+    return rb_hash_new();
+  }
+  /* Creates the pipe, which may raise, before allocating. */
+  args.wakeup = libssh_ruby_wakeup_prepare();
+  /* An entry is ready at most twice: from the queue and for write. */
+  args.ready = ALLOC_N(SelectorEntry *, holder->len * 2);
+  args.events = ALLOC_N(int, holder->len * 2);
+  for (;;) {
+    args.wakeup = libssh_ruby_wakeup_prepare();
+    rb_thread_call_without_gvl(nogvl_selector_select, &args,
+                               libssh_ruby_wakeup, args.wakeup);
+    if (args.nready > 0 || args.error_session != NULL ||
+        !libssh_ruby_wakeup_interrupted(args.wakeup)) {
+      break;
+    }
+    rb_thread_check_ints();
+  }
+
+  ret = rb_hash_new();
+  for (i = 0; i < args.nready; i++) {
+    rb_hash_aset(ret, args.ready[i]->channel, events_to_ary(args.events[i]));
+  }
+  ruby_xfree(args.ready);
+  ruby_xfree(args.events);
+  if (args.error_session != NULL) {
+    libssh_ruby_raise(args.error_session);
+  }
+  return ret;
+}
+
+/*
+ * Document-class: LibSSH::Selector
+ * Persistent set of channels to wait on. Unlike {Channel.select}, channels
+ * are registered once and only ready channels are returned.
+ *
+ * The registered channels must not be used by other threads during
+ * {#select}. Outside of it, they can be read by any thread, which queues
+ * them for the next {#select}.
+ *
+ * @since 0.5.0
+ * @see http://api.libssh.org/stable/group__libssh__callbacks.html
+ */
+
+void Init_libssh_selector(void) {
+  rb_cLibSSHSelector =
+      rb_define_class_under(rb_mLibSSH, "Selector", rb_cObject);
+  rb_define_alloc_func(rb_cLibSSHSelector, selector_alloc);
+
+  rb_define_method(rb_cLibSSHSelector, "initialize",
+                   RUBY_METHOD_FUNC(m_initialize), 0);
+  rb_define_method(rb_cLibSSHSelector, "register",
+                   RUBY_METHOD_FUNC(m_register), -1);
+  rb_define_method(rb_cLibSSHSelector, "deregister",
+                   RUBY_METHOD_FUNC(m_deregister), 1);
+  rb_define_method(rb_cLibSSHSelector, "close", RUBY_METHOD_FUNC(m_close),
+                   0);
+  rb_define_method(rb_cLibSSHSelector, "size", RUBY_METHOD_FUNC(m_size), 0);
+  rb_define_method(rb_cLibSSHSelector, "select", RUBY_METHOD_FUNC(m_select),
+                   -1);
+
+  id_read = rb_intern("read");
+  id_stderr = rb_intern("stderr");
+  id_write = rb_intern("write");
+  id_closed = rb_intern("closed");
+}
+
+#else
+
+void Init_libssh_selector(void) {}
+
+#endif
@@ -1,5 +1,16 @@
 #include "libssh_ruby.h"
+#include <ruby/io.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <ruby/thread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+#include <ruby/fiber/scheduler.h>
+#endif
 
 #define RAISE_IF_ERROR(rc) \
   if ((rc) == SSH_ERROR) libssh_ruby_raise(holder->session)
@@ -9,6 +20,7 @@ VALUE rb_cLibSSHSession;
 static ID id_none, id_warn, id_info, id_debug, id_trace;
 static ID id_password, id_publickey, id_hostbased, id_interactive,
     id_gssapi_mic;
+static ID id_for_fd, id_autoclose_set, id_fileno;
 
 static void session_mark(void *);
 static void session_free(void *);
@@ -31,10 +43,23 @@ SessionHolder *libssh_ruby_session_holder(VALUE session) {
 static VALUE session_alloc(VALUE klass) {
   SessionHolder *holder = ALLOC(SessionHolder);
   holder->session = NULL;
+  holder->io = Qnil;
+  holder->channels = Qnil;
+  holder->selectors = Qnil;
+  holder->pending = 0;
+  holder->channel_window = 0;
+  holder->nonblocking_calls = 0;
+  holder->saved_blocking = 1;
+  holder->timeout = holder->timeout_usec = 0;
   return TypedData_Wrap_Struct(klass, &session_type, holder);
 }
 
-static void session_mark(RB_UNUSED_VAR(void *arg)) {}
+static void session_mark(void *arg) {
+  SessionHolder *holder = arg;
+  rb_gc_mark(holder->io);
+  rb_gc_mark(holder->channels);
+  rb_gc_mark(holder->selectors);
+}
 
 static void session_free(void *arg) {
   SessionHolder *holder = arg;
@@ -196,7 +221,9 @@ static VALUE set_long_option(VALUE self, enum ssh_options_e type, VALUE i) {
  *  @see http://api.libssh.org/stable/group__libssh__session.html ssh_options_set(SSH_OPTIONS_TIMEOUT)
  */
 static VALUE m_set_timeout(VALUE self, VALUE sec) {
-  return set_long_option(self, SSH_OPTIONS_TIMEOUT, sec);
+  VALUE ret = set_long_option(self, SSH_OPTIONS_TIMEOUT, sec);
+  libssh_ruby_session_holder(self)->timeout = NUM2LONG(sec);
+  return ret;
 }
 
 /*
@@ -208,7 +235,9 @@ static VALUE m_set_timeout(VALUE self, VALUE sec) {
  *  @see http://api.libssh.org/stable/group__libssh__session.html ssh_options_set(SSH_OPTIONS_TIMEOUT_USEC)
  */
 static VALUE m_set_timeout_usec(VALUE self, VALUE usec) {
-  return set_long_option(self, SSH_OPTIONS_TIMEOUT_USEC, usec);
+  VALUE ret = set_long_option(self, SSH_OPTIONS_TIMEOUT_USEC, usec);
+  libssh_ruby_session_holder(self)->timeout_usec = NUM2LONG(usec);
+  return ret;
 }
 
 /*
@@ -430,6 +459,202 @@ static VALUE m_add_identity(VALUE self, VALUE path) {
   return Qnil;
 }
 
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+/* IO object for the session socket. It doesn't own the fd. */
+static VALUE session_io(VALUE session, SessionHolder *holder) {
+  int fd = ssh_get_fd(holder->session);
+
+  if (fd < 0) {
+    rb_raise(rb_eArgError, "Session isn't connected");
+  }
+  if (NIL_P(holder->io) ||
+      FIX2INT(rb_funcall(holder->io, id_fileno, 0)) != fd) {
+    VALUE io = rb_funcall(rb_cIO, id_for_fd, 1, INT2FIX(fd));
+    rb_funcall(io, id_autoclose_set, 1, Qfalse);
+    RB_OBJ_WRITE(session, &holder->io, io);
+  }
+  return holder->io;
+}
+#endif
+
+/*
+ * Put the session in libssh nonblocking mode until the matching
+ * libssh_ruby_session_nonblocking_end. The calls are counted, so that a
+ * thread finishing its call doesn't put the session back in blocking mode
+ * while another thread is waiting without GVL. Call both with GVL.
+ */
+void libssh_ruby_session_nonblocking_begin(SessionHolder *holder) {
+  if (holder->nonblocking_calls++ == 0) {
+    holder->saved_blocking = ssh_is_blocking(holder->session);
+    ssh_set_blocking(holder->session, 0);
+  }
+}
+
+void libssh_ruby_session_nonblocking_end(SessionHolder *holder) {
+  if (--holder->nonblocking_calls == 0) {
+    ssh_set_blocking(holder->session, holder->saved_blocking);
+  }
+}
+
+struct session_call_args {
+  VALUE session;
+  SessionHolder *holder;
+  void *(*func)(void *);
+  void *data;
+  const int *rc;
+  int again;
+  int has_timeout;
+  struct timespec timeout;
+  const struct timespec *deadline;
+  Wakeup *wakeup;
+};
+
+/* Milliseconds to wait for the socket. -1 means infinite and 0 means
+ * expired. */
+static int session_call_wait_ms(const struct session_call_args *args) {
+  long ms = -1, d;
+
+  if (args->has_timeout) {
+    ms = libssh_ruby_remaining_ms(&args->timeout);
+  }
+  if (args->deadline != NULL) {
+    d = libssh_ruby_remaining_ms(args->deadline);
+    if (ms < 0 || d < ms) {
+      ms = d;
+    }
+  }
+  if (ms > INT_MAX) {
+    ms = INT_MAX;
+  }
+  return (int)ms;
+}
+
+static void *nogvl_session_call(void *ptr) {
+  struct session_call_args *args = ptr;
+  struct pollfd pfds[2];
+
+  for (;;) {
+    int ms;
+
+    /* The session is nonblocking, so func returns immediately. */
+    args->func(args->data);
+    if (*args->rc != args->again ||
+        libssh_ruby_wakeup_interrupted(args->wakeup)) {
+      break;
+    }
+    ms = session_call_wait_ms(args);
+    if (ms == 0) {
+      break;
+    }
+    pfds[0].fd = ssh_get_fd(args->holder->session);
+    pfds[0].events = POLLIN;
+    if (ssh_get_poll_flags(args->holder->session) & SSH_WRITE_PENDING) {
+      pfds[0].events |= POLLOUT;
+    }
+    pfds[1].fd = args->wakeup->fd[0];
+    pfds[1].events = POLLIN;
+    pfds[0].revents = pfds[1].revents = 0;
+    if (poll(pfds, 2, ms) > 0 && pfds[1].revents != 0 &&
+        libssh_ruby_wakeup_drain(args->wakeup)) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+static VALUE session_call_body(VALUE ptr) {
+  struct session_call_args *args = (struct session_call_args *)ptr;
+
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+  if (libssh_ruby_nonblocking_p()) {
+    for (;;) {
+      VALUE timeout = Qnil;
+      int events = RB_WAITFD_IN, ms;
+
+      args->func(args->data);
+      if (*args->rc != args->again) {
+        break;
+      }
+      ms = session_call_wait_ms(args);
+      if (ms == 0) {
+        break;
+      } else if (ms > 0) {
+        timeout = rb_float_new(ms / 1000.0);
+      }
+      if (ssh_get_poll_flags(args->holder->session) & SSH_WRITE_PENDING) {
+        events |= RB_WAITFD_OUT;
+      }
+      rb_io_wait(session_io(args->session, args->holder), INT2FIX(events),
+                 timeout);
+    }
+  } else
+#endif
+  {
+    for (;;) {
+      args->wakeup = libssh_ruby_wakeup_prepare();
+      rb_thread_call_without_gvl(nogvl_session_call, args, libssh_ruby_wakeup,
+                                 args->wakeup);
+      if (*args->rc != args->again ||
+          !libssh_ruby_wakeup_interrupted(args->wakeup)) {
+        break;
+      }
+      /* Raises if the thread is killed or an exception is pending. */
+      rb_thread_check_ints();
+    }
+  }
+  if (*args->rc == args->again && args->deadline != NULL &&
+      libssh_ruby_remaining_ms(args->deadline) == 0) {
+    libssh_ruby_raise_timeout();
+  }
+  return Qnil;
+}
+
+static VALUE session_call_ensure(VALUE ptr) {
+  struct session_call_args *args = (struct session_call_args *)ptr;
+  libssh_ruby_session_nonblocking_end(args->holder);
+  return Qnil;
+}
+
+/* Whether session calls in the current fiber go through the scheduler. */
+int libssh_ruby_nonblocking_p(void) {
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+  return !NIL_P(rb_fiber_scheduler_current());
+#else
+  return 0;
+#endif
+}
+
+/*
+ * Call +func+ for +session+ in libssh nonblocking mode. +func+ is called
+ * again after waiting for the socket while +*rc+ is +again+, so it must be
+ * retryable. The wait goes through the fiber scheduler when the current
+ * fiber has one. Otherwise it is done without GVL, and Thread#raise, kill
+ * and signals wake it up through the wakeup pipe of the current thread.
+ *
+ * +timeout+ is in milliseconds and -1 means infinite. +*rc+ is left +again+
+ * when it expires. LibSSH::TimeoutError is raised when +deadline+ passes.
+ */
+void libssh_ruby_session_call(VALUE session, void *(*func)(void *), void *data,
+                              const int *rc, int again, int timeout,
+                              const struct timespec *deadline) {
+  struct session_call_args args;
+
+  args.session = session;
+  args.holder = libssh_ruby_session_holder(session);
+  args.func = func;
+  args.data = data;
+  args.rc = rc;
+  args.again = again;
+  args.has_timeout = timeout >= 0;
+  if (args.has_timeout) {
+    libssh_ruby_deadline_after(&args.timeout, timeout);
+  }
+  args.deadline = deadline;
+  libssh_ruby_session_nonblocking_begin(args.holder);
+  rb_ensure(session_call_body, (VALUE)&args, session_call_ensure,
+            (VALUE)&args);
+}
+
 struct nogvl_session_args {
   ssh_session session;
   int rc;
@@ -442,18 +667,34 @@ static void *nogvl_connect(void *ptr) {
 }
 
 /*
- * @overload connect
+ * @overload connect(deadline: nil)
  *  Connect to the SSH server.
+ *  @param [Numeric, Time, nil] deadline Raise {TimeoutError} unless the
+ *    connection is established by then. A Numeric is seconds from now. The
+ *    default is {#timeout=} and {#timeout_usec=}, or 10 seconds.
  *  @return [nil]
+ *  @raise [TimeoutError]
  *  @see http://api.libssh.org/stable/group__libssh__session.html ssh_connect
  */
-static VALUE m_connect(VALUE self) {
+static VALUE m_connect(int argc, VALUE *argv, VALUE self) {
   SessionHolder *holder;
   struct nogvl_session_args args;
+  VALUE opts;
+  struct timespec ts;
+  const struct timespec *deadline;
 
   TypedData_Get_Struct(self, SessionHolder, &session_type, holder);
+  rb_scan_args(argc, argv, "0:", &opts);
+  deadline = libssh_ruby_deadline_option(opts, &ts);
+  if (deadline == NULL) {
+    /* Same as the blocking ssh_connect. */
+    long ms = holder->timeout * 1000 + holder->timeout_usec / 1000;
+    libssh_ruby_deadline_after(&ts, ms > 0 ? ms : 10000);
+    deadline = &ts;
+  }
   args.session = holder->session;
-  rb_thread_call_without_gvl(nogvl_connect, &args, RUBY_UBF_IO, NULL);
+  libssh_ruby_session_call(self, nogvl_connect, &args, &args.rc, SSH_AGAIN,
+                           -1, deadline);
   RAISE_IF_ERROR(args.rc);
 
   return Qnil;
@@ -462,13 +703,14 @@ static VALUE m_connect(VALUE self) {
 static void *nogvl_disconnect(void *ptr) {
   struct nogvl_session_args *args = ptr;
   ssh_disconnect(args->session);
-  args->rc = 0;
+  args->rc = SSH_OK;
   return NULL;
 }
 
 /*
  * @overload disconnect
- *  Disconnect from a session.
+ *  Disconnect from a session. The disconnect message is sent in nonblocking
+ *  mode, so this never waits for the server. No deadline is needed.
  *  @return [nil]
  *  @since 0.3.0
  *  @see http://api.libssh.org/stable/group__libssh__session.html ssh_disconnect
@@ -479,7 +721,8 @@ static VALUE m_disconnect(VALUE self) {
 
   TypedData_Get_Struct(self, SessionHolder, &session_type, holder);
   args.session = holder->session;
-  rb_thread_call_without_gvl(nogvl_disconnect, &args, RUBY_UBF_IO, NULL);
+  libssh_ruby_session_call(self, nogvl_disconnect, &args, &args.rc, SSH_AGAIN,
+                           -1, NULL);
 
   return Qnil;
 }
@@ -513,6 +756,41 @@ static VALUE m_fd(VALUE self) {
   return INT2FIX(ssh_get_fd(holder->session));
 }
 
+static void *nogvl_userauth_none(void *ptr) {
+  struct nogvl_session_args *args = ptr;
+  args->rc = ssh_userauth_none(args->session, NULL);
+  return NULL;
+}
+
+/*
+ * @overload channel_window_size=(size)
+ *  Set the default {Channel#window_size=} of channels created afterwards.
+ *  @param [Integer, nil] size The window size in bytes. +nil+ means the
+ *    libssh default.
+ *  @return [Integer, nil]
+ *  @since 0.5.0
+ */
+static VALUE m_set_channel_window_size(VALUE self, VALUE size) {
+  SessionHolder *holder;
+
+  TypedData_Get_Struct(self, SessionHolder, &session_type, holder);
+  holder->channel_window = NIL_P(size) ? 0 : NUM2UINT(size);
+  return size;
+}
+
+/*
+ * @overload channel_window_size
+ *  Get the default window size of channels.
+ *  @return [Integer, nil] +nil+ if the libssh default is used.
+ *  @since 0.5.0
+ */
+static VALUE m_channel_window_size(VALUE self) {
+  SessionHolder *holder;
+
+  TypedData_Get_Struct(self, SessionHolder, &session_type, holder);
+  return holder->channel_window == 0 ? Qnil : UINT2NUM(holder->channel_window);
+}
+
 /*
  * @overload userauth_none
  *  Try to authenticate through then "none" method.
@@ -521,12 +799,26 @@ static VALUE m_fd(VALUE self) {
  */
 static VALUE m_userauth_none(VALUE self) {
   SessionHolder *holder;
-  int rc;
+  struct nogvl_session_args args;
 
   TypedData_Get_Struct(self, SessionHolder, &session_type, holder);
-  rc = ssh_userauth_none(holder->session, NULL);
-  RAISE_IF_ERROR(rc);
-  return INT2FIX(rc);
+  args.session = holder->session;
+  libssh_ruby_session_call(self, nogvl_userauth_none, &args, &args.rc,
+                           SSH_AUTH_AGAIN, -1, NULL);
+  RAISE_IF_ERROR(args.rc);
+  return INT2FIX(args.rc);
+}
+
+struct nogvl_userauth_password_args {
+  ssh_session session;
+  const char *password;
+  int rc;
+};
+
+static void *nogvl_userauth_password(void *ptr) {
+  struct nogvl_userauth_password_args *args = ptr;
+  args->rc = ssh_userauth_password(args->session, NULL, args->password);
+  return NULL;
 }
 
 /*
@@ -538,12 +830,18 @@ static VALUE m_userauth_none(VALUE self) {
  */
 static VALUE m_userauth_password(VALUE self, VALUE password) {
   SessionHolder *holder;
-  int rc;
+  struct nogvl_userauth_password_args args;
 
   TypedData_Get_Struct(self, SessionHolder, &session_type, holder);
-  rc = ssh_userauth_password(holder->session, NULL, StringValueCStr(password));
-  RAISE_IF_ERROR(rc);
-  return INT2FIX(rc);
+  args.session = holder->session;
+  StringValueCStr(password);
+  password = rb_str_new_frozen(password);
+  args.password = RSTRING_PTR(password);
+  libssh_ruby_session_call(self, nogvl_userauth_password, &args, &args.rc,
+                           SSH_AUTH_AGAIN, -1, NULL);
+  RB_GC_GUARD(password);
+  RAISE_IF_ERROR(args.rc);
+  return INT2FIX(args.rc);
 }
 
 /*
@@ -601,8 +899,8 @@ static VALUE m_userauth_publickey_auto(VALUE self) {
 
   TypedData_Get_Struct(self, SessionHolder, &session_type, holder);
   args.session = holder->session;
-  rb_thread_call_without_gvl(nogvl_userauth_publickey_auto, &args, RUBY_UBF_IO,
-                             NULL);
+  libssh_ruby_session_call(self, nogvl_userauth_publickey_auto, &args,
+                           &args.rc, SSH_AUTH_AGAIN, -1, NULL);
   RAISE_IF_ERROR(args.rc);
   return INT2FIX(args.rc);
 }
@@ -639,6 +937,687 @@ static VALUE m_write_knownhost(VALUE self) {
   return Qnil;
 }
 
+/* Register +channel+ to be dispatched by Session#process_events. */
+void libssh_ruby_session_add_channel(VALUE session, VALUE channel) {
+  SessionHolder *holder = libssh_ruby_session_holder(session);
+
+  if (NIL_P(holder->channels)) {
+    RB_OBJ_WRITE(session, &holder->channels, rb_ary_new());
+  }
+  rb_ary_push(holder->channels, channel);
+}
+
+/* Keep +selector+ alive while it has callbacks on the channels of
+ * +session+. */
+void libssh_ruby_session_add_selector(VALUE session, VALUE selector) {
+  SessionHolder *holder = libssh_ruby_session_holder(session);
+
+  if (NIL_P(holder->selectors)) {
+    RB_OBJ_WRITE(session, &holder->selectors, rb_ary_new());
+  }
+  rb_ary_push(holder->selectors, selector);
+}
+
+void libssh_ruby_session_remove_selector(VALUE session, VALUE selector) {
+  SessionHolder *holder = libssh_ruby_session_holder(session);
+
+  if (!NIL_P(holder->selectors)) {
+    rb_ary_delete(holder->selectors, selector);
+  }
+}
+
+#ifdef HAVE_SSH_ADD_CHANNEL_CALLBACKS
+static int dispatch_channels(SessionHolder *holder) {
+  VALUE channels;
+  long i;
+  int count = 0;
+
+  if (NIL_P(holder->channels)) {
+    return 0;
+  }
+  __atomic_store_n(&holder->pending, 0, __ATOMIC_RELAXED);
+  /* Blocks may register other channels. */
+  channels = rb_ary_dup(holder->channels);
+  for (i = 0; i < RARRAY_LEN(channels); i++) {
+    VALUE channel = RARRAY_AREF(channels, i);
+    int finished;
+
+    count += libssh_ruby_channel_dispatch(channel, &finished);
+    if (finished) {
+      rb_ary_delete(holder->channels, channel);
+    }
+  }
+  return count;
+}
+
+struct nogvl_process_events_args {
+  ssh_session session;
+  int *pending;
+  int infinite;
+  struct timespec deadline;
+  volatile int interrupted;
+  int rc;
+};
+
+static void *nogvl_process_events(void *ptr) {
+  struct nogvl_process_events_args *args = ptr;
+  ssh_event event;
+  int polled = 0;
+
+  args->rc = SSH_OK;
+  event = ssh_event_new();
+  if (event == NULL) {
+    args->rc = SSH_ERROR;
+    return NULL;
+  }
+  ssh_event_add_session(event, args->session);
+  while (__atomic_load_n(args->pending, __ATOMIC_ACQUIRE) == 0 &&
+         !args->interrupted) {
+    int timeout = 100;
+
+    if (!args->infinite) {
+      long ms = libssh_ruby_remaining_ms(&args->deadline);
+
+      if (ms == 0) {
+        /* Poll at least once even if timeout is 0. */
+        if (polled) {
+          break;
+        }
+        ms = 0;
+      }
+      /* Wake up periodically to notice interrupts. */
+      if (ms < timeout) {
+        timeout = (int)ms;
+      }
+    }
+    if (ssh_event_dopoll(event, timeout) == SSH_ERROR) {
+      args->rc = SSH_ERROR;
+      break;
+    }
+    polled = 1;
+  }
+  ssh_event_remove_session(event, args->session);
+  ssh_event_free(event);
+  return NULL;
+}
+
+static void process_events_ubf(void *ptr) {
+  struct nogvl_process_events_args *args = ptr;
+  args->interrupted = 1;
+}
+
+/*
+ * @overload process_events(timeout = nil)
+ *  Process incoming packets and call the blocks registered by
+ *  {Channel#on_data}, {Channel#on_eof}, {Channel#on_exit_status} and
+ *  {Channel#on_close}.
+ *  @param [Numeric, nil] timeout Timeout in seconds to wait for events.
+ *    +nil+ means waiting until any block is called.
+ *  @return [Fixnum] The number of the blocks called.
+ *  @since 0.5.0
+ *  @see http://api.libssh.org/stable/group__libssh__poll.html
+ *    ssh_event_dopoll
+ */
+static VALUE m_process_events(int argc, VALUE *argv, VALUE self) {
+  SessionHolder *holder;
+  VALUE timeout;
+  struct nogvl_process_events_args args;
+  int count;
+
+  TypedData_Get_Struct(self, SessionHolder, &session_type, holder);
+  rb_scan_args(argc, argv, "01", &timeout);
+  args.session = holder->session;
+  args.pending = &holder->pending;
+  args.infinite = NIL_P(timeout);
+  if (!args.infinite) {
+    libssh_ruby_deadline_after(&args.deadline,
+                               (long)(NUM2DBL(timeout) * 1000));
+  }
+
+  count = dispatch_channels(holder);
+  while (count == 0 && !NIL_P(holder->channels) &&
+         RARRAY_LEN(holder->channels) > 0) {
+    args.interrupted = 0;
+    rb_thread_call_without_gvl(nogvl_process_events, &args,
+                               process_events_ubf, &args);
+    RAISE_IF_ERROR(args.rc);
+    count = dispatch_channels(holder);
+    if (args.interrupted) {
+      rb_thread_check_ints();
+    } else if (!args.infinite) {
+      break;
+    }
+  }
+  return INT2FIX(count);
+}
+#endif
+
+struct connect_job {
+  ssh_session session;
+  /* Time limit of the job, from Session#timeout= and #timeout_usec= */
+  long timeout_ms;
+  int code;
+  /* NULL on success */
+  char *message;
+};
+
+struct nogvl_connect_all_args {
+  struct connect_job *jobs;
+  long njobs;
+  long next;
+  int concurrency;
+  int verify;
+  /* Written by the unblocking function and never read, so that it wakes up
+   * all of the workers. */
+  int stop[2];
+  volatile int interrupted;
+};
+
+static void connect_job_fail(struct connect_job *job, int code,
+                             const char *message) {
+  job->code = code;
+  job->message = strdup(message);
+  ssh_disconnect(job->session);
+}
+
+/* Wait for the socket of the job. Return -1 if the job is interrupted or
+ * times out. */
+static int connect_job_wait(struct nogvl_connect_all_args *args,
+                            struct connect_job *job,
+                            const struct timespec *deadline) {
+  struct pollfd pfds[2];
+  long ms;
+
+  if (args->interrupted) {
+    connect_job_fail(job, SSH_FATAL, "Interrupted");
+    return -1;
+  }
+  ms = libssh_ruby_remaining_ms(deadline);
+  if (ms == 0) {
+    connect_job_fail(job, SSH_FATAL, "Timeout");
+    return -1;
+  }
+  pfds[0].fd = ssh_get_fd(job->session);
+  pfds[0].events = POLLIN;
+  if (ssh_get_poll_flags(job->session) & SSH_WRITE_PENDING) {
+    pfds[0].events |= POLLOUT;
+  }
+  pfds[1].fd = args->stop[0];
+  pfds[1].events = POLLIN;
+  poll(pfds, 2, ms > INT_MAX ? INT_MAX : (int)ms);
+  return 0;
+}
+
+/* The session is nonblocking during the job, so that it can be
+ * interrupted. */
+static void connect_job_run(struct nogvl_connect_all_args *args,
+                            struct connect_job *job) {
+  struct timespec deadline;
+  int rc;
+
+  libssh_ruby_deadline_after(&deadline, job->timeout_ms);
+  while ((rc = ssh_connect(job->session)) == SSH_AGAIN) {
+    if (connect_job_wait(args, job, &deadline) != 0) {
+      return;
+    }
+  }
+  if (rc != SSH_OK) {
+    connect_job_fail(job, ssh_get_error_code(job->session),
+                     ssh_get_error(job->session));
+    return;
+  }
+  if (args->verify) {
+    rc = ssh_is_server_known(job->session);
+    if (rc == SSH_SERVER_ERROR) {
+      connect_job_fail(job, ssh_get_error_code(job->session),
+                       ssh_get_error(job->session));
+      return;
+    } else if (rc != SSH_SERVER_KNOWN_OK) {
+      connect_job_fail(job, SSH_REQUEST_DENIED, "Server is not known");
+      return;
+    }
+  }
+  while ((rc = ssh_userauth_publickey_auto(job->session, NULL, NULL)) ==
+         SSH_AUTH_AGAIN) {
+    if (connect_job_wait(args, job, &deadline) != 0) {
+      return;
+    }
+  }
+  if (rc == SSH_AUTH_ERROR) {
+    connect_job_fail(job, ssh_get_error_code(job->session),
+                     ssh_get_error(job->session));
+  } else if (rc != SSH_AUTH_SUCCESS) {
+    connect_job_fail(job, SSH_REQUEST_DENIED, "Authentication failed");
+  }
+}
+
+static void *connect_all_worker(void *ptr) {
+  struct nogvl_connect_all_args *args = ptr;
+  int blocking;
+
+  while (!args->interrupted) {
+    long i = __atomic_fetch_add(&args->next, 1, __ATOMIC_RELAXED);
+
+    if (i >= args->njobs) {
+      break;
+    }
+    blocking = ssh_is_blocking(args->jobs[i].session);
+    ssh_set_blocking(args->jobs[i].session, 0);
+    connect_job_run(args, &args->jobs[i]);
+    ssh_set_blocking(args->jobs[i].session, blocking);
+  }
+  return NULL;
+}
+
+static void *nogvl_connect_all(void *ptr) {
+  struct nogvl_connect_all_args *args = ptr;
+  pthread_t *threads;
+  int i, nthreads = 0;
+
+  threads = malloc(sizeof(pthread_t) * args->concurrency);
+  if (threads != NULL) {
+    /* The calling thread is also a worker. */
+    for (i = 1; i < args->concurrency; i++) {
+      if (pthread_create(&threads[nthreads], NULL, connect_all_worker, args) !=
+          0) {
+        break;
+      }
+      nthreads++;
+    }
+  }
+  connect_all_worker(args);
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  return NULL;
+}
+
+static void connect_all_ubf(void *ptr) {
+  struct nogvl_connect_all_args *args = ptr;
+
+  args->interrupted = 1;
+  if (write(args->stop[1], "", 1) < 0) {
+    /* Already written, so the workers wake up anyway. */
+  }
+}
+
+/*
+ * @overload connect_sessions(sessions, concurrency, verify = true)
+ *  Connect, check the server and authenticate with
+ *  {#userauth_publickey_auto} for all of the configured sessions on a pool
+ *  of native threads. Each session is given {#timeout=} and
+ *  {#timeout_usec=}, or 10 seconds, for all of the steps. If interrupted,
+ *  the sessions in progress fail and the exception is raised.
+ *  @param [Array<Session>] sessions Sessions to connect.
+ *  @param [Fixnum] concurrency The number of the threads.
+ *  @param [Boolean] verify Fail unless {#server_known} is
+ *    {LibSSH::SERVER_KNOWN_OK}.
+ *  @return [Array<LibSSH::Error, nil>] The error of each session. +nil+
+ *    means the session is ready.
+ *  @since 0.5.0
+ *  @see Session.connect_all
+ */
+static VALUE s_connect_sessions(int argc, VALUE *argv,
+                                RB_UNUSED_VAR(VALUE klass)) {
+  VALUE sessions, concurrency, verify, ret;
+  struct nogvl_connect_all_args args;
+  long i;
+
+  rb_scan_args(argc, argv, "21", &sessions, &concurrency, &verify);
+  Check_Type(sessions, T_ARRAY);
+  sessions = rb_ary_dup(sessions);
+  args.njobs = RARRAY_LEN(sessions);
+  args.concurrency = NUM2INT(concurrency);
+  if (args.concurrency < 1) {
+    rb_raise(rb_eArgError, "concurrency must be positive");
+  }
+  if (args.concurrency > args.njobs) {
+    args.concurrency = args.njobs == 0 ? 1 : (int)args.njobs;
+  }
+  args.verify = verify == Qundef || RTEST(verify);
+  args.next = 0;
+  args.interrupted = 0;
+  if (pipe(args.stop) != 0) {
+    rb_sys_fail("pipe");
+  }
+  fcntl(args.stop[1], F_SETFL, fcntl(args.stop[1], F_GETFL) | O_NONBLOCK);
+  args.jobs = ALLOC_N(struct connect_job, args.njobs);
+  for (i = 0; i < args.njobs; i++) {
+    SessionHolder *holder =
+        libssh_ruby_session_holder(RARRAY_AREF(sessions, i));
+    long ms = holder->timeout * 1000 + holder->timeout_usec / 1000;
+
+    args.jobs[i].session = holder->session;
+    /* Same as the blocking ssh_connect. */
+    args.jobs[i].timeout_ms = ms > 0 ? ms : 10000;
+    args.jobs[i].code = SSH_NO_ERROR;
+    args.jobs[i].message = NULL;
+  }
+
+  rb_thread_call_without_gvl(nogvl_connect_all, &args, connect_all_ubf, &args);
+  close(args.stop[0]);
+  close(args.stop[1]);
+
+  ret = rb_ary_new_capa(args.njobs);
+  for (i = 0; i < args.njobs; i++) {
+    struct connect_job *job = &args.jobs[i];
+
+    if (job->message != NULL) {
+      rb_ary_push(ret, libssh_ruby_error_new(job->code, job->message));
+      free(job->message);
+    } else if (i >= args.next) {
+      rb_ary_push(ret, libssh_ruby_error_new(SSH_FATAL, "Interrupted"));
+    } else {
+      rb_ary_push(ret, Qnil);
+    }
+  }
+  ruby_xfree(args.jobs);
+  RB_GC_GUARD(sessions);
+  rb_thread_check_ints();
+  return ret;
+}
+
+enum exec_job_state {
+  EXEC_JOB_OPEN,
+  EXEC_JOB_EXEC,
+  EXEC_JOB_READ,
+  EXEC_JOB_STATUS,
+  EXEC_JOB_DONE
+};
+
+struct exec_job {
+  const char *cmd;
+  ssh_channel channel;
+  enum exec_job_state state;
+  int eof[2];
+  struct capture_buffer out[2];
+  int exit_status;
+  int code;
+  /* NULL on success */
+  char *message;
+};
+
+struct exec_commands_args {
+  VALUE session;
+  SessionHolder *holder;
+  VALUE commands;
+  struct exec_job *jobs;
+  long njobs;
+  /* Jobs before +next+ have been started. */
+  long next;
+  /* Jobs before +yielded+ in +finished+ have been yielded. */
+  long *finished;
+  long nfinished, yielded;
+  int running;
+  int concurrency;
+  size_t max_output;
+  Wakeup *wakeup;
+  int rc;
+};
+
+static void exec_job_fail(struct exec_job *job, ssh_session session) {
+  job->code = ssh_get_error_code(session);
+  job->message = strdup(ssh_get_error(session));
+  job->state = EXEC_JOB_DONE;
+}
+
+/* Advance +job+ without blocking. Return 1 if anything has been done. */
+static int exec_job_step(struct exec_commands_args *args,
+                         struct exec_job *job) {
+  ssh_session session = args->holder->session;
+  char chunk[16384];
+  int rc, is_stderr, progress = 0;
+
+  switch (job->state) {
+    case EXEC_JOB_OPEN:
+      rc = ssh_channel_open_session(job->channel);
+      if (rc == SSH_AGAIN) {
+        return 0;
+      } else if (rc != SSH_OK) {
+        exec_job_fail(job, session);
+        return 1;
+      }
+      job->state = EXEC_JOB_EXEC;
+      progress = 1;
+      /* FALLTHROUGH */
+    case EXEC_JOB_EXEC:
+      rc = ssh_channel_request_exec(job->channel, job->cmd);
+      if (rc == SSH_AGAIN) {
+        return progress;
+      } else if (rc != SSH_OK) {
+        exec_job_fail(job, session);
+        return 1;
+      }
+      job->state = EXEC_JOB_READ;
+      progress = 1;
+      /* FALLTHROUGH */
+    case EXEC_JOB_READ:
+      for (is_stderr = 0; is_stderr < 2; is_stderr++) {
+        if (job->eof[is_stderr]) {
+          continue;
+        }
+        rc = ssh_channel_read_nonblocking(job->channel, chunk, sizeof(chunk),
+                                          is_stderr);
+        if (rc == SSH_ERROR) {
+          exec_job_fail(job, session);
+          return 1;
+        } else if (rc == SSH_EOF) {
+          job->eof[is_stderr] = 1;
+          progress = 1;
+        } else if (rc > 0) {
+          if (libssh_ruby_capture_append(&job->out[is_stderr], chunk, rc,
+                                         args->max_output) != 0) {
+            job->code = SSH_FATAL;
+            job->message = strdup("Cannot allocate memory");
+            job->state = EXEC_JOB_DONE;
+            return 1;
+          }
+          progress = 1;
+        }
+      }
+      if (!job->eof[0] || !job->eof[1]) {
+        return progress;
+      }
+      job->state = EXEC_JOB_STATUS;
+      /* FALLTHROUGH */
+    case EXEC_JOB_STATUS:
+      /* The exit status usually follows EOF. */
+      job->exit_status = ssh_channel_get_exit_status(job->channel);
+      if (job->exit_status == -1 && !ssh_channel_is_closed(job->channel) &&
+          ssh_is_connected(session)) {
+        return progress;
+      }
+      job->state = EXEC_JOB_DONE;
+      return 1;
+    case EXEC_JOB_DONE:
+      break;
+  }
+  return 0;
+}
+
+static void *nogvl_exec_commands(void *ptr) {
+  struct exec_commands_args *args = ptr;
+  ssh_session session = args->holder->session;
+  struct pollfd pfds[2];
+  long i;
+
+  args->rc = SSH_OK;
+  while (args->nfinished < args->njobs) {
+    int progress = 0;
+
+    while (args->running < args->concurrency && args->next < args->njobs) {
+      struct exec_job *job = &args->jobs[args->next++];
+
+      job->channel = ssh_channel_new(session);
+      if (job->channel == NULL) {
+        exec_job_fail(job, session);
+        args->finished[args->nfinished++] = args->next - 1;
+        continue;
+      }
+      args->running++;
+    }
+
+    for (i = 0; i < args->next; i++) {
+      struct exec_job *job = &args->jobs[i];
+
+      if (job->channel == NULL || job->state == EXEC_JOB_DONE) {
+        continue;
+      }
+      progress |= exec_job_step(args, job);
+      if (job->state == EXEC_JOB_DONE) {
+        ssh_channel_free(job->channel);
+        job->channel = NULL;
+        args->finished[args->nfinished++] = i;
+        args->running--;
+      }
+    }
+    if (!ssh_is_connected(session)) {
+      args->rc = SSH_ERROR;
+      break;
+    }
+    if (args->nfinished > args->yielded) {
+      /* Return to yield the finished commands. */
+      break;
+    }
+    if (progress) {
+      continue;
+    }
+    if (libssh_ruby_wakeup_interrupted(args->wakeup)) {
+      break;
+    }
+
+    pfds[0].fd = ssh_get_fd(session);
+    pfds[0].events = POLLIN;
+    if (ssh_get_poll_flags(session) & SSH_WRITE_PENDING) {
+      pfds[0].events |= POLLOUT;
+    }
+    pfds[1].fd = args->wakeup->fd[0];
+    pfds[1].events = POLLIN;
+    pfds[0].revents = pfds[1].revents = 0;
+    if (poll(pfds, 2, -1) > 0 && pfds[1].revents != 0 &&
+        libssh_ruby_wakeup_drain(args->wakeup)) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+static VALUE exec_job_result(struct exec_job *job) {
+  VALUE ret;
+
+  if (job->message != NULL) {
+    return libssh_ruby_error_new(job->code, job->message);
+  }
+  ret = rb_ary_new_capa(3);
+  rb_ary_push(ret, rb_utf8_str_new(job->out[0].ptr, job->out[0].len));
+  rb_ary_push(ret, rb_utf8_str_new(job->out[1].ptr, job->out[1].len));
+  rb_ary_push(ret, job->exit_status == -1 ? Qnil : INT2FIX(job->exit_status));
+  return ret;
+}
+
+static VALUE exec_commands_body(VALUE ptr) {
+  struct exec_commands_args *args = (struct exec_commands_args *)ptr;
+
+  while (args->nfinished < args->njobs) {
+    args->wakeup = libssh_ruby_wakeup_prepare();
+    rb_thread_call_without_gvl(nogvl_exec_commands, args, libssh_ruby_wakeup,
+                               args->wakeup);
+    while (args->yielded < args->nfinished) {
+      long i = args->finished[args->yielded++];
+
+      rb_yield_values(2, LONG2NUM(i), exec_job_result(&args->jobs[i]));
+    }
+    if (args->rc == SSH_ERROR) {
+      libssh_ruby_raise(args->holder->session);
+    }
+    if (libssh_ruby_wakeup_interrupted(args->wakeup)) {
+      rb_thread_check_ints();
+    }
+  }
+  return Qnil;
+}
+
+static VALUE exec_commands_ensure(VALUE ptr) {
+  struct exec_commands_args *args = (struct exec_commands_args *)ptr;
+  long i;
+
+  for (i = 0; i < args->njobs; i++) {
+    struct exec_job *job = &args->jobs[i];
+
+    if (job->channel != NULL) {
+      ssh_channel_free(job->channel);
+    }
+    free(job->out[0].ptr);
+    free(job->out[1].ptr);
+    free(job->message);
+  }
+  ruby_xfree(args->jobs);
+  ruby_xfree(args->finished);
+  libssh_ruby_session_nonblocking_end(args->holder);
+  return Qnil;
+}
+
+/*
+ * @overload exec_commands(commands, concurrency, max_output = nil)
+ *  Run the commands on up to +concurrency+ session channels at once. All of
+ *  the channels are driven by one loop without GVL.
+ *  @param [Array<String>] commands The commands to execute.
+ *  @param [Fixnum] concurrency The maximum number of the open channels.
+ *    Keep it below MaxSessions of the server.
+ *  @param [Integer, nil] max_output The maximum bytes kept for each of stdout
+ *    and stderr. +nil+ means unlimited.
+ *  @yieldparam [Fixnum] index The index of the finished command.
+ *  @yieldparam [Array, LibSSH::Error] result +[stdout, stderr, exit_status]+,
+ *    or the error of the command.
+ *  @return [nil]
+ *  @since 0.5.0
+ *  @see #exec_many
+ */
+static VALUE m_exec_commands(int argc, VALUE *argv, VALUE self) {
+  VALUE commands, concurrency, max_output;
+  struct exec_commands_args args;
+  long i;
+
+  rb_scan_args(argc, argv, "21", &commands, &concurrency, &max_output);
+  rb_need_block();
+  Check_Type(commands, T_ARRAY);
+  args.session = self;
+  args.holder = libssh_ruby_session_holder(self);
+  args.concurrency = NUM2INT(concurrency);
+  if (args.concurrency < 1) {
+    rb_raise(rb_eArgError, "concurrency must be positive");
+  }
+  if (NIL_P(max_output)) {
+    args.max_output = SIZE_MAX;
+  } else {
+    args.max_output = NUM2SIZET(max_output);
+  }
+  /* Keep the command strings alive and unchanged during the loop. */
+  args.commands = rb_ary_new_capa(RARRAY_LEN(commands));
+  for (i = 0; i < RARRAY_LEN(commands); i++) {
+    VALUE cmd = RARRAY_AREF(commands, i);
+
+    StringValueCStr(cmd);
+    cmd = rb_str_new_frozen(cmd);
+    rb_ary_push(args.commands, cmd);
+  }
+  args.njobs = RARRAY_LEN(args.commands);
+  args.jobs = ZALLOC_N(struct exec_job, args.njobs);
+  args.finished = ALLOC_N(long, args.njobs);
+  for (i = 0; i < args.njobs; i++) {
+    args.jobs[i].cmd = RSTRING_PTR(RARRAY_AREF(args.commands, i));
+    args.jobs[i].exit_status = -1;
+  }
+  args.next = args.nfinished = args.yielded = 0;
+  args.running = 0;
+  libssh_ruby_session_nonblocking_begin(args.holder);
+  rb_ensure(exec_commands_body, (VALUE)&args, exec_commands_ensure,
+            (VALUE)&args);
+  RB_GC_GUARD(args.commands);
+  return Qnil;
+}
+
 /*
  * Document-class: LibSSH::Session
  * Wrapper for ssh_session struct in libssh.
@@ -650,6 +1629,8 @@ static VALUE m_write_knownhost(VALUE self) {
 void Init_libssh_session() {
   rb_cLibSSHSession = rb_define_class_under(rb_mLibSSH, "Session", rb_cObject);
   rb_define_alloc_func(rb_cLibSSHSession, session_alloc);
+  rb_define_singleton_method(rb_cLibSSHSession, "connect_sessions",
+                             RUBY_METHOD_FUNC(s_connect_sessions), -1);
 
 #define I(name) id_##name = rb_intern(#name)
   I(none);
@@ -662,7 +1643,10 @@ void Init_libssh_session() {
   I(hostbased);
   I(interactive);
   I(gssapi_mic);
+  I(for_fd);
+  I(fileno);
 #undef I
+  id_autoclose_set = rb_intern("autoclose=");
 
   rb_define_method(rb_cLibSSHSession, "initialize",
                    RUBY_METHOD_FUNC(m_initialize), 0);
@@ -708,12 +1692,16 @@ void Init_libssh_session() {
   rb_define_method(rb_cLibSSHSession, "add_identity",
                    RUBY_METHOD_FUNC(m_add_identity), 1);
   rb_define_method(rb_cLibSSHSession, "connect", RUBY_METHOD_FUNC(m_connect),
-                   0);
+                   -1);
   rb_define_method(rb_cLibSSHSession, "disconnect",
                    RUBY_METHOD_FUNC(m_disconnect), 0);
   rb_define_method(rb_cLibSSHSession, "server_known",
                    RUBY_METHOD_FUNC(m_server_known), 0);
   rb_define_method(rb_cLibSSHSession, "fd", RUBY_METHOD_FUNC(m_fd), 0);
+  rb_define_method(rb_cLibSSHSession, "channel_window_size=",
+                   RUBY_METHOD_FUNC(m_set_channel_window_size), 1);
+  rb_define_method(rb_cLibSSHSession, "channel_window_size",
+                   RUBY_METHOD_FUNC(m_channel_window_size), 0);
 
   rb_define_method(rb_cLibSSHSession, "userauth_none",
                    RUBY_METHOD_FUNC(m_userauth_none), 0);
@@ -727,4 +1715,10 @@ void Init_libssh_session() {
                    RUBY_METHOD_FUNC(m_get_publickey), 0);
   rb_define_method(rb_cLibSSHSession, "write_knownhost",
                    RUBY_METHOD_FUNC(m_write_knownhost), 0);
+#ifdef HAVE_SSH_ADD_CHANNEL_CALLBACKS
+  rb_define_method(rb_cLibSSHSession, "process_events",
+                   RUBY_METHOD_FUNC(m_process_events), -1);
+#endif
+  rb_define_method(rb_cLibSSHSession, "exec_commands",
+                   RUBY_METHOD_FUNC(m_exec_commands), -1);
 }
@@ -0,0 +1,1428 @@
+#include "libssh_ruby.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <ruby/io.h>
+#include <ruby/thread.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RAISE_IF_ERROR(rc) \
+  if ((rc) == SSH_ERROR)   \
+  libssh_ruby_raise(libssh_ruby_session_holder(holder->session)->session)
+
+VALUE rb_cLibSSHSFTP;
+static VALUE rb_cLibSSHSFTPFile, rb_cLibSSHSFTPAttributes;
+
+static ID id_mode, id_requests, id_chunk, id_digest, id_to_path, id_resume,
+    id_range;
+static ID id_regular, id_directory, id_symlink, id_special, id_unknown;
+
+static void sftp_mark(void *);
+static void sftp_holder_free(void *);
+static size_t sftp_memsize(const void *);
+
+static const rb_data_type_t sftp_type = {
+    "sftp_session", {sftp_mark, sftp_holder_free, sftp_memsize, {NULL, NULL}},
+    NULL,           NULL,
+    RUBY_TYPED_WB_PROTECTED | RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE sftp_alloc(VALUE klass) {
+  SFTPHolder *holder = ALLOC(SFTPHolder);
+  holder->sftp = NULL;
+  holder->session = Qundef;
+  return TypedData_Wrap_Struct(klass, &sftp_type, holder);
+}
+
+static void sftp_mark(void *arg) {
+  SFTPHolder *holder = arg;
+  if (holder->sftp != NULL) {
+    rb_gc_mark(holder->session);
+  }
+}
+
+static void sftp_holder_free(void *arg) {
+  SFTPHolder *holder = arg;
+  if (holder->sftp != NULL) {
+    /* XXX: holder->sftp must be free'ed before holder->session is free'ed */
+    sftp_free(holder->sftp);
+    holder->sftp = NULL;
+  }
+  ruby_xfree(holder);
+}
+
+static size_t sftp_memsize(RB_UNUSED_VAR(const void *arg)) {
+  return sizeof(SFTPHolder);
+}
+
+/* Return the holder of +sftp+. Raise IOError if it has been closed. */
+SFTPHolder *libssh_ruby_sftp_holder(VALUE sftp) {
+  SFTPHolder *holder;
+
+  TypedData_Get_Struct(sftp, SFTPHolder, &sftp_type, holder);
+  if (holder->sftp == NULL) {
+    rb_raise(rb_eIOError, "closed sftp session");
+  }
+  return holder;
+}
+
+static void sftp_file_free(void *);
+static size_t sftp_file_memsize(const void *);
+static void sftp_file_mark(void *);
+
+struct SFTPFileHolderStruct {
+  sftp_file file;
+  VALUE sftp;
+};
+typedef struct SFTPFileHolderStruct SFTPFileHolder;
+
+static const rb_data_type_t sftp_file_type = {
+    "sftp_file",
+    {sftp_file_mark, sftp_file_free, sftp_file_memsize, {NULL, NULL}},
+    NULL,
+    NULL,
+    RUBY_TYPED_WB_PROTECTED | RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE sftp_file_alloc(VALUE klass) {
+  SFTPFileHolder *holder = ALLOC(SFTPFileHolder);
+  holder->file = NULL;
+  holder->sftp = Qundef;
+  return TypedData_Wrap_Struct(klass, &sftp_file_type, holder);
+}
+
+static void sftp_file_mark(void *arg) {
+  SFTPFileHolder *holder = arg;
+  if (holder->file != NULL) {
+    rb_gc_mark(holder->sftp);
+  }
+}
+
+static void sftp_file_free(void *arg) {
+  /* An unclosed file is leaked rather than closed here, because sftp_close
+   * uses the sftp session which may have been free'ed in the same GC. */
+  ruby_xfree(arg);
+}
+
+static size_t sftp_file_memsize(RB_UNUSED_VAR(const void *arg)) {
+  return sizeof(SFTPFileHolder);
+}
+
+static SFTPFileHolder *get_file_holder(VALUE file) {
+  SFTPFileHolder *holder;
+
+  TypedData_Get_Struct(file, SFTPFileHolder, &sftp_file_type, holder);
+  if (holder->file == NULL) {
+    rb_raise(rb_eIOError, "closed sftp file");
+  }
+  return holder;
+}
+
+static VALUE attributes_new(sftp_attributes attrs) {
+  VALUE name = Qnil, type, size = Qnil, permissions = Qnil, uid = Qnil,
+        gid = Qnil, atime = Qnil, mtime = Qnil;
+
+  if (attrs->name != NULL) {
+    name = rb_str_new_cstr(attrs->name);
+  }
+  switch (attrs->type) {
+    case SSH_FILEXFER_TYPE_REGULAR:
+      type = ID2SYM(id_regular);
+      break;
+    case SSH_FILEXFER_TYPE_DIRECTORY:
+      type = ID2SYM(id_directory);
+      break;
+    case SSH_FILEXFER_TYPE_SYMLINK:
+      type = ID2SYM(id_symlink);
+      break;
+    case SSH_FILEXFER_TYPE_SPECIAL:
+      type = ID2SYM(id_special);
+      break;
+    default:
+      type = ID2SYM(id_unknown);
+      break;
+  }
+  if (attrs->flags & SSH_FILEXFER_ATTR_SIZE) {
+    size = ULL2NUM(attrs->size);
+  }
+  if (attrs->flags & SSH_FILEXFER_ATTR_PERMISSIONS) {
+    permissions = UINT2NUM(attrs->permissions & 07777);
+  }
+  if (attrs->flags & SSH_FILEXFER_ATTR_UIDGID) {
+    uid = UINT2NUM(attrs->uid);
+    gid = UINT2NUM(attrs->gid);
+  }
+  if (attrs->flags & SSH_FILEXFER_ATTR_ACMODTIME) {
+    atime = rb_time_new(attrs->atime, 0);
+    mtime = rb_time_new(attrs->mtime, 0);
+  }
+  return rb_struct_new(rb_cLibSSHSFTPAttributes, name, type, size,
+                       permissions, uid, gid, atime, mtime);
+}
+
+struct nogvl_new_args {
+  ssh_session session;
+  sftp_session sftp;
+};
+
+static void *nogvl_new(void *ptr) {
+  struct nogvl_new_args *args = ptr;
+  args->sftp = sftp_new(args->session);
+  return NULL;
+}
+
+/* @overload initialize(session)
+ *  Open a channel for the sftp subsystem.
+ *  @param [Session] session The SSH session to use.
+ *  @return [SFTP]
+ *  @see http://api.libssh.org/stable/group__libssh__sftp.html sftp_new
+ */
+static VALUE m_initialize(VALUE self, VALUE session) {
+  SFTPHolder *holder;
+  struct nogvl_new_args args;
+
+  TypedData_Get_Struct(self, SFTPHolder, &sftp_type, holder);
+  args.session = libssh_ruby_session_holder(session)->session;
+  libssh_ruby_nogvl(nogvl_new, &args);
+  if (args.sftp == NULL) {
+    libssh_ruby_raise(args.session);
+  }
+  holder->sftp = args.sftp;
+  RB_OBJ_WRITE(self, &holder->session, session);
+
+  return self;
+}
+
+static void *nogvl_sftp_free(void *ptr) {
+  sftp_free(ptr);
+  return NULL;
+}
+
+/* @overload close
+ *  Close the sftp channel. Files opened by {#open} must be closed
+ *  beforehand.
+ *  @return [nil]
+ *  @see http://api.libssh.org/stable/group__libssh__sftp.html sftp_free
+ */
+static VALUE m_close(VALUE self) {
+  SFTPHolder *holder;
+
+  TypedData_Get_Struct(self, SFTPHolder, &sftp_type, holder);
+  if (holder->sftp != NULL) {
+    sftp_session sftp = holder->sftp;
+
+    holder->sftp = NULL;
+    libssh_ruby_nogvl(nogvl_sftp_free, sftp);
+  }
+  return Qnil;
+}
+
+struct nogvl_sftp_args {
+  sftp_session sftp;
+  int rc;
+};
+
+static void *nogvl_init(void *ptr) {
+  struct nogvl_sftp_args *args = ptr;
+  args->rc = sftp_init(args->sftp);
+  return NULL;
+}
+
+/* @overload init
+ *  Initialize the sftp subsystem.
+ *  @yieldparam [SFTP] sftp self, closed after the block
+ *  @return [SFTP, Object] self, or the return value of the block when a
+ *    block is given
+ *  @see http://api.libssh.org/stable/group__libssh__sftp.html sftp_init
+ */
+static VALUE m_init(VALUE self) {
+  SFTPHolder *holder = libssh_ruby_sftp_holder(self);
+  struct nogvl_sftp_args args;
+
+  args.sftp = holder->sftp;
+  libssh_ruby_nogvl(nogvl_init, &args);
+  RAISE_IF_ERROR(args.rc);
+
+  if (rb_block_given_p()) {
+    return rb_ensure(rb_yield, self, m_close, self);
+  }
+  return self;
+}
+
+struct nogvl_path_args {
+  sftp_session sftp;
+  const char *path;
+  const char *newpath;
+  mode_t mode;
+  sftp_attributes attrs;
+  int rc;
+};
+
+static void path_args_init(struct nogvl_path_args *args, SFTPHolder *holder,
+                           VALUE path) {
+  args->sftp = holder->sftp;
+  args->path = StringValueCStr(path);
+  args->newpath = NULL;
+  args->mode = 0;
+  args->attrs = NULL;
+  args->rc = SSH_OK;
+}
+
+static void *nogvl_stat(void *ptr) {
+  struct nogvl_path_args *args = ptr;
+  args->attrs = sftp_stat(args->sftp, args->path);
+  return NULL;
+}
+
+static void *nogvl_lstat(void *ptr) {
+  struct nogvl_path_args *args = ptr;
+  args->attrs = sftp_lstat(args->sftp, args->path);
+  return NULL;
+}
+
+static VALUE stat_common(VALUE self, VALUE path, void *(*func)(void *)) {
+  SFTPHolder *holder = libssh_ruby_sftp_holder(self);
+  struct nogvl_path_args args;
+  VALUE ret;
+
+  path = rb_str_new_frozen(path);
+  path_args_init(&args, holder, path);
+  libssh_ruby_nogvl(func, &args);
+  RB_GC_GUARD(path);
+  if (args.attrs == NULL) {
+    RAISE_IF_ERROR(SSH_ERROR);
+  }
+  ret = attributes_new(args.attrs);
+  sftp_attributes_free(args.attrs);
+  return ret;
+}
+
+/* @overload stat(path)
+ *  Get the attributes of a remote file, following symbolic links.
+ *  @param [String] path The remote path.
+ *  @return [Attributes]
+ *  @see http://api.libssh.org/stable/group__libssh__sftp.html sftp_stat
+ */
+static VALUE m_stat(VALUE self, VALUE path) {
+  return stat_common(self, path, nogvl_stat);
+}
+
+/* @overload lstat(path)
+ *  Get the attributes of a remote file without following symbolic links.
+ *  @param [String] path The remote path.
+ *  @return [Attributes]
+ *  @see http://api.libssh.org/stable/group__libssh__sftp.html sftp_lstat
+ */
+static VALUE m_lstat(VALUE self, VALUE path) {
+  return stat_common(self, path, nogvl_lstat);
+}
+
+struct nogvl_readdir_args {
+  sftp_session sftp;
+  const char *path;
+  /* Allocated by realloc without GVL */
+  sftp_attributes *entries;
+  long len, capa;
+  int err;
+  int rc;
+};
+
+static void *nogvl_readdir(void *ptr) {
+  struct nogvl_readdir_args *args = ptr;
+  sftp_attributes attrs;
+  sftp_dir dir;
+
+  dir = sftp_opendir(args->sftp, args->path);
+  if (dir == NULL) {
+    args->rc = SSH_ERROR;
+    return NULL;
+  }
+  while ((attrs = sftp_readdir(args->sftp, dir)) != NULL) {
+    if (args->len == args->capa) {
+      long capa = args->capa == 0 ? 16 : args->capa * 2;
+      sftp_attributes *entries =
+          realloc(args->entries, capa * sizeof(*entries));
+
+      if (entries == NULL) {
+        sftp_attributes_free(attrs);
+        args->err = ENOMEM;
+        break;
+      }
+      args->entries = entries;
+      args->capa = capa;
+    }
+    args->entries[args->len++] = attrs;
+  }
+  if (args->err == 0 && !sftp_dir_eof(dir)) {
+    args->rc = SSH_ERROR;
+  }
+  sftp_closedir(dir);
+  return NULL;
+}
+
+/* @overload readdir(path)
+ *  List a remote directory, including "." and "..".
+ *  @param [String] path The remote directory.
+ *  @return [Array<Attributes>] The entries of the directory.
+ *  @see http://api.libssh.org/stable/group__libssh__sftp.html sftp_readdir
+ */
+static VALUE m_readdir(VALUE self, VALUE path) {
+  SFTPHolder *holder = libssh_ruby_sftp_holder(self);
+  struct nogvl_readdir_args args;
+  VALUE ret;
+  long i;
+
+  path = rb_str_new_frozen(path);
+  args.sftp = holder->sftp;
+  args.path = StringValueCStr(path);
+  args.entries = NULL;
+  args.len = 0;
+  args.capa = 0;
+  args.err = 0;
+  args.rc = SSH_OK;
+  libssh_ruby_nogvl(nogvl_readdir, &args);
+  RB_GC_GUARD(path);
+
+  ret = rb_ary_new_capa(args.len);
+  for (i = 0; i < args.len; i++) {
+    rb_ary_push(ret, attributes_new(args.entries[i]));
+    sftp_attributes_free(args.entries[i]);
+  }
+  free(args.entries);
+  if (args.err != 0) {
+    rb_memerror();
+  }
+  RAISE_IF_ERROR(args.rc);
+  return ret;
+}
+
+static void *nogvl_mkdir(void *ptr) {
+  struct nogvl_path_args *args = ptr;
+  args->rc = sftp_mkdir(args->sftp, args->path, args->mode);
+  return NULL;
+}
+
+static void *nogvl_rmdir(void *ptr) {
+  struct nogvl_path_args *args = ptr;
+  args->rc = sftp_rmdir(args->sftp, args->path);
+  return NULL;
+}
+
+static void *nogvl_unlink(void *ptr) {
+  struct nogvl_path_args *args = ptr;
+  args->rc = sftp_unlink(args->sftp, args->path);
+  return NULL;
+}
+
+static void *nogvl_rename(void *ptr) {
+  struct nogvl_path_args *args = ptr;
+  args->rc = sftp_rename(args->sftp, args->path, args->newpath);
+  return NULL;
+}
+
+/* @overload mkdir(path, mode = 0o755)
+ *  Create a remote directory.
+ *  @param [String] path The remote directory.
+ *  @param [Fixnum] mode The UNIX permissions for the new directory.
+ *  @return [nil]
+ *  @see http://api.libssh.org/stable/group__libssh__sftp.html sftp_mkdir
+ */
+static VALUE m_mkdir(int argc, VALUE *argv, VALUE self) {
+  SFTPHolder *holder = libssh_ruby_sftp_holder(self);
+  struct nogvl_path_args args;
+  VALUE path, mode;
+
+  rb_scan_args(argc, argv, "11", &path, &mode);
+  path = rb_str_new_frozen(path);
+  path_args_init(&args, holder, path);
+  args.mode = NIL_P(mode) ? 0755 : NUM2INT(mode);
+  libssh_ruby_nogvl(nogvl_mkdir, &args);
+  RB_GC_GUARD(path);
+  RAISE_IF_ERROR(args.rc);
+  return Qnil;
+}
+
+/* @overload rmdir(path)
+ *  Remove an empty remote directory.
+ *  @param [String] path The remote directory.
+ *  @return [nil]
+ *  @see http://api.libssh.org/stable/group__libssh__sftp.html sftp_rmdir
+ */
+static VALUE m_rmdir(VALUE self, VALUE path) {
+  SFTPHolder *holder = libssh_ruby_sftp_holder(self);
+  struct nogvl_path_args args;
+
+  path = rb_str_new_frozen(path);
+  path_args_init(&args, holder, path);
+  libssh_ruby_nogvl(nogvl_rmdir, &args);
+  RB_GC_GUARD(path);
+  RAISE_IF_ERROR(args.rc);
+  return Qnil;
+}
+
+/* @overload unlink(path)
+ *  Remove a remote file.
+ *  @param [String] path The remote file.
+ *  @return [nil]
+ *  @see http://api.libssh.org/stable/group__libssh__sftp.html sftp_unlink
+ */
+static VALUE m_unlink(VALUE self, VALUE path) {
+  SFTPHolder *holder = libssh_ruby_sftp_holder(self);
+  struct nogvl_path_args args;
+
+  path = rb_str_new_frozen(path);
+  path_args_init(&args, holder, path);
+  libssh_ruby_nogvl(nogvl_unlink, &args);
+  RB_GC_GUARD(path);
+  RAISE_IF_ERROR(args.rc);
+  return Qnil;
+}
+
+/* @overload rename(original, newname)
+ *  Rename or move a remote file or directory.
+ *  @param [String] original The current path.
+ *  @param [String] newname The new path.
+ *  @return [nil]
+ *  @see http://api.libssh.org/stable/group__libssh__sftp.html sftp_rename
+ */
+static VALUE m_rename(VALUE self, VALUE original, VALUE newname) {
+  SFTPHolder *holder = libssh_ruby_sftp_holder(self);
+  struct nogvl_path_args args;
+
+  original = rb_str_new_frozen(original);
+  newname = rb_str_new_frozen(newname);
+  path_args_init(&args, holder, original);
+  args.newpath = StringValueCStr(newname);
+  libssh_ruby_nogvl(nogvl_rename, &args);
+  RB_GC_GUARD(original);
+  RB_GC_GUARD(newname);
+  RAISE_IF_ERROR(args.rc);
+  return Qnil;
+}
+
+struct nogvl_open_args {
+  sftp_session sftp;
+  const char *path;
+  int flags;
+  mode_t mode;
+  sftp_file file;
+};
+
+static void *nogvl_open(void *ptr) {
+  struct nogvl_open_args *args = ptr;
+  args->file = sftp_open(args->sftp, args->path, args->flags, args->mode);
+  return NULL;
+}
+
+static VALUE file_close(VALUE self);
+
+/* @overload open(path, flags = 'r', mode = 0o644)
+ *  Open a remote file.
+ *  @param [String] path The remote file.
+ *  @param [String, Fixnum] flags A mode string such as "r" or "w", or
+ *    File::Constants flags such as +File::WRONLY | File::CREAT+.
+ *  @param [Fixnum] mode The UNIX permissions for a new file.
+ *  @return [File, Object] The opened file, or the return value of the block
+ *    when a block is given.
+ *  @yieldparam [File] file The file, which is closed after the block.
+ *  @see http://api.libssh.org/stable/group__libssh__sftp.html sftp_open
+ */
+static VALUE m_open(int argc, VALUE *argv, VALUE self) {
+  SFTPHolder *holder = libssh_ruby_sftp_holder(self);
+  SFTPFileHolder *file_holder;
+  struct nogvl_open_args args;
+  VALUE path, flags, mode, file;
+
+  rb_scan_args(argc, argv, "12", &path, &flags, &mode);
+  path = rb_str_new_frozen(path);
+  args.sftp = holder->sftp;
+  args.path = StringValueCStr(path);
+  if (NIL_P(flags)) {
+    args.flags = O_RDONLY;
+  } else if (RB_TYPE_P(flags, T_STRING)) {
+    args.flags = rb_io_modestr_oflags(StringValueCStr(flags));
+  } else {
+    args.flags = NUM2INT(flags);
+  }
+  args.mode = NIL_P(mode) ? 0644 : NUM2INT(mode);
+  libssh_ruby_nogvl(nogvl_open, &args);
+  RB_GC_GUARD(path);
+  if (args.file == NULL) {
+    RAISE_IF_ERROR(SSH_ERROR);
+  }
+
+  file = sftp_file_alloc(rb_cLibSSHSFTPFile);
+  TypedData_Get_Struct(file, SFTPFileHolder, &sftp_file_type, file_holder);
+  file_holder->file = args.file;
+  RB_OBJ_WRITE(file, &file_holder->sftp, self);
+  if (rb_block_given_p()) {
+    return rb_ensure(rb_yield, file, file_close, file);
+  }
+  return file;
+}
+
+#define DEFAULT_REQUESTS 32
+#define DEFAULT_CHUNK_SIZE 32768
+
+/* A request in flight */
+struct sftp_request {
+  uint64_t offset;
+  uint32_t len;
+  int id;
+#ifdef HAVE_SFTP_AIO_BEGIN_WRITE
+  sftp_aio aio;
+#endif
+};
+
+/* State of a pipelined transfer done without GVL. */
+struct sftp_transfer {
+  sftp_session sftp;
+  const char *remote;
+  mode_t mode;
+  int fd;
+  char *buf;
+  uint32_t chunk;
+  /* The maximum number of requests in flight */
+  int requests;
+  struct sftp_request *ring;
+  /* The remote range to download. +end+ is UINT64_MAX without an end. */
+  uint64_t offset, end;
+  /* Bytes kept in the local file by +resume:+ */
+  uint64_t resumed;
+  /* Check the downloaded size against the remote file */
+  int verify;
+  uint64_t bytes;
+  DigestState digest;
+  /* errno of a local file operation */
+  int err;
+  /* Set when the downloaded size doesn't match the remote file */
+  const char *mismatch;
+  volatile int interrupted;
+  int rc;
+};
+
+static void transfer_init(struct sftp_transfer *t, SFTPHolder *holder,
+                          VALUE requests, VALUE chunk) {
+  t->sftp = holder->sftp;
+  t->buf = NULL;
+  t->ring = NULL;
+  if (requests == Qundef || NIL_P(requests)) {
+    t->requests = DEFAULT_REQUESTS;
+  } else {
+    t->requests = NUM2INT(requests);
+    if (t->requests <= 0) {
+      rb_raise(rb_eArgError, "requests must be positive");
+    }
+  }
+  if (chunk == Qundef || NIL_P(chunk)) {
+    t->chunk = DEFAULT_CHUNK_SIZE;
+  } else {
+    t->chunk = NUM2UINT(chunk);
+    if (t->chunk == 0) {
+      rb_raise(rb_eArgError, "chunk must be positive");
+    }
+  }
+  t->mode = 0644;
+  t->offset = 0;
+  t->end = UINT64_MAX;
+  t->resumed = 0;
+  t->verify = 0;
+  t->bytes = 0;
+  t->err = 0;
+  t->mismatch = NULL;
+  t->interrupted = 0;
+  t->rc = SSH_OK;
+}
+
+/* Write +n+ bytes of the buffer to the local file. */
+static int receive_chunk(struct sftp_transfer *t, size_t n) {
+  size_t off = 0;
+
+  while (off < n) {
+    ssize_t w = write(t->fd, t->buf + off, n - off);
+
+    if (w < 0 && errno == EINTR) {
+      continue;
+    } else if (w < 0) {
+      t->err = errno;
+      return -1;
+    }
+    off += w;
+  }
+  libssh_ruby_digest_update(&t->digest, t->buf, n);
+  t->bytes += n;
+  return 0;
+}
+
+/*
+ * Receive the reply of +req+ into the buffer. The offset of the file is set
+ * first because sftp_async_read returns 0 without taking the reply off the
+ * queue once it has seen EOF, and moves the offset back on a short read.
+ */
+static int receive_reply(sftp_file file, struct sftp_transfer *t,
+                         const struct sftp_request *req) {
+  sftp_seek64(file, req->offset);
+  return sftp_async_read(file, t->buf, req->len, req->id);
+}
+
+/* Send a read of +len+ bytes at +offset+. The offset is tracked here, not
+ * by libssh. */
+static int request_read(sftp_file file, struct sftp_request *req,
+                        uint64_t offset, uint32_t len) {
+  sftp_seek64(file, offset);
+  req->offset = offset;
+  req->len = len;
+  req->id = sftp_async_read_begin(file, len);
+  return req->id;
+}
+
+/* Read the rest of a short read synchronously. */
+static int download_rest(struct sftp_transfer *t, sftp_file file,
+                         uint64_t offset, uint32_t len) {
+  while (len > 0) {
+    struct sftp_request req;
+    int n;
+
+    if (request_read(file, &req, offset, len) < 0) {
+      t->rc = SSH_ERROR;
+      return -1;
+    }
+    n = receive_reply(file, t, &req);
+    if (n == SSH_ERROR) {
+      t->rc = SSH_ERROR;
+      return -1;
+    } else if (n == 0 || receive_chunk(t, n) != 0) {
+      return -1;
+    }
+    offset += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*
+ * Keep +t->requests+ reads in flight and write the responses in order.
+ * After EOF, a local error or an interrupt, the replies of the reads in
+ * flight are still received by their ids, so that they don't stay queued in
+ * the sftp session.
+ */
+static void download_pipelined(struct sftp_transfer *t, sftp_file file) {
+  uint64_t offset = t->offset, end = t->end;
+  int head = 0, count = 0, done = 0;
+
+  for (;;) {
+    struct sftp_request *req;
+    int n;
+
+    while (!done && count < t->requests && offset < end) {
+      uint32_t len = end - offset < t->chunk ? end - offset : t->chunk;
+
+      req = &t->ring[(head + count) % t->requests];
+      if (request_read(file, req, offset, len) < 0) {
+        t->rc = SSH_ERROR;
+        return;
+      }
+      offset += len;
+      count++;
+    }
+    if (count == 0) {
+      return;
+    }
+    req = &t->ring[head];
+    head = (head + 1) % t->requests;
+    count--;
+    n = receive_reply(file, t, req);
+    if (n == SSH_ERROR) {
+      t->rc = SSH_ERROR;
+      return;
+    } else if (done) {
+      continue;
+    } else if (n == 0 || receive_chunk(t, n) != 0) {
+      done = 1;
+    } else if ((uint32_t)n < req->len &&
+               download_rest(t, file, req->offset + n, req->len - n) != 0) {
+      done = 1;
+    }
+    if (t->interrupted) {
+      done = 1;
+    }
+  }
+}
+
+/* Hash the part of the local file kept by +resume:+. */
+static int digest_resumed(struct sftp_transfer *t) {
+  uint64_t off = 0;
+
+  while (off < t->resumed) {
+    size_t len = t->resumed - off < t->chunk ? t->resumed - off : t->chunk;
+    ssize_t n = pread(t->fd, t->buf, len, (off_t)off);
+
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      t->err = n < 0 ? errno : EIO;
+      return -1;
+    }
+    libssh_ruby_digest_update(&t->digest, t->buf, n);
+    off += n;
+  }
+  return 0;
+}
+
+/*
+ * Return the end of the remote range clipped by the size of the remote
+ * file. Return 0 and set +t->rc+ on failure.
+ */
+static uint64_t remote_end(struct sftp_transfer *t, sftp_file file) {
+  sftp_attributes attrs = sftp_fstat(file);
+  uint64_t end = UINT64_MAX;
+
+  if (attrs == NULL) {
+    t->rc = SSH_ERROR;
+    return 0;
+  }
+  if (attrs->flags & SSH_FILEXFER_ATTR_SIZE) {
+    end = attrs->size;
+  }
+  sftp_attributes_free(attrs);
+  return end < t->end ? end : t->end;
+}
+
+static void *nogvl_download(void *ptr) {
+  struct sftp_transfer *t = ptr;
+  uint64_t end = UINT64_MAX;
+  sftp_file file;
+
+  file = sftp_open(t->sftp, t->remote, O_RDONLY, 0);
+  if (file == NULL) {
+    t->rc = SSH_ERROR;
+    return NULL;
+  }
+  if (t->verify) {
+    end = remote_end(t, file);
+    if (t->rc != SSH_OK) {
+      goto close;
+    } else if (end != UINT64_MAX && t->offset > end) {
+      t->mismatch = "The local file is larger than the remote file";
+      goto close;
+    }
+    /* Stop at the size seen now even if the file grows */
+    t->end = end;
+  }
+  if (t->resumed > 0 && digest_resumed(t) != 0) {
+    goto close;
+  }
+  download_pipelined(t, file);
+  if (end != UINT64_MAX && t->rc == SSH_OK && t->err == 0 &&
+      !t->interrupted && t->offset + t->bytes != end) {
+    t->mismatch = "The remote file has changed during the download";
+  }
+close:
+  if (sftp_close(file) != SSH_OK && t->rc == SSH_OK) {
+    t->rc = SSH_ERROR;
+  }
+  return NULL;
+}
+
+/* Read the next chunk of the local file into the buffer. Return 0 at EOF
+ * or on an interrupt. */
+static ssize_t send_chunk(struct sftp_transfer *t) {
+  ssize_t n;
+
+  do {
+    n = read(t->fd, t->buf, t->chunk);
+  } while (n < 0 && errno == EINTR && !t->interrupted);
+  if (n < 0 && errno == EINTR) {
+    return 0;
+  } else if (n < 0) {
+    t->err = errno;
+  } else {
+    libssh_ruby_digest_update(&t->digest, t->buf, n);
+  }
+  return n;
+}
+
+#ifdef HAVE_SFTP_AIO_BEGIN_WRITE
+/* Keep +t->requests+ writes in flight and wait for them in order. */
+static void upload_pipelined(struct sftp_transfer *t, sftp_file file) {
+  int head = 0, count = 0, done = 0;
+
+  for (;;) {
+    ssize_t w;
+
+    while (!done && count < t->requests) {
+      struct sftp_request *req = &t->ring[(head + count) % t->requests];
+      ssize_t n;
+
+      if (t->interrupted || (n = send_chunk(t)) <= 0) {
+        done = 1;
+      } else if (sftp_aio_begin_write(file, t->buf, n, &req->aio) ==
+                 SSH_ERROR) {
+        t->rc = SSH_ERROR;
+        done = 1;
+      } else {
+        count++;
+      }
+    }
+    if (count == 0) {
+      return;
+    }
+    w = sftp_aio_wait_write(&t->ring[head].aio);
+    head = (head + 1) % t->requests;
+    count--;
+    if (w == SSH_ERROR) {
+      t->rc = SSH_ERROR;
+      done = 1;
+    } else {
+      t->bytes += w;
+    }
+  }
+}
+#else
+/* libssh older than 0.11 has no asynchronous write. */
+static void upload_pipelined(struct sftp_transfer *t, sftp_file file) {
+  ssize_t n;
+
+  while (!t->interrupted && (n = send_chunk(t)) > 0) {
+    ssize_t off = 0;
+
+    while (off < n) {
+      ssize_t w = sftp_write(file, t->buf + off, n - off);
+
+      if (w < 0) {
+        t->rc = SSH_ERROR;
+        return;
+      }
+      off += w;
+      t->bytes += w;
+    }
+  }
+}
+#endif
+
+static void *nogvl_upload(void *ptr) {
+  struct sftp_transfer *t = ptr;
+  sftp_file file;
+
+  file = sftp_open(t->sftp, t->remote, O_WRONLY | O_CREAT | O_TRUNC, t->mode);
+  if (file == NULL) {
+    t->rc = SSH_ERROR;
+    return NULL;
+  }
+  upload_pipelined(t, file);
+  if (sftp_close(file) != SSH_OK && t->rc == SSH_OK) {
+    t->rc = SSH_ERROR;
+  }
+  return NULL;
+}
+
+static void transfer_ubf(void *ptr) {
+  struct sftp_transfer *t = ptr;
+  t->interrupted = 1;
+}
+
+struct transfer_call_args {
+  struct sftp_transfer *t;
+  void *(*func)(void *);
+  /* Closed after the call unless -1 */
+  int fd;
+};
+
+static VALUE transfer_call_body(VALUE ptr) {
+  struct transfer_call_args *args = (struct transfer_call_args *)ptr;
+
+  args->t->buf = ALLOC_N(char, args->t->chunk);
+  args->t->ring = ALLOC_N(struct sftp_request, args->t->requests);
+  rb_thread_call_without_gvl(args->func, args->t, transfer_ubf, args->t);
+  return Qnil;
+}
+
+static VALUE transfer_call_ensure(VALUE ptr) {
+  struct transfer_call_args *args = (struct transfer_call_args *)ptr;
+
+  ruby_xfree(args->t->buf);
+  args->t->buf = NULL;
+  ruby_xfree(args->t->ring);
+  args->t->ring = NULL;
+  if (args->fd != -1) {
+    close(args->fd);
+  }
+  return Qnil;
+}
+
+/*
+ * Call +func+ with +t+ without GVL, which can be interrupted, and raise if
+ * the transfer has failed. Return the number of bytes transferred, with the
+ * hex digest if requested.
+ */
+static VALUE transfer_call(SFTPHolder *holder, struct sftp_transfer *t,
+                           void *(*func)(void *), int fd, VALUE local) {
+  struct transfer_call_args args;
+
+  args.t = t;
+  args.func = func;
+  args.fd = fd;
+  rb_ensure(transfer_call_body, (VALUE)&args, transfer_call_ensure,
+            (VALUE)&args);
+
+  if (t->err != 0) {
+    if (RB_TYPE_P(local, T_STRING)) {
+      rb_syserr_fail_str(t->err, local);
+    } else {
+      rb_syserr_fail(t->err, func == nogvl_upload ? "read" : "write");
+    }
+  }
+  RAISE_IF_ERROR(t->rc);
+  if (t->mismatch != NULL) {
+    rb_raise(rb_eIOError, "%s", t->mismatch);
+  }
+  rb_thread_check_ints();
+
+  if (t->digest.meta != NULL) {
+    return rb_assoc_new(ULL2NUM(t->bytes), libssh_ruby_digest_finish(&t->digest));
+  }
+  return ULL2NUM(t->bytes);
+}
+
+static void parse_range(struct sftp_transfer *t, VALUE range) {
+  VALUE beg, end;
+  int excl;
+  LONG_LONG first = 0, last;
+
+  if (!rb_range_values(range, &beg, &end, &excl)) {
+    rb_raise(rb_eTypeError, "range must be a Range");
+  }
+  if (!NIL_P(beg)) {
+    first = NUM2LL(beg);
+  }
+  if (first < 0) {
+    rb_raise(rb_eArgError, "Invalid range: %" PRIsVALUE, range);
+  }
+  t->offset = first;
+  if (!NIL_P(end)) {
+    last = NUM2LL(end) + (excl ? 0 : 1);
+    if (last < first) {
+      rb_raise(rb_eArgError, "Invalid range: %" PRIsVALUE, range);
+    }
+    t->end = last;
+  }
+}
+
+/* Continue after the content of the local file for +resume:+. +fd+ is
+ * closed on failure unless -1. */
+static void resume_local(struct sftp_transfer *t, int fd, VALUE local) {
+  struct stat st;
+  int err;
+
+  if (fstat(t->fd, &st) != 0) {
+    goto fail;
+  }
+  if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+    return;
+  }
+  if (lseek(t->fd, st.st_size, SEEK_SET) < 0) {
+    goto fail;
+  }
+  t->resumed = st.st_size;
+  if (t->end - t->offset < t->resumed) {
+    if (fd != -1) {
+      close(fd);
+    }
+    rb_raise(rb_eIOError, "The local file is larger than the range");
+  }
+  t->offset += t->resumed;
+  return;
+
+fail:
+  err = errno;
+  if (fd != -1) {
+    close(fd);
+  }
+  if (RB_TYPE_P(local, T_STRING)) {
+    rb_syserr_fail_str(err, local);
+  }
+  rb_syserr_fail(err, "resume");
+}
+
+static int local_path_p(VALUE local) {
+  return RB_TYPE_P(local, T_STRING) || rb_respond_to(local, id_to_path);
+}
+
+/* @overload download(remote_path, local, mode: nil, requests: 32, chunk: 32768, digest: nil, resume: false, range: nil)
+ *  Download a remote file with +requests+ reads in flight, so that the
+ *  transfer isn't bound by the round trip time. The responses are written
+ *  to +local+ in order without GVL.
+ *
+ *  With +resume:+ or +range:+, the size of the remote file is checked
+ *  before and after the transfer, and IOError is raised if the local file
+ *  doesn't end up with the whole range.
+ *  @param [String] remote_path The remote file.
+ *  @param [String, IO, Integer] local The path of the local file, or an IO
+ *    or a file descriptor to write into. A path is created or truncated.
+ *  @param [Fixnum, nil] mode The UNIX permissions for a new local file.
+ *    +nil+ means 0666 masked by umask.
+ *  @param [Integer] requests The number of reads in flight.
+ *  @param [Integer] chunk The size of each read. The server may limit it.
+ *  @param [Symbol, Class, nil] digest An algorithm such as +:sha256+ or
+ *    +:md5+, or a Digest::Base subclass, to hash the data received. With
+ *    +resume:+, the kept part of the local file is hashed too, so the
+ *    digest covers the whole local file. An IO must be readable then.
+ *  @param [Boolean] resume Keep the content of +local+ as the beginning of
+ *    the range and download only the rest. +local+ is appended to instead
+ *    of truncated.
+ *  @param [Range, nil] range The byte range of the remote file to download,
+ *    such as +0...1024+. +local+ receives only the range.
+ *  @return [Integer, Array] The number of bytes received by this call, or
+ *    +[bytes, hexdigest]+ with +digest+.
+ *  @see http://api.libssh.org/stable/group__libssh__sftp.html
+ *    sftp_async_read
+ */
+static VALUE m_download(int argc, VALUE *argv, VALUE self) {
+  SFTPHolder *holder = libssh_ruby_sftp_holder(self);
+  VALUE remote_path, local, opts, ret;
+  const ID table[] = {id_mode,   id_requests, id_chunk,
+                      id_digest, id_resume,   id_range};
+  VALUE kwvals[sizeof(table) / sizeof(*table)];
+  struct sftp_transfer t;
+  int close_fd = 0, resume;
+
+  rb_scan_args(argc, argv, "20:", &remote_path, &local, &opts);
+  rb_get_kwargs(opts, table, 0, 6, kwvals);
+  remote_path = rb_str_new_frozen(remote_path);
+  transfer_init(&t, holder, kwvals[1], kwvals[2]);
+  t.remote = StringValueCStr(remote_path);
+  resume = kwvals[4] != Qundef && RTEST(kwvals[4]);
+  if (kwvals[5] != Qundef && !NIL_P(kwvals[5])) {
+    parse_range(&t, kwvals[5]);
+  }
+  t.verify = resume || t.offset > 0 || t.end != UINT64_MAX;
+  libssh_ruby_digest_init(&t.digest, kwvals[3]);
+
+  if (local_path_p(local)) {
+    int mode = 0666, flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+    if (kwvals[0] != Qundef && !NIL_P(kwvals[0])) {
+      mode = NUM2INT(kwvals[0]);
+    }
+    if (resume) {
+      flags = (t.digest.meta != NULL ? O_RDWR : O_WRONLY) | O_CREAT;
+    }
+    FilePathValue(local);
+    t.fd = rb_cloexec_open(StringValueCStr(local), flags, mode);
+    if (t.fd < 0) {
+      rb_sys_fail_str(local);
+    }
+    close_fd = 1;
+  } else {
+    t.fd = libssh_ruby_fd(local);
+  }
+  if (resume) {
+    resume_local(&t, close_fd ? t.fd : -1, local);
+  }
+
+  ret = transfer_call(holder, &t, nogvl_download, close_fd ? t.fd : -1, local);
+  RB_GC_GUARD(remote_path);
+  return ret;
+}
+
+/* @overload upload(local, remote_path, mode: nil, requests: 32, chunk: 32768, digest: nil)
+ *  Upload a local file with +requests+ writes in flight. The file is read
+ *  without GVL. Writes are pipelined with libssh 0.11 or later, and sent
+ *  one by one with older libssh.
+ *  @param [String, IO, Integer] local The path of the local file, or an IO
+ *    or a file descriptor to read from.
+ *  @param [String] remote_path The remote file, which is created or
+ *    truncated.
+ *  @param [Fixnum, nil] mode The UNIX permissions for a new remote file.
+ *    The permissions of the local file are used by default, or 0644 for an
+ *    IO.
+ *  @param [Integer] requests The number of writes in flight.
+ *  @param [Integer] chunk The size of each write. The server may limit it.
+ *  @param [Symbol, Class, nil] digest An algorithm such as +:sha256+ or
+ *    +:md5+, or a Digest::Base subclass, to hash the data sent.
+ *  @return [Integer, Array] The number of bytes sent, or
+ *    +[bytes, hexdigest]+ with +digest+.
+ *  @see http://api.libssh.org/stable/group__libssh__sftp.html
+ *    sftp_aio_begin_write
+ */
+static VALUE m_upload(int argc, VALUE *argv, VALUE self) {
+  SFTPHolder *holder = libssh_ruby_sftp_holder(self);
+  VALUE local, remote_path, opts, ret;
+  const ID table[] = {id_mode, id_requests, id_chunk, id_digest};
+  VALUE kwvals[sizeof(table) / sizeof(*table)];
+  struct sftp_transfer t;
+  int close_fd = 0;
+
+  rb_scan_args(argc, argv, "20:", &local, &remote_path, &opts);
+  rb_get_kwargs(opts, table, 0, 4, kwvals);
+  remote_path = rb_str_new_frozen(remote_path);
+  transfer_init(&t, holder, kwvals[1], kwvals[2]);
+  t.remote = StringValueCStr(remote_path);
+  libssh_ruby_digest_init(&t.digest, kwvals[3]);
+
+  if (local_path_p(local)) {
+    struct stat st;
+
+    FilePathValue(local);
+    t.fd = rb_cloexec_open(StringValueCStr(local), O_RDONLY, 0);
+    if (t.fd < 0) {
+      rb_sys_fail_str(local);
+    }
+    if (fstat(t.fd, &st) != 0) {
+      int err = errno;
+      close(t.fd);
+      rb_syserr_fail_str(err, local);
+    }
+    t.mode = st.st_mode & 07777;
+    close_fd = 1;
+  } else {
+    t.fd = libssh_ruby_fd(local);
+  }
+  if (kwvals[0] != Qundef && !NIL_P(kwvals[0])) {
+    t.mode = NUM2INT(kwvals[0]);
+  }
+
+  ret = transfer_call(holder, &t, nogvl_upload, close_fd ? t.fd : -1, local);
+  RB_GC_GUARD(remote_path);
+  return ret;
+}
+
+static SFTPHolder *file_sftp_holder(SFTPFileHolder *file) {
+  return libssh_ruby_sftp_holder(file->sftp);
+}
+
+struct nogvl_file_args {
+  sftp_file file;
+  void *buf;
+  size_t len;
+  ssize_t rc;
+};
+
+static void *nogvl_file_close(void *ptr) {
+  struct nogvl_file_args *args = ptr;
+  args->rc = sftp_close(args->file);
+  return NULL;
+}
+
+/* @overload close
+ *  Close the remote file.
+ *  @return [nil]
+ *  @see http://api.libssh.org/stable/group__libssh__sftp.html sftp_close
+ */
+static VALUE file_close(VALUE self) {
+  SFTPFileHolder *file;
+  SFTPHolder *holder;
+  struct nogvl_file_args args;
+
+  TypedData_Get_Struct(self, SFTPFileHolder, &sftp_file_type, file);
+  if (file->file == NULL) {
+    return Qnil;
+  }
+  holder = file_sftp_holder(file);
+  args.file = file->file;
+  file->file = NULL;
+  libssh_ruby_nogvl(nogvl_file_close, &args);
+  RAISE_IF_ERROR(args.rc);
+  return Qnil;
+}
+
+/* @overload closed?
+ *  Check if the remote file is closed or not.
+ *  @return [Boolean]
+ */
+static VALUE file_closed_p(VALUE self) {
+  SFTPFileHolder *file;
+
+  TypedData_Get_Struct(self, SFTPFileHolder, &sftp_file_type, file);
+  return file->file == NULL ? Qtrue : Qfalse;
+}
+
+static void *nogvl_file_read(void *ptr) {
+  struct nogvl_file_args *args = ptr;
+  args->rc = sftp_read(args->file, args->buf, args->len);
+  return NULL;
+}
+
+/* @overload read(size)
+ *  Read from the current position of the remote file.
+ *  @param [Integer] size The maximum count of bytes to be read.
+ *  @return [String, nil] An ASCII-8BIT String, or nil at EOF.
+ *  @see http://api.libssh.org/stable/group__libssh__sftp.html sftp_read
+ */
+static VALUE file_read(VALUE self, VALUE size) {
+  SFTPFileHolder *file = get_file_holder(self);
+  SFTPHolder *holder = file_sftp_holder(file);
+  struct nogvl_file_args args;
+  VALUE ret;
+
+  args.file = file->file;
+  args.len = NUM2SIZET(size);
+  ret = rb_str_new(NULL, args.len);
+  args.buf = RSTRING_PTR(ret);
+  libssh_ruby_nogvl(nogvl_file_read, &args);
+  RAISE_IF_ERROR(args.rc);
+  if (args.rc == 0 && args.len > 0) {
+    return Qnil;
+  }
+  rb_str_resize(ret, args.rc);
+  return ret;
+}
+
+static void *nogvl_file_write(void *ptr) {
+  struct nogvl_file_args *args = ptr;
+  args->rc = sftp_write(args->file, args->buf, args->len);
+  return NULL;
+}
+
+/* @overload write(data)
+ *  Write at the current position of the remote file.
+ *  @param [String] data The data to write.
+ *  @return [Integer] The number of bytes written.
+ *  @see http://api.libssh.org/stable/group__libssh__sftp.html sftp_write
+ */
+static VALUE file_write(VALUE self, VALUE data) {
+  SFTPFileHolder *file = get_file_holder(self);
+  SFTPHolder *holder = file_sftp_holder(file);
+  struct nogvl_file_args args;
+
+  data = rb_str_new_frozen(StringValue(data));
+  args.file = file->file;
+  args.buf = RSTRING_PTR(data);
+  args.len = RSTRING_LEN(data);
+  libssh_ruby_nogvl(nogvl_file_write, &args);
+  RB_GC_GUARD(data);
+  RAISE_IF_ERROR(args.rc);
+  return SSIZET2NUM(args.rc);
+}
+
+/* @overload seek(offset)
+ *  Move the position of the remote file. No request is sent.
+ *  @param [Integer] offset The new position.
+ *  @return [0]
+ *  @see http://api.libssh.org/stable/group__libssh__sftp.html sftp_seek64
+ */
+static VALUE file_seek(VALUE self, VALUE offset) {
+  SFTPFileHolder *file = get_file_holder(self);
+
+  if (sftp_seek64(file->file, NUM2ULL(offset)) != 0) {
+    rb_raise(rb_eIOError, "seek failed");
+  }
+  return INT2FIX(0);
+}
+
+/* @overload pos
+ *  Get the position of the remote file.
+ *  @return [Integer]
+ *  @see http://api.libssh.org/stable/group__libssh__sftp.html sftp_tell64
+ */
+static VALUE file_pos(VALUE self) {
+  return ULL2NUM(sftp_tell64(get_file_holder(self)->file));
+}
+
+struct nogvl_fstat_args {
+  sftp_file file;
+  sftp_attributes attrs;
+};
+
+static void *nogvl_fstat(void *ptr) {
+  struct nogvl_fstat_args *args = ptr;
+  args->attrs = sftp_fstat(args->file);
+  return NULL;
+}
+
+/* @overload stat
+ *  Get the attributes of the remote file.
+ *  @return [Attributes]
+ *  @see http://api.libssh.org/stable/group__libssh__sftp.html sftp_fstat
+ */
+static VALUE file_stat(VALUE self) {
+  SFTPFileHolder *file = get_file_holder(self);
+  SFTPHolder *holder = file_sftp_holder(file);
+  struct nogvl_fstat_args args;
+  VALUE ret;
+
+  args.file = file->file;
+  libssh_ruby_nogvl(nogvl_fstat, &args);
+  if (args.attrs == NULL) {
+    RAISE_IF_ERROR(SSH_ERROR);
+  }
+  ret = attributes_new(args.attrs);
+  sftp_attributes_free(args.attrs);
+  return ret;
+}
+
+/* Document-class: LibSSH::SFTP
+ * Wrapper for sftp_session struct in libssh. Unlike {Scp}, SFTP has random
+ * access and can keep many requests in flight.
+ *
+ * @since 0.5.0
+ * @see http://api.libssh.org/stable/group__libssh__sftp.html
+ */
+
+/* Document-class: LibSSH::SFTP::File
+ * Wrapper for sftp_file struct in libssh. Created by {SFTP#open}.
+ *
+ * @since 0.5.0
+ * @see http://api.libssh.org/stable/group__libssh__sftp.html
+ */
+
+void Init_libssh_sftp(void) {
+  rb_cLibSSHSFTP = rb_define_class_under(rb_mLibSSH, "SFTP", rb_cObject);
+  rb_define_alloc_func(rb_cLibSSHSFTP, sftp_alloc);
+
+  /*
+   * Document-class: LibSSH::SFTP::Attributes
+   * Attributes of a remote file. +type+ is one of +:regular+, +:directory+,
+   * +:symlink+, +:special+ and +:unknown+. The other members are nil when
+   * the server doesn't send them.
+   *
+   * @since 0.5.0
+   */
+  rb_cLibSSHSFTPAttributes = rb_struct_define_under(
+      rb_cLibSSHSFTP, "Attributes", "name", "type", "size", "permissions",
+      "uid", "gid", "atime", "mtime", NULL);
+
+  rb_define_method(rb_cLibSSHSFTP, "initialize", RUBY_METHOD_FUNC(m_initialize),
+                   1);
+  rb_define_method(rb_cLibSSHSFTP, "init", RUBY_METHOD_FUNC(m_init), 0);
+  rb_define_method(rb_cLibSSHSFTP, "close", RUBY_METHOD_FUNC(m_close), 0);
+  rb_define_method(rb_cLibSSHSFTP, "stat", RUBY_METHOD_FUNC(m_stat), 1);
+  rb_define_method(rb_cLibSSHSFTP, "lstat", RUBY_METHOD_FUNC(m_lstat), 1);
+  rb_define_method(rb_cLibSSHSFTP, "readdir", RUBY_METHOD_FUNC(m_readdir), 1);
+  rb_define_method(rb_cLibSSHSFTP, "mkdir", RUBY_METHOD_FUNC(m_mkdir), -1);
+  rb_define_method(rb_cLibSSHSFTP, "rmdir", RUBY_METHOD_FUNC(m_rmdir), 1);
+  rb_define_method(rb_cLibSSHSFTP, "unlink", RUBY_METHOD_FUNC(m_unlink), 1);
+  rb_define_method(rb_cLibSSHSFTP, "rename", RUBY_METHOD_FUNC(m_rename), 2);
+  rb_define_method(rb_cLibSSHSFTP, "open", RUBY_METHOD_FUNC(m_open), -1);
+  rb_define_method(rb_cLibSSHSFTP, "download", RUBY_METHOD_FUNC(m_download),
+                   -1);
+  rb_define_method(rb_cLibSSHSFTP, "upload", RUBY_METHOD_FUNC(m_upload), -1);
+
+  rb_cLibSSHSFTPFile =
+      rb_define_class_under(rb_cLibSSHSFTP, "File", rb_cObject);
+  rb_undef_alloc_func(rb_cLibSSHSFTPFile);
+  rb_define_method(rb_cLibSSHSFTPFile, "close", RUBY_METHOD_FUNC(file_close),
+                   0);
+  rb_define_method(rb_cLibSSHSFTPFile, "closed?",
+                   RUBY_METHOD_FUNC(file_closed_p), 0);
+  rb_define_method(rb_cLibSSHSFTPFile, "read", RUBY_METHOD_FUNC(file_read), 1);
+  rb_define_method(rb_cLibSSHSFTPFile, "write", RUBY_METHOD_FUNC(file_write),
+                   1);
+  rb_define_method(rb_cLibSSHSFTPFile, "seek", RUBY_METHOD_FUNC(file_seek), 1);
+  rb_define_method(rb_cLibSSHSFTPFile, "pos", RUBY_METHOD_FUNC(file_pos), 0);
+  rb_define_method(rb_cLibSSHSFTPFile, "stat", RUBY_METHOD_FUNC(file_stat), 0);
+
+  id_mode = rb_intern("mode");
+  id_requests = rb_intern("requests");
+  id_chunk = rb_intern("chunk");
+  id_digest = rb_intern("digest");
+  id_to_path = rb_intern("to_path");
+  id_resume = rb_intern("resume");
+  id_range = rb_intern("range");
+  id_regular = rb_intern("regular");
+  id_directory = rb_intern("directory");
+  id_symlink = rb_intern("symlink");
+  id_special = rb_intern("special");
+  id_unknown = rb_intern("unknown");
+}
@@ -0,0 +1,223 @@
+#include "libssh_ruby.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <ruby/digest.h>
+#include <ruby/thread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+VALUE rb_mLibSSHSync;
+
+static ID id_concurrency, id_sha256;
+
+#define DIGEST_CHUNK_SIZE (256 * 1024)
+#define DIGEST_MAX_THREADS 64
+
+struct digest_job {
+  const char *path;
+  /* -1 while pending, 0 on success, or errno */
+  int err;
+};
+
+struct digest_files_args {
+  const rb_digest_metadata_t *meta;
+  struct digest_job *jobs;
+  long njobs;
+  long next;
+  int concurrency;
+  /* +digest_len+ bytes for each job */
+  unsigned char *digests;
+  /* Set by the unblocking function to stop the workers */
+  volatile int interrupted;
+};
+
+/* Return 0, errno, or -1 if interrupted. */
+static int digest_file(struct digest_files_args *args, long i, void *ctx,
+                       char *buf) {
+  const rb_digest_metadata_t *meta = args->meta;
+  int fd, err = 0;
+
+  fd = open(args->jobs[i].path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return errno;
+  }
+  if (!meta->init_func(ctx)) {
+    close(fd);
+    return EINVAL;
+  }
+  for (;;) {
+    ssize_t n;
+
+    if (args->interrupted) {
+      err = -1;
+      break;
+    }
+    n = read(fd, buf, DIGEST_CHUNK_SIZE);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      err = errno;
+      break;
+    }
+    if (n == 0) {
+      if (!meta->finish_func(ctx, args->digests + i * meta->digest_len)) {
+        err = EINVAL;
+      }
+      break;
+    }
+    meta->update_func(ctx, (unsigned char *)buf, (size_t)n);
+  }
+  close(fd);
+  return err;
+}
+
+static void *digest_worker(void *ptr) {
+  struct digest_files_args *args = ptr;
+  void *ctx = malloc(args->meta->ctx_size);
+  char *buf = malloc(DIGEST_CHUNK_SIZE);
+
+  for (;;) {
+    long i = __atomic_fetch_add(&args->next, 1, __ATOMIC_RELAXED);
+    int err;
+
+    if (i >= args->njobs || args->interrupted) {
+      break;
+    }
+    if (args->jobs[i].err != -1) {
+      continue;
+    }
+    if (ctx == NULL || buf == NULL) {
+      err = ENOMEM;
+    } else {
+      err = digest_file(args, i, ctx, buf);
+    }
+    if (err == -1) {
+      break;
+    }
+    args->jobs[i].err = err;
+  }
+  free(ctx);
+  free(buf);
+  return NULL;
+}
+
+static void *nogvl_digest_files(void *ptr) {
+  struct digest_files_args *args = ptr;
+  pthread_t threads[DIGEST_MAX_THREADS];
+  int i, nthreads = 0;
+
+  for (i = 1; i < args->concurrency; i++) {
+    if (pthread_create(&threads[nthreads], NULL, digest_worker, args) != 0) {
+      break;
+    }
+    nthreads++;
+  }
+  /* This thread works too, so the jobs are done even if no thread starts. */
+  digest_worker(args);
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  return NULL;
+}
+
+static void digest_files_ubf(void *ptr) {
+  struct digest_files_args *args = ptr;
+  args->interrupted = 1;
+}
+
+/* @overload digest_files(paths, algorithm = :sha256, concurrency: 4)
+ *  Compute the digests of local files in parallel native threads without
+ *  GVL.
+ *  @param [Array<String>] paths The paths of the local files.
+ *  @param [Symbol, String, Class] algorithm The digest algorithm, such as
+ *    +:sha256+, or a Digest::Base subclass.
+ *  @param [Integer] concurrency The number of the threads.
+ *  @return [Array<String>] The hex digest of each file in order.
+ *  @raise [SystemCallError] If a file cannot be read.
+ *  @since 0.5.0
+ */
+static VALUE s_digest_files(int argc, VALUE *argv,
+                            RB_UNUSED_VAR(VALUE klass)) {
+  VALUE paths, algo, opts, keep, jobs_tmp, digests_tmp, ret;
+  const ID table[] = {id_concurrency};
+  VALUE kwvals[sizeof(table) / sizeof(*table)];
+  struct digest_files_args args;
+  long i, pending;
+
+  rb_scan_args(argc, argv, "11:", &paths, &algo, &opts);
+  rb_get_kwargs(opts, table, 0, 1, kwvals);
+  Check_Type(paths, T_ARRAY);
+  args.meta = libssh_ruby_digest_metadata(NIL_P(algo) ? ID2SYM(id_sha256)
+                                                     : algo);
+  args.concurrency =
+      kwvals[0] == Qundef || NIL_P(kwvals[0]) ? 4 : NUM2INT(kwvals[0]);
+  if (args.concurrency < 1) {
+    rb_raise(rb_eArgError, "concurrency must be positive");
+  }
+  if (args.concurrency > DIGEST_MAX_THREADS) {
+    args.concurrency = DIGEST_MAX_THREADS;
+  }
+
+  /* Keep the strings alive and unchanged during the call. */
+  keep = rb_ary_new_capa(RARRAY_LEN(paths));
+  args.njobs = RARRAY_LEN(paths);
+  args.jobs = ALLOCV_N(struct digest_job, jobs_tmp, args.njobs);
+  args.digests = ALLOCV_N(unsigned char, digests_tmp,
+                          args.njobs * args.meta->digest_len);
+  for (i = 0; i < args.njobs; i++) {
+    VALUE path = RARRAY_AREF(paths, i);
+
+    FilePathValue(path);
+    path = rb_str_new_frozen(path);
+    rb_ary_push(keep, path);
+    args.jobs[i].path = StringValueCStr(path);
+    args.jobs[i].err = -1;
+  }
+
+  /* Resume the pending jobs if interrupted without an exception. */
+  pending = args.njobs;
+  while (pending > 0) {
+    args.next = 0;
+    args.interrupted = 0;
+    rb_thread_call_without_gvl(nogvl_digest_files, &args, digest_files_ubf,
+                               &args);
+    rb_thread_check_ints();
+    for (pending = 0, i = 0; i < args.njobs; i++) {
+      if (args.jobs[i].err == -1) {
+        pending++;
+      }
+    }
+  }
+
+  ret = rb_ary_new_capa(args.njobs);
+  for (i = 0; i < args.njobs; i++) {
+    if (args.jobs[i].err != 0) {
+      rb_syserr_fail_str(args.jobs[i].err, RARRAY_AREF(keep, i));
+    }
+    rb_ary_push(ret, libssh_ruby_hex_new(args.digests +
+                                             i * args.meta->digest_len,
+                                         args.meta->digest_len));
+  }
+  ALLOCV_END(jobs_tmp);
+  ALLOCV_END(digests_tmp);
+  RB_GC_GUARD(keep);
+  return ret;
+}
+
+/*
+ * Document-module: LibSSH::Sync
+ * Push a local directory to a remote one, sending only the changed files.
+ *
+ * @since 0.5.0
+ */
+
+void Init_libssh_sync(void) {
+  rb_mLibSSHSync = rb_define_module_under(rb_mLibSSH, "Sync");
+  rb_define_singleton_method(rb_mLibSSHSync, "digest_files",
+                             RUBY_METHOD_FUNC(s_digest_files), -1);
+
+  id_concurrency = rb_intern("concurrency");
+  id_sha256 = rb_intern("sha256");
+}
@@ -0,0 +1,1332 @@
+#include "libssh_ruby.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <ruby/thread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+extern VALUE rb_cLibSSHChannel;
+
+static ID id_compress, id_level, id_stderr, id_gzip, id_zstd;
+
+#define TAR_BLOCK 512
+#define TAR_CHUNK_SIZE (256 * 1024)
+/* Bytes buffered between the channel and the worker */
+#define TAR_QUEUE_SIZE (4 * 1024 * 1024)
+/* Limit of the data of GNU long name and pax headers */
+#define TAR_EXT_MAX (1024 * 1024)
+/* Bytes of the stderr of the remote command kept during the transfer */
+#define TAR_STDERR_MAX (64 * 1024)
+
+enum tar_compress { TAR_COMPRESS_NONE, TAR_COMPRESS_GZIP, TAR_COMPRESS_ZSTD };
+
+/* Bounded byte stream between the channel and the worker thread */
+struct tar_queue {
+  char *buf;
+  size_t capa, head, len;
+  /* Set by the writer at the end of the stream */
+  int closed;
+  /* Set by either side to stop the other */
+  int aborted;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+struct tar_transfer {
+  ssh_channel channel;
+  const char *dir;
+  int compress;
+  int level;
+  struct tar_queue queue;
+  /* Used by the worker: file data and compressed data */
+  char *buf;
+  char *out;
+  size_t outlen;
+  /* Used by the channel side */
+  char *chunk;
+#ifdef HAVE_LIBZ
+  z_stream z;
+  int z_ready;
+#endif
+#ifdef HAVE_LIBZSTD
+  ZSTD_CStream *zc;
+  ZSTD_DStream *zd;
+#endif
+  /* Set at the end of a compressed stream */
+  int zend;
+  uint64_t zin;
+
+  /* The walked path while sending */
+  char walk[PATH_MAX];
+
+  /* State of the parser while receiving */
+  char header[TAR_BLOCK];
+  size_t header_len;
+  /* Bytes left in the data of the current entry and the padding after it */
+  uint64_t remaining, padding;
+  /* The file being written, or -1 */
+  int fd;
+  char path[PATH_MAX];
+  int mode;
+  time_t mtime;
+  /* Data of a GNU long name ('L') or pax ('x') header being collected */
+  int collect;
+  char *ext;
+  size_t ext_len;
+  /* Name and size given by the last long name or pax header */
+  char longname[PATH_MAX];
+  int longname_set;
+  uint64_t pax_size;
+  /* Set at the end-of-archive block */
+  int ended;
+
+  unsigned long files;
+  uint64_t bytes;
+  /* Error of the worker: errno with +errpath+, or +message+ */
+  int err;
+  const char *message;
+  char errpath[PATH_MAX];
+  /* Error of the channel */
+  int rc;
+  /* Stderr of the remote command read during the transfer */
+  struct capture_buffer errout;
+  /* Pipe to wake up the channel side, and the flag set with it */
+  int wakeup[2];
+  volatile int interrupted;
+};
+
+static const char zeros[TAR_BLOCK * 2];
+
+static void queue_init(struct tar_queue *q) {
+  q->buf = ruby_xmalloc(TAR_QUEUE_SIZE);
+  q->capa = TAR_QUEUE_SIZE;
+  q->head = 0;
+  q->len = 0;
+  q->closed = 0;
+  q->aborted = 0;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->cond, NULL);
+}
+
+static void queue_destroy(struct tar_queue *q) {
+  ruby_xfree(q->buf);
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->cond);
+}
+
+/* Return 0, or -1 if aborted. */
+static int queue_write(struct tar_queue *q, const char *data, size_t len) {
+  int rc;
+
+  pthread_mutex_lock(&q->lock);
+  while (len > 0 && !q->aborted) {
+    size_t tail, n;
+
+    if (q->len == q->capa) {
+      pthread_cond_wait(&q->cond, &q->lock);
+      continue;
+    }
+    tail = (q->head + q->len) % q->capa;
+    n = q->capa - q->len;
+    if (n > q->capa - tail) {
+      n = q->capa - tail;
+    }
+    if (n > len) {
+      n = len;
+    }
+    memcpy(q->buf + tail, data, n);
+    q->len += n;
+    data += n;
+    len -= n;
+    pthread_cond_broadcast(&q->cond);
+  }
+  rc = q->aborted ? -1 : 0;
+  pthread_mutex_unlock(&q->lock);
+  return rc;
+}
+
+/* Return the bytes read, 0 at the end of the stream, or -1 if aborted. */
+static long queue_read(struct tar_queue *q, char *buf, size_t len) {
+  long n;
+
+  pthread_mutex_lock(&q->lock);
+  while (q->len == 0 && !q->closed && !q->aborted) {
+    pthread_cond_wait(&q->cond, &q->lock);
+  }
+  if (q->aborted) {
+    n = -1;
+  } else {
+    size_t count = len < q->len ? len : q->len;
+
+    if (count > q->capa - q->head) {
+      count = q->capa - q->head;
+    }
+    memcpy(buf, q->buf + q->head, count);
+    q->head = (q->head + count) % q->capa;
+    q->len -= count;
+    n = (long)count;
+    pthread_cond_broadcast(&q->cond);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return n;
+}
+
+static void queue_finish(struct tar_queue *q, int abort) {
+  pthread_mutex_lock(&q->lock);
+  if (abort) {
+    q->aborted = 1;
+  } else {
+    q->closed = 1;
+  }
+  pthread_cond_broadcast(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+}
+
+/* Record the first error. Return -1. */
+static int tar_fail(struct tar_transfer *t, int err, const char *message,
+                    const char *path) {
+  if (t->err == 0 && t->message == NULL) {
+    t->err = err;
+    t->message = message;
+    if (path != NULL) {
+      snprintf(t->errpath, sizeof(t->errpath), "%s", path);
+    }
+  }
+  return -1;
+}
+
+static int sink_flush(struct tar_transfer *t) {
+  if (t->outlen > 0) {
+    if (queue_write(&t->queue, t->out, t->outlen) != 0) {
+      return -1;
+    }
+    t->outlen = 0;
+  }
+  return 0;
+}
+
+/*
+ * Pass tar bytes through the compressor to the queue. +finish+ ends the
+ * compressed stream, and +len+ must be 0 then.
+ */
+static int sink_write(struct tar_transfer *t, const void *data, size_t len,
+                      int finish) {
+  switch (t->compress) {
+#ifdef HAVE_LIBZ
+  case TAR_COMPRESS_GZIP: {
+    int rc;
+
+    t->z.next_in = (Bytef *)data;
+    t->z.avail_in = (uInt)len;
+    do {
+      t->z.next_out = (Bytef *)t->out + t->outlen;
+      t->z.avail_out = (uInt)(TAR_CHUNK_SIZE - t->outlen);
+      rc = deflate(&t->z, finish ? Z_FINISH : Z_NO_FLUSH);
+      if (rc == Z_STREAM_ERROR) {
+        return tar_fail(t, 0, "gzip compression failed", NULL);
+      }
+      t->outlen = TAR_CHUNK_SIZE - t->z.avail_out;
+      if (t->outlen == TAR_CHUNK_SIZE || (finish && rc == Z_STREAM_END)) {
+        if (sink_flush(t) != 0) {
+          return -1;
+        }
+      }
+    } while (t->z.avail_in > 0 || (finish && rc != Z_STREAM_END));
+    return 0;
+  }
+#endif
+#ifdef HAVE_LIBZSTD
+  case TAR_COMPRESS_ZSTD: {
+    ZSTD_inBuffer in;
+    size_t rc;
+
+    in.src = data;
+    in.size = len;
+    in.pos = 0;
+    do {
+      ZSTD_outBuffer out;
+
+      out.dst = t->out;
+      out.size = TAR_CHUNK_SIZE;
+      out.pos = t->outlen;
+      rc = finish ? ZSTD_endStream(t->zc, &out)
+                  : ZSTD_compressStream(t->zc, &out, &in);
+      if (ZSTD_isError(rc)) {
+        return tar_fail(t, 0, "zstd compression failed", NULL);
+      }
+      t->outlen = out.pos;
+      if (t->outlen == TAR_CHUNK_SIZE || (finish && rc == 0)) {
+        if (sink_flush(t) != 0) {
+          return -1;
+        }
+      }
+    } while (finish ? rc != 0 : in.pos < in.size);
+    return 0;
+  }
+#endif
+  default:
+    while (len > 0) {
+      size_t n = TAR_CHUNK_SIZE - t->outlen;
+
+      if (n > len) {
+        n = len;
+      }
+      memcpy(t->out + t->outlen, data, n);
+      t->outlen += n;
+      data = (const char *)data + n;
+      len -= n;
+      if (t->outlen == TAR_CHUNK_SIZE && sink_flush(t) != 0) {
+        return -1;
+      }
+    }
+    return finish ? sink_flush(t) : 0;
+  }
+}
+
+/* Store +value+ as octal digits and NUL, or in base-256 if it's too large. */
+static void tar_number_store(char *field, size_t width, uint64_t value) {
+  size_t i;
+
+  if (value >> (3 * (width - 1)) == 0) {
+    field[width - 1] = '\0';
+    for (i = width - 1; i > 0; i--) {
+      field[i - 1] = (char)('0' + (value & 7));
+      value >>= 3;
+    }
+  } else {
+    for (i = width - 1; i > 0; i--) {
+      field[i] = (char)(value & 0xff);
+      value >>= 8;
+    }
+    field[0] = (char)0x80;
+  }
+}
+
+static uint64_t tar_number_load(const char *field, size_t width) {
+  uint64_t value = 0;
+  size_t i;
+
+  if ((unsigned char)field[0] & 0x80) {
+    for (i = 1; i < width; i++) {
+      value = (value << 8) | (unsigned char)field[i];
+    }
+    return value;
+  }
+  for (i = 0; i < width && (field[i] == ' ' || field[i] == '0'); i++) {
+  }
+  for (; i < width && field[i] >= '0' && field[i] <= '7'; i++) {
+    value = (value << 3) | (uint64_t)(field[i] - '0');
+  }
+  return value;
+}
+
+static unsigned tar_checksum(const char *h) {
+  unsigned sum = 0;
+  size_t i;
+
+  for (i = 0; i < TAR_BLOCK; i++) {
+    sum += (i >= 148 && i < 156) ? ' ' : (unsigned char)h[i];
+  }
+  return sum;
+}
+
+/*
+ * Write a ustar header. A name which doesn't fit in the name and prefix
+ * fields is preceded by a GNU long name header.
+ */
+static int tar_header(struct tar_transfer *t, const char *name, char type,
+                      const struct stat *st, uint64_t size) {
+  char h[TAR_BLOCK];
+  size_t len = strlen(name), split = 0, i;
+
+  if (len > 100) {
+    for (i = 1; i < len && i <= 155; i++) {
+      if (name[i] == '/' && len - i - 1 <= 100 && len - i - 1 > 0) {
+        split = i;
+        break;
+      }
+    }
+    if (split == 0) {
+      memset(h, 0, sizeof(h));
+      strcpy(h, "././@LongLink");
+      tar_number_store(h + 100, 8, 0);
+      tar_number_store(h + 108, 8, 0);
+      tar_number_store(h + 116, 8, 0);
+      tar_number_store(h + 124, 12, len + 1);
+      tar_number_store(h + 136, 12, 0);
+      h[156] = 'L';
+      memcpy(h + 257, "ustar", 6);
+      memcpy(h + 263, "00", 2);
+      snprintf(h + 148, 8, "%06o", tar_checksum(h));
+      h[155] = ' ';
+      if (sink_write(t, h, TAR_BLOCK, 0) != 0 ||
+          sink_write(t, name, len + 1, 0) != 0 ||
+          sink_write(t, zeros, (TAR_BLOCK - (len + 1) % TAR_BLOCK) % TAR_BLOCK,
+                     0) != 0) {
+        return -1;
+      }
+    }
+  }
+
+  memset(h, 0, sizeof(h));
+  if (split > 0) {
+    memcpy(h + 345, name, split);
+    memcpy(h, name + split + 1, len - split - 1);
+  } else {
+    memcpy(h, name, len > 100 ? 100 : len);
+  }
+  tar_number_store(h + 100, 8, st->st_mode & 07777);
+  tar_number_store(h + 108, 8, st->st_uid);
+  tar_number_store(h + 116, 8, st->st_gid);
+  tar_number_store(h + 124, 12, size);
+  tar_number_store(h + 136, 12, st->st_mtime < 0 ? 0 : st->st_mtime);
+  h[156] = type;
+  memcpy(h + 257, "ustar", 6);
+  memcpy(h + 263, "00", 2);
+  snprintf(h + 148, 8, "%06o", tar_checksum(h));
+  h[155] = ' ';
+  return sink_write(t, h, TAR_BLOCK, 0);
+}
+
+/* Write the file at +t->walk+ as +name+. */
+static int tar_file(struct tar_transfer *t, const char *name) {
+  struct stat st;
+  uint64_t rest;
+  int fd, eof = 0, rc = -1;
+
+  fd = open(t->walk, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (fd < 0) {
+    return tar_fail(t, errno, NULL, t->walk);
+  }
+  if (fstat(fd, &st) != 0) {
+    tar_fail(t, errno, NULL, t->walk);
+    goto done;
+  }
+  if (tar_header(t, name, '0', &st, (uint64_t)st.st_size) != 0) {
+    goto done;
+  }
+  for (rest = (uint64_t)st.st_size; rest > 0;) {
+    size_t count = rest < TAR_CHUNK_SIZE ? (size_t)rest : TAR_CHUNK_SIZE;
+    ssize_t n = 0;
+
+    if (!eof) {
+      n = read(fd, t->buf, count);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        tar_fail(t, errno, NULL, t->walk);
+        goto done;
+      }
+      eof = n == 0;
+    }
+    if (eof) {
+      /* Truncated during the transfer. Keep the size in the header. */
+      memset(t->buf, 0, count);
+      n = (ssize_t)count;
+    }
+    if (sink_write(t, t->buf, (size_t)n, 0) != 0) {
+      goto done;
+    }
+    rest -= (uint64_t)n;
+  }
+  if (sink_write(t, zeros, (TAR_BLOCK - st.st_size % TAR_BLOCK) % TAR_BLOCK,
+                 0) != 0) {
+    goto done;
+  }
+  t->files++;
+  t->bytes += (uint64_t)st.st_size;
+  rc = 0;
+done:
+  close(fd);
+  return rc;
+}
+
+/*
+ * Write the entries in the directory +t->walk+ of +len+ bytes. Names in the
+ * archive start at +base+ of +t->walk+. Regular files and directories are
+ * written, and the other types such as symbolic links are skipped.
+ */
+static int tar_walk(struct tar_transfer *t, size_t len, size_t base) {
+  DIR *dir;
+  struct dirent *ent;
+  int rc = 0;
+
+  dir = opendir(t->walk);
+  if (dir == NULL) {
+    return tar_fail(t, errno, NULL, t->walk);
+  }
+  while (rc == 0 && (errno = 0, ent = readdir(dir)) != NULL) {
+    size_t n = strlen(ent->d_name);
+    struct stat st;
+
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+      continue;
+    }
+    if (len + n + 3 > sizeof(t->walk)) {
+      rc = tar_fail(t, ENAMETOOLONG, NULL, t->walk);
+      break;
+    }
+    t->walk[len] = '/';
+    memcpy(t->walk + len + 1, ent->d_name, n + 1);
+    if (lstat(t->walk, &st) != 0) {
+      rc = tar_fail(t, errno, NULL, t->walk);
+    } else if (S_ISDIR(st.st_mode)) {
+      memcpy(t->walk + len + 1 + n, "/", 2);
+      rc = tar_header(t, t->walk + base, '5', &st, 0);
+      t->walk[len + 1 + n] = '\0';
+      if (rc == 0) {
+        rc = tar_walk(t, len + 1 + n, base);
+      }
+    } else if (S_ISREG(st.st_mode)) {
+      rc = tar_file(t, t->walk + base);
+    }
+  }
+  if (rc == 0 && errno != 0) {
+    t->walk[len] = '\0';
+    rc = tar_fail(t, errno, NULL, t->walk);
+  }
+  t->walk[len] = '\0';
+  closedir(dir);
+  return rc;
+}
+
+static void *tar_send_worker(void *ptr) {
+  struct tar_transfer *t = ptr;
+  size_t len = strlen(t->walk);
+
+  if (tar_walk(t, len, len + 1) == 0 &&
+      sink_write(t, zeros, sizeof(zeros), 0) == 0 &&
+      sink_write(t, NULL, 0, 1) == 0) {
+    queue_finish(&t->queue, 0);
+  } else {
+    queue_finish(&t->queue, 1);
+  }
+  return NULL;
+}
+
+/*
+ * The session is nonblocking on the channel side, which waits for its socket
+ * here together with the wakeup pipe. Return -1 if interrupted.
+ */
+static int tar_wait(struct tar_transfer *t) {
+  ssh_session session = ssh_channel_get_session(t->channel);
+  struct pollfd pfds[2];
+
+  pfds[0].fd = ssh_get_fd(session);
+  pfds[0].events = POLLIN;
+  if (ssh_get_poll_flags(session) & SSH_WRITE_PENDING) {
+    pfds[0].events |= POLLOUT;
+  }
+  pfds[1].fd = t->wakeup[0];
+  pfds[1].events = POLLIN;
+  pfds[0].revents = pfds[1].revents = 0;
+  if (poll(pfds, 2, -1) < 0 && errno != EINTR) {
+    return tar_fail(t, errno, NULL, NULL);
+  }
+  return t->interrupted ? -1 : 0;
+}
+
+/*
+ * Read what the remote command has written to stderr, and to stdout while
+ * sending, so that its output never fills the window and stops it. Return
+ * -1 on an error.
+ */
+static int tar_drain(struct tar_transfer *t, int with_stdout) {
+  char buf[16384];
+  int is_stderr;
+
+  for (is_stderr = with_stdout ? 0 : 1; is_stderr < 2; is_stderr++) {
+    for (;;) {
+      int n = ssh_channel_read_timeout(t->channel, buf, sizeof(buf), is_stderr,
+                                       0);
+
+      if (n == SSH_ERROR) {
+        t->rc = SSH_ERROR;
+        return -1;
+      } else if (n <= 0) {
+        break;
+      }
+      if (is_stderr && libssh_ruby_capture_append(&t->errout, buf, n,
+                                                  TAR_STDERR_MAX) != 0) {
+        return tar_fail(t, ENOMEM, NULL, NULL);
+      }
+    }
+  }
+  return 0;
+}
+
+/* Return 0, or -1 on an error or an interrupt. */
+static int tar_channel_write(struct tar_transfer *t, const char *ptr,
+                             size_t len) {
+  while (len > 0) {
+    uint32_t n = len > UINT32_MAX ? UINT32_MAX : (uint32_t)len;
+    int rc;
+
+    if (tar_drain(t, 1) != 0) {
+      return -1;
+    }
+    rc = ssh_channel_write(t->channel, ptr, n);
+
+    if (rc == SSH_ERROR) {
+      t->rc = SSH_ERROR;
+      return -1;
+    }
+    ptr += rc;
+    len -= rc;
+    if ((uint32_t)rc < n && tar_wait(t) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void *nogvl_send_tar(void *ptr) {
+  struct tar_transfer *t = ptr;
+  pthread_t thread;
+  int err;
+
+  err = pthread_create(&thread, NULL, tar_send_worker, t);
+  if (err != 0) {
+    tar_fail(t, err, NULL, NULL);
+    return NULL;
+  }
+  for (;;) {
+    long n = queue_read(&t->queue, t->chunk, TAR_CHUNK_SIZE);
+
+    if (n <= 0) {
+      break;
+    }
+    if (tar_channel_write(t, t->chunk, (size_t)n) != 0) {
+      queue_finish(&t->queue, 1);
+      break;
+    }
+  }
+  pthread_join(thread, NULL);
+  return NULL;
+}
+
+/*
+ * Resolve +name+ in the archive to a path under +t->dir+. Return 1 to skip
+ * the entry of the directory itself.
+ */
+static int tar_path(struct tar_transfer *t, const char *name, char *path) {
+  size_t len = strlen(t->dir);
+  const char *p = name;
+
+  if (len >= PATH_MAX) {
+    return tar_fail(t, ENAMETOOLONG, NULL, t->dir);
+  }
+  memcpy(path, t->dir, len);
+  while (*p != '\0') {
+    const char *slash = strchr(p, '/');
+    size_t n = slash == NULL ? strlen(p) : (size_t)(slash - p);
+
+    if (n == 2 && p[0] == '.' && p[1] == '.') {
+      return tar_fail(t, 0, "unsafe path in tar stream", name);
+    }
+    if (n > 0 && !(n == 1 && p[0] == '.')) {
+      if (len + 1 + n >= PATH_MAX) {
+        return tar_fail(t, ENAMETOOLONG, NULL, name);
+      }
+      path[len++] = '/';
+      memcpy(path + len, p, n);
+      len += n;
+    }
+    p += n;
+    if (*p == '/') {
+      p++;
+    }
+  }
+  path[len] = '\0';
+  return len == strlen(t->dir) ? 1 : 0;
+}
+
+/* Create the missing parent directories of +path+ below +t->dir+. */
+static void tar_mkdir_parents(struct tar_transfer *t, char *path) {
+  char *p;
+
+  for (p = path + strlen(t->dir) + 1; (p = strchr(p, '/')) != NULL; p++) {
+    *p = '\0';
+    mkdir(path, 0755);
+    *p = '/';
+  }
+}
+
+static int tar_entry_end(struct tar_transfer *t);
+
+static int tar_entry_begin(struct tar_transfer *t) {
+  const char *h = t->header;
+  char name[PATH_MAX], path[PATH_MAX];
+  uint64_t size;
+  char type;
+  int rc;
+
+  if (memcmp(h, zeros, TAR_BLOCK) == 0) {
+    t->ended = 1;
+    return 0;
+  }
+  if (tar_number_load(h + 148, 8) != tar_checksum(h)) {
+    return tar_fail(t, 0, "invalid tar header", NULL);
+  }
+  type = h[156];
+  size = tar_number_load(h + 124, 12);
+  if (t->pax_size != UINT64_MAX && type != 'L' && type != 'x' &&
+      type != 'g') {
+    size = t->pax_size;
+    t->pax_size = UINT64_MAX;
+  }
+  t->remaining = size;
+  t->padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+  t->collect = 0;
+
+  switch (type) {
+  case 'L':
+  case 'x':
+    if (size >= TAR_EXT_MAX) {
+      return tar_fail(t, 0, "too large tar header", NULL);
+    }
+    t->ext = realloc(t->ext, (size_t)size + 1);
+    if (t->ext == NULL) {
+      return tar_fail(t, ENOMEM, NULL, NULL);
+    }
+    t->ext_len = 0;
+    t->collect = type;
+    break;
+  case 'g':
+    break;
+  default:
+    if (t->longname_set) {
+      memcpy(name, t->longname, sizeof(name));
+      t->longname_set = 0;
+    } else if (memcmp(h + 257, "ustar", 5) == 0 && h[345] != '\0') {
+      snprintf(name, sizeof(name), "%.155s/%.100s", h + 345, h);
+    } else {
+      snprintf(name, sizeof(name), "%.100s", h);
+    }
+    rc = tar_path(t, name, path);
+    if (rc != 0) {
+      if (rc < 0) {
+        return -1;
+      }
+      break;
+    }
+    t->mode = (int)(tar_number_load(h + 100, 8) & 07777);
+    t->mtime = (time_t)tar_number_load(h + 136, 12);
+    if (type == '0' || type == '\0' || type == '7') {
+      int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW;
+
+      t->fd = open(path, flags, 0600);
+      if (t->fd < 0 && errno == ENOENT) {
+        tar_mkdir_parents(t, path);
+        t->fd = open(path, flags, 0600);
+      }
+      if (t->fd < 0) {
+        return tar_fail(t, errno, NULL, path);
+      }
+      memcpy(t->path, path, sizeof(t->path));
+    } else if (type == '5') {
+      /* Keep the directory writable to extract the files in it. */
+      mode_t mode = (mode_t)(t->mode | S_IRWXU);
+
+      rc = mkdir(path, mode);
+      if (rc != 0 && errno == ENOENT) {
+        tar_mkdir_parents(t, path);
+        rc = mkdir(path, mode);
+      }
+      if (rc != 0 && errno != EEXIST) {
+        return tar_fail(t, errno, NULL, path);
+      }
+    }
+    /* The other types, such as symbolic links, are skipped. */
+    break;
+  }
+  if (t->remaining == 0) {
+    return tar_entry_end(t);
+  }
+  return 0;
+}
+
+/* Take the path and size records of a pax header. */
+static void tar_pax(struct tar_transfer *t) {
+  char *p = t->ext, *end = t->ext + t->ext_len;
+
+  while (p < end) {
+    char *rec = p, *key, *eq;
+    unsigned long len = strtoul(p, &key, 10);
+
+    if (len == 0 || (size_t)(end - rec) < len || *key != ' ') {
+      break;
+    }
+    key++;
+    p = rec + len;
+    eq = memchr(key, '=', (size_t)(p - key));
+    if (eq == NULL || p[-1] != '\n') {
+      continue;
+    }
+    if (eq - key == 4 && memcmp(key, "path", 4) == 0 &&
+        (size_t)(p - 1 - (eq + 1)) < sizeof(t->longname)) {
+      memcpy(t->longname, eq + 1, (size_t)(p - 1 - (eq + 1)));
+      t->longname[p - 1 - (eq + 1)] = '\0';
+      t->longname_set = 1;
+    } else if (eq - key == 4 && memcmp(key, "size", 4) == 0) {
+      t->pax_size = strtoull(eq + 1, NULL, 10);
+    }
+  }
+}
+
+static int tar_entry_end(struct tar_transfer *t) {
+  if (t->collect == 'L') {
+    t->ext[t->ext_len] = '\0';
+    snprintf(t->longname, sizeof(t->longname), "%s", t->ext);
+    t->longname_set = 1;
+  } else if (t->collect == 'x') {
+    tar_pax(t);
+  }
+  t->collect = 0;
+  if (t->fd >= 0) {
+    struct timespec times[2];
+    int fd = t->fd, err = 0;
+
+    times[0].tv_sec = t->mtime;
+    times[0].tv_nsec = 0;
+    times[1] = times[0];
+    t->fd = -1;
+    if (fchmod(fd, (mode_t)t->mode) != 0 || futimens(fd, times) != 0) {
+      err = errno;
+    }
+    if (close(fd) != 0 && err == 0) {
+      err = errno;
+    }
+    if (err != 0) {
+      return tar_fail(t, err, NULL, t->path);
+    }
+    t->files++;
+  }
+  return 0;
+}
+
+static int tar_entry_data(struct tar_transfer *t, const char *data,
+                          size_t len) {
+  if (t->collect) {
+    memcpy(t->ext + t->ext_len, data, len);
+    t->ext_len += len;
+  } else if (t->fd >= 0) {
+    size_t off = 0;
+
+    while (off < len) {
+      ssize_t n = write(t->fd, data + off, len - off);
+
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return tar_fail(t, errno, NULL, t->path);
+      }
+      off += (size_t)n;
+    }
+    t->bytes += len;
+  }
+  return 0;
+}
+
+static int tar_parse(struct tar_transfer *t, const char *data, size_t len) {
+  while (len > 0 && !t->ended) {
+    size_t n;
+
+    if (t->remaining > 0) {
+      n = len < t->remaining ? len : (size_t)t->remaining;
+      if (tar_entry_data(t, data, n) != 0) {
+        return -1;
+      }
+      t->remaining -= n;
+      if (t->remaining == 0 && tar_entry_end(t) != 0) {
+        return -1;
+      }
+    } else if (t->padding > 0) {
+      n = len < t->padding ? len : (size_t)t->padding;
+      t->padding -= n;
+    } else {
+      n = TAR_BLOCK - t->header_len;
+      if (n > len) {
+        n = len;
+      }
+      memcpy(t->header + t->header_len, data, n);
+      t->header_len += n;
+      if (t->header_len == TAR_BLOCK) {
+        t->header_len = 0;
+        if (tar_entry_begin(t) != 0) {
+          return -1;
+        }
+      }
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Pass received bytes through the decompressor to the parser. */
+static int source_write(struct tar_transfer *t, const char *data,
+                        size_t len) {
+  t->zin += len;
+  switch (t->compress) {
+#ifdef HAVE_LIBZ
+  case TAR_COMPRESS_GZIP:
+    t->z.next_in = (Bytef *)data;
+    t->z.avail_in = (uInt)len;
+    do {
+      int rc;
+
+      if (t->zend && t->z.avail_in > 0) {
+        /* Another gzip member follows. */
+        inflateReset(&t->z);
+        t->zend = 0;
+      }
+      t->z.next_out = (Bytef *)t->out;
+      t->z.avail_out = TAR_CHUNK_SIZE;
+      rc = inflate(&t->z, Z_NO_FLUSH);
+      if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+        return tar_fail(t, 0, "invalid gzip stream", NULL);
+      }
+      if (tar_parse(t, t->out, TAR_CHUNK_SIZE - t->z.avail_out) != 0) {
+        return -1;
+      }
+      if (rc == Z_STREAM_END) {
+        t->zend = 1;
+      }
+    } while (t->z.avail_in > 0 || t->z.avail_out == 0);
+    return 0;
+#endif
+#ifdef HAVE_LIBZSTD
+  case TAR_COMPRESS_ZSTD: {
+    ZSTD_inBuffer in;
+    int more;
+
+    in.src = data;
+    in.size = len;
+    in.pos = 0;
+    do {
+      ZSTD_outBuffer out;
+      size_t rc;
+
+      out.dst = t->out;
+      out.size = TAR_CHUNK_SIZE;
+      out.pos = 0;
+      rc = ZSTD_decompressStream(t->zd, &out, &in);
+      if (ZSTD_isError(rc)) {
+        return tar_fail(t, 0, "invalid zstd stream", NULL);
+      }
+      if (tar_parse(t, t->out, out.pos) != 0) {
+        return -1;
+      }
+      t->zend = rc == 0;
+      more = out.pos == out.size;
+    } while (in.pos < in.size || more);
+    return 0;
+  }
+#endif
+  default:
+    return tar_parse(t, data, len);
+  }
+}
+
+/* Check that the stream hasn't been cut in the middle. */
+static int source_finish(struct tar_transfer *t) {
+  if (t->compress != TAR_COMPRESS_NONE && t->zin > 0 && !t->zend) {
+    return tar_fail(t, 0, "truncated compressed stream", NULL);
+  }
+  if (!t->ended &&
+      (t->remaining > 0 || t->padding > 0 || t->header_len > 0)) {
+    return tar_fail(t, 0, "truncated tar stream", NULL);
+  }
+  return 0;
+}
+
+static void *tar_receive_worker(void *ptr) {
+  struct tar_transfer *t = ptr;
+
+  for (;;) {
+    long n = queue_read(&t->queue, t->buf, TAR_CHUNK_SIZE);
+
+    if (n < 0) {
+      break;
+    } else if (n == 0) {
+      source_finish(t);
+      break;
+    }
+    if (source_write(t, t->buf, (size_t)n) != 0) {
+      queue_finish(&t->queue, 1);
+      break;
+    }
+  }
+  return NULL;
+}
+
+static void *nogvl_receive_tar(void *ptr) {
+  struct tar_transfer *t = ptr;
+  pthread_t thread;
+  int err;
+
+  err = pthread_create(&thread, NULL, tar_receive_worker, t);
+  if (err != 0) {
+    tar_fail(t, err, NULL, NULL);
+    return NULL;
+  }
+  for (;;) {
+    int n;
+
+    if (tar_drain(t, 0) != 0) {
+      queue_finish(&t->queue, 1);
+      break;
+    }
+    n = ssh_channel_read_timeout(t->channel, t->chunk, TAR_CHUNK_SIZE, 0, 0);
+    if (n == 0) {
+      /* Unlike ssh_channel_is_eof, this ignores data left in stderr. */
+      n = ssh_channel_poll(t->channel, 0);
+      if (n == SSH_EOF || ssh_channel_is_closed(t->channel)) {
+        queue_finish(&t->queue, 0);
+        break;
+      } else if (n == 0 && tar_wait(t) != 0) {
+        queue_finish(&t->queue, 1);
+        break;
+      } else if (n != SSH_ERROR) {
+        continue;
+      }
+    }
+    if (n == SSH_ERROR) {
+      t->rc = SSH_ERROR;
+      queue_finish(&t->queue, 1);
+      break;
+    }
+    if (queue_write(&t->queue, t->chunk, (size_t)n) != 0) {
+      break;
+    }
+  }
+  pthread_join(thread, NULL);
+  return NULL;
+}
+
+static int tar_compress_option(VALUE compress) {
+  if (compress == Qundef || !RTEST(compress)) {
+    return TAR_COMPRESS_NONE;
+  }
+  if (compress == ID2SYM(id_gzip)) {
+#ifdef HAVE_LIBZ
+    return TAR_COMPRESS_GZIP;
+#else
+    rb_raise(rb_eNotImpError, "gzip is not supported by this build");
+#endif
+  }
+  if (compress == ID2SYM(id_zstd)) {
+#ifdef HAVE_LIBZSTD
+    return TAR_COMPRESS_ZSTD;
+#else
+    rb_raise(rb_eNotImpError, "zstd is not supported by this build");
+#endif
+  }
+  rb_raise(rb_eArgError, "Unsupported compression: %" PRIsVALUE, compress);
+}
+
+/* Raise ArgumentError unless the compressor accepts +level+, which it would
+ * otherwise report as a failure to allocate. */
+static void tar_check_level(int compress, int level) {
+  int min = 0, max = 0;
+
+  switch (compress) {
+#ifdef HAVE_LIBZ
+  case TAR_COMPRESS_GZIP:
+    min = Z_DEFAULT_COMPRESSION;
+    max = Z_BEST_COMPRESSION;
+    break;
+#endif
+#ifdef HAVE_LIBZSTD
+  case TAR_COMPRESS_ZSTD:
+#ifdef HAVE_ZSTD_MINCLEVEL
+    min = ZSTD_minCLevel();
+#else
+    min = 0; /* The default level */
+#endif
+    max = ZSTD_maxCLevel();
+    break;
+#endif
+  default:
+    /* Not compressed, so the level is unused. */
+    return;
+  }
+  if (level < min || level > max) {
+    rb_raise(rb_eArgError, "level must be between %d and %d: %d", min, max,
+             level);
+  }
+}
+
+/* Stop both the channel side and the worker. */
+static void tar_ubf(void *ptr) {
+  struct tar_transfer *t = ptr;
+
+  t->interrupted = 1;
+  queue_finish(&t->queue, 1);
+  if (write(t->wakeup[1], "", 1) < 0) {
+    /* The pipe is full, so the channel side will wake up anyway. */
+  }
+}
+
+struct tar_call_args {
+  struct tar_transfer *t;
+  void *(*func)(void *);
+  int sending;
+  /* String to append the stderr to, or nil */
+  VALUE errout;
+  SessionHolder *session;
+  int nonblocking;
+};
+
+static VALUE tar_call_body(VALUE ptr) {
+  struct tar_call_args *args = (struct tar_call_args *)ptr;
+  struct tar_transfer *t = args->t;
+  int i;
+
+  if (pipe(t->wakeup) != 0) {
+    t->wakeup[0] = t->wakeup[1] = -1;
+    rb_sys_fail("pipe");
+  }
+  for (i = 0; i < 2; i++) {
+    fcntl(t->wakeup[i], F_SETFL, fcntl(t->wakeup[i], F_GETFL) | O_NONBLOCK);
+    fcntl(t->wakeup[i], F_SETFD, FD_CLOEXEC);
+  }
+  switch (t->compress) {
+#ifdef HAVE_LIBZ
+  case TAR_COMPRESS_GZIP:
+    /* 16 for the gzip format, and 32 to accept both zlib and gzip */
+    if (args->sending) {
+      t->z_ready = deflateInit2(&t->z, t->level, Z_DEFLATED, 15 + 16, 8,
+                                Z_DEFAULT_STRATEGY) == Z_OK;
+    } else {
+      t->z_ready = inflateInit2(&t->z, 15 + 32) == Z_OK;
+    }
+    if (!t->z_ready) {
+      rb_raise(rb_eNoMemError, "failed to initialize zlib");
+    }
+    break;
+#endif
+#ifdef HAVE_LIBZSTD
+  case TAR_COMPRESS_ZSTD:
+    if (args->sending) {
+      t->zc = ZSTD_createCStream();
+      if (t->zc == NULL || ZSTD_isError(ZSTD_initCStream(t->zc, t->level))) {
+        rb_raise(rb_eNoMemError, "failed to initialize zstd");
+      }
+    } else {
+      t->zd = ZSTD_createDStream();
+      if (t->zd == NULL || ZSTD_isError(ZSTD_initDStream(t->zd))) {
+        rb_raise(rb_eNoMemError, "failed to initialize zstd");
+      }
+    }
+    break;
+#endif
+  default:
+    break;
+  }
+  /* The transfer waits for the channel only in tar_wait. */
+  libssh_ruby_session_nonblocking_begin(args->session);
+  args->nonblocking = 1;
+  rb_thread_call_without_gvl(args->func, t, tar_ubf, t);
+  return Qnil;
+}
+
+static VALUE tar_call_ensure(VALUE ptr) {
+  struct tar_call_args *args = (struct tar_call_args *)ptr;
+  struct tar_transfer *t = args->t;
+
+  if (args->nonblocking) {
+    libssh_ruby_session_nonblocking_end(args->session);
+  }
+#ifdef HAVE_LIBZ
+  if (t->z_ready) {
+    if (args->sending) {
+      deflateEnd(&t->z);
+    } else {
+      inflateEnd(&t->z);
+    }
+  }
+#endif
+#ifdef HAVE_LIBZSTD
+  ZSTD_freeCStream(t->zc);
+  ZSTD_freeDStream(t->zd);
+#endif
+  if (t->fd >= 0) {
+    close(t->fd);
+  }
+  if (t->wakeup[0] >= 0) {
+    close(t->wakeup[0]);
+    close(t->wakeup[1]);
+  }
+  if (!NIL_P(args->errout) && t->errout.len > 0) {
+    rb_str_cat(args->errout, t->errout.ptr, (long)t->errout.len);
+  }
+  free(t->errout.ptr);
+  free(t->ext);
+  ruby_xfree(t->buf);
+  ruby_xfree(t->out);
+  ruby_xfree(t->chunk);
+  queue_destroy(&t->queue);
+  return Qnil;
+}
+
+static VALUE tar_call(int argc, VALUE *argv, VALUE self, int sending) {
+  ChannelHolder *holder = libssh_ruby_channel_holder(self);
+  VALUE dir, opts, ret;
+  volatile VALUE tmp = 0;
+  /* level: comes last so that receive_tar can leave it out */
+  const ID table[] = {id_compress, id_stderr, id_level};
+  VALUE kwvals[sizeof(table) / sizeof(*table)];
+  struct tar_transfer *t;
+  struct tar_call_args args;
+  int compress, level;
+
+  rb_scan_args(argc, argv, "10:", &dir, &opts);
+  rb_get_kwargs(opts, table, 0, sending ? 3 : 2, kwvals);
+  FilePathValue(dir);
+  dir = rb_str_new_frozen(dir);
+  if (RSTRING_LEN(dir) >= PATH_MAX) {
+    rb_syserr_fail_str(ENAMETOOLONG, dir);
+  }
+  compress = tar_compress_option(kwvals[0]);
+  if (kwvals[1] == Qundef || NIL_P(kwvals[1])) {
+    args.errout = Qnil;
+  } else {
+    StringValue(kwvals[1]);
+    rb_str_modify(kwvals[1]);
+    args.errout = kwvals[1];
+  }
+  if (sending && kwvals[2] != Qundef && !NIL_P(kwvals[2])) {
+    level = NUM2INT(kwvals[2]);
+    tar_check_level(compress, level);
+  } else if (compress == TAR_COMPRESS_ZSTD) {
+    level = 3;
+  } else {
+    level = -1; /* Z_DEFAULT_COMPRESSION */
+  }
+
+  /* Too large for the stack of a fiber. Freed by GC on an exception. */
+  t = rb_alloc_tmp_buffer(&tmp, (long)sizeof(*t));
+  memset(t, 0, sizeof(*t));
+  t->compress = compress;
+  t->level = level;
+  t->channel = holder->channel;
+  t->dir = StringValueCStr(dir);
+  snprintf(t->walk, sizeof(t->walk), "%s", t->dir);
+  t->fd = -1;
+  t->wakeup[0] = t->wakeup[1] = -1;
+  t->pax_size = UINT64_MAX;
+  t->buf = ALLOC_N(char, TAR_CHUNK_SIZE);
+  t->out = ALLOC_N(char, TAR_CHUNK_SIZE);
+  t->chunk = ALLOC_N(char, TAR_CHUNK_SIZE);
+  queue_init(&t->queue);
+
+  args.t = t;
+  args.func = sending ? nogvl_send_tar : nogvl_receive_tar;
+  args.sending = sending;
+  args.session = libssh_ruby_session_holder(holder->session);
+  args.nonblocking = 0;
+  rb_ensure(tar_call_body, (VALUE)&args, tar_call_ensure, (VALUE)&args);
+  RB_GC_GUARD(dir);
+  RB_GC_GUARD(args.errout);
+
+  if (t->err != 0 || t->message != NULL) {
+    int err = t->err;
+    const char *message = t->message;
+    VALUE path = t->errpath[0] ? rb_str_new_cstr(t->errpath) : Qnil;
+
+    if (message == NULL) {
+      rb_syserr_fail_str(err, path);
+    } else if (NIL_P(path)) {
+      rb_raise(rb_eIOError, "%s", message);
+    } else {
+      rb_raise(rb_eIOError, "%s: %" PRIsVALUE, message, path);
+    }
+  }
+  if (t->rc == SSH_ERROR) {
+    libssh_ruby_raise(ssh_channel_get_session(holder->channel));
+  }
+  rb_thread_check_ints();
+  ret = rb_assoc_new(ULONG2NUM(t->files), ULL2NUM(t->bytes));
+  rb_free_tmp_buffer(&tmp);
+  return ret;
+}
+
+/*
+ * @overload send_tar(local_dir, compress: nil, stderr: nil, level: nil)
+ *  Write the files in a local directory to the channel as a tar stream,
+ *  such as to the stdin of +tar x+. The stream is generated and compressed
+ *  by a native thread without GVL while it is sent. Regular files and
+ *  directories are sent, and the other types such as symbolic links are
+ *  skipped. The output of the remote command is read while sending so that
+ *  it never stops the command. Its stdout is discarded.
+ *  @param [String] local_dir The local directory. The names in the stream
+ *    are relative to it.
+ *  @param [Symbol, nil] compress +:gzip+ or +:zstd+ to compress the stream.
+ *  @param [String, nil] stderr A String to append the first 64 KiB of the
+ *    stderr read during the transfer to. The rest is discarded.
+ *  @param [Integer, nil] level The compression level. The default of the
+ *    compressor is used if +nil+. gzip accepts -1 to 9, and zstd accepts
+ *    +ZSTD_minCLevel()+ to +ZSTD_maxCLevel()+.
+ *  @return [Array] +[files, bytes]+. The number of the files and bytes
+ *    sent before compression.
+ *  @raise [NotImplementedError] If the compressor isn't available.
+ *  @raise [ArgumentError] If the compressor doesn't accept +level+.
+ *  @since 0.5.0
+ *  @see Session#push_tree
+ */
+static VALUE m_send_tar(int argc, VALUE *argv, VALUE self) {
+  return tar_call(argc, argv, self, 1);
+}
+
+/*
+ * @overload receive_tar(local_dir, compress: nil, stderr: nil)
+ *  Read a tar stream from the channel until EOF, such as the stdout of
+ *  +tar c+, and extract it into a local directory. The stream is
+ *  decompressed and extracted by a native thread without GVL while it is
+ *  received. Regular files and directories are extracted, and the other
+ *  types such as symbolic links are skipped. Entries with +..+ in their
+ *  names are rejected.
+ *  @param [String] local_dir The existing local directory.
+ *  @param [Symbol, nil] compress +:gzip+ or +:zstd+ if the stream is
+ *    compressed.
+ *  @param [String, nil] stderr A String to append the first 64 KiB of the
+ *    stderr read during the transfer to. The rest is discarded.
+ *  @return [Array] +[files, bytes]+. The number of the files and bytes
+ *    extracted.
+ *  @raise [NotImplementedError] If the decompressor isn't available.
+ *  @since 0.5.0
+ *  @see Session#pull_tree
+ */
+static VALUE m_receive_tar(int argc, VALUE *argv, VALUE self) {
+  return tar_call(argc, argv, self, 0);
+}
+
+void Init_libssh_tar(void) {
+  rb_define_method(rb_cLibSSHChannel, "send_tar", RUBY_METHOD_FUNC(m_send_tar),
+                   -1);
+  rb_define_method(rb_cLibSSHChannel, "receive_tar",
+                   RUBY_METHOD_FUNC(m_receive_tar), -1);
+
+  id_compress = rb_intern("compress");
+  id_level = rb_intern("level");
+  id_stderr = rb_intern("stderr");
+  id_gzip = rb_intern("gzip");
+  id_zstd = rb_intern("zstd");
+}
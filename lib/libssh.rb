@@ -1,3 +1,8 @@
 require 'libssh/version'
 require 'libssh/libssh_ruby'
+require 'libssh/channel'
+require 'libssh/channel_pool'
 require 'libssh/key'
+require 'libssh/remote_file'
+require 'libssh/session'
+require 'libssh/sync'
@@ -0,0 +1,34 @@
+module LibSSH
+  class Channel
+    # Window size used by {#high_throughput!}.
+    # @since 0.5.0
+    HIGH_THROUGHPUT_WINDOW_SIZE = 16 * 1024 * 1024
+
+    # Use a large window for bulk transfers on links with a large
+    # bandwidth-delay product. Must be called before {#open_session}.
+    # @param [Integer] window_size The local window size in bytes.
+    # @return [self]
+    # @see #window_size=
+    # @since 0.5.0
+    def high_throughput!(window_size = HIGH_THROUGHPUT_WINDOW_SIZE)
+      self.window_size = window_size
+      self
+    end
+
+    # Read at most +maxlen+ bytes from the channel. This makes a channel
+    # usable as the source of +IO.copy_stream+.
+    # @param [Fixnum] maxlen The maximum count of bytes to be read.
+    # @param [String, nil] outbuf The buffer to be filled.
+    # @return [String] The data read.
+    # @raise [EOFError] When the channel reaches EOF.
+    # @see #read_into
+    # @since 0.5.0
+    def readpartial(maxlen, outbuf = nil)
+      outbuf ||= String.new
+      if read_into(outbuf, maxlen).zero? && eof?
+        raise EOFError, 'end of file reached'
+      end
+      outbuf
+    end
+  end
+end
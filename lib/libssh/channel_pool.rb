@@ -0,0 +1,79 @@
+module LibSSH
+  # Session channels opened ahead of use. Requests to open channels are sent
+  # without waiting for the replies, which are handled while the session is
+  # used for other channels, so a checked out channel is usually open
+  # already.
+  # @since 0.5.0
+  # @see Session#channel_pool
+  class ChannelPool
+    # @return [Session]
+    attr_reader :session
+    # @return [Integer] The number of the channels kept opening.
+    attr_reader :size
+
+    # @param [Session] session The connected and authenticated session.
+    # @param [Integer] size The number of the channels kept opening.
+    def initialize(session, size)
+      unless size.positive?
+        raise ArgumentError, 'size must be positive'
+      end
+      @session = session
+      @size = size
+      @channels = []
+      replenish
+    end
+
+    # Take an open session channel from the pool and open another in its
+    # place. Channels cannot be reused, so the channel isn't returned to the
+    # pool.
+    # @param [Numeric, Time, nil] deadline Raise {TimeoutError} unless the
+    #   channel is opened by then.
+    # @yieldparam [Channel] channel The open channel, closed after the block.
+    # @return [Channel, Object] The channel, or the return value of the block.
+    def checkout(deadline: nil)
+      replenish
+      channel = @channels.shift
+      channel.open_session(deadline: deadline)
+      replenish
+      if block_given?
+        begin
+          yield channel
+        ensure
+          channel.close
+        end
+      else
+        channel
+      end
+    end
+
+    # Close all of the channels in the pool. If closing a channel fails, the
+    # rest are still closed and the first error is raised.
+    # @return [nil]
+    def close
+      channels = @channels
+      @channels = []
+      error = nil
+      channels.each do |channel|
+        begin
+          # A channel can be closed only after its opening completes.
+          channel.open_session
+          channel.close
+        rescue Exception => e # rubocop:disable Lint/RescueException
+          error ||= e
+        end
+      end
+      raise error if error
+      nil
+    end
+
+    private
+
+    def replenish
+      while @channels.size < @size
+        channel = Channel.new(@session)
+        channel.open_session_nonblocking
+        @channels << channel
+      end
+    end
+  end
+end
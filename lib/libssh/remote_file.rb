@@ -0,0 +1,112 @@
+module LibSSH
+  class RemoteFile
+    include Enumerable
+
+    class << self
+      # Open a remote file to read.
+      # @param [SFTP, Session] sftp An initialized SFTP, or a Session to start
+      #   an SFTP which is closed with the file.
+      # @param [String] path The remote file.
+      # @param [Hash] options Options of {#initialize}.
+      # @yieldparam [RemoteFile] file The file, closed after the block.
+      # @return [RemoteFile, Object] The file, or the return value of the
+      #   block.
+      # @since 0.5.0
+      def open(sftp, path, **options)
+        file = new(sftp, path, **options)
+        return file unless block_given?
+        begin
+          yield file
+        ensure
+          file.close
+        end
+      end
+    end
+
+    alias tell pos
+
+    # Read from the current position like IO#read.
+    # @param [Integer, nil] length The maximum count of bytes to be read, or
+    #   nil to read until EOF.
+    # @return [String, nil] An ASCII-8BIT String, or nil at EOF when
+    #   +length+ is positive.
+    # @since 0.5.0
+    def read(length = nil)
+      data = length.nil? ? read_to_eof : read_block(length, pos)
+      self.pos += data.bytesize if data
+      data
+    end
+
+    # Move the current position like IO#seek.
+    # @param [Integer] offset The offset relative to +whence+.
+    # @param [Integer] whence IO::SEEK_SET, IO::SEEK_CUR or IO::SEEK_END.
+    # @return [0]
+    # @since 0.5.0
+    def seek(offset, whence = IO::SEEK_SET)
+      base =
+        case whence
+        when IO::SEEK_SET, :SET then 0
+        when IO::SEEK_CUR, :CUR then pos
+        when IO::SEEK_END, :END then size || raise(IOError, 'size of the remote file is unknown')
+        else raise ArgumentError, "unknown whence: #{whence}"
+        end
+      self.pos = base + offset
+      0
+    end
+
+    # @return [0]
+    # @since 0.5.0
+    def rewind
+      self.pos = 0
+      0
+    end
+
+    # @return [Boolean] Whether the current position is at EOF.
+    # @since 0.5.0
+    def eof?
+      read_block(1, pos).nil?
+    end
+    alias eof eof?
+
+    # Read a line from the current position like IO#gets.
+    # @param [String, nil] sep The line separator, or nil to read until EOF.
+    # @return [String, nil] The line, or nil at EOF.
+    # @since 0.5.0
+    def gets(sep = $/)
+      line = sep.nil? ? read_to_eof : pread_line(sep, pos)
+      return nil if line.empty?
+      self.pos += line.bytesize
+      line
+    end
+
+    # Iterate the lines from the current position like IO#each_line.
+    # @param [String, nil] sep The line separator.
+    # @yieldparam [String] line
+    # @return [self, Enumerator]
+    # @since 0.5.0
+    def each_line(sep = $/)
+      return enum_for(:each_line, sep) unless block_given?
+      while (line = gets(sep))
+        yield line
+      end
+      self
+    end
+    alias each each_line
+
+    private
+
+    def read_block(length, offset)
+      pread(length, offset)
+    rescue EOFError
+      nil
+    end
+
+    def read_to_eof
+      data = ''.b
+      while (chunk = read_block(block_size * 16, pos + data.bytesize))
+        data << chunk
+      end
+      data
+    end
+  end
+end
@@ -0,0 +1,254 @@
+require 'fileutils'
+require 'shellwords'
+
+module LibSSH
+  class Session
+    class << self
+      # Connect and authenticate to many hosts concurrently on a pool of
+      # native threads.
+      # @param [Array<Session, Hash>] host_specs Configured sessions, or
+      #   Hashes of session options. Each key of a Hash is set with the
+      #   setter of the same name (e.g. +host:+, +port:+, +user:+,
+      #   +knownhosts:+), and +identity:+ is added with {#add_identity}.
+      # @param [Integer] concurrency The number of the threads.
+      # @param [Boolean] verify Fail unless the server is known.
+      # @return [Array(Hash{Object => Session}, Hash{Object => LibSSH::Error})]
+      #   Ready sessions and errors, keyed by the host spec.
+      # @see Session.connect_sessions
+      # @since 0.5.0
+      def connect_all(host_specs, concurrency: 16, verify: true)
+        sessions = host_specs.map { |spec| spec.is_a?(Session) ? spec : from_spec(spec) }
+        begin
+          errors = connect_sessions(sessions, concurrency, verify)
+        rescue Exception # rubocop:disable Lint/RescueException
+          # Nobody else can reach the sessions created from the Hashes.
+          host_specs.each_with_index do |spec, i|
+            sessions[i].disconnect unless spec.is_a?(Session)
+          end
+          raise
+        end
+        ready = {}
+        failed = {}
+        host_specs.each_with_index do |spec, i|
+          if errors[i]
+            failed[spec] = errors[i]
+          else
+            ready[spec] = sessions[i]
+          end
+        end
+        [ready, failed]
+      end
+
+      private
+
+      def from_spec(spec)
+        new.tap do |session|
+          spec.each do |key, value|
+            if key.to_sym == :identity
+              Array(value).each { |path| session.add_identity(path) }
+            else
+              session.public_send("#{key}=", value)
+            end
+          end
+        end
+      end
+    end
+
+    # Use {Channel#high_throughput!} for channels created afterwards.
+    # @param [Integer] window_size The local window size in bytes.
+    # @return [self]
+    # @see #channel_window_size=
+    # @since 0.5.0
+    def high_throughput!(window_size = Channel::HIGH_THROUGHPUT_WINDOW_SIZE)
+      self.channel_window_size = window_size
+      self
+    end
+
+    # Keep session channels opened ahead of use to save the round trip of
+    # opening a channel.
+    # @param [Integer] size The number of the channels kept opening.
+    # @yieldparam [ChannelPool] pool The pool, closed after the block.
+    # @return [ChannelPool, Object] The pool, or the return value of the
+    #   block.
+    # @see ChannelPool
+    # @since 0.5.0
+    def channel_pool(size: 4)
+      pool = ChannelPool.new(self, size)
+      if block_given?
+        begin
+          yield pool
+        ensure
+          pool.close
+        end
+      else
+        pool
+      end
+    end
+
+    # Run a command on a new session channel and collect its output.
+    # @param [String] cmd The command to execute.
+    # @param [Integer, nil] max_output The maximum bytes kept for each of
+    #   stdout and stderr.
+    # @param [Numeric, Time, nil] deadline Raise {TimeoutError} unless the
+    #   command exits by then. A Numeric is seconds from now.
+    # @return [Array] +[stdout, stderr, exit_status]+.
+    # @raise [TimeoutError]
+    # @see Channel#exec_capture
+    # @since 0.5.0
+    def exec(cmd, max_output: nil, deadline: nil)
+      # Fix the deadline before opening the channel so that it covers both.
+      deadline = Time.now + deadline if deadline.is_a?(Numeric)
+      channel = Channel.new(self)
+      channel.open_session(deadline: deadline) do
+        channel.exec_capture(cmd, max_output: max_output, deadline: deadline)
+      end
+    end
+
+    # Run commands concurrently on this session, each on its own channel.
+    # @param [Array<String>] commands The commands to execute.
+    # @param [Integer] concurrency The maximum number of the open channels.
+    #   Keep it below MaxSessions of the server (10 by default for OpenSSH).
+    # @param [Integer, nil] max_output The maximum bytes kept for each of
+    #   stdout and stderr.
+    # @yieldparam [Integer] index The index of the command just finished.
+    # @yieldparam [Array, LibSSH::Error] result The result of the command.
+    # @return [Array<Array, LibSSH::Error>] +[stdout, stderr, exit_status]+
+    #   of each command in order, or the error if the command has failed.
+    # @see #exec_commands
+    # @since 0.5.0
+    def exec_many(commands, concurrency: 8, max_output: nil)
+      results = Array.new(commands.size)
+      exec_commands(commands, concurrency, max_output) do |i, result|
+        results[i] = result
+        yield i, result if block_given?
+      end
+      results
+    end
+
+    # Start the sftp subsystem on a new channel of this session.
+    # @yieldparam [SFTP] sftp The initialized sftp, closed after the block.
+    # @return [Object] The return value of the block.
+    # @see SFTP#init
+    # @since 0.5.0
+    def sftp(&block)
+      SFTP.new(self).init(&block)
+    end
+
+    # Forward local connections to a remote host via this session on a
+    # native thread.
+    # @param [String] bind_addr The local address to listen on.
+    # @param [Fixnum] local_port The local port to listen on.
+    # @param [String] remote_host The remote host to connect to.
+    # @param [Fixnum] remote_port The remote port to connect to.
+    # @yieldparam [Forward] forward The running forward, closed after the
+    #   block.
+    # @return [Forward, Object] The forward, or the return value of the block.
+    # @see Forward.local
+    # @since 0.5.0
+    def forward_local(bind_addr, local_port, remote_host, remote_port, &block)
+      with_forward(Forward.local(self, bind_addr, local_port, remote_host, remote_port), &block)
+    end
+
+    # Forward connections to a remote port back to a local host via this
+    # session on a native thread.
+    # @param [Fixnum] remote_port The remote port to listen on.
+    # @param [String] local_host The local host to connect to.
+    # @param [Fixnum] local_port The local port to connect to.
+    # @param [Numeric, Time, nil] deadline Raise {TimeoutError} unless the
+    #   server accepts the request by then. A Numeric is seconds from now.
+    # @yieldparam [Forward] forward The running forward, closed after the
+    #   block.
+    # @return [Forward, Object] The forward, or the return value of the block.
+    # @raise [TimeoutError]
+    # @see Forward.remote
+    # @since 0.5.0
+    def forward_remote(remote_port, local_host, local_port, deadline: nil, &block)
+      with_forward(Forward.remote(self, remote_port, local_host, local_port, deadline: deadline), &block)
+    end
+
+    # Send the files in a local directory to a remote directory as one tar
+    # stream through +tar x+ on a new channel. The stream is generated in
+    # native code, so no round trip is made for each file.
+    # @param [String] local_dir The local directory.
+    # @param [String] remote_dir The remote directory, created if missing.
+    # @param [Symbol, nil] compress +:gzip+ or +:zstd+ to compress the
+    #   stream. The remote host needs the command of the same name.
+    # @param [Integer, nil] level The compression level.
+    # @return [Array] +[files, bytes]+. The number of the files and bytes
+    #   sent before compression.
+    # @raise [IOError] If the remote command fails.
+    # @see Channel#send_tar
+    # @since 0.5.0
+    def push_tree(local_dir, remote_dir, compress: nil, level: nil)
+      check_tar_compress(compress)
+      dir = Shellwords.escape(remote_dir)
+      decompress = compress ? "#{compress} -dc | " : ''
+      run_tar("mkdir -p #{dir} && #{decompress}tar xf - -C #{dir}") do |channel, stderr|
+        result = channel.send_tar(local_dir, compress: compress, stderr: stderr, level: level)
+        channel.send_eof
+        result
+      end
+    end
+
+    # Receive the files in a remote directory as one tar stream from +tar c+
+    # on a new channel, and extract them in native code.
+    # @param [String] remote_dir The remote directory.
+    # @param [String] local_dir The local directory, created if missing.
+    # @param [Symbol, nil] compress +:gzip+ or +:zstd+ to compress the
+    #   stream. The remote host needs the command of the same name.
+    # @param [Integer, nil] level The compression level.
+    # @return [Array] +[files, bytes]+. The number of the files and bytes
+    #   extracted.
+    # @raise [IOError] If the remote command fails.
+    # @see Channel#receive_tar
+    # @since 0.5.0
+    def pull_tree(remote_dir, local_dir, compress: nil, level: nil)
+      check_tar_compress(compress)
+      FileUtils.mkdir_p(local_dir)
+      compressor = compress ? " | #{compress} -c#{" -#{Integer(level)}" if level}" : ''
+      run_tar("cd #{Shellwords.escape(remote_dir)} && tar cf - .#{compressor}") do |channel, stderr|
+        channel.receive_tar(local_dir, compress: compress, stderr: stderr)
+      end
+    end
+
+    private
+
+    def check_tar_compress(compress)
+      unless [nil, :gzip, :zstd].include?(compress)
+        raise ArgumentError, "Unsupported compression: #{compress.inspect}"
+      end
+    end
+
+    def run_tar(cmd)
+      channel = Channel.new(self)
+      channel.open_session do
+        channel.request_exec(cmd)
+        stderr = ''
+        result = yield channel, stderr
+        # Read both streams until EOF so that the command can exit. EOF is
+        # of the channel, so the rest of stderr is buffered meanwhile.
+        loop { break if channel.read(16_384, binary: true).empty? }
+        until (chunk = channel.read(4096, stderr: true)).empty?
+          stderr << chunk
+        end
+        status = channel.get_exit_status
+        unless status && status.zero?
+          raise IOError, "#{cmd} failed with status #{status}: #{stderr.strip}"
+        end
+        result
+      end
+    end
+
+    def with_forward(forward)
+      if block_given?
+        begin
+          yield forward
+        ensure
+          forward.close
+        end
+      else
+        forward
+      end
+    end
+  end
+end
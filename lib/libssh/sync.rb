@@ -0,0 +1,167 @@
+require 'find'
+require 'shellwords'
+
+module LibSSH
+  module Sync
+    # The result of {Sync.push}.
+    # @!attribute [r] uploaded
+    #   @return [Array<String>] The relative paths of the files sent.
+    # @!attribute [r] skipped
+    #   @return [Integer] The number of the unchanged files.
+    # @!attribute [r] bytes
+    #   @return [Integer] The number of bytes sent.
+    # @since 0.5.0
+    Result = Struct.new(:uploaded, :skipped, :bytes)
+
+    COMPARES = %i[mtime_size sha256].freeze
+    private_constant :COMPARES
+
+    class << self
+      # Push the regular files in a local directory to a remote directory,
+      # sending only the files which are missing or changed there.
+      #
+      # The remote side is listed by one command, the local digests are
+      # computed by {.digest_files}, and the changed files are sent through
+      # one recursive scp per session. Pass several sessions connected to the
+      # same host to send the files concurrently over their channels.
+      #
+      # @param [Session, Array<Session>] session Connected and authenticated
+      #   sessions.
+      # @param [String] local_dir The local directory.
+      # @param [String] remote_dir The remote directory, created if missing.
+      # @param [Integer] concurrency The number of the threads to compute the
+      #   local digests.
+      # @param [Symbol] compare +:mtime_size+ sends the files whose size
+      #   differs or which are newer than the remote ones. +:sha256+ sends the
+      #   files whose SHA-256 digest differs.
+      # @return [Result]
+      # @since 0.5.0
+      def push(session, local_dir, remote_dir, concurrency: 4, compare: :mtime_size)
+        unless COMPARES.include?(compare)
+          raise ArgumentError, "unknown compare: #{compare.inspect}"
+        end
+        sessions = Array(session)
+        raise ArgumentError, 'no session' if sessions.empty?
+        local_dir = File.expand_path(local_dir)
+
+        local = local_files(local_dir)
+        remote = remote_files(sessions.first, remote_dir, compare)
+        changed = changed_paths(local_dir, local, remote, compare, concurrency)
+        bytes = send_files(sessions, local_dir, remote_dir, changed)
+        Result.new(changed, local.size - changed.size, bytes)
+      end
+
+      private
+
+      # @return [Hash{String => File::Stat}]
+      def local_files(local_dir)
+        files = {}
+        prefix = File.join(local_dir, '')
+        Find.find(local_dir) do |path|
+          stat = File.lstat(path)
+          files[path[prefix.size..-1]] = stat if stat.file?
+        end
+        files
+      end
+
+      # @return [Hash{String => Array, String}] +[size, mtime]+ or the digest
+      #   of each remote file.
+      def remote_files(session, remote_dir, compare)
+        dir = Shellwords.escape(remote_dir)
+        cmd =
+          if compare == :sha256
+            "mkdir -p #{dir} && cd #{dir} && find . -type f -exec sha256sum {} +"
+          else
+            "mkdir -p #{dir} && find #{dir} -type f -printf '%P\\0%s\\0%T@\\0'"
+          end
+        stdout, stderr, status = session.exec(cmd)
+        unless status.zero?
+          raise IOError, "failed to list #{remote_dir}: #{stderr.strip}"
+        end
+        stdout.force_encoding(Encoding.find('filesystem'))
+        compare == :sha256 ? parse_sha256sum(stdout) : parse_find(stdout)
+      end
+
+      def parse_find(stdout)
+        files = {}
+        stdout.split("\0").each_slice(3) do |path, size, mtime|
+          files[path] = [size.to_i, mtime.to_i]
+        end
+        files
+      end
+
+      # Names with a backslash or a newline are escaped, and the line starts
+      # with a backslash.
+      def parse_sha256sum(stdout)
+        files = {}
+        stdout.each_line do |line|
+          line = line.chomp
+          escaped = line.start_with?('\\')
+          line = line[1..-1] if escaped
+          path = line[66..-1].sub(%r{\A\./}, '')
+          path = path.gsub(/\\(.)/) { |c| c == '\\n' ? "\n" : c[1] } if escaped
+          files[path] = line[0, 64]
+        end
+        files
+      end
+
+      def changed_paths(local_dir, local, remote, compare, concurrency)
+        if compare == :sha256
+          paths = local.keys.select { |path| remote.key?(path) }
+          digests = digest_files(paths.map { |path| File.join(local_dir, path) },
+                                 :sha256, concurrency: concurrency)
+          same = paths.zip(digests).select { |path, digest| remote[path] == digest }
+          local.keys - same.map(&:first)
+        else
+          local.keys.select do |path|
+            size, mtime = remote[path]
+            size.nil? || size != local[path].size || local[path].mtime.to_i > mtime
+          end
+        end
+      end
+
+      # Send the files of each directory in one batch, spreading the
+      # directories over the sessions.
+      # @return [Integer] The number of bytes sent.
+      def send_files(sessions, local_dir, remote_dir, paths)
+        groups = paths.group_by { |path| File.dirname(path) }.sort
+        slices = Array.new([sessions.size, groups.size].min) { [] }
+        groups.each_with_index { |group, i| slices[i % slices.size] << group }
+        threads = slices.each_with_index.map do |slice, i|
+          Thread.new { send_groups(sessions[i], local_dir, remote_dir, slice) }
+        end
+        threads.map(&:value).inject(0, :+)
+      end
+
+      def send_groups(session, local_dir, remote_dir, groups)
+        scp = Scp.new(session, :write, remote_dir, recursive: true)
+        bytes = 0
+        scp.init do
+          cwd = []
+          groups.each do |dir, paths|
+            cwd = change_directory(scp, local_dir, cwd, dir == '.' ? [] : dir.split('/'))
+            entries = paths.map do |path|
+              { name: File.basename(path), path: File.join(local_dir, path) }
+            end
+            bytes += scp.upload_batch(entries)[1]
+          end
+        end
+        bytes
+      end
+
+      # Move the scp from +cwd+ to +target+, creating the directories with
+      # the permissions of the local ones.
+      def change_directory(scp, local_dir, cwd, target)
+        common = cwd.zip(target).take_while { |a, b| a == b }.size
+        (cwd.size - common).times { scp.leave_directory }
+        cwd = cwd.take(common)
+        target.drop(common).each do |name|
+          cwd << name
+          mode = File.stat(File.join(local_dir, *cwd)).mode & 0o7777
+          scp.push_directory(name, mode)
+        end
+        cwd
+      end
+    end
+  end
+end
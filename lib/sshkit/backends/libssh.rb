@@ -42,22 +42,26 @@ module SSHKit
       # @param [String, #read] local Path to the local file to be uploaded.
       #   If +local+ responds to +#read+, +local+ is treated as IO-like object.
       # @param [String] remote Path to the remote file.
+      # @param [Hash] options
+      # @option options [Boolean] :recursive Upload +local+ directory with
+      #   all of its contents as +remote+.
       # @since 0.2.0
       # @see SSHKit::Backend::Abstract#upload!.
       # @todo Make +options+ compatible with {SSHKit::Backend::Netssh#upload!}.
-      def upload!(local, remote, _options = {})
+      def upload!(local, remote, options = {})
         with_session do |session|
-          scp = LibSSH::Scp.new(session, :write, File.dirname(remote))
-          wrap_local_reader(local) do |io, mode|
+          scp = LibSSH::Scp.new(session, :write, File.dirname(remote), recursive: options[:recursive])
+          if local.respond_to?(:read)
+            upload_io(scp, local, remote)
+          elsif options[:recursive] && File.directory?(local)
             scp.init do
-              scp.push_file(File.basename(remote), io.size, mode)
               info "Uploading #{remote}"
-              begin
-                loop do
-                  scp.write(io.readpartial(BUFSIZ))
-                end
-              rescue EOFError # rubocop:disable Lint/HandleExceptions
-              end
+              scp.upload_tree(local, File.basename(remote))
+            end
+          else
+            scp.init do
+              info "Uploading #{remote}"
+              scp.upload_file(local, File.basename(remote))
             end
           end
         end
@@ -67,20 +71,39 @@ module SSHKit
       # @param [String] remote Path to the remote file to be downloaded.
       # @param [String, #write] local Path to the local file.
       #   If +local+ responds to +#write+, +local+ is treated as IO-like object.
+      # @param [Hash] options
+      # @option options [Boolean] :recursive Download +remote+ directory with
+      #   all of its contents into +local+ directory.
+      # @option options [Boolean] :resume Keep the content of +local+ path
+      #   and download only the rest over SFTP. Since 0.5.0.
       # @since 0.2.0
       # @see SSHKit::Backend::Abstract#download!.
       # @todo Make +options+ compatible with {SSHKit::Backend::Netssh#download!}.
-      def download!(remote, local, _options = {})
+      def download!(remote, local, options = {})
         with_session do |session|
+          if options[:recursive]
+            scp = LibSSH::Scp.new(session, :read, remote, recursive: true)
+            info "Downloading #{remote}"
+            return scp.init { scp.download_tree(local) }
+          end
+          if options[:resume] && local.is_a?(String)
+            info "Downloading #{remote}"
+            return session.sftp { |sftp| sftp.download(remote, local, resume: true) }
+          end
+
           scp = LibSSH::Scp.new(session, :read, remote)
           scp.init do
             loop do
               case scp.pull_request
               when LibSSH::Scp::REQUEST_NEWFILE
                 info "Downloading #{remote}"
-                download_file(scp, local)
+                if local.is_a?(String) || local.is_a?(IO)
+                  scp.download_file(local)
+                else
+                  download_file(scp, local)
+                end
               when LibSSH::Scp::REQUEST_NEWDIR
-                scp.deny_request('Only NEWFILE is acceptable')
+                scp.deny_request('Use recursive: true to download a directory')
               when LibSSH::Scp::REQUEST_EOF
                 break
               end
@@ -139,13 +162,15 @@ module SSHKit
         end
       end
 
-      def wrap_local_reader(local)
-        if local.respond_to?(:read)
-          # local is IO-like object
-          yield(local, 0o644)
-        else
-          File.open(local, 'rb') do |f|
-            yield(f, File.stat(local).mode & 0xfff)
+      def upload_io(scp, io, remote)
+        scp.init do
+          scp.push_file(File.basename(remote), io.size, 0o644)
+          info "Uploading #{remote}"
+          begin
+            loop do
+              scp.write(io.readpartial(BUFSIZ))
+            end
+          rescue EOFError # rubocop:disable Lint/HandleExceptions
           end
         end
       end
@@ -167,10 +192,10 @@ module SSHKit
         scp.accept_request
         wrap_local_writer(local, mode) do |io|
           n = 0
+          buf = String.new
           while n < size
-            buf = scp.read(size - n)
+            n += scp.read_into(buf, [size - n, BUFSIZ].min)
             io.write(buf)
-            n += buf.size
           end
         end
       end
@@ -1,4 +1,6 @@
 require 'spec_helper'
+require 'digest'
+require 'stringio'
 
 RSpec.describe LibSSH::Channel do
   let(:session) { LibSSH::Session.new }
@@ -114,4 +116,259 @@ RSpec.describe LibSSH::Channel do
       end
     end
   end
+
+  describe '#read_into' do
+    before do
+      session.connect
+      session.userauth_publickey_auto
+    end
+
+    context 'with valid condition' do
+      it 'fills the given buffer in binary' do
+        channel.open_session do
+          channel.request_exec('echo hello')
+          buf = String.new
+          stdout = String.new
+          until channel.eof?
+            n = channel.read_into(buf, 64)
+            expect(buf.bytesize).to eq(n)
+            stdout << buf
+          end
+          expect(buf.encoding).to eq(Encoding::ASCII_8BIT)
+          expect(stdout).to eq("hello\n")
+        end
+      end
+    end
+  end
+
+  describe '#read' do
+    before do
+      session.connect
+      session.userauth_publickey_auto
+    end
+
+    context 'with binary: true' do
+      it 'returns an ASCII-8BIT string' do
+        channel.open_session do
+          channel.request_exec('echo hello')
+          expect(channel.read(64, binary: true)).to eq("hello\n".b)
+        end
+      end
+    end
+  end
+
+  describe '#exec_capture' do
+    before do
+      session.connect
+      session.userauth_publickey_auto
+    end
+
+    context 'with valid condition' do
+      it 'returns stdout, stderr and exit status' do
+        channel.open_session do
+          expect(channel.exec_capture('echo out; echo err >&2; exit 3')).to eq(["out\n", "err\n", 3])
+        end
+      end
+    end
+
+    context 'with max_output' do
+      it 'truncates the output' do
+        channel.open_session do
+          expect(channel.exec_capture('seq 1000', max_output: 4)).to eq(["1\n2\n", '', 0])
+        end
+      end
+    end
+  end
+
+  describe '#writev' do
+    before do
+      session.connect
+      session.userauth_publickey_auto
+    end
+
+    context 'with valid condition' do
+      it 'writes all strings' do
+        channel.open_session do
+          channel.request_exec('cat')
+          expect(channel.writev(%W[foo bar baz\n])).to eq(10)
+          expect(channel.write_all("qux\n")).to eq(4)
+          channel.send_eof
+          stdout = ''
+          until channel.eof?
+            stdout << channel.read(64)
+          end
+          expect(stdout).to eq("foobarbaz\nqux\n")
+        end
+      end
+    end
+  end
+
+  describe '#copy_to' do
+    before do
+      session.connect
+      session.userauth_publickey_auto
+    end
+
+    context 'with valid condition' do
+      it 'copies stdout to the IO' do
+        IO.pipe do |r, w|
+          channel.open_session do
+            channel.request_exec('seq 3')
+            expect(channel.copy_to(w)).to eq(6)
+          end
+          w.close
+          expect(r.read).to eq("1\n2\n3\n")
+        end
+      end
+
+      it 'computes the digest of the copied data' do
+        IO.pipe do |r, w|
+          channel.open_session do
+            channel.request_exec('seq 3')
+            expect(channel.copy_to(w, digest: :sha1)).to eq([6, Digest::SHA1.hexdigest("1\n2\n3\n")])
+          end
+        end
+      end
+    end
+  end
+
+  describe '#copy_from' do
+    before do
+      session.connect
+      session.userauth_publickey_auto
+    end
+
+    context 'with valid condition' do
+      it 'copies the IO to stdin' do
+        IO.pipe do |r, w|
+          w.write("hello\n")
+          w.close
+          channel.open_session do
+            channel.request_exec('cat')
+            expect(channel.copy_from(r)).to eq(6)
+            channel.send_eof
+            expect(IO.copy_stream(channel, out = StringIO.new)).to eq(6)
+            expect(out.string).to eq("hello\n")
+          end
+        end
+      end
+    end
+  end
+
+  describe '#on_data' do
+    before do
+      session.connect
+      session.userauth_publickey_auto
+    end
+
+    context 'with valid condition' do
+      it 'delivers events from Session#process_events' do
+        out = String.new
+        err = String.new
+        events = []
+        channel.open_session
+        channel.on_data { |data, stderr| (stderr ? err : out) << data }
+        channel.on_eof { events << :eof }
+        channel.on_exit_status { |status| events << status }
+        channel.on_close { events << :close }
+        channel.request_exec('echo hello; echo world >&2; exit 3')
+        session.process_events(5) until events.include?(:close)
+
+        expect(out).to eq("hello\n")
+        expect(err).to eq("world\n")
+        expect(events).to eq([:eof, 3, :close])
+        expect(session.process_events(0)).to eq(0)
+      end
+
+      it 'delivers ASCII-8BIT data with binary: true' do
+        chunks = []
+        closed = false
+        channel.open_session
+        channel.on_data(binary: true) { |data, _| chunks << data }
+        channel.on_close { closed = true }
+        channel.request_exec('printf "\\377"')
+        session.process_events(5) until closed
+
+        expect(chunks.join).to eq("\xFF".b)
+        expect(chunks.map(&:encoding).uniq).to eq([Encoding::ASCII_8BIT])
+      end
+    end
+  end
+
+  describe '#window_size=' do
+    before do
+      session.connect
+      session.userauth_publickey_auto
+    end
+
+    context 'with valid condition' do
+      it 'transfers data with a large window' do
+        channel.high_throughput!
+        expect(channel.window_size).to eq(LibSSH::Channel::HIGH_THROUGHPUT_WINDOW_SIZE)
+        channel.open_session do
+          expect(channel.remote_window).to be > 0
+          channel.request_exec('head -c 4000000 /dev/zero')
+          IO.pipe do |r, w|
+            reader = Thread.new { r.read.bytesize }
+            expect(channel.copy_to(w)).to eq(4000000)
+            w.close
+            expect(reader.value).to eq(4000000)
+          end
+        end
+      end
+    end
+  end
+
+  describe 'deadline:' do
+    before do
+      session.connect
+      session.userauth_publickey_auto
+    end
+
+    context 'with valid condition' do
+      it 'raises TimeoutError when the deadline passes' do
+        channel.open_session(deadline: 5) do
+          channel.request_exec('sleep 10', deadline: 5)
+          started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+          expect { channel.read(1, deadline: 0.5) }.to raise_error(LibSSH::TimeoutError)
+          expect(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started).to be < 5
+        end
+      end
+
+      it 'can be interrupted by another thread' do
+        channel.open_session do
+          channel.request_exec('sleep 10')
+          reader = Thread.new { channel.read(1) }
+          sleep 0.5
+          reader.kill
+          expect(reader.join(5)).to eq(reader)
+        end
+      end
+
+      it 'raises TimeoutError from copy_to' do
+        channel.open_session do
+          channel.request_exec('sleep 10')
+          IO.pipe do |_r, w|
+            expect { channel.copy_to(w, deadline: 0.5) }.to raise_error(LibSSH::TimeoutError)
+          end
+        end
+      end
+
+      it 'raises TimeoutError from exec_capture' do
+        channel.open_session do
+          expect { channel.exec_capture('sleep 10', deadline: 0.5) }.to raise_error(LibSSH::TimeoutError)
+        end
+      end
+
+      it 'can interrupt poll' do
+        channel.open_session do
+          channel.request_exec('sleep 10')
+          poller = Thread.new { channel.poll }
+          sleep 0.5
+          poller.kill
+          expect(poller.join(5)).to eq(poller)
+        end
+      end
+    end
+  end
 end
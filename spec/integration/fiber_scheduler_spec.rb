@@ -0,0 +1,49 @@
+require 'spec_helper'
+
+begin
+  require 'async'
+rescue LoadError
+  nil
+end
+
+RSpec.describe 'Fiber scheduler support' do
+  before do
+    skip 'async is not available' unless defined?(Async)
+  end
+
+  def open_session
+    session = LibSSH::Session.new
+    session.host = SshHelper.host
+    session.port = DockerHelper.port
+    session.user = SshHelper.user
+    session.add_identity(SshHelper.identity_path)
+    session.connect
+    session.userauth_publickey_auto
+    session
+  end
+
+  it 'runs sessions concurrently on one thread' do
+    started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    outputs = Async do |task|
+      Array.new(3) do |i|
+        task.async do
+          session = open_session
+          begin
+            channel = LibSSH::Channel.new(session)
+            channel.open_session do
+              channel.request_exec("sleep 1; echo #{i}")
+              output = channel.read(16)
+              [output, channel.get_exit_status]
+            end
+          ensure
+            session.disconnect
+          end
+        end
+      end.map(&:wait)
+    end.wait
+    elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - started
+
+    expect(outputs).to eq([["0\n", 0], ["1\n", 0], ["2\n", 0]])
+    expect(elapsed).to be < 2.5
+  end
+end
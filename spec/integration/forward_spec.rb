@@ -0,0 +1,79 @@
+require 'spec_helper'
+require 'socket'
+
+RSpec.describe LibSSH::Forward do
+  let(:session) { LibSSH::Session.new }
+
+  before do
+    session.host = SshHelper.host
+    session.port = DockerHelper.port
+    session.user = SshHelper.user
+    session.add_identity(SshHelper.identity_path)
+  end
+
+  after do
+    session.disconnect
+  end
+
+  describe '.local' do
+    context 'without connected session' do
+      it 'raises an error' do
+        expect { described_class.local(session, '127.0.0.1', 0, 'localhost', 22) }.to raise_error(ArgumentError)
+      end
+    end
+
+    context 'with valid condition' do
+      before do
+        session.connect
+        session.userauth_publickey_auto
+      end
+
+      it 'forwards connections' do
+        session.forward_local('127.0.0.1', 0, 'localhost', 22) do |forward|
+          expect(forward).to be_running
+          TCPSocket.open('127.0.0.1', forward.local_port) do |socket|
+            expect(socket.gets).to start_with('SSH-2.0-')
+          end
+          expect(forward.connections).to eq(1)
+          expect(forward.bytes_received).to be > 0
+        end
+      end
+    end
+  end
+
+  describe '.remote' do
+    context 'with valid condition' do
+      before do
+        session.connect
+        session.userauth_publickey_auto
+      end
+
+      it 'forwards connections back to the local port' do
+        TCPServer.open('127.0.0.1', 0) do |server|
+          session.forward_remote(0, '127.0.0.1', server.addr[1]) do |forward|
+            expect(forward).to be_running
+            reader = Thread.start do
+              socket = server.accept
+              data = socket.readpartial(5)
+              socket.close
+              data
+            end
+
+            client = LibSSH::Session.new
+            client.host = SshHelper.host
+            client.port = DockerHelper.port
+            client.user = SshHelper.user
+            client.add_identity(SshHelper.identity_path)
+            client.connect
+            client.userauth_publickey_auto
+            client.exec("printf hello | nc 127.0.0.1 #{forward.remote_port}")
+            client.disconnect
+
+            expect(reader.value).to eq('hello')
+            expect(forward.connections).to eq(1)
+          end
+        end
+      end
+    end
+  end
+end
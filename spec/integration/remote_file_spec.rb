@@ -0,0 +1,65 @@
+require 'spec_helper'
+
+RSpec.describe LibSSH::RemoteFile do
+  let(:session) { LibSSH::Session.new }
+  let(:content) { (1..20000).map { |i| "line #{i}\n" }.join }
+
+  before do
+    session.host = SshHelper.host
+    session.port = DockerHelper.port
+    session.user = SshHelper.user
+    session.add_identity(SshHelper.identity_path)
+    session.connect
+    session.userauth_publickey_auto
+    session.exec('seq -f "line %g" 20000 > /tmp/remote_file')
+  end
+
+  after do
+    session.disconnect
+  end
+
+  describe '#pread' do
+    it 'serves cached blocks without requests' do
+      described_class.open(session, '/tmp/remote_file', block_size: 4096, readahead: 0) do |f|
+        expect(f.size).to eq(content.bytesize)
+        expect(f.pread(100, 5000)).to eq(content.byteslice(5000, 100))
+        expect(f.pread(100, 5100)).to eq(content.byteslice(5100, 100))
+        expect(f.stats).to eq(hits: 1, misses: 1, requests: 1)
+        expect(f.pread(100, content.bytesize - 50)).to eq(content.byteslice(-50, 50))
+        expect { f.pread(1, content.bytesize) }.to raise_error(EOFError)
+        expect(f.pos).to eq(0)
+      end
+    end
+
+    it 'reads ahead during sequential reads' do
+      described_class.open(session, '/tmp/remote_file', block_size: 1024, readahead: 8) do |f|
+        f.pread(1024, 0)
+        f.pread(1024, 1024)
+        expect(f.stats[:requests]).to eq(1 + 1 + 8)
+        (2..9).each { |i| f.pread(1024, i * 1024) }
+        expect(f.stats[:requests]).to eq(10)
+      end
+    end
+  end
+
+  describe '#each_line' do
+    it 'iterates the lines from the position' do
+      described_class.open(session, '/tmp/remote_file') do |f|
+        f.seek(-22, IO::SEEK_END)
+        expect(f.each_line.to_a).to eq(["line 19999\n", "line 20000\n"])
+        expect(f.eof?).to be(true)
+        f.rewind
+        expect(f.gets).to eq("line 1\n")
+        expect(f.read(7)).to eq("line 2\n")
+        expect(f.read.bytesize).to eq(content.bytesize - 14)
+        expect(f.read(1)).to be_nil
+      end
+    end
+
+    it 'finds separators across blocks' do
+      described_class.open(session, '/tmp/remote_file', block_size: 5) do |f|
+        expect(f.each_line("\nli").first(100)).to eq(content.each_line("\nli").first(100))
+      end
+    end
+  end
+end
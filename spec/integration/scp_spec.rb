@@ -0,0 +1,197 @@
+require 'spec_helper'
+require 'digest'
+require 'fileutils'
+require 'tempfile'
+require 'tmpdir'
+
+RSpec.describe LibSSH::Scp do
+  let(:session) { LibSSH::Session.new }
+
+  before do
+    session.host = SshHelper.host
+    session.port = DockerHelper.port
+    session.user = SshHelper.user
+    session.add_identity(SshHelper.identity_path)
+    session.connect
+    session.userauth_publickey_auto
+  end
+
+  after do
+    session.disconnect
+  end
+
+  describe '#upload_file' do
+    let(:data) { Random.new(42).bytes(3 * 1024 * 1024 + 5) }
+
+    it 'sends the local file' do
+      Tempfile.create('upload') do |f|
+        f.binmode
+        f.write(data)
+        f.close
+        File.chmod(0o640, f.path)
+
+        scp = described_class.new(session, :write, '/tmp')
+        scp.init do
+          expect(scp.upload_file(f.path, 'upload_file', chunk: 1024 * 1024)).to eq(data.bytesize)
+        end
+        stdout, = session.exec('md5sum < /tmp/upload_file; stat -c %a /tmp/upload_file')
+        expect(stdout).to eq("#{Digest::MD5.hexdigest(data)}  -\n640\n")
+      end
+    end
+
+    it 'computes the digest of the sent data' do
+      Tempfile.create('upload') do |f|
+        f.binmode
+        f.write(data)
+        f.close
+
+        scp = described_class.new(session, :write, '/tmp')
+        scp.init do
+          expect(scp.upload_file(f.path, 'upload_file', digest: :sha256)).to eq([data.bytesize, Digest::SHA256.hexdigest(data)])
+        end
+      end
+    end
+  end
+
+  describe '#download_file' do
+    it 'writes the remote file' do
+      session.exec('head -c 3000005 /dev/urandom > /tmp/download_file; chmod 600 /tmp/download_file')
+      expected, = session.exec('md5sum < /tmp/download_file')
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, 'download_file')
+        scp = described_class.new(session, :read, '/tmp/download_file')
+        scp.init do
+          expect(scp.pull_request).to eq(LibSSH::Scp::REQUEST_NEWFILE)
+          size, elapsed = scp.download_file(path, chunk: 65536)
+          expect(size).to eq(3000005)
+          expect(elapsed).to be_a(Float)
+        end
+        expect("#{Digest::MD5.file(path).hexdigest}  -\n").to eq(expected)
+        expect(File.stat(path).mode & 0o777).to eq(0o600)
+      end
+    end
+
+    it 'computes the digest of the received data' do
+      session.exec('head -c 100000 /dev/urandom > /tmp/download_file')
+      expected, = session.exec('md5sum < /tmp/download_file')
+      Dir.mktmpdir do |dir|
+        scp = described_class.new(session, :read, '/tmp/download_file')
+        scp.init do
+          scp.pull_request
+          size, _elapsed, hex = scp.download_file(File.join(dir, 'download_file'), digest: :md5)
+          expect(size).to eq(100000)
+          expect("#{hex}  -\n").to eq(expected)
+        end
+      end
+    end
+
+    it 'denies the request if the local file cannot be opened' do
+      session.exec('echo hello > /tmp/download_file')
+      Dir.mktmpdir do |dir|
+        scp = described_class.new(session, :read, '/tmp/download_file')
+        scp.init do
+          scp.pull_request
+          expect { scp.download_file(File.join(dir, 'missing/download_file')) }.to raise_error(Errno::ENOENT)
+        end
+      end
+      expect(session.exec('echo ok')).to eq(["ok\n", '', 0])
+    end
+  end
+
+  describe '#upload_tree' do
+    it 'sends the local directory' do
+      Dir.mktmpdir do |dir|
+        FileUtils.mkdir_p(File.join(dir, 'tree/a/b'))
+        File.write(File.join(dir, 'tree/x'), 'x' * 100)
+        File.write(File.join(dir, 'tree/a/b/y'), 'y' * 200)
+
+        scp = described_class.new(session, :write, '/tmp', recursive: true)
+        scp.init do
+          expect(scp.upload_tree(File.join(dir, 'tree'), 'upload_tree')).to eq([2, 300])
+        end
+      end
+      stdout, = session.exec('cd /tmp/upload_tree && find . -type f | sort | xargs wc -c')
+      expect(stdout.split).to eq(%w[200 ./a/b/y 100 ./x 300 total])
+    end
+  end
+
+  describe '#download_tree' do
+    it 'receives the remote directory' do
+      session.exec('rm -rf /tmp/download_tree; mkdir -p /tmp/download_tree/a; echo x > /tmp/download_tree/x; echo y > /tmp/download_tree/a/y')
+      Dir.mktmpdir do |dir|
+        scp = described_class.new(session, :read, '/tmp/download_tree', recursive: true)
+        scp.init do
+          expect(scp.download_tree(dir)).to eq([2, 4])
+        end
+        expect(File.read(File.join(dir, 'download_tree/x'))).to eq("x\n")
+        expect(File.read(File.join(dir, 'download_tree/a/y'))).to eq("y\n")
+      end
+    end
+  end
+
+  describe '#upload_batch' do
+    it 'sends files and data in one stream' do
+      Tempfile.create('batch') do |f|
+        f.write('from file')
+        f.close
+        File.chmod(0o600, f.path)
+
+        session.exec('rm -rf /tmp/upload_batch; mkdir /tmp/upload_batch')
+        scp = described_class.new(session, :write, '/tmp/upload_batch')
+        entries = [
+          { name: 'file', path: f.path },
+          { name: 'data', data: 'from data', mode: 0o640 },
+          { name: 'empty', data: '' }
+        ]
+        scp.init do
+          expect(scp.upload_batch(entries)).to eq([3, 18])
+        end
+      end
+      stdout, = session.exec('cd /tmp/upload_batch && for f in file data empty; do stat -c %a $f; cat $f; echo; done')
+      expect(stdout).to eq("600\nfrom file\n640\nfrom data\n644\n\n")
+    end
+  end
+
+  describe '.broadcast' do
+    let(:other) { LibSSH::Session.new }
+
+    before do
+      other.host = SshHelper.host
+      other.port = DockerHelper.port
+      other.user = SshHelper.user
+      other.add_identity(SshHelper.identity_path)
+      other.connect
+      other.userauth_publickey_auto
+    end
+
+    after do
+      other.disconnect
+    end
+
+    it 'sends the file to all of the sessions' do
+      data = Random.new(1).bytes(1024 * 1024 + 3)
+      Tempfile.create('broadcast') do |f|
+        f.binmode
+        f.write(data)
+        f.close
+
+        session.exec('rm -rf /tmp/broadcast1 /tmp/broadcast2; mkdir /tmp/broadcast1')
+        progress = Hash.new(0)
+        errors = described_class.broadcast([session, other], f.path, '/tmp/broadcast1/file', concurrency: 2) do |i, sent|
+          progress[i] = sent
+        end
+        expect(errors).to eq([nil, nil])
+        expect(progress).to eq(0 => data.bytesize, 1 => data.bytesize)
+
+        errors = described_class.broadcast([session], f.path, '/tmp/broadcast2/file')
+        expect(errors[0]).to be_a(LibSSH::Error)
+      end
+    end
+
+    it 'rejects a session given twice' do
+      Tempfile.create('broadcast') do |f|
+        expect { described_class.broadcast([session, session], f.path, '/tmp/file') }.to raise_error(ArgumentError)
+      end
+    end
+  end
+end
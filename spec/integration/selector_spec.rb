@@ -0,0 +1,66 @@
+require 'spec_helper'
+
+RSpec.describe LibSSH::Selector do
+  let(:session) { LibSSH::Session.new }
+  let(:selector) { described_class.new }
+
+  before do
+    session.host = SshHelper.host
+    session.port = DockerHelper.port
+    session.user = SshHelper.user
+    session.add_identity(SshHelper.identity_path)
+    session.connect
+    session.userauth_publickey_auto
+  end
+
+  after do
+    selector.close
+    session.disconnect
+  end
+
+  it 'returns ready channels only' do
+    channels = Array.new(3) { LibSSH::Channel.new(session) }
+    channels.each(&:open_session)
+    channels[0].request_exec('sleep 10')
+    channels[1].request_exec('echo hello')
+    channels[2].request_exec('sleep 10')
+    channels.each { |channel| selector.register(channel, :read) }
+    expect(selector.size).to eq(3)
+
+    ready = selector.select(5)
+    expect(ready).to eq(channels[1] => [:read])
+    expect(channels[1].read).to eq("hello\n")
+  end
+
+  it 'returns an empty Hash on timeout' do
+    channel = LibSSH::Channel.new(session)
+    channel.open_session
+    channel.request_exec('sleep 10')
+    selector.register(channel)
+    expect(selector.select(0.1)).to eq({})
+  end
+
+  it 'reports writable and closed channels' do
+    channel = LibSSH::Channel.new(session)
+    channel.open_session
+    channel.request_exec('sleep 1')
+    selector.register(channel, :write)
+    expect(selector.select(5)).to eq(channel => [:write])
+
+    selector.register(channel, :closed)
+    expect(selector.select(5)).to eq(channel => [:closed])
+    selector.deregister(channel)
+    expect(selector.size).to eq(0)
+  end
+
+  it 'can be interrupted by another thread' do
+    channel = LibSSH::Channel.new(session)
+    channel.open_session
+    channel.request_exec('sleep 10')
+    selector.register(channel)
+    waiter = Thread.new { selector.select }
+    sleep 0.5
+    waiter.kill
+    expect(waiter.join(5)).to eq(waiter)
+  end
+end
@@ -1,4 +1,5 @@
 require 'spec_helper'
+require 'tmpdir'
 
 RSpec.describe LibSSH::Session do
   let(:session) { described_class.new }
@@ -180,4 +181,140 @@ RSpec.describe LibSSH::Session do
       end
     end
   end
+
+  describe '#exec' do
+    before do
+      session.host = SshHelper.host
+      session.port = DockerHelper.port
+      session.user = SshHelper.user
+      session.add_identity(SshHelper.identity_path)
+      session.connect
+      session.userauth_publickey_auto
+    end
+
+    it 'returns stdout, stderr and exit status' do
+      expect(session.exec('echo hello')).to eq(["hello\n", '', 0])
+    end
+  end
+
+  describe '#channel_pool' do
+    before do
+      session.host = SshHelper.host
+      session.port = DockerHelper.port
+      session.user = SshHelper.user
+      session.add_identity(SshHelper.identity_path)
+      session.connect
+      session.userauth_publickey_auto
+    end
+
+    it 'hands out open channels' do
+      session.channel_pool(size: 2) do |pool|
+        3.times do |i|
+          output = pool.checkout do |channel|
+            channel.exec_capture("echo #{i}")
+          end
+          expect(output).to eq(["#{i}\n", '', 0])
+        end
+      end
+    end
+  end
+
+  describe '#exec_many' do
+    before do
+      session.host = SshHelper.host
+      session.port = DockerHelper.port
+      session.user = SshHelper.user
+      session.add_identity(SshHelper.identity_path)
+      session.connect
+      session.userauth_publickey_auto
+    end
+
+    it 'runs the commands concurrently' do
+      commands = Array.new(6) { |i| "sleep 1; echo #{i}; echo err >&2; exit #{i}" }
+      finished = []
+      started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      results = session.exec_many(commands, concurrency: 6) { |i, _| finished << i }
+      expect(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started).to be < 4
+      expect(results).to eq(Array.new(6) { |i| ["#{i}\n", "err\n", i] })
+      expect(finished).to match_array(0...6)
+    end
+  end
+
+  describe '#push_tree and #pull_tree' do
+    before do
+      session.host = SshHelper.host
+      session.port = DockerHelper.port
+      session.user = SshHelper.user
+      session.add_identity(SshHelper.identity_path)
+      session.connect
+      session.userauth_publickey_auto
+      session.exec('rm -rf /tmp/push_tree')
+    end
+
+    [nil, :gzip].each do |compress|
+      it "round-trips a directory with compress: #{compress.inspect}" do
+        Dir.mktmpdir do |dir|
+          long = 'n' * 120
+          FileUtils.mkdir_p(File.join(dir, "src/a/#{long}"))
+          File.write(File.join(dir, 'src/x'), 'x' * 100)
+          File.write(File.join(dir, "src/a/#{long}/y"), 'y' * 70000)
+          File.chmod(0o600, File.join(dir, 'src/x'))
+
+          expect(session.push_tree(File.join(dir, 'src'), '/tmp/push_tree', compress: compress)).to eq([2, 70100])
+          stdout, = session.exec('cd /tmp/push_tree && stat -c %a x && find . -type f | sort | xargs wc -c')
+          expect(stdout.split).to eq(['600', '70000', "./a/#{long}/y", '100', './x', '70100', 'total'])
+
+          expect(session.pull_tree('/tmp/push_tree', File.join(dir, 'dst'), compress: compress)).to eq([2, 70100])
+          expect(File.read(File.join(dir, "dst/a/#{long}/y"))).to eq('y' * 70000)
+          expect(File.stat(File.join(dir, 'dst/x')).mode & 0o777).to eq(0o600)
+        end
+      end
+    end
+
+    it 'raises if the remote tar fails' do
+      Dir.mktmpdir do |dir|
+        expect { session.pull_tree('/tmp/push_tree/missing', dir) }.to raise_error(IOError)
+      end
+    end
+
+    it 'reports the stderr of tar x written during the transfer' do
+      session.exec('mkdir -p /tmp/push_tree && touch /tmp/push_tree/a')
+      Dir.mktmpdir do |dir|
+        FileUtils.mkdir_p(File.join(dir, 'a'))
+        3000.times { |i| File.write(File.join(dir, "a/#{i}"), 'x') }
+        expect { session.push_tree(dir, '/tmp/push_tree') }.to raise_error(IOError, /Not a directory/)
+      end
+    end
+  end
+
+  describe '.connect_all' do
+    let(:good) do
+      {
+        host: SshHelper.host,
+        port: DockerHelper.port,
+        user: SshHelper.user,
+        knownhosts: SshHelper.valid_known_hosts,
+        identity: SshHelper.identity_path
+      }
+    end
+    let(:bad) { good.merge(port: DockerHelper.port + 1) }
+    let(:unknown) { good.merge(knownhosts: SshHelper.empty_known_hosts) }
+
+    before do
+      SshHelper.prepare_known_hosts
+    end
+
+    it 'returns ready sessions and errors' do
+      ready, failed = described_class.connect_all([good, bad, unknown], concurrency: 2)
+      begin
+        expect(ready.keys).to eq([good])
+        expect(ready[good]).to be_a(described_class)
+        expect(ready[good].exec('echo hello')).to eq(["hello\n", '', 0])
+        expect(failed.keys).to match_array([bad, unknown])
+        expect(failed.values).to all(be_a(LibSSH::Error))
+      ensure
+        ready.each_value(&:disconnect)
+      end
+    end
+  end
 end
@@ -0,0 +1,154 @@
+require 'spec_helper'
+require 'digest'
+require 'tempfile'
+require 'tmpdir'
+
+RSpec.describe LibSSH::SFTP do
+  let(:session) { LibSSH::Session.new }
+
+  before do
+    session.host = SshHelper.host
+    session.port = DockerHelper.port
+    session.user = SshHelper.user
+    session.add_identity(SshHelper.identity_path)
+    session.connect
+    session.userauth_publickey_auto
+    session.exec('rm -rf /tmp/sftp; mkdir /tmp/sftp')
+  end
+
+  after do
+    session.disconnect
+  end
+
+  describe '#stat' do
+    it 'returns the attributes' do
+      session.exec('printf hello > /tmp/sftp/file; chmod 640 /tmp/sftp/file')
+      session.sftp do |sftp|
+        attrs = sftp.stat('/tmp/sftp/file')
+        expect(attrs.type).to eq(:regular)
+        expect(attrs.size).to eq(5)
+        expect(attrs.permissions).to eq(0o640)
+        expect(attrs.mtime).to be_a(Time)
+      end
+    end
+
+    it 'raises an error for a missing file' do
+      session.sftp do |sftp|
+        expect { sftp.stat('/tmp/sftp/missing') }.to raise_error(LibSSH::Error)
+      end
+    end
+  end
+
+  describe 'directory operations' do
+    it 'creates, lists, renames and removes entries' do
+      session.sftp do |sftp|
+        sftp.mkdir('/tmp/sftp/dir')
+        sftp.open('/tmp/sftp/dir/a', 'w') { |f| f.write('a') }
+        sftp.rename('/tmp/sftp/dir/a', '/tmp/sftp/dir/b')
+        entries = sftp.readdir('/tmp/sftp/dir')
+        expect(entries.map(&:name).sort).to eq(%w[. .. b])
+        sftp.unlink('/tmp/sftp/dir/b')
+        sftp.rmdir('/tmp/sftp/dir')
+      end
+      stdout, = session.exec('ls /tmp/sftp')
+      expect(stdout).to eq('')
+    end
+  end
+
+  describe '#open' do
+    it 'reads and writes at the position' do
+      session.sftp do |sftp|
+        sftp.open('/tmp/sftp/file', 'w') do |f|
+          expect(f.write('hello world')).to eq(11)
+        end
+        sftp.open('/tmp/sftp/file') do |f|
+          f.seek(6)
+          expect(f.read(100)).to eq('world')
+          expect(f.pos).to eq(11)
+          expect(f.read(100)).to be_nil
+          expect(f.stat.size).to eq(11)
+        end
+      end
+    end
+  end
+
+  describe '#download' do
+    it 'writes the remote file with reads in flight' do
+      session.exec('head -c 1000003 /dev/urandom > /tmp/sftp/download')
+      expected, = session.exec('sha256sum < /tmp/sftp/download')
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, 'download')
+        session.sftp do |sftp|
+          bytes, hex = sftp.download('/tmp/sftp/download', path, requests: 4, chunk: 16384, digest: :sha256)
+          expect(bytes).to eq(1000003)
+          expect("#{hex}  -\n").to eq(expected)
+        end
+        expect("#{Digest::SHA256.file(path).hexdigest}  -\n").to eq(expected)
+      end
+    end
+
+    it 'writes the remote file with chunks larger than the server reads' do
+      session.exec('head -c 3000007 /dev/urandom > /tmp/sftp/download')
+      expected, = session.exec('sha256sum < /tmp/sftp/download')
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, 'download')
+        session.sftp do |sftp|
+          bytes, hex = sftp.download('/tmp/sftp/download', path, requests: 4, chunk: 1 << 20, digest: :sha256)
+          expect(bytes).to eq(3000007)
+          expect("#{hex}  -\n").to eq(expected)
+        end
+        expect(File.size(path)).to eq(3000007)
+        expect("#{Digest::SHA256.file(path).hexdigest}  -\n").to eq(expected)
+      end
+    end
+
+    it 'resumes a partial download' do
+      session.exec('head -c 300000 /dev/urandom > /tmp/sftp/download')
+      expected, = session.exec('sha256sum < /tmp/sftp/download')
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, 'download')
+        session.sftp do |sftp|
+          expect(sftp.download('/tmp/sftp/download', path, range: 0...100000)).to eq(100000)
+          bytes, hex = sftp.download('/tmp/sftp/download', path, resume: true, digest: :sha256)
+          expect(bytes).to eq(200000)
+          expect("#{hex}  -\n").to eq(expected)
+          expect(sftp.download('/tmp/sftp/download', path, resume: true)).to eq(0)
+        end
+        expect(File.size(path)).to eq(300000)
+      end
+    end
+
+    it 'downloads a byte range' do
+      session.exec('seq 1000 > /tmp/sftp/download')
+      content = (1..1000).map { |i| "#{i}\n" }.join
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, 'download')
+        session.sftp do |sftp|
+          expect(sftp.download('/tmp/sftp/download', path, range: 2..5)).to eq(4)
+          expect(File.read(path)).to eq(content[2..5])
+          expect(sftp.download('/tmp/sftp/download', path, range: 3800..(1 << 40))).to eq(content.bytesize - 3800)
+          expect(File.read(path)).to eq(content[3800..-1])
+        end
+      end
+    end
+  end
+
+  describe '#upload' do
+    let(:data) { Random.new(42).bytes(1000003) }
+
+    it 'sends the local file' do
+      Tempfile.create('upload') do |f|
+        f.binmode
+        f.write(data)
+        f.close
+        File.chmod(0o600, f.path)
+
+        session.sftp do |sftp|
+          expect(sftp.upload(f.path, '/tmp/sftp/upload', requests: 4)).to eq(data.bytesize)
+        end
+      end
+      stdout, = session.exec('md5sum < /tmp/sftp/upload; stat -c %a /tmp/sftp/upload')
+      expect(stdout).to eq("#{Digest::MD5.hexdigest(data)}  -\n600\n")
+    end
+  end
+end
@@ -0,0 +1,74 @@
+require 'spec_helper'
+require 'digest'
+require 'fileutils'
+require 'tmpdir'
+
+RSpec.describe LibSSH::Sync do
+  let(:session) { LibSSH::Session.new }
+
+  before do
+    session.host = SshHelper.host
+    session.port = DockerHelper.port
+    session.user = SshHelper.user
+    session.add_identity(SshHelper.identity_path)
+    session.connect
+    session.userauth_publickey_auto
+    session.exec('rm -rf /tmp/sync')
+  end
+
+  after do
+    session.disconnect
+  end
+
+  def make_tree(dir)
+    FileUtils.mkdir_p(File.join(dir, 'a/b'))
+    File.write(File.join(dir, 'x'), 'x' * 100)
+    File.write(File.join(dir, 'a/y'), 'y' * 200)
+    File.write(File.join(dir, 'a/b/z'), 'z' * 300)
+  end
+
+  describe '.push' do
+    it 'sends only the changed files by size and mtime' do
+      Dir.mktmpdir do |dir|
+        make_tree(dir)
+        result = described_class.push(session, dir, '/tmp/sync')
+        expect(result.uploaded.sort).to eq(%w[a/b/z a/y x])
+        expect(result.bytes).to eq(600)
+
+        File.write(File.join(dir, 'a/y'), 'y' * 201)
+        result = described_class.push(session, dir, '/tmp/sync')
+        expect(result.uploaded).to eq(%w[a/y])
+        expect(result.skipped).to eq(2)
+      end
+      stdout, = session.exec('cd /tmp/sync && find . -type f | sort | xargs wc -c')
+      expect(stdout.split).to eq(%w[300 ./a/b/z 201 ./a/y 100 ./x 601 total])
+    end
+
+    it 'sends only the changed files by digest' do
+      Dir.mktmpdir do |dir|
+        make_tree(dir)
+        session.exec("mkdir -p /tmp/sync/a && printf '%0200d' 0 | tr 0 y > /tmp/sync/a/y && echo stale > /tmp/sync/x")
+        result = described_class.push(session, dir, '/tmp/sync', compare: :sha256, concurrency: 2)
+        expect(result.uploaded.sort).to eq(%w[a/b/z x])
+        expect(result.skipped).to eq(1)
+      end
+      stdout, = session.exec('cd /tmp/sync && find . -type f | sort | xargs sha256sum')
+      expect(stdout.lines.map(&:split)).to eq([
+        [Digest::SHA256.hexdigest('z' * 300), './a/b/z'],
+        [Digest::SHA256.hexdigest('y' * 200), './a/y'],
+        [Digest::SHA256.hexdigest('x' * 100), './x']
+      ])
+    end
+  end
+
+  describe '.digest_files' do
+    it 'computes the digests in order' do
+      Dir.mktmpdir do |dir|
+        make_tree(dir)
+        paths = %w[x a/y a/b/z].map { |path| File.join(dir, path) }
+        expect(described_class.digest_files(paths, concurrency: 3)).to eq(paths.map { |path| Digest::SHA256.file(path).hexdigest })
+        expect { described_class.digest_files([File.join(dir, 'missing')]) }.to raise_error(Errno::ENOENT)
+      end
+    end
+  end
+end